@@ -0,0 +1,313 @@
+/*
+ * cbfuse implements a FUSE file-system using Couchbase as the data store.
+ * Copyright (c) 2021 Raymond Cardillo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include "custom-uthash.h"
+#include "uthash/uthash.h"
+
+#include "atimes.h"
+#include "util.h"
+#include "common.h"
+
+// Updating the access time is a get and a CAS replace of the stat document, which
+// triples the cost of a read. Relatime skips the update unless the access time would
+// otherwise look older than the last change. Lazy mode only remembers the latest access
+// time of each file and a background thread writes them every ATIME_FLUSH_INTERVAL.
+
+typedef struct pending_atime {
+    char *pkey;                 // key of the stat entry (hash key)
+    struct timespec atime;      // latest access time
+    UT_hash_handle hh;
+} pending_atime;
+
+static pthread_mutex_t _pending_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _pending_cond = PTHREAD_COND_INITIALIZER;
+static pending_atime *_pending = NULL;
+static atime_mode _mode = ATIME_STRICT;
+static lcb_pool *_pool = NULL;
+static pthread_t _flusher;
+static bool _flusher_started = false;
+static bool _stopping = false;
+
+int atimes_parse_mode(const char *name, atime_mode *mode)
+{
+    static const struct {
+        const char *name;
+        atime_mode mode;
+    } modes[] = {
+        { "strictatime",    ATIME_STRICT },
+        { "relatime",       ATIME_RELATIME },
+        { "noatime",        ATIME_NOATIME },
+        { "lazyatime",      ATIME_LAZY }
+    };
+
+    for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+        if (strcmp(name, modes[i].name) == 0) {
+            *mode = modes[i].mode;
+            return 0;
+        }
+    }
+
+    return -EINVAL;
+}
+
+static void free_pending(pending_atime *pending)
+{
+    pending_atime *entry, *tmp;
+    HASH_ITER(hh, pending, entry, tmp) {
+        HASH_DEL(pending, entry);
+        free(entry->pkey);
+        free(entry);
+    }
+}
+
+// Writes every pending access time (a file that's gone by now is skipped).
+static void flush_pending(void)
+{
+    pthread_mutex_lock(&_pending_lock);
+    pending_atime *pending = _pending;
+    _pending = NULL;
+    pthread_mutex_unlock(&_pending_lock);
+
+    if (pending == NULL) {
+        return;
+    }
+
+    size_t npending = HASH_COUNT(pending);
+    const char **pkeys = calloc(npending, sizeof(const char*));
+    struct timespec *atimes = calloc(npending, sizeof(struct timespec));
+    int *results = calloc(npending, sizeof(int));
+    if (pkeys == NULL || atimes == NULL || results == NULL) {
+        fprintf(stderr, "  %s:%s:%d couldn't write %zu access times\n", __FILENAME__, __func__, __LINE__, npending);
+        goto done;
+    }
+
+    size_t i = 0;
+    pending_atime *entry, *tmp;
+    HASH_ITER(hh, pending, entry, tmp) {
+        pkeys[i] = entry->pkey;
+        atimes[i] = entry->atime;
+        i++;
+    }
+
+    // every pending access time is written in the same batch
+    lcb_INSTANCE *instance = pool_borrow(_pool);
+    update_stat_atimes(instance, pkeys, atimes, npending, results);
+    pool_return(_pool, instance);
+
+    for (i = 0; i < npending; i++) {
+        if (results[i] != 0 && results[i] != -ENOENT) {
+            fprintf(stderr, "  %s:%s:%d couldn't write the access time of %s\n", __FILENAME__, __func__, __LINE__, pkeys[i]);
+        }
+    }
+
+done:
+    free(results);
+    free(atimes);
+    free(pkeys);
+    free_pending(pending);
+}
+
+static void *flusher_loop(__unused void *arg)
+{
+    pthread_mutex_lock(&_pending_lock);
+    while (!_stopping) {
+        struct timespec wakeup;
+        clock_gettime(CLOCK_REALTIME, &wakeup);
+        wakeup.tv_sec += ATIME_FLUSH_INTERVAL;
+
+        // a full table wakes the flusher early
+        pthread_cond_timedwait(&_pending_cond, &_pending_lock, &wakeup);
+        if (_pending == NULL) {
+            continue;
+        }
+
+        pthread_mutex_unlock(&_pending_lock);
+        flush_pending();
+        pthread_mutex_lock(&_pending_lock);
+    }
+    pthread_mutex_unlock(&_pending_lock);
+
+    return NULL;
+}
+
+int atimes_init(atime_mode mode, lcb_pool *pool)
+{
+    int fresult = 0;
+
+    _mode = mode;
+    _pool = pool;
+
+    if (_mode == ATIME_LAZY) {
+        IfFalseGotoDoneWithRef(
+            (pthread_create(&_flusher, NULL, flusher_loop, NULL) == 0),
+            -EIO,
+            "pthread_create"
+        );
+        _flusher_started = true;
+    }
+
+done:
+    return fresult;
+}
+
+static int compare_times(time_t sec1, long nsec1, time_t sec2, long nsec2)
+{
+    if (sec1 != sec2) {
+        return (sec1 < sec2) ? -1 : 1;
+    }
+    if (nsec1 != nsec2) {
+        return (nsec1 < nsec2) ? -1 : 1;
+    }
+    return 0;
+}
+
+// Same rule as Linux: the access time is updated if it isn't newer than the
+// modified or changed time, or if it's more than RELATIME_MAX_AGE old.
+static bool is_relatime_due(const cbfuse_stat *stat, const struct timespec *now)
+{
+    return compare_times(stat->st_atime, stat->st_atimensec, stat->st_mtime, stat->st_mtimensec) <= 0 ||
+        compare_times(stat->st_atime, stat->st_atimensec, stat->st_ctime, stat->st_ctimensec) <= 0 ||
+        (now->tv_sec - stat->st_atime) >= (time_t)RELATIME_MAX_AGE;
+}
+
+static int remember_atime(const char *pkey, const struct timespec *atime)
+{
+    int fresult = 0;
+    pthread_mutex_lock(&_pending_lock);
+
+    pending_atime *entry = NULL;
+    HASH_FIND_STR(_pending, pkey, entry);
+    if (entry == NULL) {
+        entry = calloc(1, sizeof(pending_atime));
+        IfNULLGotoDoneWithRef(entry, -ENOMEM, pkey);
+
+        entry->pkey = strdup(pkey);
+        if (entry->pkey == NULL) {
+            free(entry);
+            fresult = -ENOMEM;
+            goto done;
+        }
+
+        HASH_ADD_KEYPTR(hh, _pending, entry->pkey, strlen(entry->pkey), entry);
+        if (HASH_COUNT(_pending) >= ATIME_MAX_PENDING) {
+            pthread_cond_signal(&_pending_cond);
+        }
+    }
+    entry->atime = *atime;
+
+done:
+    pthread_mutex_unlock(&_pending_lock);
+    return fresult;
+}
+
+int atimes_touch(lcb_INSTANCE *instance, const char *pkey, const cbfuse_stat *stat)
+{
+    int fresult = 0;
+
+    if (_mode == ATIME_NOATIME) {
+        goto done;
+    }
+
+    struct timespec now;
+    IfFalseGotoDoneWithRef(
+        (clock_gettime(CLOCK_REALTIME, &now) == 0),
+        -EIO,
+        "clock_gettime"
+    );
+
+    switch (_mode) {
+    case ATIME_LAZY:
+        fresult = remember_atime(pkey, &now);
+        break;
+
+    case ATIME_RELATIME:
+        if (is_relatime_due(stat, &now)) {
+            fresult = update_stat_atime(instance, pkey, &now);
+        }
+        break;
+
+    default:
+        fresult = update_stat_atime(instance, pkey, &now);
+        break;
+    }
+    IfFRErrorGotoDoneWithRef(pkey);
+
+done:
+    return fresult;
+}
+
+bool atimes_pending(const char *pkey, struct timespec *atime)
+{
+    if (_mode != ATIME_LAZY) {
+        return false;
+    }
+
+    pthread_mutex_lock(&_pending_lock);
+
+    pending_atime *entry = NULL;
+    HASH_FIND_STR(_pending, pkey, entry);
+    if (entry != NULL) {
+        *atime = entry->atime;
+    }
+
+    pthread_mutex_unlock(&_pending_lock);
+    return (entry != NULL);
+}
+
+void atimes_forget(const char *pkey)
+{
+    if (_mode != ATIME_LAZY) {
+        return;
+    }
+
+    pthread_mutex_lock(&_pending_lock);
+
+    pending_atime *entry = NULL;
+    HASH_FIND_STR(_pending, pkey, entry);
+    if (entry != NULL) {
+        HASH_DEL(_pending, entry);
+        free(entry->pkey);
+        free(entry);
+    }
+
+    pthread_mutex_unlock(&_pending_lock);
+}
+
+void atimes_destroy(void)
+{
+    if (_flusher_started) {
+        pthread_mutex_lock(&_pending_lock);
+        _stopping = true;
+        pthread_cond_signal(&_pending_cond);
+        pthread_mutex_unlock(&_pending_lock);
+
+        pthread_join(_flusher, NULL);
+        _flusher_started = false;
+
+        flush_pending();
+    }
+
+    free_pending(_pending);
+    _pending = NULL;
+}
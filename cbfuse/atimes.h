@@ -0,0 +1,85 @@
+/*
+ * cbfuse implements a FUSE file-system using Couchbase as the data store.
+ * Copyright (c) 2021 Raymond Cardillo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CBFUSE_ATIMES_HEADER_SEEN
+#define CBFUSE_ATIMES_HEADER_SEEN
+
+#include <stdbool.h>
+#include <time.h>
+#include <libcouchbase/couchbase.h>
+
+#include "stats.h"
+#include "pool.h"
+
+typedef enum atime_mode {
+    ATIME_STRICT,       // every read updates the access time
+    ATIME_RELATIME,     // reads update an access time older than the last change (or a day old)
+    ATIME_NOATIME,      // reads never update the access time
+    ATIME_LAZY          // access times are kept in memory and written in the background
+} atime_mode;
+
+/**
+ * Parses the name of an access time mode (strictatime, relatime, noatime or lazyatime).
+ *
+ * @param name      name of the mode
+ * @param mode      receives the mode
+ * @return zero on success or -EINVAL if the name isn't a mode
+ */
+int atimes_parse_mode(const char *name, atime_mode *mode);
+
+/**
+ * Configures how reads update access times (every read does until this is called).
+ * In lazy mode a background thread writes the pending access times with instances from the pool.
+ *
+ * @param mode      access time mode
+ * @param pool      pool used by the background thread (the pool must outlive atimes_destroy)
+ * @return zero on success or a negative error code
+ */
+int atimes_init(atime_mode mode, lcb_pool *pool);
+
+/**
+ * Records a read of a file.
+ *
+ * @param instance  instance used when the access time is written right away
+ * @param pkey      key of the stat entry
+ * @param stat      stat that was read with the data (used to decide if an update is needed)
+ * @return zero on success or a negative error code
+ */
+int atimes_touch(lcb_INSTANCE *instance, const char *pkey, const cbfuse_stat *stat);
+
+/**
+ * Looks up an access time that hasn't been written yet (so getattr sees it).
+ *
+ * @param pkey      key of the stat entry
+ * @param atime     receives the pending access time
+ * @return whether an access time is pending
+ */
+bool atimes_pending(const char *pkey, struct timespec *atime);
+
+/**
+ * Drops a pending access time (e.g., when the file is removed).
+ *
+ * @param pkey      key of the stat entry
+ */
+void atimes_forget(const char *pkey);
+
+/**
+ * Stops the background thread and writes any pending access times.
+ */
+void atimes_destroy(void);
+
+#endif /* !CBFUSE_ATIMES_HEADER_SEEN */
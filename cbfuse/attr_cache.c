@@ -0,0 +1,189 @@
+/*
+ * cbfuse implements a FUSE file-system using Couchbase as the data store.
+ * Copyright (c) 2021 Raymond Cardillo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include "custom-uthash.h"
+#include "uthash/uthash.h"
+
+#include "attr_cache.h"
+
+// FUSE asks for attributes constantly (ls -l, tab completion, every open and write)
+// so recently used stat entries are kept in memory for a short time along with the CAS
+// of the stat document. Local mutations update the entry in place with the new CAS, and
+// a mutation that fails because of a CAS mismatch removes the entry so it's refetched.
+// Paths that don't exist are also remembered (for a shorter time) because editors, shells,
+// and build tools constantly probe for them.
+
+typedef struct attr_cache_entry {
+    char *pkey;                 // key of the stat entry (hash key)
+    cbfuse_stat stat;           // cached stat
+    uint64_t cas;               // cas of the cached stat document
+    bool negative;              // true if the entry is known not to exist
+    struct timespec expires;    // monotonic time when the entry can no longer be used
+    UT_hash_handle hh;
+} attr_cache_entry;
+
+// FUSE operations run on multiple threads so all access to the entries is serialized
+static pthread_mutex_t _entries_lock = PTHREAD_MUTEX_INITIALIZER;
+static attr_cache_entry *_entries = NULL;
+static unsigned int _timeout = 0;
+static unsigned int _negative_timeout = 0;
+static size_t _max_entries = 0;
+
+static bool is_expired(const struct timespec *expires, const struct timespec *now)
+{
+    return (now->tv_sec > expires->tv_sec) ||
+        (now->tv_sec == expires->tv_sec && now->tv_nsec >= expires->tv_nsec);
+}
+
+static void delete_entry(attr_cache_entry *entry)
+{
+    HASH_DEL(_entries, entry);
+    free(entry->pkey);
+    free(entry);
+}
+
+void attr_cache_init(unsigned int timeout, unsigned int negative_timeout, size_t max_entries)
+{
+    _timeout = timeout;
+    _negative_timeout = negative_timeout;
+    _max_entries = max_entries;
+}
+
+attr_cache_status attr_cache_get(const char *pkey, cbfuse_stat *stat, uint64_t *cas)
+{
+    attr_cache_status status = ATTR_CACHE_MISS;
+    pthread_mutex_lock(&_entries_lock);
+
+    attr_cache_entry *entry = NULL;
+    HASH_FIND_STR(_entries, pkey, entry);
+    if (entry == NULL) {
+        goto done;
+    }
+
+    struct timespec now;
+    if (clock_gettime(CLOCK_MONOTONIC, &now) != 0 || is_expired(&entry->expires, &now)) {
+        delete_entry(entry);
+        goto done;
+    }
+
+    if (entry->negative) {
+        status = ATTR_CACHE_NEGATIVE;
+        goto done;
+    }
+
+    *stat = entry->stat;
+    if (cas != NULL) {
+        *cas = entry->cas;
+    }
+    status = ATTR_CACHE_HIT;
+
+done:
+    pthread_mutex_unlock(&_entries_lock);
+    return status;
+}
+
+static void put_entry(const char *pkey, const cbfuse_stat *stat, uint64_t cas, unsigned int timeout)
+{
+    if (_max_entries == 0 || timeout == 0) {
+        return;
+    }
+
+    struct timespec now;
+    if (clock_gettime(CLOCK_MONOTONIC, &now) != 0) {
+        return;
+    }
+
+    // entries are kept in insertion order so a replaced entry moves to the end
+    attr_cache_entry *entry = NULL;
+    HASH_FIND_STR(_entries, pkey, entry);
+    if (entry != NULL) {
+        HASH_DEL(_entries, entry);
+    } else {
+        // make room by evicting the least recently stored entry
+        if (HASH_COUNT(_entries) >= _max_entries) {
+            delete_entry(_entries);
+        }
+
+        entry = calloc(1, sizeof(attr_cache_entry));
+        if (entry == NULL) {
+            return;
+        }
+
+        entry->pkey = strdup(pkey);
+        if (entry->pkey == NULL) {
+            free(entry);
+            return;
+        }
+    }
+
+    if (stat != NULL) {
+        entry->stat = *stat;
+        entry->negative = false;
+    } else {
+        memset(&entry->stat, 0, sizeof(cbfuse_stat));
+        entry->negative = true;
+    }
+    entry->cas = cas;
+    entry->expires.tv_sec = now.tv_sec + timeout;
+    entry->expires.tv_nsec = now.tv_nsec;
+
+    HASH_ADD_KEYPTR(hh, _entries, entry->pkey, strlen(entry->pkey), entry);
+}
+
+void attr_cache_put(const char *pkey, const cbfuse_stat *stat, uint64_t cas)
+{
+    pthread_mutex_lock(&_entries_lock);
+    put_entry(pkey, stat, cas, _timeout);
+    pthread_mutex_unlock(&_entries_lock);
+}
+
+void attr_cache_put_negative(const char *pkey)
+{
+    pthread_mutex_lock(&_entries_lock);
+    put_entry(pkey, NULL, 0, _negative_timeout);
+    pthread_mutex_unlock(&_entries_lock);
+}
+
+void attr_cache_remove(const char *pkey)
+{
+    pthread_mutex_lock(&_entries_lock);
+
+    attr_cache_entry *entry = NULL;
+    HASH_FIND_STR(_entries, pkey, entry);
+    if (entry != NULL) {
+        delete_entry(entry);
+    }
+
+    pthread_mutex_unlock(&_entries_lock);
+}
+
+void attr_cache_destroy(void)
+{
+    pthread_mutex_lock(&_entries_lock);
+
+    attr_cache_entry *entry, *tmp;
+    HASH_ITER(hh, _entries, entry, tmp) {
+        delete_entry(entry);
+    }
+
+    pthread_mutex_unlock(&_entries_lock);
+}
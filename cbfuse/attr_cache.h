@@ -0,0 +1,79 @@
+/*
+ * cbfuse implements a FUSE file-system using Couchbase as the data store.
+ * Copyright (c) 2021 Raymond Cardillo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CBFUSE_ATTR_CACHE_HEADER_SEEN
+#define CBFUSE_ATTR_CACHE_HEADER_SEEN
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "stats.h"
+
+typedef enum attr_cache_status {
+    ATTR_CACHE_MISS,        // nothing usable is cached
+    ATTR_CACHE_HIT,         // a cached stat was found
+    ATTR_CACHE_NEGATIVE     // the entry is known not to exist
+} attr_cache_status;
+
+/**
+ * Configures the attribute cache (the cache is disabled until this is called).
+ *
+ * @param timeout           seconds that an entry can be used before it must be fetched again
+ * @param negative_timeout  seconds that a missing entry is remembered
+ * @param max_entries       maximum number of cached entries (zero disables the cache)
+ */
+void attr_cache_init(unsigned int timeout, unsigned int negative_timeout, size_t max_entries);
+
+/**
+ * Looks up an unexpired stat entry.
+ *
+ * @param pkey      key of the stat entry
+ * @param stat      receives the cached stat
+ * @param cas       receives the cas of the cached stat document (optional)
+ * @return whether a cached stat (or a cached missing entry) was found
+ */
+attr_cache_status attr_cache_get(const char *pkey, cbfuse_stat *stat, uint64_t *cas);
+
+/**
+ * Adds or replaces the cached stat entry (and resets its expiration).
+ *
+ * @param pkey      key of the stat entry
+ * @param stat      stat to cache
+ * @param cas       cas of the stat document that was fetched or stored
+ */
+void attr_cache_put(const char *pkey, const cbfuse_stat *stat, uint64_t cas);
+
+/**
+ * Remembers that an entry doesn't exist (e.g., lookups for lock files and dotfiles).
+ *
+ * @param pkey      key of the missing stat entry
+ */
+void attr_cache_put_negative(const char *pkey);
+
+/**
+ * Removes a cached entry (e.g., when it's removed or known to be stale).
+ *
+ * @param pkey      key of the stat entry
+ */
+void attr_cache_remove(const char *pkey);
+
+/**
+ * Removes all cached entries and frees the memory used by the cache.
+ */
+void attr_cache_destroy(void);
+
+#endif /* !CBFUSE_ATTR_CACHE_HEADER_SEEN */
@@ -0,0 +1,310 @@
+/*
+ * cbfuse implements a FUSE file-system using Couchbase as the data store.
+ * Copyright (c) 2021 Raymond Cardillo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <string.h>
+
+#include "custom-uthash.h"
+#include "uthash/uthash.h"
+
+#include "block_cache.h"
+
+// Files that are read over and over (shared libraries, config files, model weights read by
+// many processes) would otherwise fetch the same blocks for every read. Recently read blocks
+// are kept in memory with their CAS within a byte budget. Blocks are removed when they're
+// written or removed through this mount, and the cached blocks of a file are checked against
+// the CAS in Couchbase when it's opened (close-to-open consistency for other clients).
+//
+// Eviction uses CLOCK: the entries form a ring, a hit sets the referenced bit of an entry, and
+// the hand gives referenced entries a second chance (clearing the bit) and evicts the first
+// entry that wasn't referenced since the hand last passed it.
+
+typedef struct block_cache_entry {
+    char *key;                          // key of the block (hash key)
+    char *data;                         // data of the block
+    size_t ndata;                       // length of the data
+    uint64_t cas;                       // cas of the block when it was fetched
+    bool referenced;                    // read since the hand last passed it
+    struct block_cache_entry *next;     // next entry in the clock ring
+    struct block_cache_entry *prev;     // previous entry in the clock ring
+    UT_hash_handle hh;
+} block_cache_entry;
+
+// FUSE operations run on multiple threads so all access to the entries is serialized
+static pthread_mutex_t _entries_lock = PTHREAD_MUTEX_INITIALIZER;
+static block_cache_entry *_entries = NULL;
+static block_cache_entry *_hand = NULL;
+static size_t _max_bytes = 0;
+static uint64_t _epoch = 0;
+static block_cache_stats _stats = {0};
+
+static void free_entry(block_cache_entry *entry)
+{
+    free(entry->key);
+    free(entry->data);
+    free(entry);
+}
+
+static void delete_entry(block_cache_entry *entry)
+{
+    if (entry->next == entry) {
+        _hand = NULL;
+    } else {
+        entry->prev->next = entry->next;
+        entry->next->prev = entry->prev;
+        if (_hand == entry) {
+            _hand = entry->next;
+        }
+    }
+
+    HASH_DEL(_entries, entry);
+    _stats.nbytes -= entry->ndata;
+    free_entry(entry);
+}
+
+// New entries go right behind the hand so they're the last ones it looks at.
+static void link_entry(block_cache_entry *entry)
+{
+    if (_hand == NULL) {
+        entry->next = entry;
+        entry->prev = entry;
+        _hand = entry;
+    } else {
+        entry->next = _hand;
+        entry->prev = _hand->prev;
+        _hand->prev->next = entry;
+        _hand->prev = entry;
+    }
+
+    HASH_ADD_KEYPTR(hh, _entries, entry->key, strlen(entry->key), entry);
+    _stats.nbytes += entry->ndata;
+}
+
+static void evict_entries(size_t nrequired)
+{
+    while (_hand != NULL && _stats.nbytes + nrequired > _max_bytes) {
+        if (_hand->referenced) {
+            _hand->referenced = false;
+            _hand = _hand->next;
+        } else {
+            delete_entry(_hand);
+            _stats.evictions++;
+        }
+    }
+}
+
+void block_cache_init(size_t max_bytes)
+{
+    _max_bytes = max_bytes;
+}
+
+bool block_cache_enabled(void)
+{
+    return (_max_bytes > 0);
+}
+
+uint64_t block_cache_epoch(void)
+{
+    pthread_mutex_lock(&_entries_lock);
+    uint64_t epoch = _epoch;
+    pthread_mutex_unlock(&_entries_lock);
+    return epoch;
+}
+
+bool block_cache_read(const char *key, size_t offset, size_t len, char *buf, size_t *ncopied)
+{
+    if (_max_bytes == 0) {
+        return false;
+    }
+
+    pthread_mutex_lock(&_entries_lock);
+
+    block_cache_entry *entry = NULL;
+    HASH_FIND_STR(_entries, key, entry);
+    if (entry == NULL) {
+        _stats.misses++;
+        goto done;
+    }
+
+    *ncopied = 0;
+    if (offset < entry->ndata) {
+        *ncopied = entry->ndata - offset;
+        if (*ncopied > len) {
+            *ncopied = len;
+        }
+        memcpy(buf, entry->data + offset, *ncopied);
+    }
+
+    entry->referenced = true;
+    _stats.hits++;
+
+done:
+    pthread_mutex_unlock(&_entries_lock);
+    return (entry != NULL);
+}
+
+void block_cache_put(const char *key, char *data, size_t ndata, uint64_t cas, uint64_t epoch)
+{
+    block_cache_entry *entry = NULL;
+    pthread_mutex_lock(&_entries_lock);
+
+    // a block that was removed while it was being fetched may be stale
+    if (_max_bytes == 0 || ndata > _max_bytes || epoch != _epoch) {
+        goto done;
+    }
+
+    entry = calloc(1, sizeof(block_cache_entry));
+    if (entry == NULL) {
+        goto done;
+    }
+
+    entry->key = strdup(key);
+    if (entry->key == NULL) {
+        free(entry);
+        entry = NULL;
+        goto done;
+    }
+
+    // another thread may have cached the same block
+    block_cache_entry *existing = NULL;
+    HASH_FIND_STR(_entries, key, existing);
+    if (existing != NULL) {
+        delete_entry(existing);
+    }
+
+    evict_entries(ndata);
+
+    entry->data = data;
+    entry->ndata = ndata;
+    entry->cas = cas;
+    link_entry(entry);
+
+done:
+    pthread_mutex_unlock(&_entries_lock);
+    if (entry == NULL) {
+        free(data);
+    }
+}
+
+static void remove_entry(const char *key)
+{
+    block_cache_entry *entry = NULL;
+    HASH_FIND_STR(_entries, key, entry);
+    if (entry != NULL) {
+        delete_entry(entry);
+    }
+
+    // blocks that are being fetched may be older than the change
+    _epoch++;
+}
+
+void block_cache_remove(const char *key)
+{
+    if (_max_bytes == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&_entries_lock);
+    remove_entry(key);
+    pthread_mutex_unlock(&_entries_lock);
+}
+
+size_t block_cache_find(const char *prefix, block_cache_ref **refs)
+{
+    size_t nrefs = 0;
+    *refs = NULL;
+
+    if (_max_bytes == 0) {
+        return nrefs;
+    }
+
+    pthread_mutex_lock(&_entries_lock);
+
+    size_t nprefix = strlen(prefix);
+    size_t maxrefs = 0;
+    block_cache_entry *entry, *tmp;
+    HASH_ITER(hh, _entries, entry, tmp) {
+        if (strncmp(entry->key, prefix, nprefix) != 0) {
+            continue;
+        }
+
+        if (nrefs == maxrefs) {
+            size_t new_maxrefs = (maxrefs == 0) ? 16 : maxrefs * 2;
+            block_cache_ref *new_refs = realloc(*refs, new_maxrefs * sizeof(block_cache_ref));
+            if (new_refs == NULL) {
+                break;
+            }
+            *refs = new_refs;
+            maxrefs = new_maxrefs;
+        }
+
+        (*refs)[nrefs].key = strdup(entry->key);
+        if ((*refs)[nrefs].key == NULL) {
+            break;
+        }
+        (*refs)[nrefs].cas = entry->cas;
+        nrefs++;
+    }
+
+    pthread_mutex_unlock(&_entries_lock);
+    return nrefs;
+}
+
+void block_cache_free_refs(block_cache_ref *refs, size_t nrefs)
+{
+    for (size_t i = 0; i < nrefs; i++) {
+        free(refs[i].key);
+    }
+    free(refs);
+}
+
+void block_cache_validate(const char *key, uint64_t cas)
+{
+    if (_max_bytes == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&_entries_lock);
+
+    block_cache_entry *entry = NULL;
+    HASH_FIND_STR(_entries, key, entry);
+    if (entry != NULL && (cas == 0 || entry->cas != cas)) {
+        remove_entry(key);
+    }
+
+    pthread_mutex_unlock(&_entries_lock);
+}
+
+void block_cache_get_stats(block_cache_stats *stats)
+{
+    pthread_mutex_lock(&_entries_lock);
+    *stats = _stats;
+    pthread_mutex_unlock(&_entries_lock);
+}
+
+void block_cache_destroy(void)
+{
+    pthread_mutex_lock(&_entries_lock);
+
+    block_cache_entry *entry, *tmp;
+    HASH_ITER(hh, _entries, entry, tmp) {
+        delete_entry(entry);
+    }
+
+    pthread_mutex_unlock(&_entries_lock);
+}
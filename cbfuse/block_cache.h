@@ -0,0 +1,126 @@
+/*
+ * cbfuse implements a FUSE file-system using Couchbase as the data store.
+ * Copyright (c) 2021 Raymond Cardillo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CBFUSE_BLOCK_CACHE_HEADER_SEEN
+#define CBFUSE_BLOCK_CACHE_HEADER_SEEN
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct block_cache_ref {
+    char *key;          // key of a cached block
+    uint64_t cas;       // cas of the cached block
+} block_cache_ref;      // a cached block that can be validated against Couchbase
+
+typedef struct block_cache_stats {
+    uint64_t hits;      // reads served from the cache
+    uint64_t misses;    // reads that had to fetch the block
+    uint64_t evictions; // blocks evicted to stay within the budget
+    size_t nbytes;      // bytes of cached block data
+} block_cache_stats;
+
+/**
+ * Configures the block cache (the cache is disabled until this is called).
+ *
+ * @param max_bytes     budget for cached block data (zero disables the cache)
+ */
+void block_cache_init(size_t max_bytes);
+
+/**
+ * @return whether blocks are cached
+ */
+bool block_cache_enabled(void);
+
+/**
+ * Gets the current generation of the cache, which changes whenever a block is removed.
+ * It's taken before a block is fetched so a block that changed while it was being
+ * fetched isn't cached (see block_cache_put).
+ *
+ * @return the current generation
+ */
+uint64_t block_cache_epoch(void);
+
+/**
+ * Copies a range of a cached block.
+ *
+ * @param key       key of the block
+ * @param offset    offset of the range within the block
+ * @param len       length of the range
+ * @param buf       receives the range
+ * @param ncopied   receives the number of bytes copied (less than len for a short block)
+ * @return whether the block was cached
+ */
+bool block_cache_read(const char *key, size_t offset, size_t len, char *buf, size_t *ncopied);
+
+/**
+ * Caches a block that was fetched, evicting other blocks if the budget is exceeded.
+ * The cache takes ownership of the data (and frees it if it isn't kept).
+ *
+ * @param key       key of the block
+ * @param data      data of the block (allocated with malloc)
+ * @param ndata     length of the data
+ * @param cas       cas of the block that was fetched
+ * @param epoch     generation of the cache taken before the block was fetched
+ */
+void block_cache_put(const char *key, char *data, size_t ndata, uint64_t cas, uint64_t epoch);
+
+/**
+ * Removes a cached block (e.g., when it's written or removed).
+ *
+ * @param key       key of the block
+ */
+void block_cache_remove(const char *key);
+
+/**
+ * Finds the cached blocks whose keys start with a prefix (e.g., the blocks of a file).
+ *
+ * @param prefix    prefix of the keys
+ * @param refs      receives the cached blocks (must be freed with block_cache_free_refs)
+ * @return number of cached blocks that were found
+ */
+size_t block_cache_find(const char *prefix, block_cache_ref **refs);
+
+/**
+ * Frees the blocks returned by block_cache_find.
+ *
+ * @param refs      blocks to free
+ * @param nrefs     number of blocks
+ */
+void block_cache_free_refs(block_cache_ref *refs, size_t nrefs);
+
+/**
+ * Removes a cached block unless it has the current cas of the block in Couchbase.
+ *
+ * @param key       key of the block
+ * @param cas       current cas of the block (zero if it no longer exists or couldn't be checked)
+ */
+void block_cache_validate(const char *key, uint64_t cas);
+
+/**
+ * Gets the counters of the cache.
+ *
+ * @param stats     receives the counters
+ */
+void block_cache_get_stats(block_cache_stats *stats);
+
+/**
+ * Removes all cached blocks and frees the memory used by the cache.
+ */
+void block_cache_destroy(void);
+
+#endif /* !CBFUSE_BLOCK_CACHE_HEADER_SEEN */
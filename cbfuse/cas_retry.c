@@ -0,0 +1,115 @@
+/*
+ * cbfuse implements a FUSE file-system using Couchbase as the data store.
+ * Copyright (c) 2021 Raymond Cardillo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "cas_retry.h"
+#include "util.h"
+#include "common.h"
+
+// Several mounts can change the same stat, block or directory entry shard. Each change is
+// read, modified, and stored with the CAS that was read, and a conflict means someone else
+// got there first. Retrying right away tends to collide again, so the retries are spread
+// out with "full jitter" (a random delay up to an exponentially growing bound).
+
+static atomic_uint_fast64_t _updates;
+static atomic_uint_fast64_t _conflicts;
+static atomic_uint_fast64_t _exhausted;
+
+// each thread has its own seed so the jitter doesn't need a lock
+static _Thread_local unsigned int _seed = 0;
+
+static unsigned int next_random(void)
+{
+    if (_seed == 0) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        _seed = (unsigned int)(ts.tv_nsec ^ (uintptr_t)&ts) | 1;
+    }
+
+    // xorshift32
+    _seed ^= _seed << 13;
+    _seed ^= _seed >> 17;
+    _seed ^= _seed << 5;
+    return _seed;
+}
+
+void cas_retry_init(cas_retry *retry, const char *ref)
+{
+    retry->ref = ref;
+    retry->attempts = 0;
+    retry->delay_us = CAS_RETRY_MIN_DELAY_US;
+    atomic_fetch_add_explicit(&_updates, 1, memory_order_relaxed);
+}
+
+bool cas_retry_again(cas_retry *retry, int fresult)
+{
+    retry->attempts++;
+    if (fresult != -EAGAIN) {
+        return false;
+    }
+
+    atomic_fetch_add_explicit(&_conflicts, 1, memory_order_relaxed);
+
+    if (retry->attempts >= CAS_RETRY_MAX_ATTEMPTS) {
+        atomic_fetch_add_explicit(&_exhausted, 1, memory_order_relaxed);
+        fprintf(stderr, "  %s:%s:%d CAS conflicts after %u attempts %s\n", __FILENAME__, __func__, __LINE__, retry->attempts, retry->ref);
+        return false;
+    }
+
+    // the first conflict is often just a stale cached copy
+    if (retry->attempts == 1) {
+        return true;
+    }
+
+    unsigned int delay_us = next_random() % (retry->delay_us + 1);
+    struct timespec ts = { .tv_sec = delay_us / 1000000, .tv_nsec = (delay_us % 1000000) * 1000 };
+    nanosleep(&ts, NULL);
+
+    if (retry->delay_us < CAS_RETRY_MAX_DELAY_US) {
+        retry->delay_us *= 2;
+    }
+    return true;
+}
+
+int cas_retry_update(const char *ref, cas_update update, void *context)
+{
+    int fresult = 0;
+
+    cas_retry retry;
+    cas_retry_init(&retry, ref);
+    do {
+        fresult = update(context);
+    } while (cas_retry_again(&retry, fresult));
+
+    IfTrueGotoDoneWithRef((fresult == -EAGAIN), -EIO, ref);
+
+done:
+    return fresult;
+}
+
+void cas_retry_get_stats(cas_retry_stats *stats)
+{
+    stats->updates = atomic_load_explicit(&_updates, memory_order_relaxed);
+    stats->conflicts = atomic_load_explicit(&_conflicts, memory_order_relaxed);
+    stats->exhausted = atomic_load_explicit(&_exhausted, memory_order_relaxed);
+}
@@ -0,0 +1,81 @@
+/*
+ * cbfuse implements a FUSE file-system using Couchbase as the data store.
+ * Copyright (c) 2021 Raymond Cardillo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CBFUSE_CAS_RETRY_HEADER_SEEN
+#define CBFUSE_CAS_RETRY_HEADER_SEEN
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct cas_retry {
+    const char *ref;            // reported when the retry budget is spent
+    unsigned int attempts;      // attempts made so far
+    unsigned int delay_us;      // upper bound of the next backoff
+} cas_retry;                    // state of one optimistic update
+
+typedef struct cas_retry_stats {
+    uint64_t updates;           // optimistic updates that were started
+    uint64_t conflicts;         // attempts that failed with a CAS conflict
+    uint64_t exhausted;         // updates that gave up after the retry budget was spent
+} cas_retry_stats;
+
+/**
+ * An attempt of an optimistic update. It reads the current document, applies the change,
+ * and stores it with the CAS that was read.
+ *
+ * @param context   context passed to cas_retry_update
+ * @return zero on success, -EAGAIN on a CAS conflict, or another negative error code
+ */
+typedef int (*cas_update)(void *context);
+
+/**
+ * Starts an optimistic update that's driven by a loop in the caller.
+ *
+ * @param retry     state of the update
+ * @param ref       reported when the retry budget is spent (e.g., the key)
+ */
+void cas_retry_init(cas_retry *retry, const char *ref);
+
+/**
+ * Decides whether an attempt should be made again. A CAS conflict (-EAGAIN) is retried
+ * right away the first time (e.g., a cached copy was stale) and after a jittered,
+ * exponentially growing delay after that, until the retry budget is spent.
+ *
+ * @param retry     state of the update
+ * @param fresult   result of the attempt
+ * @return true if the caller should read the document again and retry
+ */
+bool cas_retry_again(cas_retry *retry, int fresult);
+
+/**
+ * Runs an optimistic update until it doesn't conflict.
+ *
+ * @param ref       reported when the retry budget is spent (e.g., the key)
+ * @param update    attempt that is retried
+ * @param context   passed to each attempt
+ * @return zero on success, -EIO if the retry budget was spent, or the error of the last attempt
+ */
+int cas_retry_update(const char *ref, cas_update update, void *context);
+
+/**
+ * Gets the counters of every optimistic update so far.
+ *
+ * @param stats     receives the counters
+ */
+void cas_retry_get_stats(cas_retry_stats *stats);
+
+#endif /* !CBFUSE_CAS_RETRY_HEADER_SEEN */
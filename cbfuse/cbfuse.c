@@ -20,6 +20,8 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <string.h>
 #include <libgen.h>
 
@@ -31,22 +33,92 @@
 #include <cbfuse.h>
 #include "util.h"
 #include "common.h"
-#include "sync_get.h"
-#include "sync_store.h"
-#include "sync_remove.h"
 #include "stats.h"
 #include "dentries.h"
 #include "data.h"
+#include "inodes.h"
+#include "migrate.h"
+#include "handles.h"
+#include "attr_cache.h"
+#include "lookups.h"
+#include "block_cache.h"
+#include "atimes.h"
+#include "cas_retry.h"
+#include "sync_get.h"
+#include "pool.h"
 
 // We're using high-level FUSE ops which are synchronous
 // and from those we're making synchronous calls to Couchbase.
-static lcb_INSTANCE *_lcb_instance = NULL;
+// FUSE can run operations on multiple threads so each operation
+// borrows its own library instance from the pool.
+static lcb_pool *_lcb_pool = NULL;
 
 /////
 
-static void open_callback(__unused lcb_INSTANCE *instance, lcb_STATUS rc)
+static inline file_handle *get_file_handle(struct fuse_file_info *fi)
+{
+    return (file_handle*)(uintptr_t)fi->fh;
+}
+
+// children that are filled by readdir with one batch of stats
+#define READDIR_STAT_BATCH_LEN  128
+
+static inline dir_handle *get_dir_handle(struct fuse_file_info *fi)
 {
-    fprintf(stderr, "open bucket: %s\n", lcb_strerror_short(rc));
+    return (dir_handle*)(uintptr_t)fi->fh;
+}
+
+static int open_file_handle(const char *pkey, struct fuse_file_info *fi)
+{
+    file_handle *fh = file_handle_create(pkey);
+    if (fh == NULL) {
+        return -ENOMEM;
+    }
+
+    fi->fh = (uint64_t)(uintptr_t)fh;
+    return 0;
+}
+
+// Splits a path into newly allocated parent directory and base name strings.
+// The libgen dirname/basename functions may use static storage which isn't safe
+// when FUSE is running operations on multiple threads.
+static int split_path(const char *path, char **dname, char **bname)
+{
+    const char *slash = strrchr(path, '/');
+    if (slash == NULL) {
+        return -ENOENT;
+    }
+
+    // the parent of a top level entry is the root directory
+    size_t ndname = (slash == path) ? 1 : (size_t)(slash - path);
+    *dname = strndup(path, ndname);
+    *bname = strdup(slash + 1);
+    if (*dname == NULL || *bname == NULL) {
+        free(*dname);
+        free(*bname);
+        *dname = NULL;
+        *bname = NULL;
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+// Resolves a path to the key of its entry and gets the stat of the entry.
+// A path that resolved to an entry that is gone (e.g., removed by another mount)
+// is looked up again next time.
+static int get_path_stat(lcb_INSTANCE *instance, const char *path, char *pkey, cbfuse_stat *stat)
+{
+    int fresult = lookup_path(instance, path, pkey);
+    if (fresult != 0) {
+        return fresult;
+    }
+
+    fresult = get_stat(instance, pkey, stat, NULL);
+    if (fresult == -ENOENT) {
+        lookups_remove(path, false);
+    }
+    return fresult;
 }
 
 /////
@@ -68,48 +140,13 @@ static void *cbfuse_init(__unused struct fuse_conn_info *conn)
     return NULL;
 }
 
-// Get file attributes
-static int cbfuse_getattr(const char *path, struct stat *stbuf)
+// Copies a stat into a stat buffer (with the uid and gid of the caller).
+static void fill_stat(const cbfuse_stat *stres, struct stat *stbuf)
 {
-    fprintf(stderr, "cbfuse_getattr path:%s\n", path);
-
-    int fresult = 0;
-    sync_get_result *result = NULL;
-
-    lcb_STATUS rc;
-    lcb_CMDGET *cmd;
-
-    rc = lcb_cmdget_create(&cmd);
-    IfLCBFailGotoDone(rc, -EIO);
-
-    rc = lcb_cmdget_collection(
-        cmd,
-        DEFAULT_SCOPE_STRING, DEFAULT_SCOPE_STRLEN,
-        STATS_COLLECTION_STRING, STATS_COLLECTION_STRLEN);
-    IfLCBFailGotoDone(rc, -EIO);
-
-    size_t npath = strlen(path);
-    IfTrueGotoDoneWithRef((npath > MAX_PATH_LEN), ENAMETOOLONG, path);
-
-    rc = lcb_cmdget_key(cmd, path, npath);
-    IfLCBFailGotoDone(rc, -EIO);
-
-    rc = sync_get(_lcb_instance, cmd, &result);
-
-    // first check the sync command result code
-    IfLCBFailGotoDone(rc, -EIO);
-
-    // now check the actual result status
-    IfLCBFailGotoDoneWithRef(result->status, -ENOENT, path);
-
-    // sanity check that we received the expected structure
-    IfTrueGotoDoneWithRef((result->nvalue != CBFUSE_STAT_STRUCT_SIZE), -EBADF, path);
-
     // get the fuse context (for uid and gid)
     struct fuse_context *fc = fuse_get_context();
 
     // copy the stat binary into the stat buffer
-    cbfuse_stat *stres = (cbfuse_stat*)result->value;
     stbuf->st_uid = fc->uid;
     stbuf->st_gid = fc->gid;
     stbuf->st_mode = stres->st_mode;
@@ -120,11 +157,57 @@ static int cbfuse_getattr(const char *path, struct stat *stbuf)
     stbuf->st_ctime = stres->st_ctime;
     stbuf->st_ctimensec = stres->st_ctimensec;
     stbuf->st_size = stres->st_size;
+    stbuf->st_ino = stres->st_ino;
+}
+
+// Applies changes that are pending in memory (writes through open files and lazy access times).
+static void fill_pending(const char *pkey, struct stat *stbuf)
+{
+    size_t size = 0;
+    struct timespec mtime;
+    if (file_handles_pending(pkey, &size, &mtime)) {
+        if ((off_t)size > stbuf->st_size) {
+            stbuf->st_size = size;
+        }
+        if (mtime.tv_sec != 0 || mtime.tv_nsec != 0) {
+            stbuf->st_mtime = mtime.tv_sec;
+            stbuf->st_mtimensec = mtime.tv_nsec;
+        }
+    }
+
+    struct timespec atime;
+    if (atimes_pending(pkey, &atime)) {
+        stbuf->st_atime = atime.tv_sec;
+        stbuf->st_atimensec = atime.tv_nsec;
+    }
+}
+
+// Get file attributes
+static int cbfuse_getattr(const char *path, struct stat *stbuf)
+{
+    fprintf(stderr, "cbfuse_getattr path:%s\n", path);
+
+    int fresult = 0;
+    lcb_INSTANCE *instance = pool_borrow(_lcb_pool);
+
+    size_t npath = strlen(path);
+    IfTrueGotoDoneWithRef((npath > MAX_PATH_LEN), -ENAMETOOLONG, path);
+
+    // entry keys and stats are served from the lookup and attribute caches when possible
+    char pkey[INODE_KEY_LEN + 1];
+    cbfuse_stat stres = {0};
+    fresult = get_path_stat(instance, path, pkey, &stres);
+    if (fresult != 0) {
+        goto done;
+    }
+
+    fill_stat(&stres, stbuf);
+    fill_pending(pkey, stbuf);
 
     fprintf(stderr, "%s:%s:%d %s size:%lld\n", __FILENAME__, __func__, __LINE__, path, stbuf->st_size);
 
 done:
-    sync_get_destroy(result);
+    pool_return(_lcb_pool, instance);
     return fresult;
 }
 
@@ -134,35 +217,71 @@ static int cbfuse_open(const char *path, struct fuse_file_info *fi)
     fprintf(stderr, "cbfuse_open path:%s flags:0x%04x\n", path, fi->flags);
     
     int fresult = 0;
+    lcb_INSTANCE *instance = pool_borrow(_lcb_pool);
 
     size_t npath = strlen(path);
-    IfTrueGotoDoneWithRef((npath > MAX_PATH_LEN), ENAMETOOLONG, path);
+    IfTrueGotoDoneWithRef((npath > MAX_PATH_LEN), -ENAMETOOLONG, path);
 
+    char pkey[INODE_KEY_LEN + 1];
     cbfuse_stat stat = {0};
-    fresult = get_stat(_lcb_instance, path, &stat, NULL);
+    fresult = get_path_stat(instance, path, pkey, &stat);
+    IfFRErrorGotoDoneWithRef(path);
+
+    // cached blocks that someone else changed since they were read aren't used
+    revalidate_data(instance, pkey, &stat);
+
+    fresult = open_file_handle(pkey, fi);
     IfFRErrorGotoDoneWithRef(path);
 
 done:
+    pool_return(_lcb_pool, instance);
     return fresult;
 }
 
+// Removes the documents inserted by a create or mkdir that couldn't be completed
+// so a failed operation doesn't leave an entry behind that isn't in its parent
+// (or a child in the parent that doesn't exist).
+static void undo_insert(lcb_INSTANCE *instance, const char *pkey, const char *parent_pkey, const char *bname, bool stat_inserted, bool dentry_inserted, bool child_added)
+{
+    if (child_added) {
+        remove_child_from_dentry(instance, parent_pkey, bname);
+    }
+
+    sync_batch batch;
+    sync_batch_init(&batch, instance);
+
+    sync_remove_result *result;
+    if (stat_inserted) {
+        batch_remove_stat(&batch, pkey, &result);
+    }
+    if (dentry_inserted) {
+        batch_remove_dentry(&batch, pkey, &result);
+    }
+    sync_batch_execute(&batch);
+
+    // the stat is either gone or in an unknown state
+    attr_cache_remove(pkey);
+    sync_batch_destroy(&batch);
+}
+
 // Create and open a file
-static int cbfuse_create(const char *path, mode_t mode, __unused struct fuse_file_info *fi)
+static int cbfuse_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
     fprintf(stderr, "cbfuse_create path:%s mode:0x%02X\n", path, mode);
 
-    int fresult = 0;
+    char *dname = NULL;
+    char *bname = NULL;
+    char pkey[INODE_KEY_LEN + 1];
+    char parent_pkey[INODE_KEY_LEN + 1];
+    bool stat_inserted = false;
+    bool child_added = false;
+    lcb_INSTANCE *instance = pool_borrow(_lcb_pool);
 
-    char *dirstr = strdup(path);
-    char *basestr = strdup(path);
-    char *dname = dirname(dirstr);
-    char *bname = basename(basestr);
-    
-    IfTrueGotoDoneWithRef(
-        (dname == NULL || bname == NULL),
-        -ENOENT,
-        path
-    );
+    sync_batch batch;
+    sync_batch_init(&batch, instance);
+
+    int fresult = split_path(path, &dname, &bname);
+    IfFRErrorGotoDoneWithRef(path);
 
     IfFalseGotoDoneWithRef(
         S_ISREG(mode),
@@ -171,17 +290,58 @@ static int cbfuse_create(const char *path, mode_t mode, __unused struct fuse_fil
     );
 
     size_t npath = strlen(path);
-    IfTrueGotoDoneWithRef((npath > MAX_PATH_LEN), ENAMETOOLONG, path);
+    IfTrueGotoDoneWithRef((npath > MAX_PATH_LEN), -ENAMETOOLONG, path);
+
+    fresult = lookup_path(instance, dname, parent_pkey);
+    IfFRErrorGotoDoneWithRef(dname);
+
+    // the inode number keys the file (so nothing moves when the file is renamed)
+    uint64_t ino = 0;
+    fresult = next_inode(instance, &ino);
+    IfFRErrorGotoDoneWithRef(path);
+    inode_key(ino, pkey);
+
+    // the new stat and adding the file to the parent directory entry
+    // are independent so they go out together
+    cbfuse_stat stat;
+    sync_store_result *stat_result = NULL;
+    fresult = batch_insert_stat(&batch, pkey, mode, ino, &stat, &stat_result);
+    IfFRErrorGotoDoneWithRef(path);
 
-    fresult = insert_stat(_lcb_instance, path, mode);
+    dentry_shard_result parent_result = {0};
+    fresult = batch_add_child_to_dentry(&batch, parent_pkey, bname, ino, &parent_result);
     IfFRErrorGotoDoneWithRef(path);
 
-    fresult = add_child_to_dentry(_lcb_instance, dname, bname);
+    lcb_STATUS rc = sync_batch_execute(&batch);
+    IfLCBFailGotoDone(rc, -EIO);
+
+    // remember what was created so it can be undone if a later step fails
+    int stat_fresult = insert_stat_result(pkey, &stat, stat_result);
+    stat_inserted = (stat_fresult == 0);
+    int parent_fresult = add_child_to_dentry_result(instance, parent_pkey, bname, ino, &parent_result, &child_added);
+
+    fresult = stat_fresult;
+    IfFRErrorGotoDoneWithRef(path);
+
+    fresult = parent_fresult;
+    IfFRErrorGotoDoneWithRef(path);
+
+    // the new file is complete (and replaces a cached lookup miss)
+    stat_inserted = false;
+    child_added = false;
+    lookups_put(path, pkey);
+
+    fresult = open_file_handle(pkey, fi);
     IfFRErrorGotoDoneWithRef(path);
 
 done:
-    free(dirstr);
-    free(basestr);
+    if (fresult != 0 && (stat_inserted || child_added)) {
+        undo_insert(instance, pkey, parent_pkey, bname, stat_inserted, false, child_added);
+    }
+    sync_batch_destroy(&batch);
+    pool_return(_lcb_pool, instance);
+    free(dname);
+    free(bname);
     return fresult;
 }
 
@@ -190,85 +350,320 @@ static int cbfuse_unlink(const char *path)
 {
     fprintf(stderr, "cbfuse_unlink path:%s\n", path);
 
-    int fresult = 0;
+    char *dname = NULL;
+    char *bname = NULL;
+    lcb_INSTANCE *instance = pool_borrow(_lcb_pool);
 
-    char *dirstr = strdup(path);
-    char *basestr = strdup(path);
-    char *dname = dirname(dirstr);
-    char *bname = basename(basestr);
+    sync_batch batch;
+    sync_batch_init(&batch, instance);
 
-    IfTrueGotoDoneWithRef(
-        (dname == NULL || bname == NULL),
-        -ENOENT,
-        path
-    );
+    int fresult = split_path(path, &dname, &bname);
+    IfFRErrorGotoDoneWithRef(path);
 
-    // TODO: These operations can be in a transaction or at least scheduled as a batch
+    char parent_pkey[INODE_KEY_LEN + 1];
+    fresult = lookup_path(instance, dname, parent_pkey);
+    IfFRErrorGotoDoneWithRef(dname);
 
-    // remove any data for the file
-    fresult = remove_data(_lcb_instance, path);
+    char pkey[INODE_KEY_LEN + 1];
+    fresult = lookup_path(instance, path, pkey);
+    IfFRErrorGotoDoneWithRef(path);
+
+    // the data, the stat and the parent directory entry are independent so they go out together
 
-    // remove the file from the parent directory entry
-    fresult = remove_child_from_dentry(_lcb_instance, dname, bname);
+    // remove any data for the file
+    batch_remove_data(&batch, pkey);
+    atimes_forget(pkey);
+    file_handles_discard(pkey, true, true);
 
     // remove the stat entry for the file
-    fresult = remove_stat(_lcb_instance, path);
+    sync_remove_result *stat_result = NULL;
+    fresult = batch_remove_stat(&batch, pkey, &stat_result);
+    IfFRErrorGotoDoneWithRef(path);
+
+    // remove the file from the parent directory entry by name
+    dentry_shard_result parent_result = {0};
+    int parent_fresult = batch_remove_child_from_dentry(&batch, parent_pkey, bname, &parent_result);
+
+    lcb_STATUS rc = sync_batch_execute(&batch);
+    file_handles_invalidate(pkey);
+    lookups_put_negative(path);
+    IfLCBFailGotoDone(rc, -EIO);
+
+    if (parent_fresult == 0) {
+        remove_child_from_dentry_result(instance, parent_pkey, bname, &parent_result);
+    }
 
     // Only check the stat operation - others can fail silently and may be useful for error recovery
+    fresult = remove_stat_result(pkey, stat_result);
+    IfFRErrorGotoDoneWithRef(path);
+
+done:
+    sync_batch_destroy(&batch);
+    pool_return(_lcb_pool, instance);
+    free(dname);
+    free(bname);
+    return fresult;
+}
+
+typedef struct readdir_context {
+    void *buf;                  // buffer passed to the filler
+    fuse_fill_dir_t filler;     // adds an entry to the buffer
+    off_t offset;               // offset of the first entry to add
+    off_t child_offset;         // offset of the next child
+} readdir_context;
+
+static int readdir_child(void *context, const char *child_name, __unused uint64_t ino)
+{
+    readdir_context *readdir = context;
+
+    // skip to the offset and fill with the offset of the next entry
+    if (readdir->child_offset++ >= readdir->offset) {
+        return readdir->filler(readdir->buf, child_name, NULL, readdir->child_offset);
+    }
+    return 0;
+}
+
+static int snapshot_child(void *context, const char *child_name, uint64_t ino)
+{
+    return dir_handle_add(context, child_name, ino);
+}
+
+// Open directory (the children are fetched once and readdir is served from the snapshot)
+static int cbfuse_opendir(const char *path, struct fuse_file_info *fi)
+{
+    fprintf(stderr, "cbfuse_opendir path:%s\n", path);
+
+    int fresult = 0;
+    lcb_INSTANCE *instance = pool_borrow(_lcb_pool);
+
+    dir_handle *dh = dir_handle_create();
+    IfNULLGotoDoneWithRef(dh, -ENOMEM, path);
+
+    char pkey[INODE_KEY_LEN + 1];
+    fresult = lookup_path(instance, path, pkey);
+    IfFRErrorGotoDoneWithRef(path);
+
+    fresult = read_dentry_children(instance, pkey, snapshot_child, dh);
     IfFRErrorGotoDoneWithRef(path);
 
+    fi->fh = (uint64_t)(uintptr_t)dh;
+    dh = NULL;
+
+done:
+    dir_handle_destroy(dh);
+    pool_return(_lcb_pool, instance);
+    return fresult;
+}
+
+// Fills the next batch of children with their stats. The children were listed with
+// their inode numbers so the stats are fetched together by key (and cached) and the
+// getattr that follows for each child is served from memory. The paths of the
+// children are remembered as well so that getattr doesn't look them up again.
+static int fill_children(const char *path, void *buf, fuse_fill_dir_t filler, dir_handle *dh, size_t first, bool *full)
+{
+    int fresult = 0;
+    const char *pkeys[READDIR_STAT_BATCH_LEN];
+    char keys[READDIR_STAT_BATCH_LEN][INODE_KEY_LEN + 1];
+    cbfuse_stat stats[READDIR_STAT_BATCH_LEN];
+    int results[READDIR_STAT_BATCH_LEN];
+    size_t nchildren = 0;
+
+    // paths can be long so the child path is on the heap
+    char *child_path = malloc(MAX_PATH_LEN + 1);
+    IfNULLGotoDoneWithRef(child_path, -ENOMEM, path);
+
+    while (nchildren < READDIR_STAT_BATCH_LEN && dir_handle_child(dh, first + nchildren) != NULL) {
+        inode_key(dir_handle_inode(dh, first + nchildren), keys[nchildren]);
+        pkeys[nchildren] = keys[nchildren];
+        nchildren++;
+    }
+
+    // the listing doesn't fail because the stats couldn't be fetched
+    lcb_INSTANCE *instance = pool_borrow(_lcb_pool);
+    int stats_fresult = get_stats(instance, pkeys, nchildren, stats, results);
+    pool_return(_lcb_pool, instance);
+
+    // a child with a path that is too long isn't remembered
+    const char *separator = (strcmp(path, ROOT_DIR_STRING) == 0) ? "" : "/";
+    for (size_t i = 0; i < nchildren; i++) {
+        const char *child_name = dir_handle_child(dh, first + i);
+        struct stat stbuf = {0};
+        bool has_stat = (stats_fresult == 0 && results[i] == 0);
+        if (has_stat) {
+            fill_stat(&stats[i], &stbuf);
+            fill_pending(pkeys[i], &stbuf);
+
+            int n = snprintf(child_path, MAX_PATH_LEN + 1, "%s%s%s", path, separator, child_name);
+            if (n > 0 && (size_t)n <= MAX_PATH_LEN) {
+                lookups_put(child_path, pkeys[i]);
+            }
+        }
+
+        if (filler(buf, child_name, has_stat ? &stbuf : NULL, first + i + 1) != 0) {
+            *full = true;
+            break;
+        }
+    }
+
 done:
-    free(dirstr);
-    free(basestr);
+    free(child_path);
     return fresult;
 }
 
 // Read directory
-static int cbfuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, __unused struct fuse_file_info *fi)
+static int cbfuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
 {
     fprintf(stderr, "cbfuse_readdir path:%s\n", path);
 
-    cJSON *dentry_json = NULL;
-    int fresult = get_dentry_json(_lcb_instance, path, &dentry_json);
-    IfFRErrorGotoDoneWithRef(path);
+    int fresult = 0;
+    dir_handle *dh = get_dir_handle(fi);
+
+    // without a snapshot the shards are fetched and filled in order until the buffer is full
+    if (dh == NULL) {
+        lcb_INSTANCE *instance = pool_borrow(_lcb_pool);
+        readdir_context context = { .buf = buf, .filler = filler, .offset = offset, .child_offset = 0 };
+        char pkey[INODE_KEY_LEN + 1];
+        fresult = lookup_path(instance, path, pkey);
+        if (fresult == 0) {
+            fresult = read_dentry_children(instance, pkey, readdir_child, &context);
+        }
+        pool_return(_lcb_pool, instance);
+        IfFRErrorGotoDoneWithRef(path);
+        goto done;
+    }
 
-    int child_offset = 0;
-    cJSON *child;
-    cJSON *children = cJSON_GetObjectItemCaseSensitive(dentry_json, DENTRY_CHILDREN);
-    IfFalseGotoDoneWithRef(cJSON_IsArray(children), 0, path);
+    // a rewind starts over with a new snapshot
+    if (offset == 0 && dh->served) {
+        dir_handle_clear(dh);
 
-    cJSON_ArrayForEach(child, children) {
-        // skip to the offset (underlying implementation is a linked list)
-        if (child_offset++ >= offset) {
-            // fill with the next offset or zero if no more
-            IfFalseGotoDoneWithRef(cJSON_IsString(child), 0, path);
-            fresult = filler(buf, cJSON_GetStringValue(child), NULL, child_offset);
+        lcb_INSTANCE *instance = pool_borrow(_lcb_pool);
+        char pkey[INODE_KEY_LEN + 1];
+        fresult = lookup_path(instance, path, pkey);
+        if (fresult == 0) {
+            fresult = read_dentry_children(instance, pkey, snapshot_child, dh);
         }
+        pool_return(_lcb_pool, instance);
+        IfFRErrorGotoDoneWithRef(path);
+    }
+    dh->served = true;
+
+    // fill with the offset of the next entry until the buffer is full
+    bool full = false;
+    for (size_t index = offset; !full && dir_handle_child(dh, index) != NULL; index += READDIR_STAT_BATCH_LEN) {
+        fresult = fill_children(path, buf, filler, dh, index, &full);
+        IfFRErrorGotoDoneWithRef(path);
     }
 
 done:
-    cJSON_Delete(dentry_json);
     return fresult;
 }
 
+// Release an open directory
+static int cbfuse_releasedir(const char *path, struct fuse_file_info *fi)
+{
+    fprintf(stderr, "cbfuse_releasedir path:%s\n", path);
+
+    dir_handle_destroy(get_dir_handle(fi));
+    fi->fh = 0;
+
+    return 0;
+}
+
 // Read data from an open file
-static int cbfuse_read(const char *path, char *buf, size_t size, off_t offset, __unused struct fuse_file_info *fi)
+static int cbfuse_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
     fprintf(stderr, "cbfuse_read path:%s size:%lu offset:%llu\n", path, size, offset);
 
-    // TODO: the underlying CB write operation can benefit from streaming/buffering
+    int fresult = 0;
+    lcb_INSTANCE *instance = pool_borrow(_lcb_pool);
+
+    file_handle *fh = get_file_handle(fi);
+    if (fh == NULL) {
+        char pkey[INODE_KEY_LEN + 1];
+        fresult = lookup_path(instance, path, pkey);
+        if (fresult == 0) {
+            fresult = read_data(instance, pkey, buf, size, offset, false);
+        }
+    } else {
+        // sequential reads are served from the blocks the handle fetched ahead
+        fresult = file_handle_read(instance, fh, buf, size, offset);
+    }
 
-    return read_data(_lcb_instance, path, buf, size, offset);
+    pool_return(_lcb_pool, instance);
+    return fresult;
 }
 
 // Write data to an open file
-static int cbfuse_write(const char *path, const char *buf, size_t size, off_t offset, __unused struct fuse_file_info *fi)
+static int cbfuse_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
     fprintf(stderr, "cbfuse_write path:%s size:%lu offset:%llu\n", path, size, offset);
 
-    // TODO: the underlying CB write operation can benefit from streaming/buffering
+    int fresult = 0;
+    lcb_INSTANCE *instance = pool_borrow(_lcb_pool);
+
+    file_handle *fh = get_file_handle(fi);
+    if (fh == NULL) {
+        char pkey[INODE_KEY_LEN + 1];
+        fresult = lookup_path(instance, path, pkey);
+        if (fresult == 0) {
+            fresult = write_data(instance, pkey, buf, size, offset);
+            file_handles_invalidate(pkey);
+        }
+    } else {
+        // sequential writes are coalesced in the handle and written on flush/release/fsync
+        fresult = file_handle_write(instance, fh, buf, size, offset);
+    }
+
+    pool_return(_lcb_pool, instance);
+    return fresult;
+}
+
+// Write any buffered data (called for each close of an open file)
+static int cbfuse_flush(const char *path, struct fuse_file_info *fi)
+{
+    fprintf(stderr, "cbfuse_flush path:%s\n", path);
+
+    int fresult = 0;
+
+    file_handle *fh = get_file_handle(fi);
+    if (fh != NULL) {
+        lcb_INSTANCE *instance = pool_borrow(_lcb_pool);
+        fresult = file_handle_flush(instance, fh);
+        pool_return(_lcb_pool, instance);
+        IfFRErrorGotoDoneWithRef(path);
+    }
+
+done:
+    return fresult;
+}
+
+// Release an open file (called once when there are no more references to it)
+static int cbfuse_release(const char *path, struct fuse_file_info *fi)
+{
+    fprintf(stderr, "cbfuse_release path:%s\n", path);
+
+    int fresult = 0;
+
+    file_handle *fh = get_file_handle(fi);
+    if (fh != NULL) {
+        lcb_INSTANCE *instance = pool_borrow(_lcb_pool);
+        fresult = file_handle_flush(instance, fh);
+        pool_return(_lcb_pool, instance);
+        file_handle_destroy(fh);
+        fi->fh = 0;
+        IfFRErrorGotoDoneWithRef(path);
+    }
+
+done:
+    return fresult;
+}
+
+// Synchronize file contents
+static int cbfuse_fsync(const char *path, __unused int datasync, struct fuse_file_info *fi)
+{
+    fprintf(stderr, "cbfuse_fsync path:%s\n", path);
 
-    return write_data(_lcb_instance, path, buf, size, offset);
+    return cbfuse_flush(path, fi);
 }
 
 // Change the permission bits of a file
@@ -276,10 +671,17 @@ static int cbfuse_chmod(const char *path, mode_t mode)
 {
     fprintf(stderr, "cbfuse_chmod path:%s mode:0x%04X\n", path, mode);
 
-    int fresult = update_stat_mode(_lcb_instance, path, mode);
+    lcb_INSTANCE *instance = pool_borrow(_lcb_pool);
+
+    char pkey[INODE_KEY_LEN + 1];
+    int fresult = lookup_path(instance, path, pkey);
+    IfFRErrorGotoDoneWithRef(path);
+
+    fresult = update_stat_mode(instance, pkey, mode);
     IfFRErrorGotoDoneWithRef(path);
 
 done:
+    pool_return(_lcb_pool, instance);
     return fresult;
 }
 
@@ -288,7 +690,35 @@ static int cbfuse_truncate(const char *path, off_t offset)
 {
     fprintf(stderr, "cbfuse_truncate path:%s offset:%llu\n", path, offset);
 
-    int fresult = truncate_data(_lcb_instance, path, offset);
+    lcb_INSTANCE *instance = pool_borrow(_lcb_pool);
+
+    char pkey[INODE_KEY_LEN + 1];
+    int fresult = lookup_path(instance, path, pkey);
+    IfFRErrorGotoDoneWithRef(path);
+
+    // writes that are still pending (or buffered by other open handles) can't grow the file back afterwards
+    file_handles_truncate(pkey, offset);
+    file_handles_discard(pkey, true, true);
+
+    fresult = truncate_data(instance, pkey, offset);
+    file_handles_invalidate(pkey);
+    IfFRErrorGotoDoneWithRef(path);
+
+done:
+    pool_return(_lcb_pool, instance);
+    return fresult;
+}
+
+// Change the size of an open file
+static int cbfuse_ftruncate(const char *path, off_t offset, struct fuse_file_info *fi)
+{
+    fprintf(stderr, "cbfuse_ftruncate path:%s offset:%llu\n", path, offset);
+
+    // buffered data must be written first so it can't extend the file afterwards
+    int fresult = cbfuse_flush(path, fi);
+    IfFRErrorGotoDoneWithRef(path);
+
+    fresult = cbfuse_truncate(path, offset);
     IfFRErrorGotoDoneWithRef(path);
 
 done:
@@ -300,10 +730,22 @@ static int cbfuse_utimens(const char *path, const struct timespec tv[2])
 {
     fprintf(stderr, "cbfuse_utimens path:%s", path);
 
-    int fresult = update_stat_utimens(_lcb_instance, path, tv);
+    lcb_INSTANCE *instance = pool_borrow(_lcb_pool);
+
+    char pkey[INODE_KEY_LEN + 1];
+    int fresult = lookup_path(instance, path, pkey);
+    IfFRErrorGotoDoneWithRef(path);
+
+    // an explicit modified time replaces the time of writes that are still pending
+    if (utimens_sets_mtime(tv)) {
+        file_handles_discard(pkey, false, true);
+    }
+
+    fresult = update_stat_utimens(instance, pkey, tv);
     IfFRErrorGotoDoneWithRef(path);
 
 done:
+    pool_return(_lcb_pool, instance);
     return fresult;
 }
 
@@ -311,18 +753,20 @@ static int cbfuse_mkdir(const char * path, mode_t mode)
 {
     fprintf(stderr, "cbfuse_mkdir path:%s mode:0x%02X\n", path, mode);
 
-    int fresult = 0;
+    char *dname = NULL;
+    char *bname = NULL;
+    char pkey[INODE_KEY_LEN + 1];
+    char parent_pkey[INODE_KEY_LEN + 1];
+    bool stat_inserted = false;
+    bool dentry_inserted = false;
+    bool child_added = false;
+    lcb_INSTANCE *instance = pool_borrow(_lcb_pool);
 
-    char *dirstr = strdup(path);
-    char *basestr = strdup(path);
-    char *dname = dirname(dirstr);
-    char *bname = basename(basestr);
+    sync_batch batch;
+    sync_batch_init(&batch, instance);
 
-    IfTrueGotoDoneWithRef(
-        (dname == NULL || bname == NULL),
-        -ENOENT,
-        path
-    );
+    int fresult = split_path(path, &dname, &bname);
+    IfFRErrorGotoDoneWithRef(path);
 
     IfFalseGotoDoneWithRef(
         (mode|S_IFDIR),
@@ -330,23 +774,66 @@ static int cbfuse_mkdir(const char * path, mode_t mode)
         path
     );
 
-    // TODO: These operations can be in a transaction or at least scheduled as a batch
+    size_t npath = strlen(path);
+    IfTrueGotoDoneWithRef((npath > MAX_PATH_LEN), -ENAMETOOLONG, path);
+
+    fresult = lookup_path(instance, dname, parent_pkey);
+    IfFRErrorGotoDoneWithRef(dname);
+
+    uint64_t ino = 0;
+    fresult = next_inode(instance, &ino);
+    IfFRErrorGotoDoneWithRef(path);
+    inode_key(ino, pkey);
+
+    // the new stat, the new directory entry and adding the directory
+    // to the parent directory entry are independent so they go out together
 
     // add stat info for the entry
-    fresult = insert_stat(_lcb_instance, path, mode);
+    cbfuse_stat stat;
+    sync_store_result *stat_result = NULL;
+    fresult = batch_insert_stat(&batch, pkey, mode, ino, &stat, &stat_result);
     IfFRErrorGotoDoneWithRef(path);
 
     // add a new directory entry
-    fresult = add_new_dentry(_lcb_instance, path, path, dname);
+    sync_store_result *dentry_result = NULL;
+    fresult = batch_add_new_dentry(&batch, pkey, parent_pkey, &dentry_result);
     IfFRErrorGotoDoneWithRef(path);
 
     // add the new directory to the parent directory entry
-    fresult = add_child_to_dentry(_lcb_instance, dname, bname);
+    dentry_shard_result parent_result = {0};
+    fresult = batch_add_child_to_dentry(&batch, parent_pkey, bname, ino, &parent_result);
+    IfFRErrorGotoDoneWithRef(path);
+
+    lcb_STATUS rc = sync_batch_execute(&batch);
+    IfLCBFailGotoDone(rc, -EIO);
+
+    // remember what was created so it can be undone if a later step fails
+    int stat_fresult = insert_stat_result(pkey, &stat, stat_result);
+    stat_inserted = (stat_fresult == 0);
+    int dentry_fresult = add_new_dentry_result(pkey, dentry_result);
+    dentry_inserted = (dentry_fresult == 0);
+    int parent_fresult = add_child_to_dentry_result(instance, parent_pkey, bname, ino, &parent_result, &child_added);
+
+    fresult = stat_fresult;
+    IfFRErrorGotoDoneWithRef(path);
+
+    fresult = dentry_fresult;
     IfFRErrorGotoDoneWithRef(path);
 
+    fresult = parent_fresult;
+    IfFRErrorGotoDoneWithRef(path);
+
+    // the new directory is complete (and replaces a cached lookup miss)
+    lookups_put(path, pkey);
+
 done:
-    free(dirstr);
-    free(basestr);
+    if (fresult != 0 && (stat_inserted || dentry_inserted || child_added)) {
+        undo_insert(instance, pkey, parent_pkey, bname, stat_inserted, dentry_inserted, child_added);
+    }
+    sync_batch_destroy(&batch);
+    pool_return(_lcb_pool, instance);
+    free(dname);
+    free(bname);
     return fresult;
 }
 
@@ -354,36 +841,201 @@ static int cbfuse_rmdir(const char * path)
 {
     fprintf(stderr, "cbfuse_unlink path:%s\n", path);
 
-    int fresult = 0;
+    char *dname = NULL;
+    char *bname = NULL;
+    lcb_INSTANCE *instance = pool_borrow(_lcb_pool);
 
-    char *dirstr = strdup(path);
-    char *basestr = strdup(path);
-    char *dname = dirname(dirstr);
-    char *bname = basename(basestr);
+    sync_batch batch;
+    sync_batch_init(&batch, instance);
 
-    IfTrueGotoDoneWithRef(
-        (dname == NULL || bname == NULL),
-        -ENOENT,
-        path
-    );
+    int fresult = split_path(path, &dname, &bname);
+    IfFRErrorGotoDoneWithRef(path);
 
-    // TODO: These operations can be in a transaction or at least scheduled as a batch
+    char parent_pkey[INODE_KEY_LEN + 1];
+    fresult = lookup_path(instance, dname, parent_pkey);
+    IfFRErrorGotoDoneWithRef(dname);
 
-    // remove the directory entry
-    fresult = remove_dentry(_lcb_instance, path);
+    char pkey[INODE_KEY_LEN + 1];
+    fresult = lookup_path(instance, path, pkey);
+    IfFRErrorGotoDoneWithRef(path);
+
+    // the directory entry, the stat and the parent directory entry are independent so they go out together
 
-    // remove the directory from the parent directory entry
-    fresult = remove_child_from_dentry(_lcb_instance, dname, bname);
+    // remove the directory entry
+    sync_remove_result *dentry_result = NULL;
+    batch_remove_dentry(&batch, pkey, &dentry_result);
 
     // remove stat info for the directory
-    fresult = remove_stat(_lcb_instance, path);
+    sync_remove_result *stat_result = NULL;
+    fresult = batch_remove_stat(&batch, pkey, &stat_result);
+    IfFRErrorGotoDoneWithRef(path);
+
+    // remove the directory from the parent directory entry by name
+    dentry_shard_result parent_result = {0};
+    int parent_fresult = batch_remove_child_from_dentry(&batch, parent_pkey, bname, &parent_result);
+
+    lcb_STATUS rc = sync_batch_execute(&batch);
+    lookups_remove(path, true);
+    lookups_put_negative(path);
+    IfLCBFailGotoDone(rc, -EIO);
+
+    if (parent_fresult == 0) {
+        remove_child_from_dentry_result(instance, parent_pkey, bname, &parent_result);
+    }
 
     // Only check the stat operation - others can fail silently and may be useful for error recovery
+    fresult = remove_stat_result(pkey, stat_result);
     IfFRErrorGotoDoneWithRef(path);
 
 done:
-    free(dirstr);
-    free(basestr);
+    sync_batch_destroy(&batch);
+    pool_return(_lcb_pool, instance);
+    free(dname);
+    free(bname);
+    return fresult;
+}
+
+// Stops reading a directory at the first child.
+static int found_child(void *context, __unused const char *child_name, __unused uint64_t ino)
+{
+    *(bool*)context = true;
+    return 1;
+}
+
+// Rename a file or directory (replacing the target if it exists). Entries are keyed
+// by their inode numbers so only the names in the parent directory entries change
+// (and nothing below a directory is touched).
+static int cbfuse_rename(const char *from, const char *to)
+{
+    fprintf(stderr, "cbfuse_rename from:%s to:%s\n", from, to);
+
+    char *from_dname = NULL;
+    char *from_bname = NULL;
+    char *to_dname = NULL;
+    char *to_bname = NULL;
+    lcb_INSTANCE *instance = pool_borrow(_lcb_pool);
+
+    sync_batch batch;
+    sync_batch_init(&batch, instance);
+
+    int fresult = 0;
+    IfTrueGotoDoneWithRef((strlen(to) > MAX_PATH_LEN), -ENAMETOOLONG, to);
+
+    if (strcmp(from, to) == 0) {
+        goto done;
+    }
+
+    fresult = split_path(from, &from_dname, &from_bname);
+    IfFRErrorGotoDoneWithRef(from);
+
+    fresult = split_path(to, &to_dname, &to_bname);
+    IfFRErrorGotoDoneWithRef(to);
+
+    char from_pkey[INODE_KEY_LEN + 1];
+    cbfuse_stat stat;
+    fresult = get_path_stat(instance, from, from_pkey, &stat);
+    IfFRErrorGotoDoneWithRef(from);
+
+    char from_parent_pkey[INODE_KEY_LEN + 1];
+    fresult = lookup_path(instance, from_dname, from_parent_pkey);
+    IfFRErrorGotoDoneWithRef(from_dname);
+
+    char to_parent_pkey[INODE_KEY_LEN + 1];
+    fresult = lookup_path(instance, to_dname, to_parent_pkey);
+    IfFRErrorGotoDoneWithRef(to_dname);
+
+    // a directory can't be moved below itself
+    size_t nfrom = strlen(from);
+    IfTrueGotoDoneWithRef(
+        (S_ISDIR(stat.st_mode) && strncmp(to, from, nfrom) == 0 && to[nfrom] == '/'),
+        -EINVAL,
+        to
+    );
+
+    // an existing target is replaced (a directory only by an empty directory)
+    char to_pkey[INODE_KEY_LEN + 1];
+    cbfuse_stat to_stat;
+    int to_fresult = get_path_stat(instance, to, to_pkey, &to_stat);
+    if (to_fresult == 0) {
+        if (S_ISDIR(stat.st_mode)) {
+            IfFalseGotoDoneWithRef(S_ISDIR(to_stat.st_mode), -ENOTDIR, to);
+
+            bool has_children = false;
+            fresult = read_dentry_children(instance, to_pkey, found_child, &has_children);
+            IfFRErrorGotoDoneWithRef(to);
+            IfTrueGotoDoneWithRef(has_children, -ENOTEMPTY, to);
+        } else {
+            IfTrueGotoDoneWithRef(S_ISDIR(to_stat.st_mode), -EISDIR, to);
+        }
+    } else if (to_fresult != -ENOENT) {
+        fresult = to_fresult;
+        goto done;
+    }
+
+    // the new name points at the entry before the old name is removed
+    // (a replaced target keeps its name which now points at the moved entry)
+    if (to_fresult == 0) {
+        fresult = replace_child_in_dentry(instance, to_parent_pkey, to_bname, stat.st_ino);
+    } else {
+        fresult = add_child_to_dentry(instance, to_parent_pkey, to_bname, stat.st_ino);
+    }
+    IfFRErrorGotoDoneWithRef(to);
+
+    // an old name that is already gone (e.g., removed by another mount) has nothing left to remove
+    fresult = remove_child_from_dentry(instance, from_parent_pkey, from_bname);
+    if (fresult != 0 && fresult != -ENOENT) {
+        // the entry stays where it was (and a replaced target is put back)
+        if (to_fresult == 0) {
+            replace_child_in_dentry(instance, to_parent_pkey, to_bname, to_stat.st_ino);
+        } else {
+            remove_child_from_dentry(instance, to_parent_pkey, to_bname);
+        }
+        IfFRErrorGotoDoneWithRef(from);
+    }
+    fresult = 0;
+
+    // the entry has moved so the rest can fail silently (like unlink)
+
+    // a directory entry remembers its parent
+    if (S_ISDIR(stat.st_mode) && strcmp(from_parent_pkey, to_parent_pkey) != 0) {
+        set_dentry_parent(instance, from_pkey, to_parent_pkey);
+    }
+
+    // renaming is a status change
+    update_stat_ctime(instance, from_pkey);
+
+    // a replaced target is only removed once nothing refers to it
+    if (to_fresult == 0) {
+        if (S_ISDIR(to_stat.st_mode)) {
+            sync_remove_result *dentry_result = NULL;
+            batch_remove_dentry(&batch, to_pkey, &dentry_result);
+        } else {
+            batch_remove_data(&batch, to_pkey);
+        }
+
+        sync_remove_result *stat_result = NULL;
+        batch_remove_stat(&batch, to_pkey, &stat_result);
+
+        sync_batch_execute(&batch);
+        file_handles_invalidate(to_pkey);
+        atimes_forget(to_pkey);
+        file_handles_discard(to_pkey, true, true);
+    }
+
+    // paths below a moved directory now resolve through its new name
+    // (and cached misses below a replaced target are wrong)
+    lookups_remove(from, S_ISDIR(stat.st_mode));
+    lookups_remove(to, true);
+    lookups_put(to, from_pkey);
+    lookups_put_negative(from);
+
+done:
+    sync_batch_destroy(&batch);
+    pool_return(_lcb_pool, instance);
+    free(from_dname);
+    free(from_bname);
+    free(to_dname);
+    free(to_bname);
     return fresult;
 }
 
@@ -392,11 +1044,16 @@ done:
 static int insert_root(lcb_INSTANCE *instance) {
     // TODO: Consider refactoring to C++ to take advantage of transaction context with multiple ops
 
+    uint64_t ino = 0;
+    int fresult = next_inode(instance, &ino);
+    IfFRErrorGotoDoneWithRef(ROOT_DIR_STRING);
+
     // add root stat as directory with 0x755 permissions
-    int fresult = insert_stat(instance, ROOT_DIR_STRING, (S_IFDIR | 0755));
+    fresult = insert_stat(instance, ROOT_DIR_STRING, (S_IFDIR | 0755), ino);
     IfFRErrorGotoDoneWithRef(ROOT_DIR_STRING);
 
-    fresult = add_new_dentry(instance, ROOT_DIR_STRING, ROOT_DIR_STRING, NULL);
+    // the root directory has no parent
+    fresult = add_new_dentry(instance, ROOT_DIR_STRING, NULL);
     IfFRErrorGotoDoneWithRef(ROOT_DIR_STRING);
 
 done:
@@ -411,11 +1068,18 @@ static struct fuse_operations cb_filesystem_operations = {
     .open       = cbfuse_open,
     .create     = cbfuse_create,
     .unlink     = cbfuse_unlink,
+    .rename     = cbfuse_rename,
     .read       = cbfuse_read,
+    .opendir    = cbfuse_opendir,
     .readdir    = cbfuse_readdir,
+    .releasedir = cbfuse_releasedir,
     .write      = cbfuse_write,
+    .flush      = cbfuse_flush,
+    .release    = cbfuse_release,
+    .fsync      = cbfuse_fsync,
     .chmod      = cbfuse_chmod,
     .truncate   = cbfuse_truncate,
+    .ftruncate  = cbfuse_ftruncate,
     .utimens    = cbfuse_utimens,
     .mkdir      = cbfuse_mkdir,
     .rmdir      = cbfuse_rmdir
@@ -425,6 +1089,14 @@ struct cbfuse_config {
     char *cb_connect;
     char *cb_username;
     char *cb_password;
+    unsigned int cb_attr_timeout;
+    unsigned int cb_negative_timeout;
+    unsigned int cb_attr_cache;
+    unsigned int cb_block_cache;
+    unsigned int cb_pool_size;
+    int cb_async;
+    char *cb_atime;
+    unsigned int cb_stat_interval;
 };
 
 enum {
@@ -441,6 +1113,22 @@ static struct fuse_opt cbfuse_opts[] = {
     CBFUSE_OPT("--cb_username=%s",  cb_username, 0),
     CBFUSE_OPT("cb_password=%s",    cb_password, 0),
     CBFUSE_OPT("--cb_password=%s",  cb_password, 0),
+    CBFUSE_OPT("cb_pool_size=%u",   cb_pool_size, 0),
+    CBFUSE_OPT("--cb_pool_size=%u", cb_pool_size, 0),
+    CBFUSE_OPT("cb_async",          cb_async, 1),
+    CBFUSE_OPT("--cb_async",        cb_async, 1),
+    CBFUSE_OPT("cb_attr_timeout=%u",    cb_attr_timeout, 0),
+    CBFUSE_OPT("--cb_attr_timeout=%u",  cb_attr_timeout, 0),
+    CBFUSE_OPT("cb_negative_timeout=%u",    cb_negative_timeout, 0),
+    CBFUSE_OPT("--cb_negative_timeout=%u",  cb_negative_timeout, 0),
+    CBFUSE_OPT("cb_attr_cache=%u",      cb_attr_cache, 0),
+    CBFUSE_OPT("--cb_attr_cache=%u",    cb_attr_cache, 0),
+    CBFUSE_OPT("cb_block_cache=%u",     cb_block_cache, 0),
+    CBFUSE_OPT("--cb_block_cache=%u",   cb_block_cache, 0),
+    CBFUSE_OPT("cb_atime=%s",       cb_atime, 0),
+    CBFUSE_OPT("--cb_atime=%s",     cb_atime, 0),
+    CBFUSE_OPT("cb_stat_interval=%u",   cb_stat_interval, 0),
+    CBFUSE_OPT("--cb_stat_interval=%u", cb_stat_interval, 0),
 
     FUSE_OPT_KEY("-V",              KEY_VERSION),
     FUSE_OPT_KEY("--version",       KEY_VERSION),
@@ -465,6 +1153,25 @@ static void usage(const char *name) {
         "  --cb_connect=COUCHBASE_CONNECT_STRING\n"
         "  --cb_username=COUCHBASE_SASL_USERNAME\n"
         "  --cb_password=COUCHBASE_SASL_PASSWORD\n"
+        "  -o cb_pool_size=INSTANCES    couchbase connections shared by FUSE threads (default: 8)\n"
+        "  -o cb_async                  pipeline operations over event loop driven connections\n"
+        "                               (cb_pool_size then sets the number of event loops)\n"
+        "\n"
+        "cache options:\n"
+        "  -o cb_attr_timeout=SECONDS   seconds to cache file attributes (default: 1)\n"
+        "  -o cb_negative_timeout=SECONDS   seconds to cache missing files (default: 1)\n"
+        "  -o cb_attr_cache=ENTRIES     max cached file attributes (default: 65536, 0 disables)\n"
+        "  -o cb_block_cache=MIB        memory for cached file data (default: 64, 0 disables)\n"
+        "  -o cb_stat_interval=SECONDS  seconds that size and modified time changes of an open file\n"
+        "                               can wait before they're written (default: 5, 0 writes them\n"
+        "                               with the data; they're always written on close)\n"
+        "\n"
+        "access time options:\n"
+        "  -o cb_atime=MODE             when reads update the access time (default: strictatime)\n"
+        "                               strictatime: every read\n"
+        "                               relatime: when older than the last change or a day old\n"
+        "                               noatime: never\n"
+        "                               lazyatime: kept in memory and written in the background\n"
         "\n"
         "example:\n"
         "  %s ~/mountdir --cb_connect=couchbase://127.0.0.1/cbfuse --cb_username=rcardillo --cb_password=rcardillo\n"
@@ -503,15 +1210,18 @@ int main(int argc, char **argv)
     ///// PARSE ARGUMENTS
 
     struct fuse_args fargs = FUSE_ARGS_INIT(argc, argv);
-    struct cbfuse_config config = {0};
+    struct cbfuse_config config = {
+        .cb_attr_timeout = 1,
+        .cb_negative_timeout = 1,
+        .cb_attr_cache = 65536,
+        .cb_block_cache = 64,
+        .cb_pool_size = 8,
+        .cb_stat_interval = 5
+    };
 
     int fresult = fuse_opt_parse(&fargs, &config, cbfuse_opts, cbfuse_opt_proc);
     IfFRFailGotoDoneWithRef("Could not parse options");
 
-    // set FUSE single-threaded mode
-    fresult = fuse_opt_add_arg(&fargs, "-s");
-    IfFRFailGotoDoneWithRef("Could not add FUSE single-threaded mode option.");
-
     // set FUSE foreground mode
     fresult = fuse_opt_add_arg(&fargs, "-f");
     IfFRFailGotoDoneWithRef("Could not add FUSE foreground mode option.");
@@ -523,67 +1233,66 @@ int main(int argc, char **argv)
         exit(EXIT_FAILURE);
     }
 
-    ///// CONNECT TO COUCHBASE
+    attr_cache_init(config.cb_attr_timeout, config.cb_negative_timeout, config.cb_attr_cache);
+    lookups_init(config.cb_attr_timeout, config.cb_negative_timeout, config.cb_attr_cache);
+    block_cache_init((size_t)config.cb_block_cache * 1024 * 1024);
+    file_handles_init(config.cb_stat_interval);
 
-    lcb_CREATEOPTS *create_options = NULL;
-    lcb_createopts_create(&create_options, LCB_TYPE_CLUSTER);
-    lcb_createopts_connstr(create_options, config.cb_connect, strlen(config.cb_connect));
-    if (config.cb_username != NULL || config.cb_password != NULL) {
-        lcb_createopts_credentials(
-            create_options,
-            config.cb_username, strlen(config.cb_username),
-            config.cb_password, strlen(config.cb_password)
-        );
+    atime_mode atime = ATIME_STRICT;
+    if (config.cb_atime != NULL && atimes_parse_mode(config.cb_atime, &atime) != 0) {
+        fprintf(stderr, "Unknown access time mode: %s\n\n", config.cb_atime);
+        usage(basename(argv[0]));
+        exit(EXIT_FAILURE);
     }
 
-    lcb_STATUS rc;
-    rc = lcb_create(&_lcb_instance, create_options);
-    lcb_createopts_destroy(create_options);
-    IfLCBFailGotoDoneWithMsg(rc, EXIT_FAILURE, "Couldn't create a couchbase instance.");
-    IfNULLGotoDoneWithRef(_lcb_instance, EXIT_FAILURE, "Couldn't create a couchbase instance.");
-
-    rc = lcb_connect(_lcb_instance);
-    IfLCBFailGotoDoneWithMsg(rc, EXIT_FAILURE, "Couldn't create couchbase connect handle.");
-
-    rc = lcb_wait(_lcb_instance, LCB_WAIT_DEFAULT);
-    IfLCBFailGotoDoneWithMsg(rc, EXIT_FAILURE, "Couldn't connect to couchbase.");
-
-    rc = lcb_get_bootstrap_status(_lcb_instance);
-    IfLCBFailGotoDoneWithMsg(rc, EXIT_FAILURE, "Couldn't bootstrap couchbase connection (make sure server is running).");
+    ///// CONNECT TO COUCHBASE
 
-    // install callbacks for the initialized instance
-    lcb_set_open_callback(_lcb_instance, open_callback);
-    sync_get_init(_lcb_instance);
-    sync_store_init(_lcb_instance);
-    sync_remove_init(_lcb_instance);
+    // FUSE runs multi-threaded (unless -s is provided) and
+    // each thread borrows an instance from the pool for each operation
+    // (or shares an event loop driven instance in async mode)
+    lcb_pool_options pool_options = {
+        .connect = config.cb_connect,
+        .username = config.cb_username,
+        .password = config.cb_password,
+        .bucket = "cbfuse",
+        .size = config.cb_pool_size,
+        .async = config.cb_async
+    };
 
-    const char *bucket = "cbfuse";
-    rc = lcb_open(_lcb_instance, bucket, strlen(bucket));
-    IfLCBFailGotoDoneWithMsg(rc, EXIT_FAILURE, "Couldn't create a couchbase open bucket request.");
+    lcb_STATUS rc = pool_create(&pool_options, &_lcb_pool);
+    IfLCBFailGotoDoneWithMsg(rc, EXIT_FAILURE, "Couldn't create the couchbase connection pool.");
 
-    rc = lcb_wait(_lcb_instance, LCB_WAIT_DEFAULT);
-    IfLCBFailGotoDoneWithMsg(rc, EXIT_FAILURE, "Couldn't open couchbase bucket.");
+    fresult = atimes_init(atime, _lcb_pool);
+    IfFRErrorGotoDoneWithRef("Couldn't start the access time writer.");
 
     ///// VERIFY OR INSTALL ROOT DIR
 
-    struct stat root_stat;
-    int get_root_rc = cbfuse_getattr(ROOT_DIR_STRING, &root_stat);
+    lcb_INSTANCE *instance = pool_borrow(_lcb_pool);
+
+    cbfuse_stat root_stat = {0};
+    int get_root_rc = get_stat(instance, ROOT_DIR_STRING, &root_stat, NULL);
     if (get_root_rc == 0) {
         if (!S_ISDIR(root_stat.st_mode)) {
             // we received something but it's not a directory
             fprintf(stderr, "Unexpected root directory detected. st_mode=0x%02x\n", root_stat.st_mode);
             fresult = EXIT_FAILURE;
-            goto done;
+        } else if (migrate_entries(instance) != 0) {
+            // entries that predate inodes can't be found until they are migrated
+            fprintf(stderr, "Unexpected error when trying to migrate entries that predate inodes.\n");
+            fresult = EXIT_FAILURE;
         }
     } else if (get_root_rc == -ENOENT) {
-        if (insert_root(_lcb_instance) != 0) {
+        if (insert_root(instance) != 0) {
             fprintf(stderr, "Unexpected error when trying to create root directory.\n");
             fresult = EXIT_FAILURE;
-            goto done;
         }
     } else {
         fprintf(stderr, "Unexpected error when trying to find root directory.\n");
         fresult = EXIT_FAILURE;
+    }
+
+    pool_return(_lcb_pool, instance);
+    if (fresult != 0) {
         goto done;
     }
 
@@ -592,15 +1301,36 @@ int main(int argc, char **argv)
     fresult = fuse_main(fargs.argc, fargs.argv, &cb_filesystem_operations, NULL);
     IfFRErrorGotoDoneWithRef("FUSE error encountered.");
 
+    cas_retry_stats retry_stats;
+    cas_retry_get_stats(&retry_stats);
+    fprintf(stderr, "CAS updates: %" PRIu64 ", conflicts: %" PRIu64 ", exhausted: %" PRIu64 "\n",
+        retry_stats.updates, retry_stats.conflicts, retry_stats.exhausted);
+
+    block_cache_stats cache_stats;
+    block_cache_get_stats(&cache_stats);
+    fprintf(stderr, "Block cache hits: %" PRIu64 ", misses: %" PRIu64 ", evictions: %" PRIu64 "\n",
+        cache_stats.hits, cache_stats.misses, cache_stats.evictions);
+
+    sync_get_share_stats share_stats;
+    sync_get_get_share_stats(&share_stats);
+    fprintf(stderr, "Shared gets sent: %" PRIu64 ", followed: %" PRIu64 "\n",
+        share_stats.flights, share_stats.followers);
+
 done:
     fuse_opt_free_args(&fargs);
 	free(config.cb_connect);
 	free(config.cb_username);
 	free(config.cb_password);
+	free(config.cb_atime);
 
-    if (_lcb_instance) {
-        lcb_destroy(_lcb_instance);
-    }
+    // pending access times are written before the connections go away
+    atimes_destroy();
+    pool_destroy(_lcb_pool);
+
+    attr_cache_destroy();
+    lookups_destroy();
+    block_cache_destroy();
+    dentry_shards_destroy();
 
 	return fresult;
 }
@@ -20,9 +20,25 @@
 const size_t  MAX_KEY_LEN                   = 250;
 const size_t  MAX_DOC_LEN                   = 20 * 1024 * 1024;
 
-const size_t  MAX_PATH_LEN                  = MAX_KEY_LEN;
-const size_t  MAX_FILE_BLOCKS               = 256;
-const size_t  MAX_FILE_LEN                  = MAX_FILE_BLOCKS * MAX_DOC_LEN;
+const size_t  MAX_PATH_LEN                  = 4096; // longer than MAX_KEY_LEN so long paths are hashed
+const size_t  FILE_BLOCK_LEN                = 1024 * 1024;
+const size_t  MAX_FILE_BLOCKS               = 5 * 1024;
+const size_t  MAX_FILE_LEN                  = MAX_FILE_BLOCKS * FILE_BLOCK_LEN;
+
+const size_t  WRITE_BUFFER_LEN              = 16 * FILE_BLOCK_LEN;
+const size_t  WRITE_BUFFER_MAX_AGE          = 5;    // seconds
+
+const size_t  READ_AHEAD_MAX_BLOCKS         = 16;   // blocks fetched ahead of a sequential read
+const size_t  READ_AHEAD_MAX_AGE            = 1;    // seconds before read-ahead data is fetched again
+const size_t  READ_AHEAD_MAX_LATENCY_MS     = 200;  // the window only grows while fetches are faster
+
+const size_t  RELATIME_MAX_AGE              = 24 * 60 * 60; // seconds before relatime updates anyway
+const size_t  ATIME_FLUSH_INTERVAL          = 30;   // seconds between lazy access time writes
+const size_t  ATIME_MAX_PENDING             = 64 * 1024;    // pending access times before an early write
+
+const size_t  CAS_RETRY_MAX_ATTEMPTS        = 8;    // attempts of an optimistic update before it fails
+const size_t  CAS_RETRY_MIN_DELAY_US        = 1000; // bound of the first backoff (doubled for each retry)
+const size_t  CAS_RETRY_MAX_DELAY_US        = 64 * 1000;
 
 const char   *DEFAULT_SCOPE_STRING          = NULL;
 const size_t  DEFAULT_SCOPE_STRLEN          = 0;
@@ -39,6 +55,19 @@ const size_t  DENTRIES_COLLECTION_STRLEN    = sizeof(DENTRIES_COLLECTION_STRING)
 const char    BLOCKS_COLLECTION_STRING[]    = "blocks";
 const size_t  BLOCKS_COLLECTION_STRLEN      = sizeof(BLOCKS_COLLECTION_STRING)-1;
 
-const char    DENTRY_DIR_PATH[]             = "d";  // current directory path key
-const char    DENTRY_PAR_PATH[]             = "p";  // parent directory path key
-const char    DENTRY_CHILDREN[]             = "c";  // current directory child path keys
+const char    BLOCK_KEY_SEPARATOR           = '#';  // separates the file key and block number
+
+const char    DENTRY_DIR_PATH[]             = "d";  // current directory entry key
+const char    DENTRY_PAR_PATH[]             = "p";  // parent directory entry key
+const char    DENTRY_CHILDREN[]             = "c";  // child names of entries that predate inodes
+const char    DENTRY_INODES[]               = "i";  // inode number of each child by name
+const char    DENTRY_COUNT[]                = "n";  // number of children in the shard
+const char    DENTRY_SHARDS[]               = "s";  // number of additional child shards
+
+const char    DENTRY_SHARD_KEY_PREFIX       = '#';  // precedes the shard number in a shard key
+const size_t  DENTRY_SHARD_MAX_CHILDREN     = 4096; // children in a shard before a split
+const size_t  DENTRY_MAX_SHARDS             = 64 * 1024;
+
+const char    INODE_COUNTER_KEY[]           = "#inode"; // allocates inode numbers (paths always start with '/')
+const char    INODE_KEY_PREFIX              = '@';  // precedes the inode number in an entry key
+const size_t  INODE_RANGE_LEN               = 1024; // inode numbers reserved by each counter increment
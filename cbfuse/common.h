@@ -23,9 +23,25 @@
 extern const size_t  MAX_KEY_LEN;
 extern const size_t  MAX_DOC_LEN;
 extern const size_t  MAX_PATH_LEN;
+extern const size_t  FILE_BLOCK_LEN;
 extern const size_t  MAX_FILE_BLOCKS;
 extern const size_t  MAX_FILE_LEN;
 
+extern const size_t  WRITE_BUFFER_LEN;
+extern const size_t  WRITE_BUFFER_MAX_AGE;
+
+extern const size_t  READ_AHEAD_MAX_BLOCKS;
+extern const size_t  READ_AHEAD_MAX_AGE;
+extern const size_t  READ_AHEAD_MAX_LATENCY_MS;
+
+extern const size_t  RELATIME_MAX_AGE;
+extern const size_t  ATIME_FLUSH_INTERVAL;
+extern const size_t  ATIME_MAX_PENDING;
+
+extern const size_t  CAS_RETRY_MAX_ATTEMPTS;
+extern const size_t  CAS_RETRY_MIN_DELAY_US;
+extern const size_t  CAS_RETRY_MAX_DELAY_US;
+
 extern const char   *DEFAULT_SCOPE_STRING;
 extern const size_t  DEFAULT_SCOPE_STRLEN;
 
@@ -41,8 +57,21 @@ extern const size_t  DENTRIES_COLLECTION_STRLEN;
 extern const char    BLOCKS_COLLECTION_STRING[];
 extern const size_t  BLOCKS_COLLECTION_STRLEN;
 
+extern const char    BLOCK_KEY_SEPARATOR;
+
 extern const char    DENTRY_DIR_PATH[];
 extern const char    DENTRY_PAR_PATH[];
 extern const char    DENTRY_CHILDREN[];
+extern const char    DENTRY_INODES[];
+extern const char    DENTRY_COUNT[];
+extern const char    DENTRY_SHARDS[];
+
+extern const char    DENTRY_SHARD_KEY_PREFIX;
+extern const size_t  DENTRY_SHARD_MAX_CHILDREN;
+extern const size_t  DENTRY_MAX_SHARDS;
+
+extern const char    INODE_COUNTER_KEY[];
+extern const char    INODE_KEY_PREFIX;
+extern const size_t  INODE_RANGE_LEN;
 
 #endif /* !CBFUSE_COMMON_HEADER_SEEN */
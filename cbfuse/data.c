@@ -18,42 +18,150 @@
 #include <errno.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
 
+#include "data.h"
 #include "stats.h"
+#include "inodes.h"
+#include "attr_cache.h"
+#include "atimes.h"
 #include "util.h"
 #include "common.h"
+#include "keys.h"
+#include "cas_retry.h"
+#include "block_cache.h"
 #include "sync_get.h"
 #include "sync_store.h"
 #include "sync_remove.h"
+#include "sync_subdoc.h"
 
-static int get_block(lcb_INSTANCE *instance, const char *pkey, __unused uint8_t block, sync_get_result **result)
+// Files are stored as fixed size blocks in the blocks collection.
+// Each block is keyed by the data key of the file and the block number (e.g., "@2a#3")
+// and only the blocks covering a requested range are read or written.
+// The data key is the entry key of the file (see inode_key) so renaming a file doesn't move its blocks.
+// A file whose stat predates inodes (st_ino is 0) is still keyed by its path until it's migrated.
+// Blocks can be shorter than FILE_BLOCK_LEN (or missing) and any data that is
+// within the file size but not stored in a block is treated as zeros.
+
+// max number of block commands scheduled together when removing a range of blocks
+#define BLOCK_BATCH_LEN 64
+
+// virtual attribute with the length of a block (fetched without its data)
+#define BLOCK_LENGTH_XATTR "$document.value_bytes"
+
+static int block_key(const char *dkey, size_t block, char *key, size_t *nkey)
+{
+    int n = snprintf(key, MAX_KEY_LEN + 1, "%s%c%zu", dkey, BLOCK_KEY_SEPARATOR, block);
+    if (n < 0 || (size_t)n > MAX_KEY_LEN) {
+        return -ENAMETOOLONG;
+    }
+
+    *nkey = n;
+    return 0;
+}
+
+// The key buffer must have room for MAX_KEY_LEN + 1 characters.
+static int data_key(const char *pkey, const cbfuse_stat *stat, char *dkey)
+{
+    if (stat->st_ino != 0) {
+        inode_key(stat->st_ino, dkey);
+        return 0;
+    }
+
+    int n = snprintf(dkey, MAX_KEY_LEN + 1, "%s", pkey);
+    if (n < 0 || (size_t)n > MAX_KEY_LEN) {
+        return -ENAMETOOLONG;
+    }
+
+    return 0;
+}
+
+static size_t block_count(size_t size)
+{
+    return (size + FILE_BLOCK_LEN - 1) / FILE_BLOCK_LEN;
+}
+
+// Creates a get command for a block. The key buffer must stay valid until the command is scheduled.
+static int create_block_cmdget(const char *dkey, size_t block, char *key, lcb_CMDGET **cmd)
 {
     int fresult = 0;
 
+    size_t nkey = 0;
+    fresult = block_key(dkey, block, key, &nkey);
+    IfFRErrorGotoDoneWithRef(dkey);
+
     lcb_STATUS rc;
-    lcb_CMDGET *cmd;
 
-    rc = lcb_cmdget_create(&cmd);
+    rc = lcb_cmdget_create(cmd);
     IfLCBFailGotoDone(rc, -EIO);
 
     rc = lcb_cmdget_collection(
-        cmd,
+        *cmd,
         DEFAULT_SCOPE_STRING, DEFAULT_SCOPE_STRLEN,
         BLOCKS_COLLECTION_STRING, BLOCKS_COLLECTION_STRLEN);
     IfLCBFailGotoDone(rc, -EIO);
 
-    rc = lcb_cmdget_key(cmd, pkey, strlen(pkey));
+    rc = lcb_cmdget_key(*cmd, key, nkey);
     IfLCBFailGotoDone(rc, -EIO);
 
-    rc = sync_get(instance, cmd, result);
+done:
+    if (fresult != 0 && *cmd != NULL) {
+        lcb_cmdget_destroy(*cmd);
+        *cmd = NULL;
+    }
+    return fresult;
+}
+
+// Creates a remove command for a block. The key buffer must stay valid until the command is scheduled.
+static int create_block_cmdremove(const char *dkey, size_t block, char *key, lcb_CMDREMOVE **cmd)
+{
+    int fresult = 0;
+
+    size_t nkey = 0;
+    fresult = block_key(dkey, block, key, &nkey);
+    IfFRErrorGotoDoneWithRef(dkey);
+
+    lcb_STATUS rc;
+
+    rc = lcb_cmdremove_create(cmd);
+    IfLCBFailGotoDone(rc, -EIO);
+
+    rc = lcb_cmdremove_collection(
+        *cmd,
+        DEFAULT_SCOPE_STRING, DEFAULT_SCOPE_STRLEN,
+        BLOCKS_COLLECTION_STRING, BLOCKS_COLLECTION_STRLEN);
+    IfLCBFailGotoDone(rc, -EIO);
+
+    rc = lcb_cmdremove_key(*cmd, key, nkey);
+    IfLCBFailGotoDone(rc, -EIO);
+
+done:
+    if (fresult != 0 && *cmd != NULL) {
+        lcb_cmdremove_destroy(*cmd);
+        *cmd = NULL;
+    }
+    return fresult;
+}
+
+static int get_block(lcb_INSTANCE *instance, const char *dkey, size_t block, sync_get_result **result)
+{
+    int fresult = 0;
+
+    char key[MAX_KEY_LEN + 1];
+    lcb_CMDGET *cmd = NULL;
+    fresult = create_block_cmdget(dkey, block, key, &cmd);
+    IfFRErrorGotoDoneWithRef(dkey);
+
+    // concurrent readers of the same block share a single get
+    lcb_STATUS rc = sync_get_shared(instance, BLOCKS_COLLECTION_STRING, key, strlen(key), cmd, result);
 
     // first check the sync command result code
     IfLCBFailGotoDone(rc, -EIO);
 
     // check the actual result status
-    IfLCBFailGotoDoneWithRef((*result)->status, -ENOENT, pkey);
+    IfLCBFailGotoDoneWithRef((*result)->status, -ENOENT, key);
 
     // TODO: Consider techniques to reduce extra copying (e.g., CPP ref counting)
 
@@ -61,117 +169,508 @@ done:
     return fresult;
 }
 
-static int update_block(lcb_INSTANCE *instance, const char *pkey, __unused uint8_t block, const char *buf, size_t nbuf, off_t offset, size_t *new_block_size)
+// Gets several blocks in one round trip, copying a slice of each one straight into a buffer.
+// Without slices the whole values are returned and concurrent readers of the same block share a get.
+// A block that doesn't exist is returned with an LCB_ERR_DOCUMENT_NOT_FOUND status.
+static int get_block_slices(lcb_INSTANCE *instance, const char *dkey, const size_t *blocks, size_t nblocks, const sync_get_slice *slices, sync_get_result **results)
 {
     int fresult = 0;
-    sync_get_result *get_result = NULL;
-    sync_store_result *store_result = NULL;
-    const bool isNotTruncate = (buf != NULL && nbuf > 0); 
+    size_t ncmds = 0;
+
+    char *keys = malloc(nblocks * (MAX_KEY_LEN + 1));
+    const char **key_ptrs = calloc(nblocks, sizeof(char*));
+    size_t *nkeys = calloc(nblocks, sizeof(size_t));
+    lcb_CMDGET **cmds = calloc(nblocks, sizeof(lcb_CMDGET*));
+    IfTrueGotoDoneWithRef((keys == NULL || key_ptrs == NULL || nkeys == NULL || cmds == NULL), -ENOMEM, dkey);
+
+    for (; ncmds < nblocks; ncmds++) {
+        key_ptrs[ncmds] = keys + (ncmds * (MAX_KEY_LEN + 1));
+        fresult = create_block_cmdget(dkey, blocks[ncmds], (char*)key_ptrs[ncmds], &cmds[ncmds]);
+        IfFRErrorGotoDoneWithRef(dkey);
+        nkeys[ncmds] = strlen(key_ptrs[ncmds]);
+    }
 
-    // calculate the overall length of the update operation
-    size_t nupdate = offset + nbuf;
-    IfTrueGotoDoneWithRef((nupdate > MAX_FILE_LEN), -EFBIG, pkey);
+    // the commands are consumed even if the multi-get fails
+    lcb_STATUS rc;
+    if (slices != NULL) {
+        rc = sync_get_slices(instance, cmds, nblocks, slices, results);
+    } else {
+        rc = sync_get_multi_shared(instance, BLOCKS_COLLECTION_STRING, key_ptrs, nkeys, cmds, nblocks, results);
+    }
+    ncmds = 0;
+    IfLCBFailGotoDone(rc, -EIO);
 
-    // get the current data for the block
-    fresult = get_block(instance, pkey, 1, &get_result);
-    if (fresult == -ENOENT) {
-        // if a block wasn't found:
-        // a) nothing to do if it's a truncate operation (no data provided)
-        // b) otherwise allocate memory to store the new data
+    for (size_t i = 0; i < nblocks; i++) {
+        lcb_STATUS status = results[i]->status;
+        IfTrueGotoDoneWithRef(
+            (status != LCB_SUCCESS && status != LCB_ERR_DOCUMENT_NOT_FOUND),
+            -EIO,
+            dkey
+        );
+    }
 
-        fresult = 0;
-        if (isNotTruncate) {
-            get_result->value = malloc(nupdate);
-            IfNULLGotoDoneWithRef(get_result->value, -ENOMEM, pkey);
-            get_result->nvalue = nupdate;
-            *new_block_size = nupdate;
-        } else {
-            goto done;
+done:
+    for (size_t i = 0; i < ncmds; i++) {
+        lcb_cmdget_destroy(cmds[i]);
+    }
+    free(cmds);
+    free(nkeys);
+    free(key_ptrs);
+    free(keys);
+    return fresult;
+}
+
+// Removes a range of blocks [first, last) in batches.
+static int remove_blocks(lcb_INSTANCE *instance, const char *dkey, size_t first, size_t last)
+{
+    int fresult = 0;
+    size_t ncmds = 0;
+    sync_remove_result *results[BLOCK_BATCH_LEN] = {0};
+    lcb_CMDREMOVE *cmds[BLOCK_BATCH_LEN];
+    char keys[BLOCK_BATCH_LEN][MAX_KEY_LEN + 1];
+
+    // try to remove every block even if one fails (so they can be cleaned up later)
+    for (size_t batch = first; batch < last; batch += BLOCK_BATCH_LEN) {
+        size_t nbatch = last - batch;
+        if (nbatch > BLOCK_BATCH_LEN) {
+            nbatch = BLOCK_BATCH_LEN;
         }
 
-    } else {
-        IfFRErrorGotoDoneWithRef(pkey);
-    }
+        for (ncmds = 0; ncmds < nbatch; ncmds++) {
+            fresult = create_block_cmdremove(dkey, batch + ncmds, keys[ncmds], &cmds[ncmds]);
+            IfFRErrorGotoDoneWithRef(dkey);
+        }
 
-    if (isNotTruncate) {
-        // if we need more room then grow the buffer
-        if (nupdate > get_result->nvalue) {
-            void *new_data = memdupm(get_result->value, get_result->nvalue, nupdate);
-            IfNULLGotoDoneWithRef(get_result->value, -ENOMEM, pkey);
-            free((void*)(get_result->value));
-            get_result->value = new_data;
-            get_result->nvalue = nupdate;
-            *new_block_size = nupdate;
+        lcb_STATUS rc = sync_remove_multi(instance, cmds, nbatch, results);
+        ncmds = 0;
+
+        for (size_t i = 0; i < nbatch; i++) {
+            block_cache_remove(keys[i]);
+        }
+        if (rc != LCB_SUCCESS) {
+            fprintf(stderr, "  %s:%s:%d LCB_FAIL %s %s\n", __FILENAME__, __func__, __LINE__, dkey, lcb_strerror_short(rc));
+            fresult = -EIO;
         }
 
-        // modify the data as instructed
-        memcpy((void*)((get_result->value)+offset), buf, nbuf);
-    } else {
-        // no need to allocate and copy - just truncate the size of the data
-        get_result->nvalue = offset;
+        for (size_t i = 0; i < nbatch; i++) {
+            // sparse files may not have every block so a missing block is not an error
+            if (results[i] != NULL &&
+                results[i]->status != LCB_SUCCESS &&
+                results[i]->status != LCB_ERR_DOCUMENT_NOT_FOUND) {
+                fresult = -EIO;
+            }
+            sync_remove_destroy(results[i]);
+            results[i] = NULL;
+        }
     }
 
-    // now write the data back to Couchbase
+done:
+    for (size_t i = 0; i < ncmds; i++) {
+        lcb_cmdremove_destroy(cmds[i]);
+    }
+    return fresult;
+}
+
+// Adds a segment of a block value that's stored without being copied into one buffer first.
+static void add_segment(lcb_IOV *iov, size_t *niov, const char *base, size_t len)
+{
+    iov[*niov].iov_base = (void*)base;
+    iov[*niov].iov_len = len;
+    (*niov)++;
+}
+
+// Creates a store command for block data that's made up of one or more segments.
+// The key and segments must stay valid until the command is scheduled.
+static int create_block_cmdstore(const char *key, size_t nkey, const lcb_IOV *iov, size_t niov, lcb_STORE_OPERATION operation, uint64_t cas, lcb_CMDSTORE **cmd)
+{
+    int fresult = 0;
 
     lcb_STATUS rc;
-    lcb_CMDSTORE *cmd;
 
-    // insert or update block data
-    rc = lcb_cmdstore_create(&cmd, LCB_STORE_UPSERT);
+    rc = lcb_cmdstore_create(cmd, operation);
     IfLCBFailGotoDone(rc, -EIO);
 
+    if (cas != 0) {
+        rc = lcb_cmdstore_cas(*cmd, cas);
+        IfLCBFailGotoDone(rc, -EIO);
+    }
+
     rc = lcb_cmdstore_collection(
-        cmd,
+        *cmd,
         DEFAULT_SCOPE_STRING, DEFAULT_SCOPE_STRLEN,
         BLOCKS_COLLECTION_STRING, BLOCKS_COLLECTION_STRLEN);
     IfLCBFailGotoDone(rc, -EIO);
 
-    rc = lcb_cmdstore_datatype(cmd, LCB_VALUE_RAW);
+    rc = lcb_cmdstore_datatype(*cmd, LCB_VALUE_RAW);
     IfLCBFailGotoDone(rc, -EIO);
 
-    rc = lcb_cmdstore_key(cmd, pkey, strlen(pkey));
+    rc = lcb_cmdstore_key(*cmd, key, nkey);
     IfLCBFailGotoDone(rc, -EIO);
 
-    rc = lcb_cmdstore_value(cmd, get_result->value, get_result->nvalue);
+    rc = lcb_cmdstore_value_iov(*cmd, iov, niov);
     IfLCBFailGotoDone(rc, -EIO);
 
-    rc = sync_store(instance, cmd, &store_result);
+done:
+    if (fresult != 0 && *cmd != NULL) {
+        lcb_cmdstore_destroy(*cmd);
+        *cmd = NULL;
+    }
+    return fresult;
+}
+
+// A replace with a CAS (or an insert) fails with -EAGAIN if someone else changed the block first.
+static int store_block_result(lcb_STATUS status)
+{
+    if (status == LCB_SUCCESS) {
+        return 0;
+    } else if (status == LCB_ERR_CAS_MISMATCH || status == LCB_ERR_DOCUMENT_EXISTS) {
+        return -EAGAIN;
+    } else if (status == LCB_ERR_DOCUMENT_NOT_FOUND || status == LCB_ERR_NOT_STORED) {
+        // an append to a block that doesn't exist isn't stored
+        return -ENOENT;
+    }
+    return -EIO;
+}
+
+// Stores block data that's made up of one or more segments.
+static int store_block(lcb_INSTANCE *instance, const char *key, size_t nkey, const lcb_IOV *iov, size_t niov, lcb_STORE_OPERATION operation, uint64_t cas)
+{
+    int fresult = 0;
+    sync_store_result *store_result = NULL;
+
+    lcb_CMDSTORE *cmd = NULL;
+    fresult = create_block_cmdstore(key, nkey, iov, niov, operation, cas, &cmd);
+    IfFRErrorGotoDoneWithRef(key);
+
+    lcb_STATUS rc = sync_store(instance, cmd, &store_result);
+
+    // the cached copy is stale even if the store failed (e.g., someone else changed the block)
+    block_cache_remove(key);
 
     // first check the sync command result code
     IfLCBFailGotoDone(rc, -EIO);
 
     // now check the actual result status
-    if (store_result->status == LCB_SUCCESS) {
-        fresult = 0;
-    } else if (store_result->status == LCB_ERR_DOCUMENT_NOT_FOUND) {
+    fresult = store_block_result(store_result->status);
+
+done:
+    sync_store_destroy(store_result);
+    return fresult;
+}
+
+// Creates a lookup of the length of a block (which also returns its CAS) that doesn't fetch its data.
+// The key must stay valid until the command is scheduled.
+static int create_block_lookup(const char *key, size_t nkey, lcb_CMDSUBDOC **cmd, lcb_SUBDOCSPECS **specs)
+{
+    int fresult = 0;
+
+    lcb_STATUS rc = lcb_subdocspecs_create(specs, 1);
+    IfLCBFailGotoDone(rc, -EIO);
+
+    rc = lcb_subdocspecs_get(*specs, 0, LCB_SUBDOCSPECS_F_XATTRPATH, BLOCK_LENGTH_XATTR, strlen(BLOCK_LENGTH_XATTR));
+    IfLCBFailGotoDone(rc, -EIO);
+
+    rc = lcb_cmdsubdoc_create(cmd);
+    IfLCBFailGotoDone(rc, -EIO);
+
+    rc = lcb_cmdsubdoc_collection(
+        *cmd,
+        DEFAULT_SCOPE_STRING, DEFAULT_SCOPE_STRLEN,
+        BLOCKS_COLLECTION_STRING, BLOCKS_COLLECTION_STRLEN);
+    IfLCBFailGotoDone(rc, -EIO);
+
+    rc = lcb_cmdsubdoc_key(*cmd, key, nkey);
+    IfLCBFailGotoDone(rc, -EIO);
+
+    rc = lcb_cmdsubdoc_specs(*cmd, *specs);
+    IfLCBFailGotoDone(rc, -EIO);
+
+done:
+    if (fresult != 0) {
+        if (*cmd != NULL) {
+            lcb_cmdsubdoc_destroy(*cmd);
+            *cmd = NULL;
+        }
+        if (*specs != NULL) {
+            lcb_subdocspecs_destroy(*specs);
+            *specs = NULL;
+        }
+    }
+    return fresult;
+}
+
+// Gets the length and CAS of a block without fetching its data.
+static int get_block_length(lcb_INSTANCE *instance, const char *key, size_t nkey, size_t *length, uint64_t *cas)
+{
+    int fresult = 0;
+    sync_subdoc_result *result = NULL;
+    lcb_SUBDOCSPECS *specs = NULL;
+    lcb_CMDSUBDOC *cmd = NULL;
+
+    fresult = create_block_lookup(key, nkey, &cmd, &specs);
+    IfFRErrorGotoDoneWithRef(key);
+
+    // the command and specs are destroyed by the sync call
+    lcb_STATUS rc = sync_subdoc(instance, cmd, specs, &result);
+    cmd = NULL;
+    specs = NULL;
+    IfLCBFailGotoDone(rc, -EIO);
+
+    if (result->status == LCB_ERR_DOCUMENT_NOT_FOUND) {
         fresult = -ENOENT;
+        goto done;
+    }
+    IfLCBFailGotoDoneWithRef(result->status, -EIO, key);
+    IfTrueGotoDoneWithRef(
+        (result->nentries < 1 || result->entries[0].status != LCB_SUCCESS),
+        -EIO,
+        key
+    );
+
+    // the length is a JSON number that isn't terminated
+    char digits[32];
+    size_t ndigits = result->entries[0].nvalue;
+    IfTrueGotoDoneWithRef((ndigits == 0 || ndigits >= sizeof(digits)), -EIO, key);
+    memcpy(digits, result->entries[0].value, ndigits);
+    digits[ndigits] = '\0';
+
+    char *end = NULL;
+    unsigned long long value = strtoull(digits, &end, 10);
+    IfTrueGotoDoneWithRef((*end != '\0'), -EIO, key);
+
+    *length = value;
+    *cas = result->cas;
+
+done:
+    if (cmd != NULL) {
+        lcb_cmdsubdoc_destroy(cmd);
+    }
+    if (specs != NULL) {
+        lcb_subdocspecs_destroy(specs);
+    }
+    sync_subdoc_destroy(result);
+    return fresult;
+}
+
+// Works out how to add data at the end of a block without reading it. A write that starts a
+// block is inserted as a new block and any other write is appended to the block if it still
+// ends where the write starts. Returns -EAGAIN if the block has to be updated the slow way.
+static int prepare_append(lcb_INSTANCE *instance, const char *key, size_t nkey, size_t block_offset, lcb_STORE_OPERATION *operation, uint64_t *cas)
+{
+    int fresult = 0;
+
+    *operation = LCB_STORE_INSERT;
+    *cas = 0;
+    if (block_offset == 0) {
+        goto done;
+    }
+
+    size_t length = 0;
+    fresult = get_block_length(instance, key, nkey, &length, cas);
+
+    // a missing block is a hole (and a block of another length is out of step with the size)
+    if (fresult == -ENOENT || (fresult == 0 && length != block_offset)) {
+        fresult = -EAGAIN;
+        goto done;
+    }
+    IfFRErrorGotoDoneWithRef(key);
+
+    // the CAS makes sure nothing changed the block after its length was checked
+    *operation = LCB_STORE_APPEND;
+
+done:
+    return fresult;
+}
+
+// Adds data at the end of a block (see prepare_append).
+static int try_append_block(lcb_INSTANCE *instance, const char *dkey, size_t block, const char *buf, size_t nbuf, size_t block_offset)
+{
+    int fresult = 0;
+
+    char key[MAX_KEY_LEN + 1];
+    size_t nkey = 0;
+    fresult = block_key(dkey, block, key, &nkey);
+    IfFRErrorGotoDoneWithRef(dkey);
+
+    lcb_STORE_OPERATION operation;
+    uint64_t cas = 0;
+    fresult = prepare_append(instance, key, nkey, block_offset, &operation, &cas);
+    if (fresult != 0) {
+        goto done;
+    }
+
+    lcb_IOV iov[1];
+    size_t niov = 0;
+    add_segment(iov, &niov, buf, nbuf);
+
+    fresult = store_block(instance, key, nkey, iov, niov, operation, cas);
+
+    // the block was removed after its length was checked
+    if (fresult == -ENOENT) {
+        fresult = -EAGAIN;
+    }
+
+done:
+    return fresult;
+}
+
+// Updates a single block with the provided data at an offset relative to the start of the block.
+// When no data is provided the block is truncated to the offset.
+// If the block grows then new_block_size is set to the new block length.
+typedef struct block_update {
+    lcb_INSTANCE *instance;
+    const char *dkey;
+    size_t block;
+    const char *buf;            // data to write (NULL to truncate the block at offset)
+    size_t nbuf;
+    off_t offset;
+    size_t *new_block_size;     // receives the new size of a block that grew (optional)
+} block_update;
+
+// Reads, modifies, and stores a block with the CAS that was read.
+// The old data around the change is sent as separate segments so the block is never rebuilt in memory.
+static int try_update_block(void *context)
+{
+    int fresult = 0;
+    const block_update *update = context;
+    sync_get_result *get_result = NULL;
+    char *hole = NULL;
+    const char *buf = update->buf;
+    size_t nbuf = update->nbuf;
+    off_t offset = update->offset;
+    const bool isNotTruncate = (buf != NULL && nbuf > 0);
+    const bool isOverwrite = (isNotTruncate && offset == 0 && nbuf == FILE_BLOCK_LEN);
+    size_t new_block_size = 0;
+
+    char key[MAX_KEY_LEN + 1];
+    size_t nkey = 0;
+    fresult = block_key(update->dkey, update->block, key, &nkey);
+    IfFRErrorGotoDoneWithRef(update->dkey);
+
+    // calculate the overall length of the update operation
+    size_t nupdate = offset + nbuf;
+    IfTrueGotoDoneWithRef((nupdate > FILE_BLOCK_LEN), -EFBIG, key);
+
+    // get the current data for the block (unless it's about to be entirely overwritten)
+    if (isOverwrite) {
+        fresult = -ENOENT;
+    } else {
+        fresult = get_block(update->instance, update->dkey, update->block, &get_result);
+    }
+
+    // the block is replaced only if nobody changed it since it was read
+    lcb_STORE_OPERATION operation = LCB_STORE_REPLACE;
+    uint64_t cas = 0;
+    const char *old_value = NULL;
+    size_t nold = 0;
+
+    if (fresult == -ENOENT) {
+        // nothing to truncate if a block wasn't found (otherwise it's written as a new block)
+        fresult = 0;
+        if (!isNotTruncate) {
+            goto done;
+        }
+
+        // a new block can't replace one that someone else just created (unless all of it is overwritten)
+        operation = isOverwrite ? LCB_STORE_UPSERT : LCB_STORE_INSERT;
+
     } else {
-        fresult = -EIO;
+        IfFRErrorGotoDoneWithRef(key);
+        cas = get_result->cas;
+        old_value = get_result->value;
+        nold = get_result->nvalue;
+    }
+
+    // head, hole, new data, and tail
+    lcb_IOV iov[4];
+    size_t niov = 0;
+
+    if (isNotTruncate) {
+        size_t nhead = ((size_t)offset < nold) ? (size_t)offset : nold;
+        if (nhead > 0) {
+            add_segment(iov, &niov, old_value, nhead);
+        }
+
+        // any gap between the old data and the new data is a hole
+        if ((size_t)offset > nold) {
+            hole = calloc(1, offset - nold);
+            IfNULLGotoDoneWithRef(hole, -ENOMEM, key);
+            add_segment(iov, &niov, hole, offset - nold);
+        }
+
+        add_segment(iov, &niov, buf, nbuf);
+
+        if (nupdate < nold) {
+            add_segment(iov, &niov, old_value + nupdate, nold - nupdate);
+        } else if (nupdate > nold) {
+            new_block_size = nupdate;
+        }
+    } else if ((size_t)offset < nold) {
+        // no need to copy - just store the data before the offset
+        add_segment(iov, &niov, old_value, offset);
+    } else {
+        // nothing to truncate because the block is already small enough
+        goto done;
+    }
+
+    // now write the data back to Couchbase
+    fresult = store_block(update->instance, key, nkey, iov, niov, operation, cas);
+
+    // a block that was removed after it was read (e.g., truncated) is read again
+    if (fresult == -ENOENT) {
+        fresult = -EAGAIN;
+    }
+    if (fresult != 0) {
+        goto done;
     }
 
-    // TODO: retry if fail due to CAS (could also considering locking semantics with CAS to prevent this
+    if (update->new_block_size != NULL) {
+        *update->new_block_size = new_block_size;
+    }
 
 done:
+    free(hole);
     sync_get_destroy(get_result);
-    sync_store_destroy(store_result);
     return fresult;
 }
 
+// Applies a change to a block, reading it again when someone else changed it first.
+static int update_block(lcb_INSTANCE *instance, const char *dkey, size_t block, const char *buf, size_t nbuf, off_t offset, size_t *new_block_size)
+{
+    block_update update = {
+        .instance = instance,
+        .dkey = dkey,
+        .block = block,
+        .buf = buf,
+        .nbuf = nbuf,
+        .offset = offset,
+        .new_block_size = new_block_size
+    };
+    return cas_retry_update(dkey, try_update_block, &update);
+}
+
 /////
 
-int read_data(lcb_INSTANCE *instance, const char *pkey, const char *buf, size_t nbuf, off_t offset)
+int read_data(lcb_INSTANCE *instance, const char *pkey, const char *buf, size_t nbuf, off_t offset, bool sequential)
 {
     int fresult = 0;
-    sync_get_result *get_result = NULL;
-
-    // TODO: Refactor to support multiple data blocks
+    char dkey[MAX_KEY_LEN + 1];
+    char key[MAX_KEY_LEN + 1];
+    sync_get_result **get_results = NULL;
+    size_t nget_results = 0;
+    sync_get_slice *slices = NULL;
+    size_t *misses = NULL;
+    sync_get_slice *miss_slices = NULL;
+
+    // the file size is the max read size (blocks may be sparse)
+    cbfuse_stat stat = {0};
+    fresult = get_stat(instance, pkey, &stat, NULL);
+    IfFRErrorGotoDoneWithRef(pkey);
 
-    // get the current data for the block and then deal with offset and max
-    fresult = get_block(instance, pkey, 1, &get_result);
+    fresult = data_key(pkey, &stat, dkey);
     IfFRErrorGotoDoneWithRef(pkey);
 
-    // the result size is the max read size
-    size_t max_size = get_result->nvalue;
+    size_t max_size = stat.st_size;
 
     // Check if trying to read past the max size.
     IfTrueGotoDoneWithRef((offset >= (off_t)max_size), 0, pkey);
@@ -181,10 +680,97 @@ int read_data(lcb_INSTANCE *instance, const char *pkey, const char *buf, size_t
         nbuf = max_size - offset;
     }
 
-    // Copy requested data into the buffer.
-    memcpy((void*)buf, (void*)((get_result->value)+offset), nbuf);
+    // A zero length read has no blocks to cover.
+    if (nbuf == 0) {
+        goto done;
+    }
+
+    size_t first = offset / FILE_BLOCK_LEN;
+    size_t nblocks = ((offset + nbuf - 1) / FILE_BLOCK_LEN) - first + 1;
+    get_results = calloc(nblocks, sizeof(sync_get_result*));
+    slices = calloc(nblocks, sizeof(sync_get_slice));
+    misses = calloc(nblocks, sizeof(size_t));
+    miss_slices = calloc(nblocks, sizeof(sync_get_slice));
+    IfTrueGotoDoneWithRef(
+        (get_results == NULL || slices == NULL || misses == NULL || miss_slices == NULL),
+        -ENOMEM,
+        pkey
+    );
+    nget_results = nblocks;
+
+    // Work out which part of each block covering the range lands where in the buffer.
+    size_t ncopied = 0;
+    for (size_t i = 0; i < nblocks; i++) {
+        size_t block_offset = (offset + ncopied) % FILE_BLOCK_LEN;
+        size_t ncopy = FILE_BLOCK_LEN - block_offset;
+        if (ncopy > nbuf - ncopied) {
+            ncopy = nbuf - ncopied;
+        }
+
+        slices[i].buf = (char*)buf + ncopied;
+        slices[i].offset = block_offset;
+        slices[i].len = ncopy;
+        ncopied += ncopy;
+    }
+
+    // Copy the blocks that are cached and fetch the rest at once. A whole block is 1 MiB so it's only
+    // fetched (and cached) for sequential reads or reads that cover every missing block, otherwise
+    // just the requested data is copied straight into the buffer.
+    bool whole = block_cache_enabled();
+    uint64_t epoch = block_cache_epoch();
+    size_t nmisses = 0;
+    for (size_t i = 0; i < nblocks; i++) {
+        size_t nkey = 0;
+        fresult = block_key(dkey, first + i, key, &nkey);
+        IfFRErrorGotoDoneWithRef(dkey);
+
+        size_t navail = 0;
+        if (block_cache_read(key, slices[i].offset, slices[i].len, slices[i].buf, &navail)) {
+            // data past the end of a short block is a hole
+            memset(slices[i].buf + navail, 0, slices[i].len - navail);
+        } else {
+            if (!sequential && slices[i].len < FILE_BLOCK_LEN) {
+                whole = false;
+            }
+            misses[nmisses] = first + i;
+            miss_slices[nmisses] = slices[i];
+            nmisses++;
+        }
+    }
+
+    if (nmisses > 0) {
+        fresult = get_block_slices(instance, dkey, misses, nmisses, whole ? NULL : miss_slices, get_results);
+        IfFRErrorGotoDoneWithRef(pkey);
+    }
+
+    for (size_t i = 0; i < nmisses; i++) {
+        const sync_get_slice *slice = &slices[misses[i] - first];
+        sync_get_result *get_result = get_results[i];
+
+        // a missing block is a hole and so is the data past the end of a short block
+        size_t navail = 0;
+        if (get_result->status == LCB_SUCCESS && !whole) {
+            navail = get_result->nslice;
+        } else if (get_result->status == LCB_SUCCESS) {
+            if (slice->offset < get_result->nvalue) {
+                navail = get_result->nvalue - slice->offset;
+                if (navail > slice->len) {
+                    navail = slice->len;
+                }
+                memcpy(slice->buf, get_result->value + slice->offset, navail);
+            }
+
+            // the cache takes the fetched value
+            size_t nkey = 0;
+            if (block_key(dkey, misses[i], key, &nkey) == 0) {
+                block_cache_put(key, (char*)get_result->value, get_result->nvalue, get_result->cas, epoch);
+                get_result->value = NULL;
+            }
+        }
+        memset(slice->buf + navail, 0, slice->len - navail);
+    }
 
-    fresult = update_stat_atime(instance, pkey);
+    fresult = atimes_touch(instance, pkey, &stat);
     IfFRErrorGotoDoneWithRef(pkey);
 
     // Update the read result to indicate how many bytes were read
@@ -195,32 +781,261 @@ done:
         // read must return 0 on EOF or -1 when an error happens
         fresult = -1;
     }
-    sync_get_destroy(get_result);
+    for (size_t i = 0; i < nget_results; i++) {
+        sync_get_destroy(get_results[i]);
+    }
+    free(get_results);
+    free(slices);
+    free(misses);
+    free(miss_slices);
     return fresult;
 }
 
-int write_data(lcb_INSTANCE *instance, const char *pkey, const char *buf, size_t nbuf, off_t offset)
+void revalidate_data(lcb_INSTANCE *instance, const char *pkey, const cbfuse_stat *stat)
 {
     int fresult = 0;
+    char dkey[MAX_KEY_LEN + 1];
+    char prefix[MAX_KEY_LEN + 2];
+    block_cache_ref *refs = NULL;
+    size_t nrefs = 0;
+    size_t nchecked = 0;
+
+    if (!block_cache_enabled()) {
+        goto done;
+    }
+
+    fresult = data_key(pkey, stat, dkey);
+    IfFRErrorGotoDoneWithRef(pkey);
+
+    snprintf(prefix, sizeof(prefix), "%s%c", dkey, BLOCK_KEY_SEPARATOR);
+    nrefs = block_cache_find(prefix, &refs);
+
+    // the CAS of every cached block is looked up (without its data) in batches
+    for (; nchecked < nrefs; nchecked += BLOCK_BATCH_LEN) {
+        size_t nbatch = nrefs - nchecked;
+        if (nbatch > BLOCK_BATCH_LEN) {
+            nbatch = BLOCK_BATCH_LEN;
+        }
+
+        sync_subdoc_result *results[BLOCK_BATCH_LEN] = {0};
+        sync_batch batch;
+        sync_batch_init(&batch, instance);
+
+        for (size_t i = 0; i < nbatch; i++) {
+            const char *key = refs[nchecked + i].key;
+            lcb_SUBDOCSPECS *specs = NULL;
+            lcb_CMDSUBDOC *cmd = NULL;
+            if (create_block_lookup(key, strlen(key), &cmd, &specs) == 0) {
+                sync_batch_subdoc(&batch, cmd, specs, &results[i]);
+            }
+        }
+
+        // a block that changed, is gone, or couldn't be checked is dropped
+        lcb_STATUS rc = sync_batch_execute(&batch);
+        for (size_t i = 0; i < nbatch; i++) {
+            bool valid = (rc == LCB_SUCCESS && results[i] != NULL && results[i]->status == LCB_SUCCESS);
+            block_cache_validate(refs[nchecked + i].key, valid ? results[i]->cas : 0);
+        }
 
-    // TODO: Refactor to support multiple data blocks
+        sync_batch_destroy(&batch);
+    }
+
+done:
+    block_cache_free_refs(refs, nrefs);
+}
+
+int write_blocks(lcb_INSTANCE *instance, const char *pkey, const char *buf, size_t nbuf, off_t offset, size_t pending_size, size_t *grown_size)
+{
+    int fresult = 0;
+    char dkey[MAX_KEY_LEN + 1];
 
     // TODO: Improve write performance
-    // Current strategy is pretty bad because it's fetching the current block and then making changes and rewriting.
+    // Each block covering the range is still fetched, modified, and rewritten (unless it's appended to).
     // Even with FUSE_CAP_BIG_WRITES it ends up being too chatty because we're limited to the kernel read/write
     // buffer size (e.g., 64k on macOS).
 
+    *grown_size = 0;
     IfTrueGotoDoneWithRef((offset + nbuf > MAX_FILE_LEN), -EFBIG, pkey);
 
-    size_t new_block_size = 0;
-    fresult = update_block(instance, pkey, 1, buf, nbuf, offset, &new_block_size);
+    // the stat has the inode number that keys the blocks (and is usually cached)
+    cbfuse_stat stat = {0};
+    fresult = get_stat(instance, pkey, &stat, NULL);
     IfFRErrorGotoDoneWithRef(pkey);
 
-    if (new_block_size != 0) {
-        fresult = update_stat_size(instance, pkey, new_block_size);
+    fresult = data_key(pkey, &stat, dkey);
+    IfFRErrorGotoDoneWithRef(pkey);
+
+    // the end of the file may be past the stored size when the size is still pending
+    size_t eof = ((size_t)stat.st_size > pending_size) ? (size_t)stat.st_size : pending_size;
+
+    size_t nwritten = 0;
+    while (nwritten < nbuf) {
+        size_t pos = offset + nwritten;
+        size_t block = pos / FILE_BLOCK_LEN;
+        size_t block_offset = pos % FILE_BLOCK_LEN;
+        size_t nwrite = FILE_BLOCK_LEN - block_offset;
+        if (nwrite > nbuf - nwritten) {
+            nwrite = nbuf - nwritten;
+        }
+
+        // a write at the end of the file only sends the new data (unless the tail block is out of step)
+        size_t new_block_size = 0;
+        fresult = (pos == eof) ? try_append_block(instance, dkey, block, buf + nwritten, nwrite, block_offset) : -EAGAIN;
+        if (fresult == 0) {
+            new_block_size = block_offset + nwrite;
+        } else if (fresult == -EAGAIN) {
+            fresult = update_block(instance, dkey, block, buf + nwritten, nwrite, block_offset, &new_block_size);
+        }
         IfFRErrorGotoDoneWithRef(pkey);
+
+        if (new_block_size != 0) {
+            *grown_size = (block * FILE_BLOCK_LEN) + new_block_size;
+        }
+
+        // the next block of an append starts a new block at the end of the file
+        if (pos == eof) {
+            eof += nwrite;
+        }
+        nwritten += nwrite;
     }
 
+done:
+    return fresult;
+}
+
+// Puts back the stat of an append whose block wasn't stored. If someone else changed the stat
+// in the meantime their change is kept.
+static void restore_stat(lcb_INSTANCE *instance, const char *pkey, const cbfuse_stat *stat, uint64_t cas)
+{
+    sync_store_result *result = NULL;
+
+    sync_batch batch;
+    sync_batch_init(&batch, instance);
+
+    if (batch_replace_stat(&batch, pkey, stat, cas, &result) == 0 &&
+        sync_batch_execute(&batch) == LCB_SUCCESS) {
+        replace_stat_result(pkey, stat, result);
+    } else {
+        attr_cache_remove(pkey);
+    }
+
+    sync_batch_destroy(&batch);
+}
+
+// Appends data that fits in the tail block and grows the stat in the same round trip.
+// Returns -EAGAIN if the write isn't a simple append (or the tail block is out of step).
+static int append_data(lcb_INSTANCE *instance, const char *pkey, const char *buf, size_t nbuf, off_t offset)
+{
+    int fresult = 0;
+    char dkey[MAX_KEY_LEN + 1];
+    char key[MAX_KEY_LEN + 1];
+    sync_store_result *block_result = NULL;
+    sync_store_result *stat_result = NULL;
+
+    sync_batch batch;
+    sync_batch_init(&batch, instance);
+
+    cbfuse_stat stat = {0};
+    uint64_t stat_cas = 0;
+    fresult = get_stat(instance, pkey, &stat, &stat_cas);
+    IfFRErrorGotoDoneWithRef(pkey);
+
+    size_t block = offset / FILE_BLOCK_LEN;
+    size_t block_offset = offset % FILE_BLOCK_LEN;
+    if (offset != stat.st_size || block_offset + nbuf > FILE_BLOCK_LEN || offset + nbuf > MAX_FILE_LEN) {
+        fresult = -EAGAIN;
+        goto done;
+    }
+
+    fresult = data_key(pkey, &stat, dkey);
+    IfFRErrorGotoDoneWithRef(pkey);
+
+    size_t nkey = 0;
+    fresult = block_key(dkey, block, key, &nkey);
+    IfFRErrorGotoDoneWithRef(dkey);
+
+    lcb_STORE_OPERATION operation;
+    uint64_t cas = 0;
+    fresult = prepare_append(instance, key, nkey, block_offset, &operation, &cas);
+    if (fresult != 0) {
+        goto done;
+    }
+
+    // get the current time to update modified time
+    struct timespec ts;
+    IfFalseGotoDoneWithRef(
+        (clock_gettime(CLOCK_REALTIME, &ts) == 0),
+        -EIO,
+        "clock_gettime"
+    );
+
+    cbfuse_stat grown = stat;
+    grown.st_size = offset + nbuf;
+    grown.st_mtime = ts.tv_sec;
+    grown.st_mtimensec = ts.tv_nsec;
+
+    lcb_IOV iov[1];
+    size_t niov = 0;
+    add_segment(iov, &niov, buf, nbuf);
+
+    lcb_CMDSTORE *cmd = NULL;
+    fresult = create_block_cmdstore(key, nkey, iov, niov, operation, cas, &cmd);
+    IfFRErrorGotoDoneWithRef(key);
+
+    lcb_STATUS rc = sync_batch_store(&batch, cmd, &block_result);
+    IfLCBFailGotoDone(rc, -EIO);
+
+    fresult = batch_replace_stat(&batch, pkey, &grown, stat_cas, &stat_result);
+    IfFRErrorGotoDoneWithRef(pkey);
+
+    rc = sync_batch_execute(&batch);
+    block_cache_remove(key);
+
+    // first check the sync command result code
+    IfLCBFailGotoDone(rc, -EIO);
+
+    int stat_fresult = replace_stat_result(pkey, &grown, stat_result);
+
+    fresult = store_block_result(block_result->status);
+    if (fresult == -ENOENT) {
+        fresult = -EAGAIN;
+    }
+    if (fresult != 0) {
+        // the stat grew without the data so it's put back (the full write that may follow grows it again)
+        if (stat_fresult == 0) {
+            restore_stat(instance, pkey, &stat, stat_result->cas);
+        }
+        goto done;
+    }
+
+    // someone else changed the stat so the size is grown the slow way
+    fresult = stat_fresult;
+    if (fresult == -EAGAIN) {
+        fresult = extend_stat_size(instance, pkey, offset + nbuf);
+    }
+    IfFRErrorGotoDoneWithRef(pkey);
+
+done:
+    sync_batch_destroy(&batch);
+    return fresult;
+}
+
+int write_data(lcb_INSTANCE *instance, const char *pkey, const char *buf, size_t nbuf, off_t offset)
+{
+    // an append that fits in the tail block is sent with the new size
+    int fresult = append_data(instance, pkey, buf, nbuf, offset);
+    if (fresult == -EAGAIN) {
+        size_t grown_size = 0;
+        fresult = write_blocks(instance, pkey, buf, nbuf, offset, 0, &grown_size);
+        IfFRErrorGotoDoneWithRef(pkey);
+
+        // a grown block only grows the file when it ends past the current size
+        if (grown_size != 0) {
+            fresult = extend_stat_size(instance, pkey, grown_size);
+        }
+    }
+    IfFRErrorGotoDoneWithRef(pkey);
+
     // Update the write result to indicate how many bytes were written
     fresult = nbuf;
 
@@ -235,9 +1050,194 @@ done:
 int remove_data(lcb_INSTANCE *instance, const char *pkey)
 {
     int fresult = 0;
-    sync_remove_result *result = NULL;
+    char dkey[MAX_KEY_LEN + 1];
+
+    // the file size determines how many blocks may exist
+    cbfuse_stat stat = {0};
+    fresult = get_stat(instance, pkey, &stat, NULL);
+    IfFRErrorGotoDoneWithRef(pkey);
+
+    fresult = data_key(pkey, &stat, dkey);
+    IfFRErrorGotoDoneWithRef(pkey);
+
+    fresult = remove_blocks(instance, dkey, 0, block_count(stat.st_size));
+    IfFRErrorGotoDoneWithRef(pkey);
+
+done:
+    return fresult;
+}
 
-    // TODO: Refactor to support multiple data blocks
+// Queues the removal of every block of a file. The results aren't checked
+// because leftover blocks are harmless (they are overwritten or removed later).
+int batch_remove_data(sync_batch *batch, const char *pkey)
+{
+    int fresult = 0;
+    char dkey[MAX_KEY_LEN + 1];
+
+    // the file size determines how many blocks may exist
+    cbfuse_stat stat = {0};
+    fresult = get_stat(batch->instance, pkey, &stat, NULL);
+    IfFRErrorGotoDoneWithRef(pkey);
+
+    fresult = data_key(pkey, &stat, dkey);
+    IfFRErrorGotoDoneWithRef(pkey);
+
+    size_t nblocks = block_count(stat.st_size);
+    if (nblocks == 0) {
+        goto done;
+    }
+
+    // the keys have to live until the batch is executed
+    char *keys = malloc(nblocks * (MAX_KEY_LEN + 1));
+    IfNULLGotoDoneWithRef(keys, -ENOMEM, pkey);
+
+    lcb_STATUS rc = sync_batch_own(batch, keys);
+    IfLCBFailGotoDone(rc, -ENOMEM);
+
+    for (size_t block = 0; block < nblocks; block++) {
+        lcb_CMDREMOVE *cmd = NULL;
+        fresult = create_block_cmdremove(dkey, block, keys + (block * (MAX_KEY_LEN + 1)), &cmd);
+        IfFRErrorGotoDoneWithRef(pkey);
+
+        // the data key isn't used again once the file is gone so it's dropped from the cache right away
+        block_cache_remove(keys + (block * (MAX_KEY_LEN + 1)));
+
+        sync_remove_result *result;
+        rc = sync_batch_remove(batch, cmd, &result);
+        IfLCBFailGotoDone(rc, -EIO);
+    }
+
+done:
+    return fresult;
+}
+
+// Gets the single document keyed by the path of a file that held all of its data
+// before files were split into blocks (-ENOENT if the file never had one).
+static int get_legacy_document(lcb_INSTANCE *instance, const char *path, sync_get_result **result)
+{
+    int fresult = 0;
+
+    lcb_STATUS rc;
+    lcb_CMDGET *cmd;
+
+    rc = lcb_cmdget_create(&cmd);
+    IfLCBFailGotoDone(rc, -EIO);
+
+    rc = lcb_cmdget_collection(
+        cmd,
+        DEFAULT_SCOPE_STRING, DEFAULT_SCOPE_STRLEN,
+        BLOCKS_COLLECTION_STRING, BLOCKS_COLLECTION_STRLEN);
+    IfLCBFailGotoDone(rc, -EIO);
+
+    rc = lcb_cmdget_key(cmd, path, strlen(path));
+    IfLCBFailGotoDone(rc, -EIO);
+
+    rc = sync_get(instance, cmd, result);
+    IfLCBFailGotoDone(rc, -EIO);
+
+    if ((*result)->status == LCB_ERR_DOCUMENT_NOT_FOUND) {
+        fresult = -ENOENT;
+        goto done;
+    }
+    IfLCBFailGotoDoneWithRef((*result)->status, -EIO, path);
+
+done:
+    return fresult;
+}
+
+// Splits the single document of a file into the blocks of its inode.
+static int split_legacy_document(lcb_INSTANCE *instance, const char *dkey, const cbfuse_stat *stat, const sync_get_result *result)
+{
+    int fresult = 0;
+    char key[MAX_KEY_LEN + 1];
+
+    // anything stored past the size of the file was never readable
+    size_t nvalue = result->nvalue;
+    if ((off_t)nvalue > stat->st_size) {
+        nvalue = stat->st_size;
+    }
+
+    for (size_t block = 0; block < block_count(nvalue); block++) {
+        size_t offset = block * FILE_BLOCK_LEN;
+        size_t len = nvalue - offset;
+        if (len > FILE_BLOCK_LEN) {
+            len = FILE_BLOCK_LEN;
+        }
+
+        size_t nkey = 0;
+        fresult = block_key(dkey, block, key, &nkey);
+        IfFRErrorGotoDoneWithRef(dkey);
+
+        lcb_IOV iov;
+        size_t niov = 0;
+        add_segment(&iov, &niov, result->value + offset, len);
+
+        fresult = store_block(instance, key, nkey, &iov, niov, LCB_STORE_UPSERT, 0);
+        IfFRErrorGotoDoneWithRef(key);
+    }
+
+done:
+    return fresult;
+}
+
+// Copies the data a file stored under its path before it had an inode number to the
+// blocks of the inode it was given. That's either a single document with all of the data
+// (before files were split into blocks) or blocks keyed by the path. The old documents are
+// left in place (for remove_legacy_data) until the file can be found by its inode.
+int copy_legacy_data(lcb_INSTANCE *instance, const char *path, const cbfuse_stat *stat)
+{
+    int fresult = 0;
+    sync_get_result *result = NULL;
+    char dkey[MAX_KEY_LEN + 1];
+    char key[MAX_KEY_LEN + 1];
+
+    IfTrueGotoDoneWithRef((stat->st_ino == 0), -EINVAL, path);
+    inode_key(stat->st_ino, dkey);
+
+    fresult = get_legacy_document(instance, path, &result);
+    if (fresult == 0) {
+        fresult = split_legacy_document(instance, dkey, stat, result);
+        IfFRErrorGotoDoneWithRef(path);
+        goto done;
+    }
+    if (fresult != -ENOENT) {
+        IfFRErrorGotoDoneWithRef(path);
+    }
+    fresult = 0;
+
+    for (size_t block = 0; block < block_count(stat->st_size); block++) {
+        sync_get_destroy(result);
+        result = NULL;
+
+        // sparse files may not have every block
+        fresult = get_block(instance, path, block, &result);
+        if (fresult == -ENOENT) {
+            fresult = 0;
+            continue;
+        }
+        IfFRErrorGotoDoneWithRef(path);
+
+        size_t nkey = 0;
+        fresult = block_key(dkey, block, key, &nkey);
+        IfFRErrorGotoDoneWithRef(dkey);
+
+        lcb_IOV iov;
+        size_t niov = 0;
+        add_segment(&iov, &niov, result->value, result->nvalue);
+
+        fresult = store_block(instance, key, nkey, &iov, niov, LCB_STORE_UPSERT, 0);
+        IfFRErrorGotoDoneWithRef(key);
+    }
+
+done:
+    sync_get_destroy(result);
+    return fresult;
+}
+
+int remove_legacy_data(lcb_INSTANCE *instance, const char *path, const cbfuse_stat *stat)
+{
+    int fresult = 0;
+    sync_remove_result *result = NULL;
 
     lcb_STATUS rc;
     lcb_CMDREMOVE *cmd;
@@ -251,16 +1251,18 @@ int remove_data(lcb_INSTANCE *instance, const char *pkey)
         BLOCKS_COLLECTION_STRING, BLOCKS_COLLECTION_STRLEN);
     IfLCBFailGotoDone(rc, -EIO);
 
-    rc = lcb_cmdremove_key(cmd, pkey, strlen(pkey));
+    rc = lcb_cmdremove_key(cmd, path, strlen(path));
     IfLCBFailGotoDone(rc, -EIO);
 
+    // a file has the single document or the blocks so a missing document is not an error
     rc = sync_remove(instance, cmd, &result);
-
-    // first check the sync command result code
     IfLCBFailGotoDone(rc, -EIO);
+    if (result->status != LCB_ERR_DOCUMENT_NOT_FOUND) {
+        IfLCBFailGotoDoneWithRef(result->status, -EIO, path);
+    }
 
-    // now check the actual result status
-    IfLCBFailGotoDoneWithRef(result->status, -ENOENT, pkey);
+    fresult = remove_blocks(instance, path, 0, block_count(stat->st_size));
+    IfFRErrorGotoDoneWithRef(path);
 
 done:
     sync_remove_destroy(result);
@@ -270,6 +1272,7 @@ done:
 int truncate_data(lcb_INSTANCE *instance, const char *pkey, off_t offset)
 {
     int fresult = 0;
+    char dkey[MAX_KEY_LEN + 1];
 
     // NOTE:
     // Strategy here is just to truncate existing data if smaller.
@@ -278,17 +1281,28 @@ int truncate_data(lcb_INSTANCE *instance, const char *pkey, off_t offset)
     // New blocks will just be allocated on future writes, and the
     // writes are configured to support FUSE_CAP_BIG_WRITES writes.
 
-    // TODO: Refactor to support multiple data blocks
+    IfTrueGotoDoneWithRef(((size_t)offset > MAX_FILE_LEN), -EFBIG, pkey);
 
-    if (offset == 0) {
-        // truncating to zero is equivalent to removing all data for the file
-        fresult = remove_data(instance, pkey);
-    } else {
-        // otherwise update the block with no data (indicating a truncate)
-        fresult = update_block(instance, pkey, 1, NULL, 0, offset, NULL);
-    }
+    cbfuse_stat stat = {0};
+    fresult = get_stat(instance, pkey, &stat, NULL);
+    IfFRErrorGotoDoneWithRef(pkey);
+
+    fresult = data_key(pkey, &stat, dkey);
     IfFRErrorGotoDoneWithRef(pkey);
 
+    if (offset < stat.st_size) {
+        // remove every block that is entirely past the new size
+        fresult = remove_blocks(instance, dkey, block_count(offset), block_count(stat.st_size));
+        IfFRErrorGotoDoneWithRef(pkey);
+
+        // then truncate the block that now contains the end of the file
+        size_t block_offset = offset % FILE_BLOCK_LEN;
+        if (block_offset != 0) {
+            fresult = update_block(instance, dkey, offset / FILE_BLOCK_LEN, NULL, 0, block_offset, NULL);
+            IfFRErrorGotoDoneWithRef(pkey);
+        }
+    }
+
     // now update the file size
     fresult = update_stat_size(instance, pkey, offset);
     IfFRErrorGotoDoneWithRef(pkey);
@@ -296,4 +1310,4 @@ int truncate_data(lcb_INSTANCE *instance, const char *pkey, off_t offset)
 done:
     //fprintf(stderr, ">> truncate_data done: pkey:%s fr:%d\n", pkey, fresult);
     return fresult;
-}
\ No newline at end of file
+}
@@ -18,11 +18,26 @@
 #ifndef CBFUSE_BLOCKS_HEADER_SEEN
 #define CBFUSE_BLOCKS_HEADER_SEEN
 
+#include <stdint.h>
+#include <stdbool.h>
 #include <libcouchbase/couchbase.h>
 
-int read_data(lcb_INSTANCE *instance, const char *pkey, const char *buf, size_t nbuf, off_t offset);
+#include "stats.h"
+#include "sync_batch.h"
+
+// sequential reads fetch whole blocks (so they can be cached) and other reads only fetch the requested range
+int read_data(lcb_INSTANCE *instance, const char *pkey, const char *buf, size_t nbuf, off_t offset, bool sequential);
 int write_data(lcb_INSTANCE *instance, const char *pkey, const char *buf, size_t nbuf, off_t offset);
+// writes the blocks but leaves the stat to the caller (grown_size is the size the file may have grown to or zero)
+// pending_size is a size that's not stored yet (or zero) so writes at the end of the file can be appended
+int write_blocks(lcb_INSTANCE *instance, const char *pkey, const char *buf, size_t nbuf, off_t offset, size_t pending_size, size_t *grown_size);
+// drops cached blocks of a file that changed since they were cached (e.g., when it's opened)
+void revalidate_data(lcb_INSTANCE *instance, const char *pkey, const cbfuse_stat *stat);
 int remove_data(lcb_INSTANCE *instance, const char *pkey);
+int batch_remove_data(sync_batch *batch, const char *pkey);
 int truncate_data(lcb_INSTANCE *instance, const char *pkey, off_t offset);
+// copies the data a file stored under its path (before it had an inode number) to the blocks of its inode
+int copy_legacy_data(lcb_INSTANCE *instance, const char *path, const cbfuse_stat *stat);
+int remove_legacy_data(lcb_INSTANCE *instance, const char *path, const cbfuse_stat *stat);
 
 #endif /* !CBFUSE_BLOCKS_HEADER_SEEN */
@@ -16,21 +16,306 @@
  */
 
 #include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <xxhash.h>
+
+#include "custom-uthash.h"
+#include "uthash/uthash.h"
 
 #include "dentries.h"
+#include "dentry_reader.h"
 #include "util.h"
 #include "common.h"
+#include "keys.h"
+#include "cas_retry.h"
 #include "sync_get.h"
 #include "sync_store.h"
 #include "sync_remove.h"
 
-int get_dentry_json(lcb_INSTANCE *instance, const char *dir_pkey, cJSON **dentry_json)
+// directory entries are mostly used by readdir and to look up paths
+// represented as JSON because it's mostly dynamic character data
+// the root directory is keyed by its path and every other one by its inode (see inode_key)
+// {
+//   "d": "current-dir-key",
+//   "p": "parent-dir-key",
+//   "i": {
+//     "some-child-entry-name": 42,
+//     "other-child-entry-name": 43
+//   },
+//   "n": 2,    (number of children in "i", missing in older entries)
+//   "s": 0     (number of additional shards, missing until the first split)
+// }
+//
+// Each child maps its name to its inode number, which keys its stat (and its own
+// directory entry). Renaming an entry only adds the name to one directory entry and
+// removes it from another, however many entries there are below it.
+//
+// Large directories are split into shards with linear hashing so no document has
+// to hold every child. The directory entry is shard 0 and every other shard is a
+// separate document keyed by "#<shard><dir-key>" that only has "i" and "n".
+// A child belongs to the shard selected by the XXH3 hash of its name and the
+// number of shards. When a shard grows past DENTRY_SHARD_MAX_CHILDREN the next
+// shard is claimed by incrementing "s" and the children of the shard it splits
+// from that hash to the new shard are moved over.
+//
+// The number of shards only grows so a child is always in the shard it hashes to
+// or in one of the shards that shard was split from (e.g., when another mount used
+// a stale number of shards or a move is still in progress). Lookups walk back
+// through those shards when a child isn't where it's expected.
+
+#define DENTRY_SHARD_BATCH_LEN      64      // shards fetched together by readdir
+#define DENTRY_SHARDS_CACHE_LEN     4096    // directories with a remembered number of shards
+
+typedef struct dentry_shards_entry {
+    char *dir_pkey;             // key of the directory entry (hash key)
+    uint32_t nshards;           // number of shards last seen
+    UT_hash_handle hh;
+} dentry_shards_entry;
+
+// a stale number of shards is safe (see above) so it's remembered until the directory is removed
+static pthread_mutex_t _shards_lock = PTHREAD_MUTEX_INITIALIZER;
+static dentry_shards_entry *_shards = NULL;
+
+static void delete_shards_entry(dentry_shards_entry *entry)
+{
+    HASH_DEL(_shards, entry);
+    free(entry->dir_pkey);
+    free(entry);
+}
+
+static bool get_cached_shards(const char *dir_pkey, uint32_t *nshards)
+{
+    pthread_mutex_lock(&_shards_lock);
+
+    dentry_shards_entry *entry = NULL;
+    HASH_FIND_STR(_shards, dir_pkey, entry);
+    if (entry != NULL) {
+        *nshards = entry->nshards;
+    }
+
+    pthread_mutex_unlock(&_shards_lock);
+    return (entry != NULL);
+}
+
+static void put_cached_shards(const char *dir_pkey, uint32_t nshards)
+{
+    pthread_mutex_lock(&_shards_lock);
+
+    dentry_shards_entry *entry = NULL;
+    HASH_FIND_STR(_shards, dir_pkey, entry);
+    if (entry == NULL) {
+        // make room by evicting the least recently added entry
+        if (HASH_COUNT(_shards) >= DENTRY_SHARDS_CACHE_LEN) {
+            delete_shards_entry(_shards);
+        }
+
+        entry = calloc(1, sizeof(dentry_shards_entry));
+        if (entry == NULL) {
+            goto done;
+        }
+
+        entry->dir_pkey = strdup(dir_pkey);
+        if (entry->dir_pkey == NULL) {
+            free(entry);
+            goto done;
+        }
+
+        HASH_ADD_KEYPTR(hh, _shards, entry->dir_pkey, strlen(entry->dir_pkey), entry);
+    }
+    entry->nshards = nshards;
+
+done:
+    pthread_mutex_unlock(&_shards_lock);
+}
+
+static void remove_cached_shards(const char *dir_pkey)
+{
+    pthread_mutex_lock(&_shards_lock);
+
+    dentry_shards_entry *entry = NULL;
+    HASH_FIND_STR(_shards, dir_pkey, entry);
+    if (entry != NULL) {
+        delete_shards_entry(entry);
+    }
+
+    pthread_mutex_unlock(&_shards_lock);
+}
+
+void dentry_shards_destroy(void)
+{
+    pthread_mutex_lock(&_shards_lock);
+
+    dentry_shards_entry *entry, *tmp;
+    HASH_ITER(hh, _shards, entry, tmp) {
+        delete_shards_entry(entry);
+    }
+
+    pthread_mutex_unlock(&_shards_lock);
+}
+
+// Highest power of two that isn't larger than n (n > 0).
+static uint32_t shard_level(uint32_t n)
+{
+    uint32_t level = 1;
+    while (level <= n / 2) {
+        level *= 2;
+    }
+    return level;
+}
+
+static uint32_t child_shard(const char *child_name, uint32_t nshards)
+{
+    uint64_t hash = XXH3_64bits(child_name, strlen(child_name));
+    uint64_t level = shard_level(nshards);
+
+    // shards below the split point have already been split into the next level
+    uint64_t shard = hash & (level - 1);
+    if (shard < nshards - level) {
+        shard = hash & ((level * 2) - 1);
+    }
+    return (uint32_t)shard;
+}
+
+// The shard that was split to create a shard (shard > 0).
+static uint32_t parent_shard(uint32_t shard)
+{
+    return shard - shard_level(shard);
+}
+
+// The key buffer must have room for MAX_KEY_LEN + 1 characters.
+// The other shards prefix the key of the directory (shortened to make room if needed).
+static int shard_key(const char *dir_pkey, uint32_t shard, char *key)
+{
+    size_t nkey = 0;
+    if (shard == 0) {
+        return path_to_key(dir_pkey, key, &nkey);
+    }
+
+    int n = snprintf(key, MAX_KEY_LEN + 1, "%c%u", DENTRY_SHARD_KEY_PREFIX, shard);
+    if (n < 0 || (size_t)n > MAX_KEY_LEN) {
+        return -ENAMETOOLONG;
+    }
+
+    return path_to_key_len(dir_pkey, MAX_KEY_LEN - (size_t)n, key + n, &nkey);
+}
+
+// Creates a shard key that lives until the batch is destroyed.
+static int batch_shard_key(sync_batch *batch, const char *dir_pkey, uint32_t shard, char **key)
+{
+    int fresult = 0;
+
+    *key = malloc(MAX_KEY_LEN + 1);
+    IfNULLGotoDoneWithRef(*key, -ENOMEM, dir_pkey);
+
+    lcb_STATUS rc = sync_batch_own(batch, *key);
+    IfLCBFailGotoDone(rc, -ENOMEM);
+
+    fresult = shard_key(dir_pkey, shard, *key);
+    IfFRErrorGotoDoneWithRef(dir_pkey);
+
+done:
+    return fresult;
+}
+
+// The status of the document, or of the first path when the document was found.
+static lcb_STATUS subdoc_status(const sync_subdoc_result *result)
+{
+    if (result->status != LCB_SUCCESS || result->nentries == 0) {
+        return result->status;
+    }
+    return result->entries[0].status;
+}
+
+// Parses a non-negative number returned for a path (e.g., by a counter).
+static bool entry_to_size(const sync_subdoc_entry *entry, size_t *value)
+{
+    char number[32];
+    if (entry->status != LCB_SUCCESS || entry->value == NULL ||
+        entry->nvalue == 0 || entry->nvalue >= sizeof(number)) {
+        return false;
+    }
+
+    memcpy(number, entry->value, entry->nvalue);
+    number[entry->nvalue] = '\0';
+
+    char *end;
+    long long n = strtoll(number, &end, 10);
+    if (*end != '\0' || n < 0) {
+        return false;
+    }
+
+    *value = (size_t)n;
+    return true;
+}
+
+// Parses an inode number returned for a path.
+static bool entry_to_inode(const sync_subdoc_entry *entry, uint64_t *ino)
+{
+    char number[32];
+    if (entry->status != LCB_SUCCESS || entry->value == NULL ||
+        entry->nvalue == 0 || entry->nvalue >= sizeof(number)) {
+        return false;
+    }
+
+    memcpy(number, entry->value, entry->nvalue);
+    number[entry->nvalue] = '\0';
+
+    char *end;
+    unsigned long long n = strtoull(number, &end, 10);
+    if (*end != '\0' || number[0] == '-' || n == 0) {
+        return false;
+    }
+
+    *ino = (uint64_t)n;
+    return true;
+}
+
+// Creates the sub-document path of a child (its name is quoted with backticks, which are doubled).
+static char *child_path(const char *child_name)
+{
+    size_t npath = strlen(DENTRY_INODES) + strlen(child_name) + 4;
+    for (const char *c = child_name; *c != '\0'; c++) {
+        if (*c == '`') {
+            npath++;
+        }
+    }
+
+    char *path = malloc(npath);
+    if (path == NULL) {
+        return NULL;
+    }
+
+    char *out = path + sprintf(path, "%s.`", DENTRY_INODES);
+    for (const char *c = child_name; *c != '\0'; c++) {
+        if (*c == '`') {
+            *out++ = '`';
+        }
+        *out++ = *c;
+    }
+    *out++ = '`';
+    *out = '\0';
+
+    return path;
+}
+
+// Creates the JSON value of an inode number.
+static char *inode_value(uint64_t ino)
+{
+    char *value = malloc(24);
+    if (value != NULL) {
+        snprintf(value, 24, "%" PRIu64, ino);
+    }
+    return value;
+}
+
+static int batch_get_dentry_key(sync_batch *batch, const char *key, sync_get_result **result)
 {
     int fresult = 0;
-    sync_get_result *result = NULL;
 
     lcb_STATUS rc;
     lcb_CMDGET *cmd;
@@ -44,37 +329,18 @@ int get_dentry_json(lcb_INSTANCE *instance, const char *dir_pkey, cJSON **dentry
         DENTRIES_COLLECTION_STRING, DENTRIES_COLLECTION_STRLEN);
     IfLCBFailGotoDone(rc, -EIO);
 
-    rc = lcb_cmdget_key(cmd, dir_pkey, strlen(dir_pkey));
+    rc = lcb_cmdget_key(cmd, key, strlen(key));
     IfLCBFailGotoDone(rc, -EIO);
 
-    rc = sync_get(instance, cmd, &result);
-
-    // first check the sync command result code
+    // concurrent listings of the same directory share a single get
+    rc = sync_batch_get_shared(batch, DENTRIES_COLLECTION_STRING, key, strlen(key), cmd, result);
     IfLCBFailGotoDone(rc, -EIO);
 
-    // now check the actual result status
-    IfLCBFailGotoDoneWithRef(result->status, -ENOENT, dir_pkey);
-
-    *dentry_json = cJSON_ParseWithLength(result->value, result->nvalue);
-    IfNULLGotoDoneWithRef(dentry_json, -EIO, dir_pkey);
-
 done:
-    sync_get_destroy(result);
     return fresult;
 }
 
-// directory entries are mostly used by readdir
-// represented as JSON because it's mostly dynamic character data
-// note that the path-key may not be the full path
-// {
-//   "d": "current-dir-path",
-//   "p": "parent-dir-path",
-//   "c": [
-//     "some-child-entry-name",
-//     "other-child-entry-name"
-//   ]
-// }
-static char *create_dentry(const char *dir_path, const char *parent_path, const char *child_names[], int child_nkeys)
+static char *create_dentry(const char *dir_pkey, const char *parent_pkey)
 {
     char *dentry_string = NULL;
     cJSON *dentry_json = cJSON_CreateObject();
@@ -82,21 +348,21 @@ static char *create_dentry(const char *dir_path, const char *parent_path, const
         goto done;
     }
 
-    if (!cJSON_AddItemToObject(dentry_json, DENTRY_DIR_PATH, cJSON_CreateStringReference(dir_path))) {
+    if (!cJSON_AddItemToObject(dentry_json, DENTRY_DIR_PATH, cJSON_CreateStringReference(dir_pkey))) {
         goto done;
     }
 
-    if (!cJSON_AddItemToObject(dentry_json, DENTRY_PAR_PATH, cJSON_CreateStringReference(parent_path))) {
+    // the root directory has no parent
+    if (parent_pkey != NULL &&
+        !cJSON_AddItemToObject(dentry_json, DENTRY_PAR_PATH, cJSON_CreateStringReference(parent_pkey))) {
         goto done;
     }
 
-    cJSON *children_json = cJSON_CreateArray();
-    for (int i=0; i < child_nkeys; i++) {
-        if (!cJSON_AddItemToArray(children_json, cJSON_CreateStringReference(child_names[i]))) {
-            goto done;
-        }
+    if (cJSON_AddObjectToObject(dentry_json, DENTRY_INODES) == NULL) {
+        goto done;
     }
-    if (!cJSON_AddItemToObject(dentry_json, DENTRY_CHILDREN, children_json)) {
+
+    if (cJSON_AddNumberToObject(dentry_json, DENTRY_COUNT, 0) == NULL) {
         goto done;
     }
 
@@ -110,21 +376,11 @@ done:
     return dentry_string;
 }
 
-int add_new_dentry(lcb_INSTANCE *instance, const char *dir_pkey, const char *dir_path, const char *parent_path)
+// Queues the insert of a directory entry (or shard) document. The key and value have to
+// live until the batch is executed.
+static int batch_insert_dentry_key(sync_batch *batch, const char *key, const char *value, size_t nvalue, sync_store_result **result)
 {
     int fresult = 0;
-    sync_store_result *result = NULL;
-
-    const char *dentry = create_dentry(
-        dir_path,
-        parent_path,
-        NULL,
-        0
-    );
-    if (dentry == NULL) {
-        fprintf(stderr, "%s:%s:%d Failed to create new dentry JSON.\n", __FILENAME__, __func__, __LINE__);
-        goto done;
-    }
 
     lcb_STATUS rc;
     lcb_CMDSTORE *cmd;
@@ -138,157 +394,226 @@ int add_new_dentry(lcb_INSTANCE *instance, const char *dir_pkey, const char *dir
         DENTRIES_COLLECTION_STRING, DENTRIES_COLLECTION_STRLEN);
     IfLCBFailGotoDone(rc, -EIO);
 
-    rc = lcb_cmdstore_key(cmd, dir_pkey, strlen(dir_pkey));
+    rc = lcb_cmdstore_key(cmd, key, strlen(key));
     IfLCBFailGotoDone(rc, -EIO);
 
-    rc = lcb_cmdstore_value(cmd, dentry, strlen(dentry));
+    rc = lcb_cmdstore_value(cmd, value, nvalue);
     IfLCBFailGotoDone(rc, -EIO);
 
-    rc = sync_store(instance, cmd, &result);
-
-    // first check the sync command result code
+    rc = sync_batch_store(batch, cmd, result);
     IfLCBFailGotoDone(rc, -EIO);
 
-    // now check the actual result status
+done:
+    return fresult;
+}
+
+int batch_add_new_dentry(sync_batch *batch, const char *dir_pkey, const char *parent_pkey, sync_store_result **result)
+{
+    int fresult = 0;
+
+    char *dentry = create_dentry(dir_pkey, parent_pkey);
+    IfNULLGotoDoneWithRef(dentry, -EIO, dir_pkey);
+
+    // the value has to live until the batch is executed
+    lcb_STATUS rc = sync_batch_own(batch, dentry);
+    IfLCBFailGotoDone(rc, -ENOMEM);
+
+    const char *key = NULL;
+    size_t nkey = 0;
+    fresult = batch_path_key(batch, dir_pkey, &key, &nkey);
+    IfFRErrorGotoDoneWithRef(dir_pkey);
+
+    fresult = batch_insert_dentry_key(batch, key, dentry, strlen(dentry), result);
+    IfFRErrorGotoDoneWithRef(dir_pkey);
+
+done:
+    return fresult;
+}
+
+int add_new_dentry_result(const char *dir_pkey, const sync_store_result *result)
+{
+    int fresult = 0;
+
+    IfTrueGotoDoneWithRef((result->status == LCB_ERR_DOCUMENT_EXISTS), -EEXIST, dir_pkey);
     IfLCBFailGotoDoneWithRef(result->status, -ENOENT, dir_pkey);
 
 done:
-    sync_store_destroy(result);
     return fresult;
 }
 
-int add_child_to_dentry(lcb_INSTANCE *instance, const char *dir_pkey, const char *child_name)
+int add_new_dentry(lcb_INSTANCE *instance, const char *dir_pkey, const char *parent_pkey)
 {
     sync_store_result *result = NULL;
 
-    cJSON *dentry_json = NULL;
-    int fresult = get_dentry_json(instance, dir_pkey, &dentry_json);
-    if (fresult != 0) {
-        return fresult;
-    }
-    
-    cJSON *children_json = cJSON_GetObjectItemCaseSensitive(dentry_json, DENTRY_CHILDREN);
-    IfNULLGotoDoneWithRef(dentry_json, -EIO, dir_pkey);
+    sync_batch batch;
+    sync_batch_init(&batch, instance);
 
-    IfFalseGotoDoneWithRef(cJSON_IsArray(children_json), -EIO, dir_pkey);
+    int fresult = batch_add_new_dentry(&batch, dir_pkey, parent_pkey, &result);
+    IfFRErrorGotoDoneWithRef(dir_pkey);
 
-    IfFalseGotoDoneWithRef(
-        cJSON_AddItemToArray(children_json, cJSON_CreateString(child_name)),
-        -EIO,
-        dir_pkey
-    );
+    lcb_STATUS rc = sync_batch_execute(&batch);
 
-    char *dentry_string = cJSON_PrintUnformatted(dentry_json);
-    IfNULLGotoDoneWithRef(dentry_string, -EIO, dir_pkey);
+    // first check the sync command result code
+    IfLCBFailGotoDone(rc, -EIO);
+
+    // now check the actual result status
+    fresult = add_new_dentry_result(dir_pkey, result);
+
+done:
+    sync_batch_destroy(&batch);
+    return fresult;
+}
+
+// Creates a sub-document command for a directory entry (or one of its shards).
+static int create_dentry_cmdsubdoc(const char *key, lcb_SUBDOCSPECS *specs, lcb_CMDSUBDOC **cmd)
+{
+    int fresult = 0;
 
     lcb_STATUS rc;
-    lcb_CMDSTORE *cmd;
 
-    // replace the previous dentry
-    rc = lcb_cmdstore_create(&cmd, LCB_STORE_REPLACE);
+    rc = lcb_cmdsubdoc_create(cmd);
     IfLCBFailGotoDone(rc, -EIO);
 
-    rc = lcb_cmdstore_collection(
-        cmd,
+    rc = lcb_cmdsubdoc_collection(
+        *cmd,
         DEFAULT_SCOPE_STRING, DEFAULT_SCOPE_STRLEN,
         DENTRIES_COLLECTION_STRING, DENTRIES_COLLECTION_STRLEN);
     IfLCBFailGotoDone(rc, -EIO);
 
-    rc = lcb_cmdstore_key(cmd, dir_pkey, strlen(dir_pkey));
+    rc = lcb_cmdsubdoc_key(*cmd, key, strlen(key));
     IfLCBFailGotoDone(rc, -EIO);
 
-    rc = lcb_cmdstore_value(cmd, dentry_string, strlen(dentry_string));
+    rc = lcb_cmdsubdoc_specs(*cmd, specs);
     IfLCBFailGotoDone(rc, -EIO);
 
-    rc = sync_store(instance, cmd, &result);
+done:
+    if (fresult != 0 && *cmd != NULL) {
+        lcb_cmdsubdoc_destroy(*cmd);
+        *cmd = NULL;
+    }
+    return fresult;
+}
+
+// Runs a sub-document command and destroys the specs (even on failure).
+static int run_dentry_subdoc(lcb_INSTANCE *instance, const char *key, lcb_SUBDOCSPECS *specs, uint64_t cas, sync_subdoc_result **result)
+{
+    lcb_CMDSUBDOC *cmd = NULL;
 
-    // first check the sync command result code
-    IfLCBFailGotoDone(rc, -EIO);
+    int fresult = create_dentry_cmdsubdoc(key, specs, &cmd);
+    IfFRErrorGotoDoneWithRef(key);
 
-    // now check the actual result status
-    IfLCBFailGotoDoneWithRef(result->status, -ENOENT, dir_pkey);
+    if (cas != 0) {
+        lcb_STATUS rc = lcb_cmdsubdoc_cas(cmd, cas);
+        IfLCBFailGotoDone(rc, -EIO);
+    }
+
+    // the command and specs are destroyed by the sync helper
+    lcb_STATUS rc = sync_subdoc(instance, cmd, specs, result);
+    cmd = NULL;
+    specs = NULL;
+    IfLCBFailGotoDone(rc, -EIO);
 
 done:
-    cJSON_Delete(dentry_json);
-    sync_store_destroy(result);
+    if (cmd != NULL) {
+        lcb_cmdsubdoc_destroy(cmd);
+    }
+    if (specs != NULL) {
+        lcb_subdocspecs_destroy(specs);
+    }
     return fresult;
 }
 
-int remove_dentry(lcb_INSTANCE *instance, const char *dir_pkey)
+// Fetches the number of shards of a directory (and remembers it).
+static int fetch_dentry_shards(lcb_INSTANCE *instance, const char *dir_pkey, uint32_t *nshards)
 {
     int fresult = 0;
-    sync_remove_result *result = NULL;
+    lcb_SUBDOCSPECS *specs = NULL;
+    sync_subdoc_result *result = NULL;
 
-    lcb_STATUS rc;
-    lcb_CMDREMOVE *cmd;
-
-    rc = lcb_cmdremove_create(&cmd);
+    lcb_STATUS rc = lcb_subdocspecs_create(&specs, 1);
     IfLCBFailGotoDone(rc, -EIO);
 
-    rc = lcb_cmdremove_collection(
-        cmd,
-        DEFAULT_SCOPE_STRING, DEFAULT_SCOPE_STRLEN,
-        DENTRIES_COLLECTION_STRING, DENTRIES_COLLECTION_STRLEN);
+    rc = lcb_subdocspecs_get(specs, 0, 0, DENTRY_SHARDS, strlen(DENTRY_SHARDS));
     IfLCBFailGotoDone(rc, -EIO);
 
-    rc = lcb_cmdremove_key(cmd, dir_pkey, strlen(dir_pkey));
-    IfLCBFailGotoDone(rc, -EIO);
+    fresult = run_dentry_subdoc(instance, dir_pkey, specs, 0, &result);
+    specs = NULL;
+    IfFRErrorGotoDoneWithRef(dir_pkey);
 
-    rc = sync_remove(instance, cmd, &result);
+    IfTrueGotoDoneWithRef((result->status == LCB_ERR_DOCUMENT_NOT_FOUND), -ENOENT, dir_pkey);
 
-    // first check the sync command result code
-    IfLCBFailGotoDone(rc, -EIO);
+    // directories that were never split don't have the field
+    size_t extra = 0;
+    lcb_STATUS status = subdoc_status(result);
+    if (status != LCB_ERR_SUBDOC_PATH_NOT_FOUND) {
+        IfLCBFailGotoDoneWithRef(status, -EIO, dir_pkey);
+        IfFalseGotoDoneWithRef(entry_to_size(&result->entries[0], &extra), -EIO, dir_pkey);
+    }
 
-    // now check the actual result status
-    IfLCBFailGotoDoneWithRef(result->status, -ENOENT, dir_pkey);
+    *nshards = (uint32_t)(extra + 1);
+    put_cached_shards(dir_pkey, *nshards);
 
 done:
-    sync_remove_destroy(result);
+    if (specs != NULL) {
+        lcb_subdocspecs_destroy(specs);
+    }
+    sync_subdoc_destroy(result);
     return fresult;
 }
 
-int remove_child_from_dentry(__unused lcb_INSTANCE *instance, const char *dir_pkey, const char *child_name)
+static int get_dentry_shards(lcb_INSTANCE *instance, const char *dir_pkey, uint32_t *nshards)
 {
-    sync_store_result *result = NULL;
-
-    cJSON *dentry_json = NULL;
-    int fresult = get_dentry_json(instance, dir_pkey, &dentry_json);
-    if (fresult != 0) {
-        return fresult;
-    }
-
-    cJSON *children_json = cJSON_GetObjectItemCaseSensitive(dentry_json, DENTRY_CHILDREN);
-    IfNULLGotoDoneWithRef(dentry_json, -EIO, dir_pkey);
-
-    IfFalseGotoDoneWithRef(cJSON_IsArray(children_json), -EIO, dir_pkey);
-
-    cJSON *child_json;
-    cJSON *new_children_json = cJSON_CreateArray();
-    cJSON_ArrayForEach(child_json, children_json) {
-        // copy and skip the path string that's being deleted
-        if (cJSON_IsString(child_json)) {
-            char *child_string = cJSON_GetStringValue(child_json);
-            if (strcmp(child_string, child_name) != 0) {
-                IfFalseGotoDoneWithRef(
-                    cJSON_AddItemToArray(new_children_json, cJSON_CreateString(child_string)),
-                    -EIO,
-                    dir_pkey
-                );
-            }
-        }
+    if (get_cached_shards(dir_pkey, nshards)) {
+        return 0;
     }
-    cJSON_ReplaceItemInObjectCaseSensitive(dentry_json, DENTRY_CHILDREN, new_children_json);
+    return fetch_dentry_shards(instance, dir_pkey, nshards);
+}
+
+// Claims the next shard by incrementing the number of shards (concurrent claims get different shards).
+static int claim_dentry_shard(lcb_INSTANCE *instance, const char *dir_pkey, uint32_t *nshards)
+{
+    int fresult = 0;
+    lcb_SUBDOCSPECS *specs = NULL;
+    sync_subdoc_result *result = NULL;
 
-    /////
+    lcb_STATUS rc = lcb_subdocspecs_create(&specs, 1);
+    IfLCBFailGotoDone(rc, -EIO);
+
+    rc = lcb_subdocspecs_counter(specs, 0, 0, DENTRY_SHARDS, strlen(DENTRY_SHARDS), 1);
+    IfLCBFailGotoDone(rc, -EIO);
 
-    char *dentry_string = cJSON_PrintUnformatted(dentry_json);
-    IfNULLGotoDoneWithRef(dentry_string, -EIO, dir_pkey);
+    fresult = run_dentry_subdoc(instance, dir_pkey, specs, 0, &result);
+    specs = NULL;
+    IfFRErrorGotoDoneWithRef(dir_pkey);
 
-    lcb_STATUS rc;
+    IfLCBFailGotoDoneWithRef(subdoc_status(result), -EIO, dir_pkey);
+
+    size_t extra = 0;
+    IfFalseGotoDoneWithRef(entry_to_size(&result->entries[0], &extra), -EIO, dir_pkey);
+
+    *nshards = (uint32_t)(extra + 1);
+    put_cached_shards(dir_pkey, *nshards);
+
+done:
+    if (specs != NULL) {
+        lcb_subdocspecs_destroy(specs);
+    }
+    sync_subdoc_destroy(result);
+    return fresult;
+}
+
+// Creates a shard document with no children (an existing shard is left as is).
+static int insert_empty_shard(lcb_INSTANCE *instance, const char *key)
+{
+    sync_store_result *result = NULL;
     lcb_CMDSTORE *cmd;
+    static const char value[] = "{\"i\":{},\"n\":0}";
 
-    // replace the previous dentry
-    rc = lcb_cmdstore_create(&cmd, LCB_STORE_REPLACE);
+    sync_batch batch;
+    sync_batch_init(&batch, instance);
+
+    int fresult = 0;
+    lcb_STATUS rc = lcb_cmdstore_create(&cmd, LCB_STORE_INSERT);
     IfLCBFailGotoDone(rc, -EIO);
 
     rc = lcb_cmdstore_collection(
@@ -297,22 +622,1132 @@ int remove_child_from_dentry(__unused lcb_INSTANCE *instance, const char *dir_pk
         DENTRIES_COLLECTION_STRING, DENTRIES_COLLECTION_STRLEN);
     IfLCBFailGotoDone(rc, -EIO);
 
-    rc = lcb_cmdstore_key(cmd, dir_pkey, strlen(dir_pkey));
+    rc = lcb_cmdstore_key(cmd, key, strlen(key));
     IfLCBFailGotoDone(rc, -EIO);
 
-    rc = lcb_cmdstore_value(cmd, dentry_string, strlen(dentry_string));
+    rc = lcb_cmdstore_value(cmd, value, sizeof(value) - 1);
     IfLCBFailGotoDone(rc, -EIO);
 
-    rc = sync_store(instance, cmd, &result);
+    rc = sync_batch_store(&batch, cmd, &result);
+    IfLCBFailGotoDone(rc, -EIO);
 
-    // first check the sync command result code
+    rc = sync_batch_execute(&batch);
     IfLCBFailGotoDone(rc, -EIO);
 
-    // now check the actual result status
-    IfLCBFailGotoDoneWithRef(result->status, -ENOENT, dir_pkey);
+    if (result->status != LCB_ERR_DOCUMENT_EXISTS) {
+        IfLCBFailGotoDoneWithRef(result->status, -EIO, key);
+    }
 
 done:
-    cJSON_Delete(dentry_json);
-    sync_store_destroy(result);
+    sync_batch_destroy(&batch);
+    return fresult;
+}
+
+// Fetches the children of a shard along with the CAS of the shard document.
+static int get_shard_children(lcb_INSTANCE *instance, const char *key, cJSON **children, uint64_t *cas)
+{
+    int fresult = 0;
+    lcb_SUBDOCSPECS *specs = NULL;
+    sync_subdoc_result *result = NULL;
+
+    lcb_STATUS rc = lcb_subdocspecs_create(&specs, 1);
+    IfLCBFailGotoDone(rc, -EIO);
+
+    rc = lcb_subdocspecs_get(specs, 0, 0, DENTRY_INODES, strlen(DENTRY_INODES));
+    IfLCBFailGotoDone(rc, -EIO);
+
+    fresult = run_dentry_subdoc(instance, key, specs, 0, &result);
+    specs = NULL;
+    IfFRErrorGotoDoneWithRef(key);
+
+    IfTrueGotoDoneWithRef((result->status == LCB_ERR_DOCUMENT_NOT_FOUND), -ENOENT, key);
+    *cas = result->cas;
+
+    lcb_STATUS status = subdoc_status(result);
+    if (status == LCB_ERR_SUBDOC_PATH_NOT_FOUND) {
+        *children = cJSON_CreateObject();
+        IfNULLGotoDoneWithRef(*children, -ENOMEM, key);
+        goto done;
+    }
+    IfLCBFailGotoDoneWithRef(status, -EIO, key);
+
+    *children = cJSON_ParseWithLength(result->entries[0].value, result->entries[0].nvalue);
+    IfFalseGotoDoneWithRef(cJSON_IsObject(*children), -EIO, key);
+
+done:
+    if (specs != NULL) {
+        lcb_subdocspecs_destroy(specs);
+    }
+    if (fresult != 0) {
+        cJSON_Delete(*children);
+        *children = NULL;
+    }
+    sync_subdoc_destroy(result);
     return fresult;
-}
\ No newline at end of file
+}
+
+// Replaces the children of a shard unless the shard changed since it was read (-EAGAIN).
+static int put_shard_children(lcb_INSTANCE *instance, const char *key, cJSON *children, uint64_t cas)
+{
+    int fresult = 0;
+    lcb_SUBDOCSPECS *specs = NULL;
+    sync_subdoc_result *result = NULL;
+    char count[32];
+
+    char *value = cJSON_PrintUnformatted(children);
+    IfNULLGotoDoneWithRef(value, -ENOMEM, key);
+
+    int ncount = snprintf(count, sizeof(count), "%d", cJSON_GetArraySize(children));
+
+    lcb_STATUS rc = lcb_subdocspecs_create(&specs, 2);
+    IfLCBFailGotoDone(rc, -EIO);
+
+    rc = lcb_subdocspecs_dict_upsert(specs, 0, 0, DENTRY_INODES, strlen(DENTRY_INODES), value, strlen(value));
+    IfLCBFailGotoDone(rc, -EIO);
+
+    rc = lcb_subdocspecs_dict_upsert(specs, 1, 0, DENTRY_COUNT, strlen(DENTRY_COUNT), count, ncount);
+    IfLCBFailGotoDone(rc, -EIO);
+
+    fresult = run_dentry_subdoc(instance, key, specs, cas, &result);
+    specs = NULL;
+    IfFRErrorGotoDoneWithRef(key);
+
+    IfTrueGotoDoneWithRef((result->status == LCB_ERR_CAS_MISMATCH), -EAGAIN, key);
+    IfLCBFailGotoDoneWithRef(subdoc_status(result), -EIO, key);
+
+done:
+    if (specs != NULL) {
+        lcb_subdocspecs_destroy(specs);
+    }
+    sync_subdoc_destroy(result);
+    free(value);
+    return fresult;
+}
+
+// Adds children to a shard (children that were added concurrently are kept).
+static int merge_shard_children(lcb_INSTANCE *instance, const char *key, cJSON *moved)
+{
+    int fresult = 0;
+    cJSON *children = NULL;
+
+    cas_retry retry;
+    cas_retry_init(&retry, key);
+    do {
+        cJSON_Delete(children);
+        children = NULL;
+
+        uint64_t cas = 0;
+        fresult = get_shard_children(instance, key, &children, &cas);
+        IfFRErrorGotoDoneWithRef(key);
+
+        cJSON *child_json;
+        cJSON_ArrayForEach(child_json, moved) {
+            if (cJSON_GetObjectItemCaseSensitive(children, child_json->string) != NULL) {
+                continue;
+            }
+
+            IfFalseGotoDoneWithRef(cJSON_AddItemToObject(children, child_json->string, cJSON_Duplicate(child_json, false)), -ENOMEM, key);
+        }
+
+        fresult = put_shard_children(instance, key, children, cas);
+    } while (cas_retry_again(&retry, fresult));
+
+    IfFRErrorGotoDoneWithRef(key);
+
+done:
+    cJSON_Delete(children);
+    return fresult;
+}
+
+// Claims the next shard and moves the children that now hash to it out of the
+// shard it was split from. A split that fails part way only leaves children in
+// the shard they were split from, which is where lookups look next. A child that
+// is removed while it's being moved can still be listed in the new shard until
+// it's removed again.
+static int split_dentry(lcb_INSTANCE *instance, const char *dir_pkey)
+{
+    int fresult = 0;
+    char from_key[MAX_KEY_LEN + 1];
+    char to_key[MAX_KEY_LEN + 1];
+    cJSON *from_children = NULL;
+    cJSON *keep = NULL;
+    cJSON *moved = NULL;
+
+    uint32_t nshards = 1;
+    fresult = get_dentry_shards(instance, dir_pkey, &nshards);
+    IfFRErrorGotoDoneWithRef(dir_pkey);
+
+    // a directory with the most shards just keeps growing
+    if (nshards >= DENTRY_MAX_SHARDS) {
+        goto done;
+    }
+
+    fresult = claim_dentry_shard(instance, dir_pkey, &nshards);
+    IfFRErrorGotoDoneWithRef(dir_pkey);
+
+    uint32_t to = nshards - 1;
+    uint32_t from = parent_shard(to);
+
+    fresult = shard_key(dir_pkey, from, from_key);
+    IfFRErrorGotoDoneWithRef(dir_pkey);
+
+    fresult = shard_key(dir_pkey, to, to_key);
+    IfFRErrorGotoDoneWithRef(dir_pkey);
+
+    // new children can't be added to the new shard until it exists
+    fresult = insert_empty_shard(instance, to_key);
+    IfFRErrorGotoDoneWithRef(to_key);
+
+    cas_retry retry;
+    cas_retry_init(&retry, from_key);
+    do {
+        cJSON_Delete(from_children);
+        cJSON_Delete(keep);
+        cJSON_Delete(moved);
+        keep = cJSON_CreateObject();
+        moved = cJSON_CreateObject();
+        from_children = NULL;
+        IfTrueGotoDoneWithRef((keep == NULL || moved == NULL), -ENOMEM, dir_pkey);
+
+        uint64_t cas = 0;
+        fresult = get_shard_children(instance, from_key, &from_children, &cas);
+        IfFRErrorGotoDoneWithRef(from_key);
+
+        cJSON *child_json;
+        cJSON_ArrayForEach(child_json, from_children) {
+            const char *child_name = child_json->string;
+            cJSON *target = (child_shard(child_name, nshards) == to) ? moved : keep;
+            IfFalseGotoDoneWithRef(cJSON_AddItemToObject(target, child_name, cJSON_Duplicate(child_json, false)), -ENOMEM, dir_pkey);
+        }
+
+        if (cJSON_GetArraySize(moved) == 0) {
+            goto done;
+        }
+
+        // copy the children to the new shard first so they can't go missing
+        fresult = merge_shard_children(instance, to_key, moved);
+        IfFRErrorGotoDoneWithRef(to_key);
+
+        // then remove them from the old shard unless it changed after it was read
+        fresult = put_shard_children(instance, from_key, keep, cas);
+    } while (cas_retry_again(&retry, fresult));
+
+    IfFRErrorGotoDoneWithRef(from_key);
+
+done:
+    cJSON_Delete(keep);
+    cJSON_Delete(moved);
+    cJSON_Delete(from_children);
+    return fresult;
+}
+
+// Entries written before "n" was added get it from their first counter operation, which starts
+// from zero instead of the number of children. When a count could have come from one of those
+// (one after an add or negative after a removal) it's set from the size of "i" instead.
+static int seed_shard_count(lcb_INSTANCE *instance, const char *key, size_t *nchildren)
+{
+    int fresult = 0;
+    lcb_SUBDOCSPECS *specs = NULL;
+    sync_subdoc_result *result = NULL;
+    char count[32];
+
+    cas_retry retry;
+    cas_retry_init(&retry, key);
+    do {
+        sync_subdoc_destroy(result);
+        result = NULL;
+
+        lcb_STATUS rc = lcb_subdocspecs_create(&specs, 2);
+        IfLCBFailGotoDone(rc, -EIO);
+
+        rc = lcb_subdocspecs_get_count(specs, 0, 0, DENTRY_INODES, strlen(DENTRY_INODES));
+        IfLCBFailGotoDone(rc, -EIO);
+
+        rc = lcb_subdocspecs_get(specs, 1, 0, DENTRY_COUNT, strlen(DENTRY_COUNT));
+        IfLCBFailGotoDone(rc, -EIO);
+
+        fresult = run_dentry_subdoc(instance, key, specs, 0, &result);
+        specs = NULL;
+        IfFRErrorGotoDoneWithRef(key);
+
+        // a missing path only shows up in the status of its entry
+        IfTrueGotoDoneWithRef((result->status == LCB_ERR_DOCUMENT_NOT_FOUND), -ENOENT, key);
+        IfTrueGotoDoneWithRef((result->nentries < 2), -EIO, key);
+
+        // a shard without children may not have the object
+        *nchildren = 0;
+        if (result->entries[0].status != LCB_ERR_SUBDOC_PATH_NOT_FOUND) {
+            IfFalseGotoDoneWithRef(entry_to_size(&result->entries[0], nchildren), -EIO, key);
+        }
+
+        size_t stored = 0;
+        if (entry_to_size(&result->entries[1], &stored) && stored == *nchildren) {
+            goto done;
+        }
+
+        int ncount = snprintf(count, sizeof(count), "%zu", *nchildren);
+
+        rc = lcb_subdocspecs_create(&specs, 1);
+        IfLCBFailGotoDone(rc, -EIO);
+
+        rc = lcb_subdocspecs_dict_upsert(specs, 0, 0, DENTRY_COUNT, strlen(DENTRY_COUNT), count, ncount);
+        IfLCBFailGotoDone(rc, -EIO);
+
+        uint64_t cas = result->cas;
+        sync_subdoc_destroy(result);
+        result = NULL;
+
+        // the count only goes in if no child was added or removed since it was read
+        fresult = run_dentry_subdoc(instance, key, specs, cas, &result);
+        specs = NULL;
+        IfFRErrorGotoDoneWithRef(key);
+
+        fresult = (result->status == LCB_ERR_CAS_MISMATCH) ? -EAGAIN : 0;
+        if (fresult == 0) {
+            IfLCBFailGotoDoneWithRef(subdoc_status(result), -EIO, key);
+        }
+    } while (cas_retry_again(&retry, fresult));
+
+    IfFRErrorGotoDoneWithRef(key);
+
+done:
+    if (specs != NULL) {
+        lcb_subdocspecs_destroy(specs);
+    }
+    sync_subdoc_destroy(result);
+    return fresult;
+}
+
+// Queues a sub-document command for one shard and takes the specs (even on failure).
+// The key and the paths and values of the specs have to live until the batch is executed.
+static int batch_shard_subdoc(sync_batch *batch, const char *key, lcb_SUBDOCSPECS *specs, sync_subdoc_result **result)
+{
+    lcb_CMDSUBDOC *cmd = NULL;
+
+    int fresult = create_dentry_cmdsubdoc(key, specs, &cmd);
+    IfFRErrorGotoDoneWithRef(key);
+
+    // the batch owns the command and specs from here on
+    lcb_STATUS rc = sync_batch_subdoc(batch, cmd, specs, result);
+    cmd = NULL;
+    specs = NULL;
+    IfLCBFailGotoDone(rc, -EIO);
+
+done:
+    if (cmd != NULL) {
+        lcb_cmdsubdoc_destroy(cmd);
+    }
+    if (specs != NULL) {
+        lcb_subdocspecs_destroy(specs);
+    }
+    return fresult;
+}
+
+// Creates the path of a child that lives until the batch is destroyed.
+static int batch_child_path(sync_batch *batch, const char *child_name, char **path)
+{
+    int fresult = 0;
+
+    *path = child_path(child_name);
+    IfNULLGotoDoneWithRef(*path, -ENOMEM, child_name);
+
+    lcb_STATUS rc = sync_batch_own(batch, *path);
+    IfLCBFailGotoDone(rc, -ENOMEM);
+
+done:
+    return fresult;
+}
+
+static int batch_add_child_to_shard(sync_batch *batch, const char *dir_pkey, uint32_t shard, const char *child_name, uint64_t ino, sync_subdoc_result **result)
+{
+    int fresult = 0;
+    lcb_SUBDOCSPECS *specs = NULL;
+
+    char *key = NULL;
+    fresult = batch_shard_key(batch, dir_pkey, shard, &key);
+    IfFRErrorGotoDoneWithRef(dir_pkey);
+
+    char *path = NULL;
+    fresult = batch_child_path(batch, child_name, &path);
+    IfFRErrorGotoDoneWithRef(dir_pkey);
+
+    // the value has to live until the batch is executed
+    char *value = inode_value(ino);
+    IfNULLGotoDoneWithRef(value, -ENOMEM, dir_pkey);
+
+    lcb_STATUS rc = sync_batch_own(batch, value);
+    IfLCBFailGotoDone(rc, -ENOMEM);
+
+    rc = lcb_subdocspecs_create(&specs, 2);
+    IfLCBFailGotoDone(rc, -EIO);
+
+    // the add fails if the name is taken (entries that predate inodes don't have the object yet)
+    rc = lcb_subdocspecs_dict_add(specs, 0, LCB_SUBDOCSPECS_F_MKINTERMEDIATES, path, strlen(path), value, strlen(value));
+    IfLCBFailGotoDone(rc, -EIO);
+
+    // the new count tells whether the shard should be split
+    rc = lcb_subdocspecs_counter(specs, 1, 0, DENTRY_COUNT, strlen(DENTRY_COUNT), 1);
+    IfLCBFailGotoDone(rc, -EIO);
+
+    fresult = batch_shard_subdoc(batch, key, specs, result);
+    specs = NULL;
+    IfFRErrorGotoDoneWithRef(dir_pkey);
+
+done:
+    if (specs != NULL) {
+        lcb_subdocspecs_destroy(specs);
+    }
+    return fresult;
+}
+
+// an operation on a child of one shard (-ENOENT when the child isn't in the shard)
+typedef int (*child_operation)(lcb_INSTANCE *instance, const char *key, const char *child_name, void *context);
+
+// Runs an operation on the shard a child hashes to (with a fresh number of shards) and then
+// on the shards that shard was split from until the child is found. The shard that was
+// already tried is skipped.
+static int walk_child_shards(lcb_INSTANCE *instance, const char *dir_pkey, const char *child_name, uint32_t tried, child_operation operation, void *context)
+{
+    char key[MAX_KEY_LEN + 1];
+
+    uint32_t nshards = 1;
+    int fresult = fetch_dentry_shards(instance, dir_pkey, &nshards);
+    if (fresult != 0) {
+        goto done;
+    }
+
+    fresult = -ENOENT;
+    for (uint32_t shard = child_shard(child_name, nshards); ; shard = parent_shard(shard)) {
+        if (shard != tried) {
+            fresult = shard_key(dir_pkey, shard, key);
+            IfFRErrorGotoDoneWithRef(dir_pkey);
+
+            fresult = operation(instance, key, child_name, context);
+            if (fresult != -ENOENT) {
+                break;
+            }
+        }
+        if (shard == 0) {
+            break;
+        }
+    }
+
+done:
+    return fresult;
+}
+
+// Runs an operation on the shard a child is expected in and walks back through the
+// shards it was split from when the child isn't there.
+static int find_child_shard(lcb_INSTANCE *instance, const char *dir_pkey, const char *child_name, child_operation operation, void *context)
+{
+    char key[MAX_KEY_LEN + 1];
+
+    uint32_t nshards = 1;
+    int fresult = get_dentry_shards(instance, dir_pkey, &nshards);
+    if (fresult != 0) {
+        goto done;
+    }
+
+    uint32_t shard = child_shard(child_name, nshards);
+    fresult = shard_key(dir_pkey, shard, key);
+    IfFRErrorGotoDoneWithRef(dir_pkey);
+
+    fresult = operation(instance, key, child_name, context);
+    if (fresult == -ENOENT) {
+        fresult = walk_child_shards(instance, dir_pkey, child_name, shard, operation, context);
+    }
+
+done:
+    return fresult;
+}
+
+// Points a child of one shard at another inode (the context is the inode number).
+static int set_child_in_shard(lcb_INSTANCE *instance, const char *key, const char *child_name, void *context)
+{
+    int fresult = 0;
+    lcb_SUBDOCSPECS *specs = NULL;
+    sync_subdoc_result *result = NULL;
+
+    char *path = child_path(child_name);
+    char *value = inode_value(*(const uint64_t *)context);
+    IfTrueGotoDoneWithRef((path == NULL || value == NULL), -ENOMEM, key);
+
+    lcb_STATUS rc = lcb_subdocspecs_create(&specs, 1);
+    IfLCBFailGotoDone(rc, -EIO);
+
+    rc = lcb_subdocspecs_replace(specs, 0, 0, path, strlen(path), value, strlen(value));
+    IfLCBFailGotoDone(rc, -EIO);
+
+    fresult = run_dentry_subdoc(instance, key, specs, 0, &result);
+    specs = NULL;
+    IfFRErrorGotoDoneWithRef(key);
+
+    lcb_STATUS status = subdoc_status(result);
+    if (status == LCB_ERR_DOCUMENT_NOT_FOUND || status == LCB_ERR_SUBDOC_PATH_NOT_FOUND) {
+        fresult = -ENOENT;
+        goto done;
+    }
+    IfLCBFailGotoDoneWithRef(status, -EIO, key);
+
+done:
+    if (specs != NULL) {
+        lcb_subdocspecs_destroy(specs);
+    }
+    sync_subdoc_destroy(result);
+    free(value);
+    free(path);
+    return fresult;
+}
+
+// Only the child (its name and inode number) travels to the server and the server
+// adds it to the children object (unless the name is taken) so the cost doesn't
+// depend on the size of the directory and concurrent changes can't clobber each other.
+int batch_add_child_to_dentry(sync_batch *batch, const char *dir_pkey, const char *child_name, uint64_t ino, dentry_shard_result *result)
+{
+    uint32_t nshards = 1;
+    int fresult = get_dentry_shards(batch->instance, dir_pkey, &nshards);
+    IfFRErrorGotoDoneWithRef(dir_pkey);
+
+    result->shard = child_shard(child_name, nshards);
+
+    fresult = batch_add_child_to_shard(batch, dir_pkey, result->shard, child_name, ino, &result->result);
+    IfFRErrorGotoDoneWithRef(dir_pkey);
+
+done:
+    return fresult;
+}
+
+int add_child_to_dentry_result(lcb_INSTANCE *instance, const char *dir_pkey, const char *child_name, uint64_t ino, const dentry_shard_result *result, bool *added)
+{
+    int fresult = 0;
+    *added = false;
+
+    uint32_t shard = result->shard;
+    const sync_subdoc_result *add_result = result->result;
+    char key[MAX_KEY_LEN + 1];
+
+    sync_batch retry;
+    sync_batch_init(&retry, instance);
+
+    // a missing shard is still being created by a split (or was removed with an
+    // earlier directory) so the child goes to a shard that it was split from
+    while (shard > 0 && add_result->status == LCB_ERR_DOCUMENT_NOT_FOUND) {
+        uint32_t nshards = 1;
+        fresult = fetch_dentry_shards(instance, dir_pkey, &nshards);
+        IfFRErrorGotoDoneWithRef(dir_pkey);
+
+        uint32_t next = child_shard(child_name, nshards);
+        shard = (next < shard) ? next : parent_shard(shard);
+
+        sync_batch_destroy(&retry);
+        sync_batch_init(&retry, instance);
+
+        sync_subdoc_result *retry_result = NULL;
+        fresult = batch_add_child_to_shard(&retry, dir_pkey, shard, child_name, ino, &retry_result);
+        IfFRErrorGotoDoneWithRef(dir_pkey);
+
+        lcb_STATUS rc = sync_batch_execute(&retry);
+        IfLCBFailGotoDone(rc, -EIO);
+
+        add_result = retry_result;
+    }
+
+    fresult = shard_key(dir_pkey, shard, key);
+    IfFRErrorGotoDoneWithRef(dir_pkey);
+
+    lcb_STATUS status = subdoc_status(add_result);
+
+    // the name is already listed (e.g., left over from a failed unlink) so it's pointed at the new entry
+    if (status == LCB_ERR_SUBDOC_PATH_EXISTS) {
+        fresult = set_child_in_shard(instance, key, child_name, &ino);
+        IfFRErrorGotoDoneWithRef(dir_pkey);
+
+        *added = true;
+        goto done;
+    }
+
+    IfLCBFailGotoDoneWithRef(status, -ENOENT, dir_pkey);
+    *added = true;
+
+    // the child was added so a failed count or split only means the shard stays large for now
+    size_t nchildren = 0;
+    bool counted = (add_result->nentries > 1 && entry_to_size(&add_result->entries[1], &nchildren));
+    if (!counted || nchildren == 1) {
+        counted = (seed_shard_count(instance, key, &nchildren) == 0);
+    }
+    if (counted && nchildren > DENTRY_SHARD_MAX_CHILDREN) {
+        split_dentry(instance, dir_pkey);
+    }
+
+done:
+    sync_batch_destroy(&retry);
+    return fresult;
+}
+
+int add_child_to_dentry(lcb_INSTANCE *instance, const char *dir_pkey, const char *child_name, uint64_t ino)
+{
+    dentry_shard_result result = {0};
+    bool added;
+
+    sync_batch batch;
+    sync_batch_init(&batch, instance);
+
+    int fresult = batch_add_child_to_dentry(&batch, dir_pkey, child_name, ino, &result);
+    IfFRErrorGotoDoneWithRef(dir_pkey);
+
+    lcb_STATUS rc = sync_batch_execute(&batch);
+
+    // first check the sync command result code
+    IfLCBFailGotoDone(rc, -EIO);
+
+    // now check the actual result status
+    fresult = add_child_to_dentry_result(instance, dir_pkey, child_name, ino, &result, &added);
+
+done:
+    sync_batch_destroy(&batch);
+    return fresult;
+}
+
+int replace_child_in_dentry(lcb_INSTANCE *instance, const char *dir_pkey, const char *child_name, uint64_t ino)
+{
+    int fresult = find_child_shard(instance, dir_pkey, child_name, set_child_in_shard, &ino);
+    IfFRErrorGotoDoneWithRef(dir_pkey);
+
+done:
+    return fresult;
+}
+
+typedef struct child_lookup {
+    uint64_t ino;           // inode number of the child (once it's found)
+    bool shards;            // also fetch the number of shards (only the directory entry has it)
+    uint32_t nshards;       // number of shards (zero unless they were fetched)
+} child_lookup;
+
+// Gets the inode number of a child from one shard (the context is a child_lookup).
+static int get_child_in_shard(lcb_INSTANCE *instance, const char *key, const char *child_name, void *context)
+{
+    int fresult = 0;
+    lcb_SUBDOCSPECS *specs = NULL;
+    sync_subdoc_result *result = NULL;
+    child_lookup *lookup = context;
+    size_t nspecs = lookup->shards ? 2 : 1;
+
+    char *path = child_path(child_name);
+    IfNULLGotoDoneWithRef(path, -ENOMEM, key);
+
+    lcb_STATUS rc = lcb_subdocspecs_create(&specs, nspecs);
+    IfLCBFailGotoDone(rc, -EIO);
+
+    rc = lcb_subdocspecs_get(specs, 0, 0, path, strlen(path));
+    IfLCBFailGotoDone(rc, -EIO);
+
+    if (lookup->shards) {
+        rc = lcb_subdocspecs_get(specs, 1, 0, DENTRY_SHARDS, strlen(DENTRY_SHARDS));
+        IfLCBFailGotoDone(rc, -EIO);
+    }
+
+    fresult = run_dentry_subdoc(instance, key, specs, 0, &result);
+    specs = NULL;
+    IfFRErrorGotoDoneWithRef(key);
+
+    if (result->status == LCB_ERR_DOCUMENT_NOT_FOUND) {
+        fresult = -ENOENT;
+        goto done;
+    }
+
+    // a missing path only shows up in the status of its entry
+    IfTrueGotoDoneWithRef((result->nentries < nspecs), -EIO, key);
+
+    // directories that were never split don't have the field
+    if (lookup->shards) {
+        size_t extra = 0;
+        if (result->entries[1].status != LCB_ERR_SUBDOC_PATH_NOT_FOUND) {
+            IfFalseGotoDoneWithRef(entry_to_size(&result->entries[1], &extra), -EIO, key);
+        }
+        lookup->nshards = (uint32_t)(extra + 1);
+    }
+
+    if (result->entries[0].status == LCB_ERR_SUBDOC_PATH_NOT_FOUND) {
+        fresult = -ENOENT;
+        goto done;
+    }
+    IfFalseGotoDoneWithRef(entry_to_inode(&result->entries[0], &lookup->ino), -EIO, key);
+
+done:
+    if (specs != NULL) {
+        lcb_subdocspecs_destroy(specs);
+    }
+    sync_subdoc_destroy(result);
+    free(path);
+    return fresult;
+}
+
+// A child that hashes to the directory entry is looked up along with the number of
+// shards so a missing child (the common case before a create) takes one round trip
+// unless the remembered number of shards was stale.
+int lookup_child(lcb_INSTANCE *instance, const char *dir_pkey, const char *child_name, uint64_t *ino)
+{
+    char key[MAX_KEY_LEN + 1];
+
+    uint32_t nshards = 1;
+    int fresult = get_dentry_shards(instance, dir_pkey, &nshards);
+    if (fresult != 0) {
+        goto done;
+    }
+
+    uint32_t shard = child_shard(child_name, nshards);
+    child_lookup lookup = { .ino = 0, .shards = (shard == 0), .nshards = 0 };
+
+    fresult = shard_key(dir_pkey, shard, key);
+    IfFRErrorGotoDoneWithRef(dir_pkey);
+
+    fresult = get_child_in_shard(instance, key, child_name, &lookup);
+    if (fresult == -ENOENT && lookup.nshards != 0) {
+        put_cached_shards(dir_pkey, lookup.nshards);
+        if (child_shard(child_name, lookup.nshards) == 0) {
+            goto done;
+        }
+    }
+
+    // the child can still be in a shard that its shard was split from
+    if (fresult == -ENOENT) {
+        lookup.shards = false;
+        fresult = walk_child_shards(instance, dir_pkey, child_name, shard, get_child_in_shard, &lookup);
+    }
+
+    if (fresult == 0) {
+        *ino = lookup.ino;
+    }
+
+done:
+    return fresult;
+}
+
+int set_dentry_parent(lcb_INSTANCE *instance, const char *dir_pkey, const char *parent_pkey)
+{
+    int fresult = 0;
+    lcb_SUBDOCSPECS *specs = NULL;
+    sync_subdoc_result *result = NULL;
+    char *value = NULL;
+    char key[MAX_KEY_LEN + 1];
+
+    fresult = shard_key(dir_pkey, 0, key);
+    IfFRErrorGotoDoneWithRef(dir_pkey);
+
+    // the value must be JSON so the key is quoted by cJSON
+    cJSON *parent_json = cJSON_CreateString(parent_pkey);
+    IfNULLGotoDoneWithRef(parent_json, -ENOMEM, dir_pkey);
+
+    value = cJSON_PrintUnformatted(parent_json);
+    cJSON_Delete(parent_json);
+    IfNULLGotoDoneWithRef(value, -ENOMEM, dir_pkey);
+
+    lcb_STATUS rc = lcb_subdocspecs_create(&specs, 1);
+    IfLCBFailGotoDone(rc, -EIO);
+
+    rc = lcb_subdocspecs_dict_upsert(specs, 0, 0, DENTRY_PAR_PATH, strlen(DENTRY_PAR_PATH), value, strlen(value));
+    IfLCBFailGotoDone(rc, -EIO);
+
+    fresult = run_dentry_subdoc(instance, key, specs, 0, &result);
+    specs = NULL;
+    IfFRErrorGotoDoneWithRef(dir_pkey);
+
+    IfLCBFailGotoDoneWithRef(subdoc_status(result), -ENOENT, dir_pkey);
+
+done:
+    if (specs != NULL) {
+        lcb_subdocspecs_destroy(specs);
+    }
+    sync_subdoc_destroy(result);
+    free(value);
+    return fresult;
+}
+
+static int batch_remove_dentry_key(sync_batch *batch, const char *key, sync_remove_result **result)
+{
+    int fresult = 0;
+
+    lcb_STATUS rc;
+    lcb_CMDREMOVE *cmd;
+
+    rc = lcb_cmdremove_create(&cmd);
+    IfLCBFailGotoDone(rc, -EIO);
+
+    rc = lcb_cmdremove_collection(
+        cmd,
+        DEFAULT_SCOPE_STRING, DEFAULT_SCOPE_STRLEN,
+        DENTRIES_COLLECTION_STRING, DENTRIES_COLLECTION_STRLEN);
+    IfLCBFailGotoDone(rc, -EIO);
+
+    rc = lcb_cmdremove_key(cmd, key, strlen(key));
+    IfLCBFailGotoDone(rc, -EIO);
+
+    rc = sync_batch_remove(batch, cmd, result);
+    IfLCBFailGotoDone(rc, -EIO);
+
+done:
+    return fresult;
+}
+
+// The shards are removed along with the directory entry. Their results aren't
+// checked because a shard may not have been created yet.
+int batch_remove_dentry(sync_batch *batch, const char *dir_pkey, sync_remove_result **result)
+{
+    uint32_t nshards = 1;
+    if (get_dentry_shards(batch->instance, dir_pkey, &nshards) != 0) {
+        nshards = 1;
+    }
+    remove_cached_shards(dir_pkey);
+
+    const char *dentry_key = NULL;
+    size_t ndentry_key = 0;
+    int fresult = batch_path_key(batch, dir_pkey, &dentry_key, &ndentry_key);
+    IfFRErrorGotoDoneWithRef(dir_pkey);
+
+    fresult = batch_remove_dentry_key(batch, dentry_key, result);
+    IfFRErrorGotoDoneWithRef(dir_pkey);
+
+    for (uint32_t shard = 1; shard < nshards; shard++) {
+        char *key = NULL;
+        fresult = batch_shard_key(batch, dir_pkey, shard, &key);
+        IfFRErrorGotoDoneWithRef(dir_pkey);
+
+        sync_remove_result *shard_result;
+        fresult = batch_remove_dentry_key(batch, key, &shard_result);
+        IfFRErrorGotoDoneWithRef(dir_pkey);
+    }
+
+done:
+    return fresult;
+}
+int remove_dentry_result(const char *dir_pkey, const sync_remove_result *result)
+{
+    int fresult = 0;
+
+    IfLCBFailGotoDoneWithRef(result->status, -ENOENT, dir_pkey);
+
+done:
+    return fresult;
+}
+
+int remove_dentry(lcb_INSTANCE *instance, const char *dir_pkey)
+{
+    sync_remove_result *result = NULL;
+
+    sync_batch batch;
+    sync_batch_init(&batch, instance);
+
+    int fresult = batch_remove_dentry(&batch, dir_pkey, &result);
+    IfFRErrorGotoDoneWithRef(dir_pkey);
+
+    lcb_STATUS rc = sync_batch_execute(&batch);
+
+    // first check the sync command result code
+    IfLCBFailGotoDone(rc, -EIO);
+
+    // now check the actual result status
+    fresult = remove_dentry_result(dir_pkey, result);
+
+done:
+    sync_batch_destroy(&batch);
+    return fresult;
+}
+
+// Queues the removal of a child from one shard (the key has to live until the batch is executed).
+static int batch_remove_child_from_shard(sync_batch *batch, const char *key, const char *child_name, sync_subdoc_result **result)
+{
+    int fresult = 0;
+    lcb_SUBDOCSPECS *specs = NULL;
+
+    char *path = NULL;
+    fresult = batch_child_path(batch, child_name, &path);
+    IfFRErrorGotoDoneWithRef(key);
+
+    lcb_STATUS rc = lcb_subdocspecs_create(&specs, 2);
+    IfLCBFailGotoDone(rc, -EIO);
+
+    rc = lcb_subdocspecs_remove(specs, 0, 0, path, strlen(path));
+    IfLCBFailGotoDone(rc, -EIO);
+
+    rc = lcb_subdocspecs_counter(specs, 1, 0, DENTRY_COUNT, strlen(DENTRY_COUNT), -1);
+    IfLCBFailGotoDone(rc, -EIO);
+
+    fresult = batch_shard_subdoc(batch, key, specs, result);
+    specs = NULL;
+    IfFRErrorGotoDoneWithRef(key);
+
+done:
+    if (specs != NULL) {
+        lcb_subdocspecs_destroy(specs);
+    }
+    return fresult;
+}
+
+// Checks the removal of a child from one shard (-ENOENT when the child isn't in the shard).
+static int remove_child_from_shard_result(lcb_INSTANCE *instance, const char *key, const sync_subdoc_result *result)
+{
+    int fresult = 0;
+
+    lcb_STATUS status = subdoc_status(result);
+    if (status == LCB_ERR_DOCUMENT_NOT_FOUND || status == LCB_ERR_SUBDOC_PATH_NOT_FOUND) {
+        fresult = -ENOENT;
+        goto done;
+    }
+    IfLCBFailGotoDoneWithRef(status, -EIO, key);
+
+    // the child is gone so a count that can't be fixed only stays wrong for now
+    size_t nchildren = 0;
+    if (result->nentries < 2 || !entry_to_size(&result->entries[1], &nchildren)) {
+        seed_shard_count(instance, key, &nchildren);
+    }
+
+done:
+    return fresult;
+}
+
+// Removes a child from one shard (the context isn't used).
+static int remove_child_from_shard(lcb_INSTANCE *instance, const char *key, const char *child_name, void *context)
+{
+    (void)context;
+    sync_subdoc_result *result = NULL;
+
+    sync_batch batch;
+    sync_batch_init(&batch, instance);
+
+    int fresult = batch_remove_child_from_shard(&batch, key, child_name, &result);
+    IfFRErrorGotoDoneWithRef(key);
+
+    lcb_STATUS rc = sync_batch_execute(&batch);
+    IfLCBFailGotoDone(rc, -EIO);
+
+    fresult = remove_child_from_shard_result(instance, key, result);
+
+done:
+    sync_batch_destroy(&batch);
+    return fresult;
+}
+
+// The child is removed by name so no lookup is needed first.
+int batch_remove_child_from_dentry(sync_batch *batch, const char *dir_pkey, const char *child_name, dentry_shard_result *result)
+{
+    uint32_t nshards = 1;
+    int fresult = get_dentry_shards(batch->instance, dir_pkey, &nshards);
+    IfFRErrorGotoDoneWithRef(dir_pkey);
+
+    result->shard = child_shard(child_name, nshards);
+
+    char *key = NULL;
+    fresult = batch_shard_key(batch, dir_pkey, result->shard, &key);
+    IfFRErrorGotoDoneWithRef(dir_pkey);
+
+    fresult = batch_remove_child_from_shard(batch, key, child_name, &result->result);
+    IfFRErrorGotoDoneWithRef(dir_pkey);
+
+done:
+    return fresult;
+}
+
+int remove_child_from_dentry_result(lcb_INSTANCE *instance, const char *dir_pkey, const char *child_name, const dentry_shard_result *result)
+{
+    char key[MAX_KEY_LEN + 1];
+
+    int fresult = shard_key(dir_pkey, result->shard, key);
+    IfFRErrorGotoDoneWithRef(dir_pkey);
+
+    fresult = remove_child_from_shard_result(instance, key, result->result);
+
+    // the child can still be in a shard that its shard was split from
+    if (fresult == -ENOENT) {
+        fresult = walk_child_shards(instance, dir_pkey, child_name, result->shard, remove_child_from_shard, NULL);
+    }
+    IfFRErrorGotoDoneWithRef(dir_pkey);
+
+done:
+    return fresult;
+}
+
+int remove_child_from_dentry(lcb_INSTANCE *instance, const char *dir_pkey, const char *child_name)
+{
+    int fresult = find_child_shard(instance, dir_pkey, child_name, remove_child_from_shard, NULL);
+    IfFRErrorGotoDoneWithRef(dir_pkey);
+
+done:
+    return fresult;
+}
+
+// Reports the children of one shard until the callback asks to stop (or fails).
+static int report_children(const char *dir_pkey, const sync_get_result *result, dentry_child_callback callback, void *context, bool *stop)
+{
+    dentry_reader reader;
+    int fresult = dentry_reader_document(&reader, result->value, result->nvalue);
+    IfFRErrorGotoDoneWithRef(dir_pkey);
+
+    const char *child_name;
+    uint64_t ino;
+    while ((fresult = dentry_reader_next(&reader, &child_name, &ino)) == 1) {
+        int cresult = callback(context, child_name, ino);
+        if (cresult != 0) {
+            *stop = true;
+            fresult = (cresult < 0) ? cresult : 0;
+            goto done;
+        }
+    }
+    IfFRErrorGotoDoneWithRef(dir_pkey);
+
+done:
+    return fresult;
+}
+
+int read_dentry_children(lcb_INSTANCE *instance, const char *dir_pkey, dentry_child_callback callback, void *context)
+{
+    sync_get_result *result = NULL;
+    bool stop = false;
+
+    sync_batch batch;
+    sync_batch_init(&batch, instance);
+
+    // the directory entry is the first shard and knows how many shards there are
+    const char *dentry_key = NULL;
+    size_t ndentry_key = 0;
+    int fresult = batch_path_key(&batch, dir_pkey, &dentry_key, &ndentry_key);
+    IfFRErrorGotoDoneWithRef(dir_pkey);
+
+    fresult = batch_get_dentry_key(&batch, dentry_key, &result);
+    IfFRErrorGotoDoneWithRef(dir_pkey);
+
+    lcb_STATUS rc = sync_batch_execute(&batch);
+    IfLCBFailGotoDone(rc, -EIO);
+    IfLCBFailGotoDoneWithRef(result->status, -ENOENT, dir_pkey);
+
+    size_t extra = 0;
+    fresult = dentry_reader_number(result->value, result->nvalue, DENTRY_SHARDS, &extra);
+    IfFRErrorGotoDoneWithRef(dir_pkey);
+
+    uint32_t nshards = (uint32_t)(extra + 1);
+    put_cached_shards(dir_pkey, nshards);
+
+    fresult = report_children(dir_pkey, result, callback, context, &stop);
+    IfFRErrorGotoDoneWithRef(dir_pkey);
+
+    // the other shards are fetched a batch at a time and reported in order
+    for (uint32_t first = 1; first < nshards && !stop; first += DENTRY_SHARD_BATCH_LEN) {
+        uint32_t nbatch = nshards - first;
+        if (nbatch > DENTRY_SHARD_BATCH_LEN) {
+            nbatch = DENTRY_SHARD_BATCH_LEN;
+        }
+
+        sync_batch_destroy(&batch);
+        sync_batch_init(&batch, instance);
+
+        sync_get_result *results[DENTRY_SHARD_BATCH_LEN];
+        for (uint32_t i = 0; i < nbatch; i++) {
+            char *key = NULL;
+            fresult = batch_shard_key(&batch, dir_pkey, first + i, &key);
+            IfFRErrorGotoDoneWithRef(dir_pkey);
+
+            fresult = batch_get_dentry_key(&batch, key, &results[i]);
+            IfFRErrorGotoDoneWithRef(key);
+        }
+
+        rc = sync_batch_execute(&batch);
+        IfLCBFailGotoDone(rc, -EIO);
+
+        for (uint32_t i = 0; i < nbatch && !stop; i++) {
+            // a shard that a split hasn't created yet has no children
+            if (results[i]->status == LCB_ERR_DOCUMENT_NOT_FOUND) {
+                continue;
+            }
+            IfLCBFailGotoDoneWithRef(results[i]->status, -EIO, dir_pkey);
+
+            fresult = report_children(dir_pkey, results[i], callback, context, &stop);
+            IfFRErrorGotoDoneWithRef(dir_pkey);
+        }
+    }
+
+done:
+    sync_batch_destroy(&batch);
+    return fresult;
+}
+
+// Directory entries that predate inodes are keyed by their paths and list the names
+// of their children in "c" (and are never sharded). They are only read to migrate them.
+int read_legacy_children(lcb_INSTANCE *instance, const char *dir_path, dentry_child_callback callback, void *context)
+{
+    int fresult = 0;
+    lcb_SUBDOCSPECS *specs = NULL;
+    sync_subdoc_result *result = NULL;
+    cJSON *children = NULL;
+
+    lcb_STATUS rc = lcb_subdocspecs_create(&specs, 1);
+    IfLCBFailGotoDone(rc, -EIO);
+
+    rc = lcb_subdocspecs_get(specs, 0, 0, DENTRY_CHILDREN, strlen(DENTRY_CHILDREN));
+    IfLCBFailGotoDone(rc, -EIO);
+
+    fresult = run_dentry_subdoc(instance, dir_path, specs, 0, &result);
+    specs = NULL;
+    IfFRErrorGotoDoneWithRef(dir_path);
+
+    IfTrueGotoDoneWithRef((result->status == LCB_ERR_DOCUMENT_NOT_FOUND), -ENOENT, dir_path);
+
+    // a directory entry that was already migrated has no names left
+    lcb_STATUS status = subdoc_status(result);
+    if (status == LCB_ERR_SUBDOC_PATH_NOT_FOUND) {
+        goto done;
+    }
+    IfLCBFailGotoDoneWithRef(status, -EIO, dir_path);
+
+    children = cJSON_ParseWithLength(result->entries[0].value, result->entries[0].nvalue);
+    IfFalseGotoDoneWithRef(cJSON_IsArray(children), -EIO, dir_path);
+
+    const cJSON *child;
+    cJSON_ArrayForEach(child, children) {
+        if (!cJSON_IsString(child)) {
+            continue;
+        }
+
+        int cresult = callback(context, child->valuestring, 0);
+        if (cresult != 0) {
+            fresult = (cresult < 0) ? cresult : 0;
+            goto done;
+        }
+    }
+
+done:
+    if (specs != NULL) {
+        lcb_subdocspecs_destroy(specs);
+    }
+    cJSON_Delete(children);
+    sync_subdoc_destroy(result);
+    return fresult;
+}
+
+// Drops the names of a directory entry that predates inodes once its children were added by inode.
+int remove_legacy_children(lcb_INSTANCE *instance, const char *dir_pkey)
+{
+    int fresult = 0;
+    lcb_SUBDOCSPECS *specs = NULL;
+    sync_subdoc_result *result = NULL;
+
+    lcb_STATUS rc = lcb_subdocspecs_create(&specs, 1);
+    IfLCBFailGotoDone(rc, -EIO);
+
+    rc = lcb_subdocspecs_remove(specs, 0, 0, DENTRY_CHILDREN, strlen(DENTRY_CHILDREN));
+    IfLCBFailGotoDone(rc, -EIO);
+
+    fresult = run_dentry_subdoc(instance, dir_pkey, specs, 0, &result);
+    specs = NULL;
+    IfFRErrorGotoDoneWithRef(dir_pkey);
+
+    lcb_STATUS status = subdoc_status(result);
+    if (status != LCB_ERR_SUBDOC_PATH_NOT_FOUND) {
+        IfLCBFailGotoDoneWithRef(status, -EIO, dir_pkey);
+    }
+
+done:
+    if (specs != NULL) {
+        lcb_subdocspecs_destroy(specs);
+    }
+    sync_subdoc_destroy(result);
+    return fresult;
+}
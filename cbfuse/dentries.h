@@ -18,13 +18,56 @@
 #ifndef CBFUSE_DENTRIES_HEADER_SEEN
 #define CBFUSE_DENTRIES_HEADER_SEEN
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <libcouchbase/couchbase.h>
 #include <cjson/cJSON.h>
 
-int add_new_dentry(lcb_INSTANCE *instance, const char *dir_pkey, const char *dir_path, const char *parent_path);
-int get_dentry_json(lcb_INSTANCE *instance, const char *dir_pkey, cJSON **dentry_json);
-int add_child_to_dentry(lcb_INSTANCE *instance, const char *dir_pkey, const char *child_name);
+#include "sync_batch.h"
+
+typedef struct dentry_shard_result {
+    uint32_t shard;                 // shard of the directory entry that the child hashes to
+    sync_subdoc_result *result;     // result of the shard operation (owned by the batch)
+} dentry_shard_result;
+
+// called with each child name and inode number by read_dentry_children
+// (return zero to continue, a positive value to stop, or a negative error code to fail)
+typedef int (*dentry_child_callback)(void *context, const char *child_name, uint64_t ino);
+
+// directory entries are keyed like stats (the root path or the key of the inode)
+int add_new_dentry(lcb_INSTANCE *instance, const char *dir_pkey, const char *parent_pkey);
+int add_child_to_dentry(lcb_INSTANCE *instance, const char *dir_pkey, const char *child_name, uint64_t ino);
 int remove_dentry(lcb_INSTANCE *instance, const char *dir_pkey);
 int remove_child_from_dentry(lcb_INSTANCE *instance, const char *dir_pkey, const char *child_name);
 
+// points an existing child at another inode (e.g., when a rename replaces it)
+int replace_child_in_dentry(lcb_INSTANCE *instance, const char *dir_pkey, const char *child_name, uint64_t ino);
+
+// finds the inode number of a child (-ENOENT if there's no such child)
+int lookup_child(lcb_INSTANCE *instance, const char *dir_pkey, const char *child_name, uint64_t *ino);
+
+// records the new parent of a directory that was moved
+int set_dentry_parent(lcb_INSTANCE *instance, const char *dir_pkey, const char *parent_pkey);
+
+// reports the children of every shard in order
+int read_dentry_children(lcb_INSTANCE *instance, const char *dir_pkey, dentry_child_callback callback, void *context);
+
+// reports the names of the children of a directory entry that predates inodes (with an inode number of 0)
+int read_legacy_children(lcb_INSTANCE *instance, const char *dir_path, dentry_child_callback callback, void *context);
+// drops those names once the children were added by inode
+int remove_legacy_children(lcb_INSTANCE *instance, const char *dir_pkey);
+
+// frees the remembered number of shards of each directory
+void dentry_shards_destroy(void);
+
+// batched variants (queue the command, execute the batch, then check the result)
+int batch_add_new_dentry(sync_batch *batch, const char *dir_pkey, const char *parent_pkey, sync_store_result **result);
+int add_new_dentry_result(const char *dir_pkey, const sync_store_result *result);
+int batch_remove_dentry(sync_batch *batch, const char *dir_pkey, sync_remove_result **result);
+int remove_dentry_result(const char *dir_pkey, const sync_remove_result *result);
+int batch_add_child_to_dentry(sync_batch *batch, const char *dir_pkey, const char *child_name, uint64_t ino, dentry_shard_result *result);
+int add_child_to_dentry_result(lcb_INSTANCE *instance, const char *dir_pkey, const char *child_name, uint64_t ino, const dentry_shard_result *result, bool *added);
+int batch_remove_child_from_dentry(sync_batch *batch, const char *dir_pkey, const char *child_name, dentry_shard_result *result);
+int remove_child_from_dentry_result(lcb_INSTANCE *instance, const char *dir_pkey, const char *child_name, const dentry_shard_result *result);
+
 #endif /* !CBFUSE_DENTRIES_HEADER_SEEN */
@@ -0,0 +1,374 @@
+/*
+ * cbfuse implements a FUSE file-system using Couchbase as the data store.
+ * Copyright (c) 2021 Raymond Cardillo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "dentry_reader.h"
+#include "common.h"
+
+// Listing a directory used to parse every shard into a cJSON tree, which costs
+// several allocations and a linked list node per child. Directory entries only
+// need a few top-level fields and the child names (with their inode numbers) so
+// they are read directly out of the fetched value instead. Each name is copied (and unescaped) into a fixed
+// buffer in the reader so nothing is allocated per child.
+
+static const char *skip_space(const char *pos, const char *end)
+{
+    while (pos < end && (*pos == ' ' || *pos == '\t' || *pos == '\n' || *pos == '\r')) {
+        pos++;
+    }
+    return pos;
+}
+
+// Returns the position after the closing quote of the string at pos (or NULL).
+static const char *skip_string(const char *pos, const char *end)
+{
+    for (pos++; pos < end; pos++) {
+        if (*pos == '\\') {
+            pos++;
+        } else if (*pos == '"') {
+            return pos + 1;
+        }
+    }
+    return NULL;
+}
+
+// Returns the position after the value at pos (or NULL).
+static const char *skip_value(const char *pos, const char *end)
+{
+    if (pos >= end) {
+        return NULL;
+    }
+
+    if (*pos == '"') {
+        return skip_string(pos, end);
+    }
+
+    if (*pos == '[' || *pos == '{') {
+        int depth = 0;
+        while (pos < end) {
+            if (*pos == '"') {
+                pos = skip_string(pos, end);
+                if (pos == NULL) {
+                    return NULL;
+                }
+                continue;
+            }
+
+            if (*pos == '[' || *pos == '{') {
+                depth++;
+            } else if (*pos == ']' || *pos == '}') {
+                if (--depth == 0) {
+                    return pos + 1;
+                }
+            }
+            pos++;
+        }
+        return NULL;
+    }
+
+    // numbers and literals end at the next delimiter
+    while (pos < end && *pos != ',' && *pos != '}' && *pos != ']' &&
+        *pos != ' ' && *pos != '\t' && *pos != '\n' && *pos != '\r') {
+        pos++;
+    }
+    return pos;
+}
+
+// Finds the value of a top-level field. Returns zero and sets *found to NULL if it's missing.
+static int find_field(const char *value, size_t nvalue, const char *field, const char **found)
+{
+    const char *end = value + nvalue;
+    const char *pos = skip_space(value, end);
+    size_t nfield = strlen(field);
+    *found = NULL;
+
+    if (pos >= end || *pos != '{') {
+        return -EIO;
+    }
+    pos = skip_space(pos + 1, end);
+
+    while (pos < end && *pos != '}') {
+        // field names are plain ASCII so they are compared without unescaping
+        if (*pos != '"') {
+            return -EIO;
+        }
+        const char *key = pos + 1;
+        pos = skip_string(pos, end);
+        if (pos == NULL) {
+            return -EIO;
+        }
+        bool match = ((size_t)(pos - 1 - key) == nfield && memcmp(key, field, nfield) == 0);
+
+        pos = skip_space(pos, end);
+        if (pos >= end || *pos != ':') {
+            return -EIO;
+        }
+        pos = skip_space(pos + 1, end);
+
+        if (match) {
+            *found = pos;
+            return 0;
+        }
+
+        pos = skip_value(pos, end);
+        if (pos == NULL) {
+            return -EIO;
+        }
+
+        pos = skip_space(pos, end);
+        if (pos >= end) {
+            return -EIO;
+        }
+        if (*pos == ',') {
+            pos = skip_space(pos + 1, end);
+        }
+    }
+
+    return 0;
+}
+
+int dentry_reader_document(dentry_reader *reader, const char *value, size_t nvalue)
+{
+    const char *children = NULL;
+    int fresult = find_field(value, nvalue, DENTRY_INODES, &children);
+    if (fresult != 0) {
+        return fresult;
+    }
+
+    if (children == NULL) {
+        reader->pos = reader->end = value + nvalue;
+        return 0;
+    }
+
+    return dentry_reader_object(reader, children, (value + nvalue) - children);
+}
+
+int dentry_reader_object(dentry_reader *reader, const char *value, size_t nvalue)
+{
+    reader->end = value + nvalue;
+    reader->pos = skip_space(value, reader->end);
+
+    if (reader->pos >= reader->end || *reader->pos != '{') {
+        return -EIO;
+    }
+
+    reader->pos++;
+    return 0;
+}
+
+static int hex_digit(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+// Reads the four hex digits of a \u escape (pos is at the 'u').
+static bool read_code_unit(const char *pos, const char *end, uint32_t *unit)
+{
+    if (end - pos < 5) {
+        return false;
+    }
+
+    *unit = 0;
+    for (int i = 1; i <= 4; i++) {
+        int digit = hex_digit(pos[i]);
+        if (digit < 0) {
+            return false;
+        }
+        *unit = (*unit << 4) | digit;
+    }
+    return true;
+}
+
+// Appends a code point as UTF-8. Returns the number of bytes (zero if there isn't room).
+static size_t put_utf8(char *out, size_t room, uint32_t cp)
+{
+    if (cp < 0x80 && room >= 1) {
+        out[0] = (char)cp;
+        return 1;
+    }
+    if (cp < 0x800 && room >= 2) {
+        out[0] = (char)(0xC0 | (cp >> 6));
+        out[1] = (char)(0x80 | (cp & 0x3F));
+        return 2;
+    }
+    if (cp < 0x10000 && room >= 3) {
+        out[0] = (char)(0xE0 | (cp >> 12));
+        out[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        out[2] = (char)(0x80 | (cp & 0x3F));
+        return 3;
+    }
+    if (cp < 0x110000 && room >= 4) {
+        out[0] = (char)(0xF0 | (cp >> 18));
+        out[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+        out[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        out[3] = (char)(0x80 | (cp & 0x3F));
+        return 4;
+    }
+    return 0;
+}
+
+// Reads (and unescapes) the string at pos into the name buffer. Returns the position
+// after the closing quote (or NULL if the string is malformed or too long).
+static const char *read_name(dentry_reader *reader, const char *pos, const char *end)
+{
+    size_t nname = 0;
+    for (pos++; pos < end && *pos != '"'; pos++) {
+        if (nname == DENTRY_READER_NAME_LEN) {
+            return NULL;
+        }
+
+        if (*pos != '\\') {
+            reader->name[nname++] = *pos;
+            continue;
+        }
+
+        if (++pos >= end) {
+            return NULL;
+        }
+
+        uint32_t cp = 0;
+        switch (*pos) {
+            case '"':  cp = '"';  break;
+            case '\\': cp = '\\'; break;
+            case '/':  cp = '/';  break;
+            case 'b':  cp = '\b'; break;
+            case 'f':  cp = '\f'; break;
+            case 'n':  cp = '\n'; break;
+            case 'r':  cp = '\r'; break;
+            case 't':  cp = '\t'; break;
+            case 'u':
+                if (!read_code_unit(pos, end, &cp)) {
+                    return NULL;
+                }
+                pos += 4;
+
+                // a high surrogate is combined with the low surrogate that follows it
+                uint32_t low;
+                if (cp >= 0xD800 && cp <= 0xDBFF && end - pos > 2 && pos[1] == '\\' &&
+                    read_code_unit(pos + 2, end, &low) && low >= 0xDC00 && low <= 0xDFFF) {
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                    pos += 6;
+                }
+                break;
+            default:
+                return NULL;
+        }
+
+        size_t n = put_utf8(reader->name + nname, DENTRY_READER_NAME_LEN - nname, cp);
+        if (n == 0) {
+            return NULL;
+        }
+        nname += n;
+    }
+
+    if (pos >= end) {
+        return NULL;
+    }
+
+    reader->name[nname] = '\0';
+    return pos + 1;
+}
+
+int dentry_reader_next(dentry_reader *reader, const char **child_name, uint64_t *ino)
+{
+    const char *end = reader->end;
+    const char *pos = skip_space(reader->pos, end);
+
+    while (true) {
+        if (pos < end && *pos == ',') {
+            pos = skip_space(pos + 1, end);
+        }
+        if (pos >= end || *pos == '}') {
+            reader->pos = end;
+            return 0;
+        }
+
+        if (*pos != '"') {
+            return -EIO;
+        }
+
+        pos = read_name(reader, pos, end);
+        if (pos == NULL) {
+            return -EIO;
+        }
+
+        pos = skip_space(pos, end);
+        if (pos >= end || *pos != ':') {
+            return -EIO;
+        }
+        pos = skip_space(pos + 1, end);
+
+        const char *digits = pos;
+        uint64_t n = 0;
+        while (pos < end && *pos >= '0' && *pos <= '9') {
+            n = (n * 10) + (uint64_t)(*pos - '0');
+            pos++;
+        }
+
+        // anything other than an inode number (which isn't expected) is skipped
+        if (pos == digits) {
+            pos = skip_value(pos, end);
+            if (pos == NULL) {
+                return -EIO;
+            }
+            pos = skip_space(pos, end);
+            continue;
+        }
+
+        reader->pos = pos;
+        *child_name = reader->name;
+        *ino = n;
+        return 1;
+    }
+}
+
+int dentry_reader_number(const char *value, size_t nvalue, const char *field, size_t *number)
+{
+    const char *found = NULL;
+    int fresult = find_field(value, nvalue, field, &found);
+    if (fresult != 0 || found == NULL) {
+        return fresult;
+    }
+
+    const char *end = value + nvalue;
+    size_t n = 0;
+    const char *pos = found;
+    while (pos < end && *pos >= '0' && *pos <= '9') {
+        n = (n * 10) + (*pos - '0');
+        pos++;
+    }
+
+    if (pos == found) {
+        return -EIO;
+    }
+
+    *number = n;
+    return 0;
+}
@@ -0,0 +1,75 @@
+/*
+ * cbfuse implements a FUSE file-system using Couchbase as the data store.
+ * Copyright (c) 2021 Raymond Cardillo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CBFUSE_DENTRY_READER_HEADER_SEEN
+#define CBFUSE_DENTRY_READER_HEADER_SEEN
+
+#include <stdint.h>
+#include <stdlib.h>
+
+// longest child name (in bytes) that can be read
+#define DENTRY_READER_NAME_LEN  1024
+
+typedef struct dentry_reader {
+    const char *pos;                        // next character of the children object
+    const char *end;                        // end of the value being read
+    char name[DENTRY_READER_NAME_LEN + 1];  // the last child name that was read
+} dentry_reader;                            // reads children straight out of a fetched value
+
+/**
+ * Positions the reader at the children of a directory entry (or shard) document.
+ * A document without children is read as an empty object.
+ *
+ * @param reader    reader to position
+ * @param value     JSON value of the document (it must outlive the reader)
+ * @param nvalue    length of the value
+ * @return zero on success or -EIO if the value isn't a document
+ */
+int dentry_reader_document(dentry_reader *reader, const char *value, size_t nvalue);
+
+/**
+ * Positions the reader at a children object (e.g., the result of a sub-document lookup).
+ *
+ * @param reader    reader to position
+ * @param value     JSON object of child names and inode numbers (it must outlive the reader)
+ * @param nvalue    length of the value
+ * @return zero on success or -EIO if the value isn't an object
+ */
+int dentry_reader_object(dentry_reader *reader, const char *value, size_t nvalue);
+
+/**
+ * Reads the next child. The name is only valid until the next call.
+ *
+ * @param reader        reader to read from
+ * @param child_name    receives the child name
+ * @param ino           receives the inode number of the child
+ * @return one if a child was read, zero at the end, or -EIO if the value is malformed
+ */
+int dentry_reader_next(dentry_reader *reader, const char **child_name, uint64_t *ino);
+
+/**
+ * Reads a non-negative number field of a directory entry document.
+ *
+ * @param value     JSON value of the document
+ * @param nvalue    length of the value
+ * @param field     name of the field
+ * @param number    receives the number (unchanged if the field is missing)
+ * @return zero on success or -EIO if the value isn't a document or the field isn't a number
+ */
+int dentry_reader_number(const char *value, size_t nvalue, const char *field, size_t *number);
+
+#endif /* !CBFUSE_DENTRY_READER_HEADER_SEEN */
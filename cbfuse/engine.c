@@ -0,0 +1,363 @@
+/*
+ * cbfuse implements a FUSE file-system using Couchbase as the data store.
+ * Copyright (c) 2021 Raymond Cardillo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <event2/event.h>
+#include <libcouchbase/couchbase.h>
+
+#include "util.h"
+#include "engine.h"
+
+// The sync helpers used to schedule one command and then block in lcb_wait, which left
+// the connection idle for every round trip. Instead, a dedicated thread owns the instance
+// and its event loop. FUSE threads push requests onto a lock-free queue, poke the loop
+// through a pipe, and block until the response callbacks have completed every operation.
+
+typedef struct engine_request {
+    _Atomic(struct engine_request*) next;   // queue link
+    engine_op *ops;                         // operations to schedule
+    size_t nops;                            // number of operations
+    size_t npending;                        // operations still in flight (event loop thread only)
+    bool done;                              // set once every operation has completed
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} engine_request;
+
+struct lcb_engine {
+    struct event_base *base;                // event base driven by the loop thread
+    struct event *wakeup;                   // read side of the wakeup pipe
+    lcb_io_opt_t io;                        // libevent IO plugin bound to the event base
+    lcb_INSTANCE *instance;                 // instance owned by the engine
+    pthread_t thread;                       // event loop thread
+    bool started;                           // true once the loop thread is running
+    int fds[2];                             // wakeup pipe
+
+    // intrusive MPSC queue (producers push at the head, the loop thread pops at the tail)
+    _Atomic(engine_request*) head;
+    engine_request *tail;
+    engine_request stub;
+
+    atomic_bool signaled;                   // coalesces wakeups while the loop is behind
+    atomic_bool stopping;                   // asks the loop thread to exit
+};
+
+/////
+
+static void queue_push(lcb_engine *engine, engine_request *request)
+{
+    atomic_store_explicit(&request->next, NULL, memory_order_relaxed);
+    engine_request *prev = atomic_exchange_explicit(&engine->head, request, memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, request, memory_order_release);
+}
+
+// Only called from the event loop thread.
+static engine_request *queue_pop(lcb_engine *engine)
+{
+    engine_request *tail = engine->tail;
+    engine_request *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+    if (tail == &engine->stub) {
+        if (next == NULL) {
+            return NULL;
+        }
+        engine->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    }
+
+    if (next != NULL) {
+        engine->tail = next;
+        return tail;
+    }
+
+    // a producer has swapped the head but not linked it yet (it will wake us again)
+    if (tail != atomic_load_explicit(&engine->head, memory_order_acquire)) {
+        return NULL;
+    }
+
+    queue_push(engine, &engine->stub);
+
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next != NULL) {
+        engine->tail = next;
+        return tail;
+    }
+
+    return NULL;
+}
+
+static void wake(lcb_engine *engine)
+{
+    // only the first producer after the loop has drained the queue needs to write
+    if (!atomic_exchange(&engine->signaled, true)) {
+        char c = 0;
+        while (write(engine->fds[1], &c, 1) < 0 && errno == EINTR) {}
+    }
+}
+
+/////
+
+static void schedule_op(lcb_engine *engine, engine_op *op)
+{
+    lcb_STATUS rc = LCB_ERR_INVALID_ARGUMENT;
+
+    switch (op->type) {
+    case ENGINE_OP_GET:
+        rc = lcb_get(engine->instance, op->cookie, op->cmd.get);
+        lcb_cmdget_destroy(op->cmd.get);
+        break;
+    case ENGINE_OP_STORE:
+        rc = lcb_store(engine->instance, op->cookie, op->cmd.store);
+        lcb_cmdstore_destroy(op->cmd.store);
+        break;
+    case ENGINE_OP_REMOVE:
+        rc = lcb_remove(engine->instance, op->cookie, op->cmd.remove);
+        lcb_cmdremove_destroy(op->cmd.remove);
+        break;
+    case ENGINE_OP_SUBDOC:
+        rc = lcb_subdoc(engine->instance, op->cookie, op->cmd.subdoc);
+        lcb_cmdsubdoc_destroy(op->cmd.subdoc);
+        lcb_subdocspecs_destroy(op->specs);
+        break;
+    case ENGINE_OP_COUNTER:
+        rc = lcb_counter(engine->instance, op->cookie, op->cmd.counter);
+        lcb_cmdcounter_destroy(op->cmd.counter);
+        break;
+    }
+
+    // no callback will arrive for a command that could not be scheduled
+    if (rc != LCB_SUCCESS) {
+        fprintf(stderr, "  engine:schedule: %s\n", lcb_strerror_short(rc));
+        op->rc = rc;
+        engine_complete(op);
+    }
+}
+
+static void wakeup_callback(evutil_socket_t fd, __unused short events, void *arg)
+{
+    lcb_engine *engine = arg;
+
+    char buf[64];
+    while (read(fd, buf, sizeof(buf)) > 0) {}
+
+    // reset before draining so a push that races with the drain wakes us again
+    atomic_exchange(&engine->signaled, false);
+
+    if (atomic_load(&engine->stopping)) {
+        event_base_loopbreak(engine->base);
+        return;
+    }
+
+    // everything that is queued goes out in a single scheduling window
+    lcb_sched_enter(engine->instance);
+
+    engine_request *request;
+    while ((request = queue_pop(engine)) != NULL) {
+        // An op that can't be scheduled completes right away and if it's the last one the waiting
+        // thread returns and its request is gone. That can only happen to the last op (the others
+        // are still pending) so the request isn't read again once the loop has reached it.
+        engine_op *ops = request->ops;
+        size_t nops = request->nops;
+        for (size_t i = 0; i < nops; i++) {
+            schedule_op(engine, &ops[i]);
+        }
+    }
+
+    lcb_sched_leave(engine->instance);
+}
+
+static void *engine_loop(void *data)
+{
+    lcb_engine *engine = data;
+    event_base_loop(engine->base, 0);
+    return NULL;
+}
+
+/////
+
+lcb_STATUS engine_create(lcb_engine **engine)
+{
+    lcb_STATUS fresult = LCB_SUCCESS;
+
+    *engine = NULL;
+    lcb_engine *new_engine = calloc(1, sizeof(lcb_engine));
+    IfNULLGotoDoneWithRef(new_engine, LCB_ERR_NO_MEMORY, "engine");
+
+    new_engine->fds[0] = -1;
+    new_engine->fds[1] = -1;
+    new_engine->tail = &new_engine->stub;
+    atomic_init(&new_engine->head, &new_engine->stub);
+    atomic_init(&new_engine->stub.next, NULL);
+    atomic_init(&new_engine->signaled, false);
+    atomic_init(&new_engine->stopping, false);
+    *engine = new_engine;
+
+    new_engine->base = event_base_new();
+    IfNULLGotoDoneWithRef(new_engine->base, LCB_ERR_NO_MEMORY, "event_base_new");
+
+    IfTrueGotoDoneWithRef((pipe(new_engine->fds) != 0), LCB_ERR_SDK_INTERNAL, "pipe");
+    for (int i = 0; i < 2; i++) {
+        int flags = fcntl(new_engine->fds[i], F_GETFL);
+        IfTrueGotoDoneWithRef(
+            (flags < 0 || fcntl(new_engine->fds[i], F_SETFL, flags | O_NONBLOCK) != 0),
+            LCB_ERR_SDK_INTERNAL,
+            "fcntl"
+        );
+    }
+
+    new_engine->wakeup = event_new(new_engine->base, new_engine->fds[0], EV_READ | EV_PERSIST, wakeup_callback, new_engine);
+    IfNULLGotoDoneWithRef(new_engine->wakeup, LCB_ERR_NO_MEMORY, "event_new");
+    IfTrueGotoDoneWithRef((event_add(new_engine->wakeup, NULL) != 0), LCB_ERR_SDK_INTERNAL, "event_add");
+
+    struct lcb_create_io_ops_st io_options = {0};
+    io_options.version = 0;
+    io_options.v.v0.type = LCB_IO_OPS_LIBEVENT;
+    io_options.v.v0.cookie = new_engine->base;
+    lcb_STATUS rc = lcb_create_io_ops(&new_engine->io, &io_options);
+    IfLCBFailGotoDoneWithRef(rc, rc, "lcb_create_io_ops");
+
+done:
+    return fresult;
+}
+
+lcb_io_opt_t engine_io(lcb_engine *engine)
+{
+    return engine->io;
+}
+
+lcb_STATUS engine_start(lcb_engine *engine, lcb_INSTANCE *instance)
+{
+    lcb_STATUS fresult = LCB_SUCCESS;
+
+    engine->instance = instance;
+    lcb_set_cookie(instance, engine);
+
+    IfTrueGotoDoneWithRef(
+        (pthread_create(&engine->thread, NULL, engine_loop, engine) != 0),
+        LCB_ERR_SDK_INTERNAL,
+        "pthread_create"
+    );
+    engine->started = true;
+
+done:
+    return fresult;
+}
+
+lcb_engine *engine_from_instance(lcb_INSTANCE *instance)
+{
+    return (lcb_engine*)lcb_get_cookie(instance);
+}
+
+lcb_STATUS engine_execute(lcb_engine *engine, engine_op *ops, size_t nops)
+{
+    if (nops == 0) {
+        return LCB_SUCCESS;
+    }
+
+    engine_request request = {
+        .ops = ops,
+        .nops = nops,
+        .npending = nops,
+        .done = false
+    };
+    pthread_mutex_init(&request.mutex, NULL);
+    pthread_cond_init(&request.cond, NULL);
+
+    for (size_t i = 0; i < nops; i++) {
+        ops[i].rc = LCB_SUCCESS;
+        ops[i].request = &request;
+    }
+
+    queue_push(engine, &request);
+    wake(engine);
+
+    pthread_mutex_lock(&request.mutex);
+    while (!request.done) {
+        pthread_cond_wait(&request.cond, &request.mutex);
+    }
+    pthread_mutex_unlock(&request.mutex);
+
+    pthread_cond_destroy(&request.cond);
+    pthread_mutex_destroy(&request.mutex);
+
+    for (size_t i = 0; i < nops; i++) {
+        if (ops[i].rc != LCB_SUCCESS) {
+            return ops[i].rc;
+        }
+    }
+
+    return LCB_SUCCESS;
+}
+
+void engine_complete(engine_op *op)
+{
+    if (op == NULL) {
+        return;
+    }
+
+    // the request lives on the waiting thread's stack so it must not be touched after signaling
+    engine_request *request = op->request;
+    if (--request->npending == 0) {
+        pthread_mutex_lock(&request->mutex);
+        request->done = true;
+        pthread_cond_signal(&request->cond);
+        pthread_mutex_unlock(&request->mutex);
+    }
+}
+
+void engine_destroy(lcb_engine *engine)
+{
+    if (engine == NULL) {
+        return;
+    }
+
+    if (engine->started) {
+        atomic_store(&engine->stopping, true);
+        atomic_store(&engine->signaled, false);
+        wake(engine);
+        pthread_join(engine->thread, NULL);
+    }
+
+    // the instance must go before the IO plugin and event base it was created with
+    if (engine->instance != NULL) {
+        lcb_destroy(engine->instance);
+    }
+    if (engine->io != NULL) {
+        lcb_destroy_io_ops(engine->io);
+    }
+    if (engine->wakeup != NULL) {
+        event_free(engine->wakeup);
+    }
+    if (engine->base != NULL) {
+        event_base_free(engine->base);
+    }
+    for (int i = 0; i < 2; i++) {
+        if (engine->fds[i] >= 0) {
+            close(engine->fds[i]);
+        }
+    }
+
+    free(engine);
+}
@@ -0,0 +1,109 @@
+/*
+ * cbfuse implements a FUSE file-system using Couchbase as the data store.
+ * Copyright (c) 2021 Raymond Cardillo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CBFUSE_ENGINE_HEADER_SEEN
+#define CBFUSE_ENGINE_HEADER_SEEN
+
+#include <libcouchbase/couchbase.h>
+
+typedef struct lcb_engine lcb_engine;   // an instance driven by its own event loop thread
+
+typedef enum engine_op_type {
+    ENGINE_OP_GET,
+    ENGINE_OP_STORE,
+    ENGINE_OP_REMOVE,
+    ENGINE_OP_SUBDOC,
+    ENGINE_OP_COUNTER
+} engine_op_type;
+
+typedef struct engine_op {
+    engine_op_type type;            // which command is being scheduled
+    union {
+        lcb_CMDGET *get;
+        lcb_CMDSTORE *store;
+        lcb_CMDREMOVE *remove;
+        lcb_CMDSUBDOC *subdoc;
+        lcb_CMDCOUNTER *counter;
+    } cmd;                          // command to schedule (destroyed once it has been scheduled)
+    lcb_SUBDOCSPECS *specs;         // specs used by a sub-document command (destroyed with it)
+    void *cookie;                   // cookie passed through to the response callback
+    lcb_STATUS rc;                  // status of scheduling the command
+    struct engine_request *request; // request the operation belongs to (set by the engine)
+} engine_op;                        // a single command submitted to the engine
+
+/**
+ * Creates an engine with its own event base and libevent IO plugin.
+ * The IO plugin must be used to create the instance that is given to engine_start.
+ *
+ * @param engine    receives the new engine
+ * @return LCB_SUCCESS if the event loop resources were created
+ */
+lcb_STATUS engine_create(lcb_engine **engine);
+
+/**
+ * Gets the IO plugin that must be used to create the engine instance.
+ *
+ * @param engine    engine to get the IO plugin from
+ * @return IO plugin bound to the engine event base
+ */
+lcb_io_opt_t engine_io(lcb_engine *engine);
+
+/**
+ * Starts the event loop thread for a bootstrapped instance.
+ * The engine owns the instance from now on and destroys it with engine_destroy.
+ *
+ * @param engine    engine to start
+ * @param instance  bootstrapped instance created with the engine IO plugin
+ * @return LCB_SUCCESS if the event loop thread was started
+ */
+lcb_STATUS engine_start(lcb_engine *engine, lcb_INSTANCE *instance);
+
+/**
+ * Gets the engine that drives an instance.
+ *
+ * @param instance  library instance
+ * @return engine for the instance or NULL if the instance is used synchronously
+ */
+lcb_engine *engine_from_instance(lcb_INSTANCE *instance);
+
+/**
+ * Submits operations to the engine and blocks until all of them have completed.
+ * Safe to call from any number of threads at the same time.
+ *
+ * @param engine    engine to submit to
+ * @param ops       operations to schedule in a single scheduling window
+ * @param nops      number of operations
+ * @return LCB_SUCCESS or the first scheduling error (also recorded in each engine_op.rc)
+ */
+lcb_STATUS engine_execute(lcb_engine *engine, engine_op *ops, size_t nops);
+
+/**
+ * Marks an operation as complete. Called from the response callbacks
+ * (on the event loop thread) once the operation result has been recorded.
+ *
+ * @param op        operation that completed (NULL is ignored)
+ */
+void engine_complete(engine_op *op);
+
+/**
+ * Stops the event loop thread and destroys the instance and event loop resources.
+ *
+ * @param engine    engine to destroy
+ */
+void engine_destroy(lcb_engine *engine);
+
+#endif /* !CBFUSE_ENGINE_HEADER_SEEN */
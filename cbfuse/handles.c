@@ -0,0 +1,814 @@
+/*
+ * cbfuse implements a FUSE file-system using Couchbase as the data store.
+ * Copyright (c) 2021 Raymond Cardillo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "custom-uthash.h"
+#include "uthash/uthash.h"
+
+#include "handles.h"
+#include "util.h"
+#include "common.h"
+#include "data.h"
+#include "stats.h"
+
+// Writes from the kernel arrive in small chunks (e.g., 64k on macOS) and sending each one
+// to Couchbase would cost a block rewrite and a stat update. Instead, each open file keeps
+// a single dirty range that sequential (or overlapping) writes are coalesced into.
+
+static bool write_buffer_expired(const file_handle *fh)
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
+        return true;
+    }
+
+    return (ts.tv_sec - fh->wtime.tv_sec) >= (time_t)WRITE_BUFFER_MAX_AGE;
+}
+
+// A write that grows (or just changes) a file also changes its stat, which is a get and a
+// CAS replace. The new size and modified time are kept in a table shared by every handle so
+// they're written once when the file is flushed (or after the stat interval) while getattr
+// still sees them.
+
+typedef struct pending_stat {
+    char *pkey;                 // key of the file (hash key)
+    size_t size;                // size the file grew to (zero if it hasn't grown)
+    struct timespec mtime;      // time of the last write (zero if it was discarded)
+    struct timespec since;      // monotonic time of the first pending change
+    UT_hash_handle hh;
+} pending_stat;
+
+static pthread_mutex_t _pending_lock = PTHREAD_MUTEX_INITIALIZER;
+static pending_stat *_pending = NULL;
+static unsigned int _stat_interval = 0;
+
+void file_handles_init(unsigned int stat_interval)
+{
+    _stat_interval = stat_interval;
+}
+
+static bool is_later(const struct timespec *ts1, const struct timespec *ts2)
+{
+    return (ts1->tv_sec > ts2->tv_sec) ||
+        (ts1->tv_sec == ts2->tv_sec && ts1->tv_nsec > ts2->tv_nsec);
+}
+
+static void delete_pending(pending_stat *entry)
+{
+    HASH_DEL(_pending, entry);
+    free(entry->pkey);
+    free(entry);
+}
+
+// Merges a change into the pending stat of a file.
+static int add_pending(const char *pkey, size_t size, const struct timespec *mtime)
+{
+    int fresult = 0;
+    pthread_mutex_lock(&_pending_lock);
+
+    pending_stat *entry = NULL;
+    HASH_FIND_STR(_pending, pkey, entry);
+    if (entry == NULL) {
+        entry = calloc(1, sizeof(pending_stat));
+        IfNULLGotoDoneWithRef(entry, -ENOMEM, pkey);
+
+        entry->pkey = strdup(pkey);
+        if (entry->pkey == NULL) {
+            free(entry);
+            fresult = -ENOMEM;
+            goto done;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &entry->since);
+        HASH_ADD_KEYPTR(hh, _pending, entry->pkey, strlen(entry->pkey), entry);
+    }
+
+    if (size > entry->size) {
+        entry->size = size;
+    }
+    if (is_later(mtime, &entry->mtime)) {
+        entry->mtime = *mtime;
+    }
+
+done:
+    pthread_mutex_unlock(&_pending_lock);
+    return fresult;
+}
+
+// Removes the pending stat of a file so the caller can write it.
+static bool take_pending(const char *pkey, size_t *size, struct timespec *mtime)
+{
+    pthread_mutex_lock(&_pending_lock);
+
+    pending_stat *entry = NULL;
+    HASH_FIND_STR(_pending, pkey, entry);
+    if (entry != NULL) {
+        *size = entry->size;
+        *mtime = entry->mtime;
+        delete_pending(entry);
+    }
+
+    pthread_mutex_unlock(&_pending_lock);
+    return (entry != NULL);
+}
+
+// The handles of each open file are kept in a table so data buffered by one handle is seen by
+// getattr and a truncate by path can cut the buffers of every handle. The lock order is the
+// table lock, then a handle lock, then the pending stat lock (a handle never takes the table
+// lock while its own lock is held).
+
+typedef struct open_file {
+    char *pkey;                 // key of the file (hash key)
+    file_handle *handles;       // handles that have the file open
+    atomic_uint_fast64_t generation;    // bumped when the data changes (older read-ahead data is dropped)
+    UT_hash_handle hh;
+} open_file;
+
+static pthread_mutex_t _open_lock = PTHREAD_MUTEX_INITIALIZER;
+static open_file *_open = NULL;
+
+// Finds (or creates) the entry of a file (the table lock must be held).
+static open_file *find_open_locked(const char *pkey)
+{
+    open_file *file = NULL;
+    HASH_FIND_STR(_open, pkey, file);
+    if (file == NULL) {
+        file = calloc(1, sizeof(open_file));
+        if (file == NULL) {
+            return NULL;
+        }
+
+        file->pkey = strdup(pkey);
+        if (file->pkey == NULL) {
+            free(file);
+            return NULL;
+        }
+
+        HASH_ADD_KEYPTR(hh, _open, file->pkey, strlen(file->pkey), file);
+    }
+
+    return file;
+}
+
+// Adds a handle to the entry of its file (the table lock must be held).
+static void add_open_locked(file_handle *fh, open_file *file)
+{
+    fh->file = file;
+    fh->next_open = file->handles;
+    file->handles = fh;
+}
+
+// Removes a handle from the entry of its file (the table lock must be held).
+static void remove_open_locked(file_handle *fh)
+{
+    open_file *file = fh->file;
+    if (file == NULL) {
+        return;
+    }
+
+    for (file_handle **link = &file->handles; *link != NULL; link = &(*link)->next_open) {
+        if (*link == fh) {
+            *link = fh->next_open;
+            break;
+        }
+    }
+
+    fh->file = NULL;
+    fh->next_open = NULL;
+
+    if (file->handles == NULL) {
+        HASH_DEL(_open, file);
+        free(file->pkey);
+        free(file);
+    }
+}
+
+// Looks up the end of the data buffered by the open handles of a file.
+static bool buffered_end(const char *pkey, size_t *end)
+{
+    bool buffered = false;
+    pthread_mutex_lock(&_open_lock);
+
+    open_file *file = NULL;
+    HASH_FIND_STR(_open, pkey, file);
+    if (file != NULL) {
+        for (file_handle *fh = file->handles; fh != NULL; fh = fh->next_open) {
+            size_t wend = atomic_load_explicit(&fh->wend, memory_order_acquire);
+            if (wend > 0) {
+                buffered = true;
+                if (wend > *end) {
+                    *end = wend;
+                }
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&_open_lock);
+    return buffered;
+}
+
+// The end of the buffered data and the truncate limit are atomics so a handle can publish
+// them while its own lock is held without taking the table lock (which is taken first).
+
+// Publishes the end of the buffered data (the handle lock must be held).
+static void set_buffered_end(file_handle *fh)
+{
+    size_t wend = (fh->nwbuf > 0) ? (size_t)fh->woffset + fh->nwbuf : 0;
+    atomic_store_explicit(&fh->wend, wend, memory_order_release);
+}
+
+// Cuts the buffered data to the size of a truncate that happened since it was buffered
+// (the handle lock must be held).
+static void apply_truncate(file_handle *fh)
+{
+    off_t limit = (off_t)atomic_exchange_explicit(&fh->wlimit, -1, memory_order_acq_rel);
+    if (limit >= 0) {
+        if (fh->woffset >= limit) {
+            fh->nwbuf = 0;
+        } else if (fh->woffset + (off_t)fh->nwbuf > limit) {
+            fh->nwbuf = limit - fh->woffset;
+        }
+        set_buffered_end(fh);
+
+        // the read-ahead data may be past the new end of the file
+        fh->nrbuf = 0;
+    }
+}
+
+void file_handles_invalidate(const char *pkey)
+{
+    pthread_mutex_lock(&_open_lock);
+
+    open_file *file = NULL;
+    HASH_FIND_STR(_open, pkey, file);
+    if (file != NULL) {
+        atomic_fetch_add_explicit(&file->generation, 1, memory_order_release);
+    }
+
+    pthread_mutex_unlock(&_open_lock);
+}
+
+void file_handles_truncate(const char *pkey, off_t size)
+{
+    pthread_mutex_lock(&_open_lock);
+
+    open_file *file = NULL;
+    HASH_FIND_STR(_open, pkey, file);
+    if (file != NULL) {
+        for (file_handle *fh = file->handles; fh != NULL; fh = fh->next_open) {
+            // only ever lowered here (the handle resets the limit once it applies it)
+            int_fast64_t limit = atomic_load_explicit(&fh->wlimit, memory_order_acquire);
+            while ((limit < 0 || size < limit) &&
+                !atomic_compare_exchange_weak_explicit(&fh->wlimit, &limit, size, memory_order_acq_rel, memory_order_acquire)) {
+            }
+
+            size_t wend = atomic_load_explicit(&fh->wend, memory_order_acquire);
+            while (wend > (size_t)size &&
+                !atomic_compare_exchange_weak_explicit(&fh->wend, &wend, size, memory_order_acq_rel, memory_order_acquire)) {
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&_open_lock);
+}
+
+static bool pending_expired(const char *pkey)
+{
+    bool expired = false;
+    pthread_mutex_lock(&_pending_lock);
+
+    pending_stat *entry = NULL;
+    HASH_FIND_STR(_pending, pkey, entry);
+    if (entry != NULL) {
+        struct timespec ts;
+        expired = (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) ||
+            (ts.tv_sec - entry->since.tv_sec) >= (time_t)_stat_interval;
+    }
+
+    pthread_mutex_unlock(&_pending_lock);
+    return expired;
+}
+
+// Looks up the changes that have been written to the blocks but not to the stat.
+static bool written_pending(const char *pkey, size_t *size, struct timespec *mtime)
+{
+    pthread_mutex_lock(&_pending_lock);
+
+    pending_stat *entry = NULL;
+    HASH_FIND_STR(_pending, pkey, entry);
+    if (entry != NULL) {
+        *size = entry->size;
+        *mtime = entry->mtime;
+    }
+
+    pthread_mutex_unlock(&_pending_lock);
+    return (entry != NULL);
+}
+
+bool file_handles_pending(const char *pkey, size_t *size, struct timespec *mtime)
+{
+    *size = 0;
+    *mtime = (struct timespec){0};
+    bool pending = written_pending(pkey, size, mtime);
+
+    // data that's still buffered grows the file too
+    size_t buffered = 0;
+    if (buffered_end(pkey, &buffered)) {
+        if (buffered > *size) {
+            *size = buffered;
+        }
+        pending = true;
+    }
+
+    return pending;
+}
+
+int file_handles_commit(lcb_INSTANCE *instance, const char *pkey)
+{
+    int fresult = 0;
+    size_t size = 0;
+    struct timespec mtime = {0};
+
+    if (!take_pending(pkey, &size, &mtime)) {
+        goto done;
+    }
+
+    bool has_mtime = (mtime.tv_sec != 0 || mtime.tv_nsec != 0);
+    fresult = update_stat_written(instance, pkey, size, has_mtime ? &mtime : NULL);
+
+    // the changes are kept for the next flush unless the file is gone
+    if (fresult == -ENOENT) {
+        fresult = 0;
+    } else if (fresult != 0) {
+        add_pending(pkey, size, &mtime);
+    }
+    IfFRErrorGotoDoneWithRef(pkey);
+
+done:
+    return fresult;
+}
+
+void file_handles_discard(const char *pkey, bool size, bool mtime)
+{
+    pthread_mutex_lock(&_pending_lock);
+
+    pending_stat *entry = NULL;
+    HASH_FIND_STR(_pending, pkey, entry);
+    if (entry != NULL) {
+        if (size) {
+            entry->size = 0;
+        }
+        if (mtime) {
+            entry->mtime = (struct timespec){0};
+        }
+        if (entry->size == 0 && entry->mtime.tv_sec == 0 && entry->mtime.tv_nsec == 0) {
+            delete_pending(entry);
+        }
+    }
+
+    pthread_mutex_unlock(&_pending_lock);
+}
+
+file_handle *file_handle_create(const char *pkey)
+{
+    file_handle *fh = calloc(1, sizeof(file_handle));
+    if (fh == NULL) {
+        return NULL;
+    }
+
+    fh->pkey = strdup(pkey);
+    if (fh->pkey == NULL) {
+        free(fh);
+        return NULL;
+    }
+
+    if (pthread_mutex_init(&fh->lock, NULL) != 0) {
+        free(fh->pkey);
+        free(fh);
+        return NULL;
+    }
+
+    atomic_init(&fh->wlimit, -1);
+
+    pthread_mutex_lock(&_open_lock);
+    open_file *file = find_open_locked(fh->pkey);
+    if (file != NULL) {
+        add_open_locked(fh, file);
+    }
+    pthread_mutex_unlock(&_open_lock);
+
+    if (file == NULL) {
+        pthread_mutex_destroy(&fh->lock);
+        free(fh->pkey);
+        free(fh);
+        return NULL;
+    }
+
+    return fh;
+}
+
+// Writes data to the blocks and leaves the stat changes pending.
+static int write_range(lcb_INSTANCE *instance, file_handle *fh, const char *buf, size_t nbuf, off_t offset)
+{
+    int fresult = 0;
+
+    // the read-ahead data may cover the range that's written
+    fh->nrbuf = 0;
+
+    // the size that's still pending is the end of the file that appends start from
+    size_t pending_size = 0;
+    struct timespec pending_mtime;
+    written_pending(fh->pkey, &pending_size, &pending_mtime);
+
+    size_t grown_size = 0;
+    fresult = write_blocks(instance, fh->pkey, buf, nbuf, offset, pending_size, &grown_size);
+
+    // other handles of the file may have read ahead over the range (even if only part of it was written)
+    atomic_fetch_add_explicit(&fh->file->generation, 1, memory_order_release);
+    IfFRErrorGotoDoneWithRef(fh->pkey);
+
+    struct timespec mtime;
+    IfFalseGotoDoneWithRef(
+        (clock_gettime(CLOCK_REALTIME, &mtime) == 0),
+        -EIO,
+        "clock_gettime"
+    );
+
+    fresult = add_pending(fh->pkey, grown_size, &mtime);
+    IfFRErrorGotoDoneWithRef(fh->pkey);
+
+    // don't let the stat fall behind forever if the file is kept open
+    if (pending_expired(fh->pkey)) {
+        fresult = file_handles_commit(instance, fh->pkey);
+        IfFRErrorGotoDoneWithRef(fh->pkey);
+    }
+
+done:
+    return fresult;
+}
+
+static int flush_locked(lcb_INSTANCE *instance, file_handle *fh)
+{
+    int fresult = 0;
+
+    apply_truncate(fh);
+    if (fh->nwbuf == 0) {
+        goto done;
+    }
+
+    fresult = write_range(instance, fh, fh->wbuf, fh->nwbuf, fh->woffset);
+    IfFRErrorGotoDoneWithRef(fh->pkey);
+
+    fh->nwbuf = 0;
+    set_buffered_end(fh);
+
+done:
+    return fresult;
+}
+
+int file_handle_flush(lcb_INSTANCE *instance, file_handle *fh)
+{
+    pthread_mutex_lock(&fh->lock);
+
+    // the file may change after a flush (e.g., ftruncate) so it's read again
+    fh->nrbuf = 0;
+
+    int fresult = flush_locked(instance, fh);
+    IfFRErrorGotoDoneWithRef(fh->pkey);
+
+    fresult = file_handles_commit(instance, fh->pkey);
+    IfFRErrorGotoDoneWithRef(fh->pkey);
+
+done:
+    pthread_mutex_unlock(&fh->lock);
+    return fresult;
+}
+
+int file_handle_write(lcb_INSTANCE *instance, file_handle *fh, const char *buf, size_t nbuf, off_t offset)
+{
+    int fresult = 0;
+    pthread_mutex_lock(&fh->lock);
+
+    apply_truncate(fh);
+
+    // the write can be coalesced if it starts anywhere within (or right after) the dirty range
+    bool coalesce = (fh->nwbuf > 0) &&
+        (offset >= fh->woffset) &&
+        (offset <= fh->woffset + (off_t)fh->nwbuf);
+
+    size_t nrequired = coalesce ? (size_t)(offset - fh->woffset) + nbuf : nbuf;
+    if (nrequired < fh->nwbuf) {
+        nrequired = fh->nwbuf;
+    }
+
+    if (!coalesce || nrequired > WRITE_BUFFER_LEN) {
+        fresult = flush_locked(instance, fh);
+        IfFRErrorGotoDoneWithRef(fh->pkey);
+
+        coalesce = false;
+        nrequired = nbuf;
+    }
+
+    // writes that are too large to buffer are written directly
+    if (nrequired > WRITE_BUFFER_LEN) {
+        fresult = write_range(instance, fh, buf, nbuf, offset);
+        IfFRErrorGotoDoneWithRef(fh->pkey);
+        fresult = nbuf;
+        goto done;
+    }
+
+    if (fh->wbuf == NULL) {
+        fh->wbuf = malloc(WRITE_BUFFER_LEN);
+        IfNULLGotoDoneWithRef(fh->wbuf, -ENOMEM, fh->pkey);
+    }
+
+    if (!coalesce) {
+        fh->woffset = offset;
+        IfFalseGotoDoneWithRef(
+            (clock_gettime(CLOCK_MONOTONIC, &fh->wtime) == 0),
+            -EIO,
+            "clock_gettime"
+        );
+    }
+
+    memcpy(fh->wbuf + (offset - fh->woffset), buf, nbuf);
+    fh->nwbuf = nrequired;
+
+    // getattr sees the new size and modified time while the data is still buffered
+    set_buffered_end(fh);
+
+    struct timespec mtime;
+    IfFalseGotoDoneWithRef(
+        (clock_gettime(CLOCK_REALTIME, &mtime) == 0),
+        -EIO,
+        "clock_gettime"
+    );
+
+    fresult = add_pending(fh->pkey, 0, &mtime);
+    IfFRErrorGotoDoneWithRef(fh->pkey);
+
+    // don't let dirty data sit around forever if the file is kept open
+    if (fh->nwbuf == WRITE_BUFFER_LEN || write_buffer_expired(fh)) {
+        fresult = flush_locked(instance, fh);
+        IfFRErrorGotoDoneWithRef(fh->pkey);
+    }
+
+    fresult = nbuf;
+
+done:
+    pthread_mutex_unlock(&fh->lock);
+    return fresult;
+}
+
+// Sequential reads (e.g., cat or a backup) fetch the blocks after the requested range in the
+// same multi-get and keep them in the handle so the next reads don't wait for a round trip.
+// The window doubles while fetches finish within READ_AHEAD_MAX_LATENCY_MS and halves when
+// they take longer, and a read that isn't sequential turns it off.
+
+static bool read_ahead_expired(const file_handle *fh)
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
+        return true;
+    }
+
+    return (ts.tv_sec - fh->rtime.tv_sec) >= (time_t)READ_AHEAD_MAX_AGE;
+}
+
+// Copies the part of a read that starts within the read-ahead data.
+static size_t read_ahead_hit(file_handle *fh, char *buf, size_t nbuf, off_t offset)
+{
+    if (fh->nrbuf == 0 || offset < fh->roffset || offset >= fh->roffset + (off_t)fh->nrbuf) {
+        return 0;
+    }
+
+    // the data may have been changed through another handle (or by path) since it was fetched
+    if (read_ahead_expired(fh) ||
+        fh->rgeneration != atomic_load_explicit(&fh->file->generation, memory_order_acquire)) {
+        fh->nrbuf = 0;
+        return 0;
+    }
+
+    size_t start = offset - fh->roffset;
+    size_t ncopy = fh->nrbuf - start;
+    if (ncopy > nbuf) {
+        ncopy = nbuf;
+    }
+
+    memcpy(buf, fh->rbuf + start, ncopy);
+    return ncopy;
+}
+
+static void adapt_read_ahead(file_handle *fh, const struct timespec *start)
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
+        return;
+    }
+
+    long elapsed_ms = ((ts.tv_sec - start->tv_sec) * 1000) + ((ts.tv_nsec - start->tv_nsec) / 1000000);
+    if (elapsed_ms <= (long)READ_AHEAD_MAX_LATENCY_MS) {
+        fh->rwindow = (fh->rwindow == 0) ? 1 : fh->rwindow * 2;
+        if (fh->rwindow > READ_AHEAD_MAX_BLOCKS) {
+            fh->rwindow = READ_AHEAD_MAX_BLOCKS;
+        }
+    } else if (fh->rwindow > 1) {
+        fh->rwindow /= 2;
+    }
+}
+
+int file_handle_read(lcb_INSTANCE *instance, file_handle *fh, char *buf, size_t nbuf, off_t offset)
+{
+    int fresult = 0;
+    pthread_mutex_lock(&fh->lock);
+
+    // make sure reads see any data (and size) written through this handle
+    fresult = flush_locked(instance, fh);
+    IfFRErrorGotoDoneWithRef(fh->pkey);
+
+    fresult = file_handles_commit(instance, fh->pkey);
+    IfFRErrorGotoDoneWithRef(fh->pkey);
+
+    size_t nread = read_ahead_hit(fh, buf, nbuf, offset);
+    bool sequential = (nread > 0 || offset == fh->rnext);
+    if (nread == nbuf) {
+        goto served;
+    }
+
+    off_t pos = offset + nread;
+    if (!sequential) {
+        fh->rwindow = 0;
+
+        int n = read_data(instance, fh->pkey, buf + nread, nbuf - nread, pos, false);
+        IfTrueGotoDoneWithRef((n < 0), -EIO, fh->pkey);
+        nread += n;
+        goto served;
+    }
+
+    // fetch the rest of the read and the whole blocks in the window after it
+    size_t end = pos + (nbuf - nread) + (fh->rwindow * FILE_BLOCK_LEN);
+    if (fh->rwindow > 0) {
+        end = ((end + FILE_BLOCK_LEN - 1) / FILE_BLOCK_LEN) * FILE_BLOCK_LEN;
+    }
+
+    size_t nfetch = end - pos;
+    if (nfetch > fh->maxrbuf) {
+        char *rbuf = realloc(fh->rbuf, nfetch);
+        IfNULLGotoDoneWithRef(rbuf, -ENOMEM, fh->pkey);
+        fh->rbuf = rbuf;
+        fh->maxrbuf = nfetch;
+    }
+
+    struct timespec start;
+    IfFalseGotoDoneWithRef(
+        (clock_gettime(CLOCK_MONOTONIC, &start) == 0),
+        -EIO,
+        "clock_gettime"
+    );
+
+    // a change that completes while the data is fetched drops it
+    fh->nrbuf = 0;
+    fh->rgeneration = atomic_load_explicit(&fh->file->generation, memory_order_acquire);
+    int n = read_data(instance, fh->pkey, fh->rbuf, nfetch, pos, true);
+    IfTrueGotoDoneWithRef((n < 0), -EIO, fh->pkey);
+
+    adapt_read_ahead(fh, &start);
+    fh->roffset = pos;
+    fh->nrbuf = n;
+    fh->rtime = start;
+
+    nread += read_ahead_hit(fh, buf + nread, nbuf - nread, pos);
+
+served:
+    fh->rnext = offset + nread;
+    fresult = nread;
+
+done:
+    pthread_mutex_unlock(&fh->lock);
+    return fresult;
+}
+
+void file_handle_destroy(file_handle *fh)
+{
+    if (fh != NULL) {
+        pthread_mutex_lock(&_open_lock);
+        remove_open_locked(fh);
+        pthread_mutex_unlock(&_open_lock);
+
+        pthread_mutex_destroy(&fh->lock);
+        free(fh->pkey);
+        free(fh->wbuf);
+        free(fh->rbuf);
+        free(fh);
+    }
+}
+
+// Listing a directory takes many readdir calls (one per buffer the kernel fills)
+// so the children are fetched once when the directory is opened and every call is
+// served by position from a compact copy. The kernel serializes readdir calls on
+// the same open directory so the snapshot doesn't need a lock.
+
+dir_handle *dir_handle_create(void)
+{
+    return calloc(1, sizeof(dir_handle));
+}
+
+int dir_handle_add(dir_handle *dh, const char *child_name, uint64_t ino)
+{
+    size_t nname = strlen(child_name) + 1;
+
+    // offsets are 32-bit to keep the snapshot compact
+    if (dh->nnames + nname > UINT32_MAX) {
+        return -EFBIG;
+    }
+
+    if (dh->nnames + nname > dh->maxnames) {
+        size_t maxnames = dh->maxnames ? dh->maxnames * 2 : 4096;
+        while (maxnames < dh->nnames + nname) {
+            maxnames *= 2;
+        }
+
+        char *names = realloc(dh->names, maxnames);
+        if (names == NULL) {
+            return -ENOMEM;
+        }
+        dh->names = names;
+        dh->maxnames = maxnames;
+    }
+
+    if (dh->nchildren == dh->maxchildren) {
+        size_t maxchildren = dh->maxchildren ? dh->maxchildren * 2 : 256;
+        uint32_t *offsets = realloc(dh->offsets, maxchildren * sizeof(uint32_t));
+        if (offsets == NULL) {
+            return -ENOMEM;
+        }
+        dh->offsets = offsets;
+
+        uint64_t *inodes = realloc(dh->inodes, maxchildren * sizeof(uint64_t));
+        if (inodes == NULL) {
+            return -ENOMEM;
+        }
+        dh->inodes = inodes;
+        dh->maxchildren = maxchildren;
+    }
+
+    memcpy(dh->names + dh->nnames, child_name, nname);
+    dh->inodes[dh->nchildren] = ino;
+    dh->offsets[dh->nchildren++] = (uint32_t)dh->nnames;
+    dh->nnames += nname;
+
+    return 0;
+}
+
+const char *dir_handle_child(const dir_handle *dh, size_t index)
+{
+    if (index >= dh->nchildren) {
+        return NULL;
+    }
+    return dh->names + dh->offsets[index];
+}
+
+uint64_t dir_handle_inode(const dir_handle *dh, size_t index)
+{
+    if (index >= dh->nchildren) {
+        return 0;
+    }
+    return dh->inodes[index];
+}
+
+void dir_handle_clear(dir_handle *dh)
+{
+    dh->nnames = 0;
+    dh->nchildren = 0;
+    dh->served = false;
+}
+
+void dir_handle_destroy(dir_handle *dh)
+{
+    if (dh != NULL) {
+        free(dh->names);
+        free(dh->offsets);
+        free(dh->inodes);
+        free(dh);
+    }
+}
@@ -0,0 +1,213 @@
+/*
+ * cbfuse implements a FUSE file-system using Couchbase as the data store.
+ * Copyright (c) 2021 Raymond Cardillo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CBFUSE_HANDLES_HEADER_SEEN
+#define CBFUSE_HANDLES_HEADER_SEEN
+
+#include <time.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <libcouchbase/couchbase.h>
+
+typedef struct file_handle {
+    pthread_mutex_t lock;   // serializes operations on the same open file from multiple FUSE threads
+    char *pkey;             // key of the open file
+    struct open_file *file; // state shared by every handle of the same file
+    struct file_handle *next_open;  // next handle of the same file (guarded by the open file table lock)
+    char *wbuf;             // write-back buffer with data not yet sent to Couchbase
+    size_t nwbuf;           // length of the dirty data in the write-back buffer
+    off_t woffset;          // file offset of the dirty data
+    struct timespec wtime;  // when the buffer first became dirty
+    atomic_size_t wend;     // end of the dirty data that getattr sees
+    atomic_int_fast64_t wlimit; // size a truncate cut the file to since the buffer was trimmed (or -1)
+    char *rbuf;             // read-ahead buffer with data fetched past the last read
+    size_t nrbuf;           // length of the data in the read-ahead buffer
+    size_t maxrbuf;         // allocated length of the read-ahead buffer
+    off_t roffset;          // file offset of the read-ahead data
+    off_t rnext;            // offset that a sequential read starts at
+    size_t rwindow;         // blocks fetched ahead of a sequential read
+    struct timespec rtime;  // when the read-ahead data was fetched
+    uint64_t rgeneration;   // generation of the file data when the read-ahead data was fetched
+} file_handle;              // state kept for each open file (stored in fuse_file_info.fh)
+
+/**
+ * Configures how long the size and modified time changed by writes can be pending
+ * before they're written to the stat (they're always written when the file is flushed).
+ *
+ * @param stat_interval     seconds that stat changes can be pending (zero writes them with the data)
+ */
+void file_handles_init(unsigned int stat_interval);
+
+/**
+ * Looks up the size and modified time of a file that haven't been written yet (so getattr sees them).
+ * The size includes data that's still in the write-back buffers of open handles.
+ *
+ * @param pkey      key of the file
+ * @param size      receives the size the file grew to (zero if it hasn't grown)
+ * @param mtime     receives the time of the last write (zero if it was discarded)
+ * @return whether any changes are pending
+ */
+bool file_handles_pending(const char *pkey, size_t *size, struct timespec *mtime);
+
+/**
+ * Drops the read-ahead data of every handle of a file. This must be called after the
+ * data of the file is changed without going through its handles (e.g., truncate or unlink).
+ *
+ * @param pkey      key of the file
+ */
+void file_handles_invalidate(const char *pkey);
+
+/**
+ * Cuts the data buffered by every handle of a file to the new size (so flushing them
+ * later can't grow the file back). The handles apply it before they next use their buffers.
+ *
+ * @param pkey      key of the file
+ * @param size      size the file is truncated to
+ */
+void file_handles_truncate(const char *pkey, off_t size);
+
+/**
+ * Writes the pending size and modified time of a file to its stat.
+ *
+ * @param instance  library instance to use
+ * @param pkey      key of the file
+ * @return zero on success or a negative error code (the changes are still pending)
+ */
+int file_handles_commit(lcb_INSTANCE *instance, const char *pkey);
+
+/**
+ * Drops pending changes that were overridden (e.g., by truncate or utimens).
+ *
+ * @param pkey      key of the file
+ * @param size      drop the pending size
+ * @param mtime     drop the pending modified time
+ */
+void file_handles_discard(const char *pkey, bool size, bool mtime);
+
+/**
+ * Creates the state for a newly opened file.
+ *
+ * @param pkey      key of the file that was opened
+ * @return the new handle or NULL if memory could not be allocated
+ */
+file_handle *file_handle_create(const char *pkey);
+
+/**
+ * Buffers a write and coalesces it with any sequential writes that came before it.
+ * Buffered data is written when it can't be coalesced or exceeds the size/age limits.
+ *
+ * @param instance  library instance to use when data must be written
+ * @param fh        handle of the open file
+ * @param buf       data to write
+ * @param nbuf      length of the data
+ * @param offset    file offset to write the data
+ * @return number of bytes accepted or a negative error code
+ */
+int file_handle_write(lcb_INSTANCE *instance, file_handle *fh, const char *buf, size_t nbuf, off_t offset);
+
+/**
+ * Reads data through the handle. Sequential reads also fetch the blocks that follow in the
+ * same round trip and later reads are served from them.
+ *
+ * @param instance  library instance to use
+ * @param fh        handle of the open file
+ * @param buf       receives the data
+ * @param nbuf      length of the data to read
+ * @param offset    file offset to read the data from
+ * @return number of bytes read (zero at the end of the file) or a negative error code
+ */
+int file_handle_read(lcb_INSTANCE *instance, file_handle *fh, char *buf, size_t nbuf, off_t offset);
+
+/**
+ * Writes any buffered data (and the pending stat changes) to Couchbase.
+ *
+ * @param instance  library instance to use
+ * @param fh        handle of the open file
+ * @return zero on success or a negative error code
+ */
+int file_handle_flush(lcb_INSTANCE *instance, file_handle *fh);
+
+/**
+ * Frees the memory used by the handle (buffered data must be flushed first).
+ *
+ * @param fh        handle to destroy
+ */
+void file_handle_destroy(file_handle *fh);
+
+typedef struct dir_handle {
+    char *names;            // child names (each one is terminated by a NUL)
+    size_t nnames;          // length of the child names
+    size_t maxnames;        // allocated length of names
+    uint32_t *offsets;      // offset of each child name in names
+    uint64_t *inodes;       // inode number of each child
+    size_t nchildren;       // number of children
+    size_t maxchildren;     // allocated length of offsets
+    bool served;            // whether readdir has used the snapshot
+} dir_handle;               // snapshot of the children of an open directory (stored in fuse_file_info.fh)
+
+/**
+ * Creates an empty snapshot for a newly opened directory.
+ *
+ * @return the new handle or NULL if memory could not be allocated
+ */
+dir_handle *dir_handle_create(void);
+
+/**
+ * Appends a child to the snapshot.
+ *
+ * @param dh            handle of the open directory
+ * @param child_name    name of the child
+ * @param ino           inode number of the child
+ * @return zero on success or a negative error code
+ */
+int dir_handle_add(dir_handle *dh, const char *child_name, uint64_t ino);
+
+/**
+ * Looks up a child of the snapshot by its position.
+ *
+ * @param dh        handle of the open directory
+ * @param index     position of the child
+ * @return the child name or NULL if there are no more children
+ */
+const char *dir_handle_child(const dir_handle *dh, size_t index);
+
+/**
+ * Looks up the inode number of a child of the snapshot by its position.
+ *
+ * @param dh        handle of the open directory
+ * @param index     position of the child
+ * @return the inode number or zero if there are no more children
+ */
+uint64_t dir_handle_inode(const dir_handle *dh, size_t index);
+
+/**
+ * Removes every child from the snapshot (so it can be taken again).
+ *
+ * @param dh        handle of the open directory
+ */
+void dir_handle_clear(dir_handle *dh);
+
+/**
+ * Frees the memory used by the handle.
+ *
+ * @param dh        handle to destroy
+ */
+void dir_handle_destroy(dir_handle *dh);
+
+#endif /* !CBFUSE_HANDLES_HEADER_SEEN */
@@ -0,0 +1,106 @@
+/*
+ * cbfuse implements a FUSE file-system using Couchbase as the data store.
+ * Copyright (c) 2021 Raymond Cardillo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "inodes.h"
+#include "util.h"
+#include "common.h"
+#include "sync_counter.h"
+
+// Inode numbers come from a counter document in the stats collection. Each increment
+// reserves a range of INODE_RANGE_LEN numbers so most files are created without an
+// extra round trip. Numbers left in the range when the mount exits are never used.
+
+static pthread_mutex_t _inodes_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t _next_ino = 0;  // next unused number in the reserved range
+static uint64_t _last_ino = 0;  // last number in the reserved range
+
+// Reserves the next range of inode numbers and returns the last one.
+static int reserve_inodes(lcb_INSTANCE *instance, uint64_t *last)
+{
+    int fresult = 0;
+    sync_counter_result *result = NULL;
+
+    lcb_STATUS rc;
+    lcb_CMDCOUNTER *cmd;
+
+    rc = lcb_cmdcounter_create(&cmd);
+    IfLCBFailGotoDone(rc, -EIO);
+
+    rc = lcb_cmdcounter_collection(
+        cmd,
+        DEFAULT_SCOPE_STRING, DEFAULT_SCOPE_STRLEN,
+        STATS_COLLECTION_STRING, STATS_COLLECTION_STRLEN);
+    IfLCBFailGotoDone(rc, -EIO);
+
+    rc = lcb_cmdcounter_key(cmd, INODE_COUNTER_KEY, strlen(INODE_COUNTER_KEY));
+    IfLCBFailGotoDone(rc, -EIO);
+
+    // the first mount creates the counter with the first range already reserved
+    rc = lcb_cmdcounter_delta(cmd, (int64_t)INODE_RANGE_LEN);
+    IfLCBFailGotoDone(rc, -EIO);
+
+    rc = lcb_cmdcounter_initial(cmd, INODE_RANGE_LEN);
+    IfLCBFailGotoDone(rc, -EIO);
+
+    rc = sync_counter(instance, cmd, &result);
+
+    // first check the sync command result code
+    IfLCBFailGotoDone(rc, -EIO);
+
+    // now check the actual result status
+    IfLCBFailGotoDoneWithRef(result->status, -EIO, INODE_COUNTER_KEY);
+
+    *last = result->value;
+
+done:
+    sync_counter_destroy(result);
+    return fresult;
+}
+
+int next_inode(lcb_INSTANCE *instance, uint64_t *ino)
+{
+    int fresult = 0;
+    pthread_mutex_lock(&_inodes_lock);
+
+    if (_next_ino == 0 || _next_ino > _last_ino) {
+        uint64_t last = 0;
+        fresult = reserve_inodes(instance, &last);
+        IfFRErrorGotoDoneWithRef(INODE_COUNTER_KEY);
+
+        _next_ino = last - INODE_RANGE_LEN + 1;
+        _last_ino = last;
+    }
+
+    *ino = _next_ino++;
+
+done:
+    pthread_mutex_unlock(&_inodes_lock);
+    return fresult;
+}
+
+void inode_key(uint64_t ino, char *key)
+{
+    snprintf(key, INODE_KEY_LEN + 1, "%c%" PRIx64, INODE_KEY_PREFIX, ino);
+}
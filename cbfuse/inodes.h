@@ -0,0 +1,35 @@
+/*
+ * cbfuse implements a FUSE file-system using Couchbase as the data store.
+ * Copyright (c) 2021 Raymond Cardillo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CBFUSE_INODES_HEADER_SEEN
+#define CBFUSE_INODES_HEADER_SEEN
+
+#include <stdint.h>
+#include <libcouchbase/couchbase.h>
+
+// "@" followed by up to 16 hex digits
+#define INODE_KEY_LEN   17
+
+// Every entry but the root is keyed by its inode number so a rename doesn't move any
+// document. The stat and directory entry use the key as is and the data blocks append
+// the block number to it. The key buffer must have room for INODE_KEY_LEN + 1 characters.
+void inode_key(uint64_t ino, char *key);
+
+// allocates a new inode number that is unique across every mount of the bucket (never zero)
+int next_inode(lcb_INSTANCE *instance, uint64_t *ino);
+
+#endif /* !CBFUSE_INODES_HEADER_SEEN */
@@ -0,0 +1,122 @@
+/*
+ * cbfuse implements a FUSE file-system using Couchbase as the data store.
+ * Copyright (c) 2021 Raymond Cardillo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <xxhash.h>
+
+#include "util.h"
+#include "common.h"
+#include "keys.h"
+
+#define HASH_KEY_LEN        22  // base64 characters for the 128 bit hash
+#define MIN_HASHED_KEY_LEN  (HASH_KEY_LEN + 1 + 48 + 50 + 50 + 50)
+
+// The URL safe alphabet means a hashed key never starts with '/' like a path does,
+// so it can't be mistaken for the key of a shorter path.
+static const char BASE64_CHARS[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+// Encodes the 16 byte hash as 22 base64 characters (without padding).
+static void encode_hash(const unsigned char digest[16], char *out)
+{
+    // five full 3 byte groups then the last byte
+    for (int i = 0; i < 15; i += 3) {
+        uint32_t group = ((uint32_t)digest[i] << 16) | ((uint32_t)digest[i + 1] << 8) | digest[i + 2];
+        *out++ = BASE64_CHARS[(group >> 18) & 0x3F];
+        *out++ = BASE64_CHARS[(group >> 12) & 0x3F];
+        *out++ = BASE64_CHARS[(group >> 6) & 0x3F];
+        *out++ = BASE64_CHARS[group & 0x3F];
+    }
+    *out++ = BASE64_CHARS[digest[15] >> 2];
+    *out++ = BASE64_CHARS[(digest[15] << 4) & 0x3F];
+}
+
+// Appends a sample of the path (see the README for where the samples are taken from).
+static char *append_sample(char *out, const char *path, size_t start, size_t len)
+{
+    memcpy(out, path + start, len);
+    return out + len;
+}
+
+int path_to_key_len(const char *path, size_t nmax, char *key, size_t *nkey)
+{
+    int fresult = 0;
+
+    size_t npath = strlen(path);
+    IfTrueGotoDoneWithRef((npath > MAX_PATH_LEN || nmax > MAX_KEY_LEN), -ENAMETOOLONG, path);
+
+    // the common case is a path that is already a unique key
+    if (npath <= nmax) {
+        memcpy(key, path, npath + 1);
+        *nkey = npath;
+        goto done;
+    }
+
+    IfTrueGotoDoneWithRef((nmax < MIN_HASHED_KEY_LEN), -ENAMETOOLONG, path);
+
+    XXH128_canonical_t digest;
+    XXH128_canonicalFromHash(&digest, XXH3_128bits(path, npath));
+    encode_hash(digest.digest, key);
+
+    // the first sample shrinks when the key has to be shorter than MAX_KEY_LEN
+    char *out = key + HASH_KEY_LEN;
+    out = append_sample(out, path, 1, nmax - (MIN_HASHED_KEY_LEN - 1));
+    out = append_sample(out, path, npath / 4, 48);
+    out = append_sample(out, path, npath / 2, 50);
+    out = append_sample(out, path, (npath * 3) / 4, 50);
+    out = append_sample(out, path, npath - 51, 50);
+    *out = '\0';
+    *nkey = nmax;
+
+done:
+    return fresult;
+}
+
+int path_to_key(const char *path, char *key, size_t *nkey)
+{
+    return path_to_key_len(path, MAX_KEY_LEN, key, nkey);
+}
+
+int batch_path_key(sync_batch *batch, const char *path, const char **key, size_t *nkey)
+{
+    int fresult = 0;
+
+    size_t npath = strlen(path);
+    if (npath <= MAX_KEY_LEN) {
+        *key = path;
+        *nkey = npath;
+        goto done;
+    }
+
+    char *hashed = malloc(MAX_KEY_LEN + 1);
+    IfNULLGotoDoneWithRef(hashed, -ENOMEM, path);
+
+    lcb_STATUS rc = sync_batch_own(batch, hashed);
+    IfLCBFailGotoDone(rc, -ENOMEM);
+
+    fresult = path_to_key(path, hashed, nkey);
+    IfFRErrorGotoDoneWithRef(path);
+
+    *key = hashed;
+
+done:
+    return fresult;
+}
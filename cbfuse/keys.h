@@ -0,0 +1,34 @@
+/*
+ * cbfuse implements a FUSE file-system using Couchbase as the data store.
+ * Copyright (c) 2021 Raymond Cardillo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CBFUSE_KEYS_HEADER_SEEN
+#define CBFUSE_KEYS_HEADER_SEEN
+
+#include <stdlib.h>
+
+#include "sync_batch.h"
+
+// Maps a path to a document key. Paths that fit are used as is and longer paths
+// (up to MAX_PATH_LEN) are hashed and sampled so every lookup is still one trip.
+// The key buffer must have room for MAX_KEY_LEN + 1 characters.
+int path_to_key(const char *path, char *key, size_t *nkey);
+// same as path_to_key but the key is at most nmax characters (e.g., to leave room for a prefix)
+int path_to_key_len(const char *path, size_t nmax, char *key, size_t *nkey);
+// the key lives until the batch is destroyed (a path that fits is its own key)
+int batch_path_key(sync_batch *batch, const char *path, const char **key, size_t *nkey);
+
+#endif /* !CBFUSE_KEYS_HEADER_SEEN */
@@ -0,0 +1,274 @@
+/*
+ * cbfuse implements a FUSE file-system using Couchbase as the data store.
+ * Copyright (c) 2021 Raymond Cardillo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include "custom-uthash.h"
+#include "uthash/uthash.h"
+
+#include "lookups.h"
+#include "dentries.h"
+#include "inodes.h"
+#include "util.h"
+#include "common.h"
+
+// Entries are keyed by inode so a path has to be resolved one name at a time from
+// the closest directory that's already known. FUSE passes full paths to every
+// operation so resolved paths are kept in memory for a short time (like the stats
+// in attr_cache.c) and only the names below the closest cached directory are looked
+// up. Paths that don't exist are remembered for a shorter time. A path that was
+// renamed or removed by another mount resolves to its old entry until it expires.
+
+typedef enum lookups_status {
+    LOOKUPS_MISS,           // nothing usable is cached
+    LOOKUPS_HIT,            // the key of the path was found
+    LOOKUPS_NEGATIVE        // the path is known not to exist
+} lookups_status;
+
+typedef struct lookups_entry {
+    char *path;                         // absolute path of the entry (hash key)
+    char pkey[INODE_KEY_LEN + 1];       // key of the entry
+    bool negative;                      // true if the path is known not to exist
+    struct timespec expires;            // monotonic time when the entry can no longer be used
+    UT_hash_handle hh;
+} lookups_entry;
+
+// FUSE operations run on multiple threads so all access to the entries is serialized
+static pthread_mutex_t _entries_lock = PTHREAD_MUTEX_INITIALIZER;
+static lookups_entry *_entries = NULL;
+static unsigned int _timeout = 0;
+static unsigned int _negative_timeout = 0;
+static size_t _max_entries = 0;
+
+static bool is_expired(const struct timespec *expires, const struct timespec *now)
+{
+    return (now->tv_sec > expires->tv_sec) ||
+        (now->tv_sec == expires->tv_sec && now->tv_nsec >= expires->tv_nsec);
+}
+
+static void delete_entry(lookups_entry *entry)
+{
+    HASH_DEL(_entries, entry);
+    free(entry->path);
+    free(entry);
+}
+
+void lookups_init(unsigned int timeout, unsigned int negative_timeout, size_t max_entries)
+{
+    _timeout = timeout;
+    _negative_timeout = negative_timeout;
+    _max_entries = max_entries;
+}
+
+static lookups_status get_entry(const char *path, char *pkey)
+{
+    lookups_status status = LOOKUPS_MISS;
+    pthread_mutex_lock(&_entries_lock);
+
+    lookups_entry *entry = NULL;
+    HASH_FIND_STR(_entries, path, entry);
+    if (entry == NULL) {
+        goto done;
+    }
+
+    struct timespec now;
+    if (clock_gettime(CLOCK_MONOTONIC, &now) != 0 || is_expired(&entry->expires, &now)) {
+        delete_entry(entry);
+        goto done;
+    }
+
+    if (entry->negative) {
+        status = LOOKUPS_NEGATIVE;
+        goto done;
+    }
+
+    strcpy(pkey, entry->pkey);
+    status = LOOKUPS_HIT;
+
+done:
+    pthread_mutex_unlock(&_entries_lock);
+    return status;
+}
+
+static void put_entry(const char *path, const char *pkey, unsigned int timeout)
+{
+    if (_max_entries == 0 || timeout == 0) {
+        return;
+    }
+
+    struct timespec now;
+    if (clock_gettime(CLOCK_MONOTONIC, &now) != 0) {
+        return;
+    }
+
+    // entries are kept in insertion order so a replaced entry moves to the end
+    lookups_entry *entry = NULL;
+    HASH_FIND_STR(_entries, path, entry);
+    if (entry != NULL) {
+        HASH_DEL(_entries, entry);
+    } else {
+        // make room by evicting the least recently stored entry
+        if (HASH_COUNT(_entries) >= _max_entries) {
+            delete_entry(_entries);
+        }
+
+        entry = calloc(1, sizeof(lookups_entry));
+        if (entry == NULL) {
+            return;
+        }
+
+        entry->path = strdup(path);
+        if (entry->path == NULL) {
+            free(entry);
+            return;
+        }
+    }
+
+    if (pkey != NULL) {
+        strncpy(entry->pkey, pkey, INODE_KEY_LEN);
+        entry->pkey[INODE_KEY_LEN] = '\0';
+        entry->negative = false;
+    } else {
+        entry->pkey[0] = '\0';
+        entry->negative = true;
+    }
+    entry->expires.tv_sec = now.tv_sec + timeout;
+    entry->expires.tv_nsec = now.tv_nsec;
+
+    HASH_ADD_KEYPTR(hh, _entries, entry->path, strlen(entry->path), entry);
+}
+
+void lookups_put(const char *path, const char *pkey)
+{
+    pthread_mutex_lock(&_entries_lock);
+    put_entry(path, pkey, _timeout);
+    pthread_mutex_unlock(&_entries_lock);
+}
+
+void lookups_put_negative(const char *path)
+{
+    pthread_mutex_lock(&_entries_lock);
+    put_entry(path, NULL, _negative_timeout);
+    pthread_mutex_unlock(&_entries_lock);
+}
+
+void lookups_remove(const char *path, bool below)
+{
+    pthread_mutex_lock(&_entries_lock);
+
+    lookups_entry *entry = NULL;
+    HASH_FIND_STR(_entries, path, entry);
+    if (entry != NULL) {
+        delete_entry(entry);
+    }
+
+    // a moved directory takes every path below it along (which is rare enough to scan for)
+    if (below) {
+        size_t npath = strlen(path);
+        lookups_entry *tmp;
+        HASH_ITER(hh, _entries, entry, tmp) {
+            if (strncmp(entry->path, path, npath) == 0 && entry->path[npath] == '/') {
+                delete_entry(entry);
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&_entries_lock);
+}
+
+void lookups_destroy(void)
+{
+    pthread_mutex_lock(&_entries_lock);
+
+    lookups_entry *entry, *tmp;
+    HASH_ITER(hh, _entries, entry, tmp) {
+        delete_entry(entry);
+    }
+
+    pthread_mutex_unlock(&_entries_lock);
+}
+
+int lookup_path(lcb_INSTANCE *instance, const char *path, char *pkey)
+{
+    int fresult = 0;
+    char *prefix = NULL;
+
+    // the root is keyed by its path
+    if (strcmp(path, ROOT_DIR_STRING) == 0) {
+        strcpy(pkey, ROOT_DIR_STRING);
+        goto done;
+    }
+
+    IfTrueGotoDoneWithRef((path[0] != '/'), -ENOENT, path);
+
+    lookups_status status = get_entry(path, pkey);
+    if (status != LOOKUPS_MISS) {
+        fresult = (status == LOOKUPS_HIT) ? 0 : -ENOENT;
+        goto done;
+    }
+
+    prefix = strdup(path);
+    IfNULLGotoDoneWithRef(prefix, -ENOMEM, path);
+    size_t npath = strlen(prefix);
+
+    // cut the path back to the closest directory that's cached (the root always is)
+    // and leave the names after it terminated so they can be looked up in order
+    size_t start = 0;
+    for (char *slash = strrchr(prefix, '/'); slash != prefix; slash = strrchr(prefix, '/')) {
+        *slash = '\0';
+
+        status = get_entry(prefix, pkey);
+        if (status == LOOKUPS_NEGATIVE) {
+            fresult = -ENOENT;
+            goto done;
+        }
+        if (status == LOOKUPS_HIT) {
+            start = (size_t)(slash - prefix);
+            break;
+        }
+    }
+    if (start == 0) {
+        strcpy(pkey, ROOT_DIR_STRING);
+    }
+
+    // then look up one name at a time and remember each path on the way
+    for (size_t pos = start; pos < npath; ) {
+        prefix[pos] = '/';
+        const char *child_name = prefix + pos + 1;
+
+        uint64_t ino = 0;
+        fresult = lookup_child(instance, pkey, child_name, &ino);
+        if (fresult == -ENOENT) {
+            lookups_put_negative(prefix);
+            goto done;
+        }
+        IfFRErrorGotoDoneWithRef(prefix);
+
+        inode_key(ino, pkey);
+        lookups_put(prefix, pkey);
+
+        pos += strlen(child_name) + 1;
+    }
+
+done:
+    free(prefix);
+    return fresult;
+}
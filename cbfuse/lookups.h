@@ -0,0 +1,71 @@
+/*
+ * cbfuse implements a FUSE file-system using Couchbase as the data store.
+ * Copyright (c) 2021 Raymond Cardillo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CBFUSE_LOOKUPS_HEADER_SEEN
+#define CBFUSE_LOOKUPS_HEADER_SEEN
+
+#include <stdbool.h>
+#include <libcouchbase/couchbase.h>
+
+/**
+ * Configures the lookup cache (paths are always looked up from the root until this is called).
+ *
+ * @param timeout           seconds that a resolved path can be used before it must be looked up again
+ * @param negative_timeout  seconds that a missing path is remembered
+ * @param max_entries       maximum number of cached paths (zero disables the cache)
+ */
+void lookups_init(unsigned int timeout, unsigned int negative_timeout, size_t max_entries);
+
+/**
+ * Resolves a path to the key of its entry (the key of its stat and directory entry).
+ *
+ * @param instance  library instance used for the lookups that aren't cached
+ * @param path      absolute path of the entry
+ * @param pkey      receives the key (room for INODE_KEY_LEN + 1 characters)
+ * @return zero on success, -ENOENT if the path doesn't exist, or another negative error code
+ */
+int lookup_path(lcb_INSTANCE *instance, const char *path, char *pkey);
+
+/**
+ * Remembers the key of a path (e.g., after it was created or listed).
+ *
+ * @param path      absolute path of the entry
+ * @param pkey      key of the entry
+ */
+void lookups_put(const char *path, const char *pkey);
+
+/**
+ * Remembers that a path doesn't exist (e.g., after it was removed).
+ *
+ * @param path      absolute path of the missing entry
+ */
+void lookups_put_negative(const char *path);
+
+/**
+ * Forgets a path (e.g., when its entry turns out to be gone).
+ *
+ * @param path      absolute path of the entry
+ * @param below     also forget every path below it (e.g., when a directory was moved)
+ */
+void lookups_remove(const char *path, bool below);
+
+/**
+ * Removes all cached paths and frees the memory used by the cache.
+ */
+void lookups_destroy(void);
+
+#endif /* !CBFUSE_LOOKUPS_HEADER_SEEN */
@@ -0,0 +1,199 @@
+/*
+ * cbfuse implements a FUSE file-system using Couchbase as the data store.
+ * Copyright (c) 2021 Raymond Cardillo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "migrate.h"
+#include "stats.h"
+#include "dentries.h"
+#include "data.h"
+#include "inodes.h"
+#include "util.h"
+#include "common.h"
+
+// Buckets written before inodes were added key every stat and directory entry by its
+// path, list the children of a directory by name in "c" and store the data of a file
+// under its path (as one document, or as blocks keyed by the path). Paths are now resolved through inode numbers so such a bucket is
+// converted once before it's mounted, from the root down. For each child:
+//
+// 1. an inode number is assigned and saved in the old stat (so a second attempt uses it too)
+// 2. its data is copied to blocks (or a new directory entry is created and its children are migrated)
+// 3. its stat is copied to the key of the inode and it's added to its parent by inode
+// 4. the old data, directory entry and stat are removed
+//
+// Every step can be repeated so a child whose old stat is gone was already migrated.
+// The root keeps its key and only gets an inode number once every child was migrated,
+// which is what marks the bucket as converted.
+
+typedef struct migrate_context {
+    lcb_INSTANCE *instance;
+    const char *dir_path;       // old key of the directory
+    const char *dir_pkey;       // new key of the directory
+    char *path;                 // path of the child being migrated (MAX_PATH_LEN + 1)
+} migrate_context;
+
+static int migrate_directory(lcb_INSTANCE *instance, const char *dir_path, const char *dir_pkey);
+
+// Copies a stat to the key of its inode (which an earlier attempt may have done already).
+static int copy_stat(lcb_INSTANCE *instance, const char *pkey, const cbfuse_stat *stat)
+{
+    sync_store_result *result = NULL;
+
+    sync_batch batch;
+    sync_batch_init(&batch, instance);
+
+    int fresult = batch_copy_stat(&batch, pkey, stat, &result);
+    IfFRErrorGotoDoneWithRef(pkey);
+
+    lcb_STATUS rc = sync_batch_execute(&batch);
+    IfLCBFailGotoDone(rc, -EIO);
+
+    fresult = insert_stat_result(pkey, stat, result);
+    if (fresult == -EEXIST) {
+        fresult = 0;
+    }
+
+done:
+    sync_batch_destroy(&batch);
+    return fresult;
+}
+
+static int migrate_entry(lcb_INSTANCE *instance, const char *path, const char *parent_pkey, const char *child_name)
+{
+    int fresult = 0;
+    char pkey[INODE_KEY_LEN + 1];
+
+    cbfuse_stat stat = {0};
+    fresult = get_stat(instance, path, &stat, NULL);
+    if (fresult == -ENOENT) {
+        fresult = 0;
+        goto done;
+    }
+    IfFRErrorGotoDoneWithRef(path);
+
+    if (stat.st_ino == 0) {
+        uint64_t ino = 0;
+        fresult = next_inode(instance, &ino);
+        IfFRErrorGotoDoneWithRef(path);
+
+        fresult = update_stat_ino(instance, path, ino);
+        IfFRErrorGotoDoneWithRef(path);
+
+        fresult = get_stat(instance, path, &stat, NULL);
+        IfFRErrorGotoDoneWithRef(path);
+    }
+    inode_key(stat.st_ino, pkey);
+
+    if (S_ISDIR(stat.st_mode)) {
+        fresult = add_new_dentry(instance, pkey, parent_pkey);
+        if (fresult != -EEXIST) {
+            IfFRErrorGotoDoneWithRef(path);
+        }
+
+        fresult = migrate_directory(instance, path, pkey);
+        IfFRErrorGotoDoneWithRef(path);
+    } else {
+        fresult = copy_legacy_data(instance, path, &stat);
+        IfFRErrorGotoDoneWithRef(path);
+    }
+
+    fresult = copy_stat(instance, pkey, &stat);
+    IfFRErrorGotoDoneWithRef(path);
+
+    fresult = add_child_to_dentry(instance, parent_pkey, child_name, stat.st_ino);
+    IfFRErrorGotoDoneWithRef(path);
+
+    // leftover blocks or directory entries are harmless but the old stat has to go
+    if (S_ISDIR(stat.st_mode)) {
+        remove_dentry(instance, path);
+    } else {
+        remove_legacy_data(instance, path, &stat);
+    }
+
+    fresult = remove_stat(instance, path);
+    IfFRErrorGotoDoneWithRef(path);
+
+done:
+    return fresult;
+}
+
+static int migrate_child(void *context, const char *child_name, uint64_t ino)
+{
+    migrate_context *migrate = context;
+    (void)ino;
+
+    const char *separator = (strcmp(migrate->dir_path, ROOT_DIR_STRING) == 0) ? "" : "/";
+    int n = snprintf(migrate->path, MAX_PATH_LEN + 1, "%s%s%s", migrate->dir_path, separator, child_name);
+    if (n < 0 || (size_t)n > MAX_PATH_LEN) {
+        fprintf(stderr, "%s:%s:%d path too long: %s/%s\n", __FILENAME__, __func__, __LINE__, migrate->dir_path, child_name);
+        return -ENAMETOOLONG;
+    }
+
+    return migrate_entry(migrate->instance, migrate->path, migrate->dir_pkey, child_name);
+}
+
+static int migrate_directory(lcb_INSTANCE *instance, const char *dir_path, const char *dir_pkey)
+{
+    int fresult = 0;
+
+    // the path buffer isn't on the stack because directories are migrated recursively
+    migrate_context context = { .instance = instance, .dir_path = dir_path, .dir_pkey = dir_pkey, .path = NULL };
+    context.path = malloc(MAX_PATH_LEN + 1);
+    IfNULLGotoDoneWithRef(context.path, -ENOMEM, dir_path);
+
+    fresult = read_legacy_children(instance, dir_path, migrate_child, &context);
+    IfFRErrorGotoDoneWithRef(dir_path);
+
+done:
+    free(context.path);
+    return fresult;
+}
+
+int migrate_entries(lcb_INSTANCE *instance)
+{
+    int fresult = 0;
+
+    cbfuse_stat root_stat = {0};
+    fresult = get_stat(instance, ROOT_DIR_STRING, &root_stat, NULL);
+    IfFRErrorGotoDoneWithRef(ROOT_DIR_STRING);
+
+    if (root_stat.st_ino != 0) {
+        goto done;
+    }
+
+    fprintf(stderr, "Migrating entries that predate inodes.\n");
+
+    fresult = migrate_directory(instance, ROOT_DIR_STRING, ROOT_DIR_STRING);
+    IfFRErrorGotoDoneWithRef(ROOT_DIR_STRING);
+
+    fresult = remove_legacy_children(instance, ROOT_DIR_STRING);
+    IfFRErrorGotoDoneWithRef(ROOT_DIR_STRING);
+
+    uint64_t ino = 0;
+    fresult = next_inode(instance, &ino);
+    IfFRErrorGotoDoneWithRef(ROOT_DIR_STRING);
+
+    fresult = update_stat_ino(instance, ROOT_DIR_STRING, ino);
+    IfFRErrorGotoDoneWithRef(ROOT_DIR_STRING);
+
+done:
+    return fresult;
+}
@@ -0,0 +1,28 @@
+/*
+ * cbfuse implements a FUSE file-system using Couchbase as the data store.
+ * Copyright (c) 2021 Raymond Cardillo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CBFUSE_MIGRATE_HEADER_SEEN
+#define CBFUSE_MIGRATE_HEADER_SEEN
+
+#include <libcouchbase/couchbase.h>
+
+// Converts a bucket whose entries predate inodes (keyed by their paths) to entries keyed
+// by inode. Nothing is done once the root stat has an inode number. A migration that was
+// interrupted continues where it stopped the next time.
+int migrate_entries(lcb_INSTANCE *instance);
+
+#endif /* !CBFUSE_MIGRATE_HEADER_SEEN */
@@ -0,0 +1,275 @@
+/*
+ * cbfuse implements a FUSE file-system using Couchbase as the data store.
+ * Copyright (c) 2021 Raymond Cardillo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <libcouchbase/couchbase.h>
+
+#include "pool.h"
+#include "util.h"
+#include "engine.h"
+#include "sync_get.h"
+#include "sync_store.h"
+#include "sync_remove.h"
+#include "sync_counter.h"
+#include "sync_subdoc.h"
+
+// An lcb_INSTANCE is not thread-safe and the sync helpers wait for one command at a time,
+// so each FUSE worker thread borrows its own instance for the duration of an operation.
+// In async mode each instance is owned by an engine (event loop thread) instead and
+// any number of threads can have operations in flight on it at the same time.
+
+struct lcb_pool {
+    lcb_INSTANCE **instances;   // every instance in the pool
+    lcb_INSTANCE **available;   // stack of instances that can be borrowed
+    size_t size;                // number of instances in the pool
+    size_t navailable;          // number of instances on the available stack
+    lcb_engine **engines;       // engine driving each instance (async mode only)
+    atomic_size_t next;         // round-robin position (async mode only)
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+typedef struct bootstrap_args {
+    const lcb_pool_options *options;
+    lcb_io_opt_t io;
+    lcb_INSTANCE *instance;
+    lcb_STATUS rc;
+} bootstrap_args;
+
+static void open_callback(__unused lcb_INSTANCE *instance, lcb_STATUS rc)
+{
+    fprintf(stderr, "open bucket: %s\n", lcb_strerror_short(rc));
+}
+
+// Creates, connects, and opens the bucket for a single instance.
+static void *bootstrap_instance(void *data)
+{
+    bootstrap_args *args = data;
+    const lcb_pool_options *options = args->options;
+    lcb_STATUS rc;
+
+    lcb_CREATEOPTS *create_options = NULL;
+    lcb_createopts_create(&create_options, LCB_TYPE_CLUSTER);
+    lcb_createopts_connstr(create_options, options->connect, strlen(options->connect));
+    if (options->username != NULL || options->password != NULL) {
+        lcb_createopts_credentials(
+            create_options,
+            options->username, options->username ? strlen(options->username) : 0,
+            options->password, options->password ? strlen(options->password) : 0
+        );
+    }
+
+    if (args->io != NULL) {
+        lcb_createopts_io(create_options, args->io);
+    }
+
+    rc = lcb_create(&args->instance, create_options);
+    lcb_createopts_destroy(create_options);
+    if (rc != LCB_SUCCESS || args->instance == NULL) {
+        fprintf(stderr, "Couldn't create a couchbase instance. (%s)\n", lcb_strerror_short(rc));
+        goto done;
+    }
+
+    rc = lcb_connect(args->instance);
+    if (rc != LCB_SUCCESS) {
+        fprintf(stderr, "Couldn't create couchbase connect handle. (%s)\n", lcb_strerror_short(rc));
+        goto done;
+    }
+
+    rc = lcb_wait(args->instance, LCB_WAIT_DEFAULT);
+    if (rc != LCB_SUCCESS) {
+        fprintf(stderr, "Couldn't connect to couchbase. (%s)\n", lcb_strerror_short(rc));
+        goto done;
+    }
+
+    rc = lcb_get_bootstrap_status(args->instance);
+    if (rc != LCB_SUCCESS) {
+        fprintf(stderr, "Couldn't bootstrap couchbase connection (make sure server is running). (%s)\n", lcb_strerror_short(rc));
+        goto done;
+    }
+
+    // install callbacks for the initialized instance
+    lcb_set_open_callback(args->instance, open_callback);
+    sync_get_init(args->instance);
+    sync_store_init(args->instance);
+    sync_remove_init(args->instance);
+    sync_subdoc_init(args->instance);
+    sync_counter_init(args->instance);
+
+    rc = lcb_open(args->instance, options->bucket, strlen(options->bucket));
+    if (rc != LCB_SUCCESS) {
+        fprintf(stderr, "Couldn't create a couchbase open bucket request. (%s)\n", lcb_strerror_short(rc));
+        goto done;
+    }
+
+    rc = lcb_wait(args->instance, LCB_WAIT_DEFAULT);
+    if (rc != LCB_SUCCESS) {
+        fprintf(stderr, "Couldn't open couchbase bucket. (%s)\n", lcb_strerror_short(rc));
+        goto done;
+    }
+
+done:
+    args->rc = (args->instance == NULL && rc == LCB_SUCCESS) ? LCB_ERR_NO_MEMORY : rc;
+    return NULL;
+}
+
+lcb_STATUS pool_create(const lcb_pool_options *options, lcb_pool **pool)
+{
+    lcb_STATUS rc = LCB_SUCCESS;
+    bootstrap_args *args = NULL;
+    pthread_t *threads = NULL;
+    size_t nstarted = 0;
+
+    *pool = NULL;
+    if (options->size == 0) {
+        return LCB_ERR_INVALID_ARGUMENT;
+    }
+
+    lcb_pool *new_pool = calloc(1, sizeof(lcb_pool));
+    args = calloc(options->size, sizeof(bootstrap_args));
+    threads = calloc(options->size, sizeof(pthread_t));
+    if (new_pool == NULL || args == NULL || threads == NULL) {
+        free(new_pool);
+        rc = LCB_ERR_NO_MEMORY;
+        goto done;
+    }
+
+    new_pool->size = options->size;
+    new_pool->instances = calloc(options->size, sizeof(lcb_INSTANCE*));
+    new_pool->available = calloc(options->size, sizeof(lcb_INSTANCE*));
+    pthread_mutex_init(&new_pool->mutex, NULL);
+    pthread_cond_init(&new_pool->cond, NULL);
+    atomic_init(&new_pool->next, 0);
+    *pool = new_pool;
+    if (new_pool->instances == NULL || new_pool->available == NULL) {
+        rc = LCB_ERR_NO_MEMORY;
+        goto done;
+    }
+
+    // the engine IO plugin has to be provided when each instance is created
+    if (options->async) {
+        new_pool->engines = calloc(options->size, sizeof(lcb_engine*));
+        if (new_pool->engines == NULL) {
+            rc = LCB_ERR_NO_MEMORY;
+            goto done;
+        }
+
+        for (size_t i = 0; i < options->size; i++) {
+            rc = engine_create(&new_pool->engines[i]);
+            if (rc != LCB_SUCCESS) {
+                fprintf(stderr, "Couldn't create a couchbase engine. (%s)\n", lcb_strerror_short(rc));
+                goto done;
+            }
+            args[i].io = engine_io(new_pool->engines[i]);
+        }
+    }
+
+    // bootstrapping is mostly waiting on the network so all instances are connected in parallel
+    for (; nstarted < options->size; nstarted++) {
+        args[nstarted].options = options;
+        if (pthread_create(&threads[nstarted], NULL, bootstrap_instance, &args[nstarted]) != 0) {
+            rc = LCB_ERR_GENERIC;
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < nstarted; i++) {
+        pthread_join(threads[i], NULL);
+        new_pool->instances[i] = args[i].instance;
+        new_pool->available[new_pool->navailable++] = args[i].instance;
+        if (args[i].rc != LCB_SUCCESS) {
+            rc = args[i].rc;
+        }
+    }
+
+    if (options->async) {
+        for (size_t i = 0; i < nstarted; i++) {
+            if (new_pool->instances[i] != NULL) {
+                lcb_STATUS start_rc = engine_start(new_pool->engines[i], new_pool->instances[i]);
+                if (start_rc != LCB_SUCCESS) {
+                    rc = start_rc;
+                }
+            }
+        }
+    }
+
+done:
+    free(args);
+    free(threads);
+    return rc;
+}
+
+lcb_INSTANCE *pool_borrow(lcb_pool *pool)
+{
+    if (pool->engines != NULL) {
+        size_t next = atomic_fetch_add(&pool->next, 1);
+        return pool->instances[next % pool->size];
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->navailable == 0) {
+        pthread_cond_wait(&pool->cond, &pool->mutex);
+    }
+    lcb_INSTANCE *instance = pool->available[--pool->navailable];
+    pthread_mutex_unlock(&pool->mutex);
+
+    return instance;
+}
+
+void pool_return(lcb_pool *pool, lcb_INSTANCE *instance)
+{
+    if (pool->engines != NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->available[pool->navailable++] = instance;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+void pool_destroy(lcb_pool *pool)
+{
+    if (pool == NULL) {
+        return;
+    }
+
+    if (pool->instances != NULL) {
+        for (size_t i = 0; i < pool->size; i++) {
+            if (pool->engines != NULL && pool->engines[i] != NULL) {
+                // the engine owns (and destroys) its instance once started
+                if (pool->instances[i] != NULL && engine_from_instance(pool->instances[i]) == NULL) {
+                    lcb_destroy(pool->instances[i]);
+                }
+                engine_destroy(pool->engines[i]);
+            } else if (pool->instances[i] != NULL) {
+                lcb_destroy(pool->instances[i]);
+            }
+        }
+    }
+
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->cond);
+    free(pool->instances);
+    free(pool->available);
+    free(pool->engines);
+    free(pool);
+}
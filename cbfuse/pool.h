@@ -0,0 +1,70 @@
+/*
+ * cbfuse implements a FUSE file-system using Couchbase as the data store.
+ * Copyright (c) 2021 Raymond Cardillo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CBFUSE_POOL_HEADER_SEEN
+#define CBFUSE_POOL_HEADER_SEEN
+
+#include <stdbool.h>
+#include <libcouchbase/couchbase.h>
+
+typedef struct lcb_pool lcb_pool;   // a fixed size pool of connected library instances
+
+typedef struct lcb_pool_options {
+    const char *connect;    // couchbase connection string
+    const char *username;   // couchbase SASL username (optional)
+    const char *password;   // couchbase SASL password (optional)
+    const char *bucket;     // bucket to open
+    size_t size;            // number of instances in the pool
+    bool async;             // drive each instance with an engine so it can be shared by all threads
+} lcb_pool_options;
+
+/**
+ * Creates all of the instances for the pool and bootstraps them in parallel.
+ * The sync helper callbacks are installed on every instance.
+ *
+ * @param options   connection and sizing options
+ * @param pool      receives the new pool
+ * @return LCB_SUCCESS if every instance was connected and the bucket was opened
+ */
+lcb_STATUS pool_create(const lcb_pool_options *options, lcb_pool **pool);
+
+/**
+ * Borrows an instance for the exclusive use of the calling thread.
+ * Blocks until an instance is available.
+ * In async mode the instances are shared and handed out round-robin without blocking.
+ *
+ * @param pool      pool to borrow from
+ * @return an instance that must be given back with pool_return
+ */
+lcb_INSTANCE *pool_borrow(lcb_pool *pool);
+
+/**
+ * Returns a borrowed instance to the pool.
+ *
+ * @param pool      pool the instance was borrowed from
+ * @param instance  instance to return
+ */
+void pool_return(lcb_pool *pool, lcb_INSTANCE *instance);
+
+/**
+ * Destroys every instance and frees the memory used by the pool.
+ *
+ * @param pool      pool to destroy
+ */
+void pool_destroy(lcb_pool *pool);
+
+#endif /* !CBFUSE_POOL_HEADER_SEEN */
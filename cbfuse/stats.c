@@ -16,13 +16,18 @@
  */
 
 #include <errno.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
 
 #include "stats.h"
+#include "attr_cache.h"
 #include "util.h"
 #include "common.h"
+#include "keys.h"
+#include "cas_retry.h"
 #include "sync_get.h"
 #include "sync_store.h"
 #include "sync_remove.h"
@@ -30,12 +35,25 @@
 #define UTIME_NOW       -1
 #define UTIME_OMIT      -2
 
+// returned by a stat mutator when the stat doesn't need to be stored
+#define STAT_UNCHANGED  1
+
 const size_t CBFUSE_STAT_STRUCT_SIZE = sizeof(cbfuse_stat);
 
-int get_stat(lcb_INSTANCE *instance, const char *pkey, cbfuse_stat *stat, uint64_t *cas)
+// stats that predate inodes end before st_ino (and are read with an st_ino of 0)
+static const size_t CBFUSE_STAT_NOINO_SIZE = offsetof(cbfuse_stat, st_ino);
+
+typedef int (*stat_mutator)(cbfuse_stat *stat, const void *ctx);
+
+int batch_get_stat(sync_batch *batch, const char *pkey, sync_get_result **result)
 {
     int fresult = 0;
-    sync_get_result *result = NULL;
+
+    // the key lives until the batch is executed
+    const char *key = NULL;
+    size_t nkey = 0;
+    fresult = batch_path_key(batch, pkey, &key, &nkey);
+    IfFRErrorGotoDoneWithRef(pkey);
 
     lcb_STATUS rc;
     lcb_CMDGET *cmd;
@@ -49,137 +67,254 @@ int get_stat(lcb_INSTANCE *instance, const char *pkey, cbfuse_stat *stat, uint64
         STATS_COLLECTION_STRING, STATS_COLLECTION_STRLEN);
     IfLCBFailGotoDone(rc, -EIO);
 
-    rc = lcb_cmdget_key(cmd, pkey, strlen(pkey));
+    rc = lcb_cmdget_key(cmd, key, nkey);
     IfLCBFailGotoDone(rc, -EIO);
 
-    rc = sync_get(instance, cmd, &result);
-
-    // first check the sync command result code
+    // concurrent lookups of the same path share a single get
+    rc = sync_batch_get_shared(batch, STATS_COLLECTION_STRING, key, nkey, cmd, result);
     IfLCBFailGotoDone(rc, -EIO);
 
+done:
+    return fresult;
+}
+
+int get_stat_result(const char *pkey, const sync_get_result *result, cbfuse_stat *stat, uint64_t *cas)
+{
+    int fresult = 0;
+
+    // remember paths that don't exist (but not other failures)
+    if (result->status == LCB_ERR_DOCUMENT_NOT_FOUND) {
+        attr_cache_put_negative(pkey);
+    }
+
     // now check the actual result status
     IfLCBFailGotoDoneWithRef(result->status, -ENOENT, pkey);
 
     // sanity check that we received the expected structure
-    IfTrueGotoDoneWithRef((result->nvalue != CBFUSE_STAT_STRUCT_SIZE), -EBADF, pkey);
+    IfTrueGotoDoneWithRef(
+        (result->nvalue != CBFUSE_STAT_STRUCT_SIZE && result->nvalue != CBFUSE_STAT_NOINO_SIZE),
+        -EBADF,
+        pkey
+    );
 
-    memcpy(stat, result->value, CBFUSE_STAT_STRUCT_SIZE);
+    memset(stat, 0, sizeof(cbfuse_stat));
+    memcpy(stat, result->value, result->nvalue);
 
     if (cas != NULL) {
         *cas = result->cas;
     }
 
+    attr_cache_put(pkey, stat, result->cas);
+
     fprintf(stderr, "%s:%s:%d %s size:%lld\n", __FILENAME__, __func__, __LINE__, pkey, stat->st_size);
 
 done:
-    sync_get_destroy(result);
     return fresult;
 }
 
-int insert_stat(lcb_INSTANCE *instance, const char *pkey, mode_t mode)
+int get_stat(lcb_INSTANCE *instance, const char *pkey, cbfuse_stat *stat, uint64_t *cas)
 {
     int fresult = 0;
-    cbfuse_stat root_stat = {0};
-    sync_store_result *result = NULL;
+    sync_get_result *result = NULL;
 
-    // get the current time to update file times
-    struct timespec ts;
-    IfFalseGotoDoneWithRef(
-        (clock_gettime(CLOCK_REALTIME, &ts) == 0),
-        -EIO,
-        "clock_gettime"
-    );
+    sync_batch batch;
+    sync_batch_init(&batch, instance);
 
-    // create the stat struct to insert
-    root_stat.st_mode = mode;
-    root_stat.st_atime = ts.tv_sec;
-    root_stat.st_atimensec = ts.tv_nsec;
-    root_stat.st_mtime = ts.tv_sec;
-    root_stat.st_mtimensec = ts.tv_nsec;
-    root_stat.st_ctime = ts.tv_sec;
-    root_stat.st_ctimensec = ts.tv_nsec;
+    // recently fetched or stored stats (or missing stats) can be used without a round trip
+    attr_cache_status cached = attr_cache_get(pkey, stat, cas);
+    IfTrueGotoDoneWithRef((cached == ATTR_CACHE_NEGATIVE), -ENOENT, pkey);
+    if (cached == ATTR_CACHE_HIT) {
+        goto done;
+    }
 
-    // now write the stat data to Couchbase
+    fresult = batch_get_stat(&batch, pkey, &result);
+    IfFRErrorGotoDoneWithRef(pkey);
 
-    lcb_STATUS rc;
-    lcb_CMDSTORE *cmd;
+    lcb_STATUS rc = sync_batch_execute(&batch);
 
-    rc = lcb_cmdstore_create(&cmd, LCB_STORE_INSERT);
+    // first check the sync command result code
     IfLCBFailGotoDone(rc, -EIO);
 
-    rc = lcb_cmdstore_datatype(cmd, LCB_VALUE_RAW);
-    IfLCBFailGotoDone(rc, -EIO);
+    fresult = get_stat_result(pkey, result, stat, cas);
 
-    rc = lcb_cmdstore_collection(
-        cmd,
-        DEFAULT_SCOPE_STRING, DEFAULT_SCOPE_STRLEN,
-        STATS_COLLECTION_STRING, STATS_COLLECTION_STRLEN);
-    IfLCBFailGotoDone(rc, -EIO);
+done:
+    sync_batch_destroy(&batch);
+    return fresult;
+}
 
-    rc = lcb_cmdstore_key(cmd, pkey, strlen(pkey));
-    IfLCBFailGotoDone(rc, -EIO);
+// Stats that aren't cached are fetched in one batch so listing a directory
+// costs one round trip instead of one per child.
+int get_stats(lcb_INSTANCE *instance, const char *const pkeys[], size_t npkeys, cbfuse_stat stats[], int results[])
+{
+    int fresult = 0;
+    if (npkeys == 0) {
+        return fresult;
+    }
 
-    rc = lcb_cmdstore_value(cmd, (char*)&root_stat, CBFUSE_STAT_STRUCT_SIZE);
-    IfLCBFailGotoDone(rc, -EIO);
+    sync_batch batch;
+    sync_batch_init(&batch, instance);
 
-    rc = sync_store(instance, cmd, &result);
+    sync_get_result **gets = calloc(npkeys, sizeof(sync_get_result*));
+    IfNULLGotoDoneWithRef(gets, -ENOMEM, pkeys[0]);
 
-    // first check the sync command result code
-    IfLCBFailGotoDone(rc, -EIO);
+    for (size_t i = 0; i < npkeys; i++) {
+        attr_cache_status cached = attr_cache_get(pkeys[i], &stats[i], NULL);
+        if (cached == ATTR_CACHE_MISS) {
+            results[i] = batch_get_stat(&batch, pkeys[i], &gets[i]);
+        } else {
+            results[i] = (cached == ATTR_CACHE_HIT) ? 0 : -ENOENT;
+        }
+    }
 
-    // now check the actual result status
-    IfLCBFailGotoDoneWithRef(result->status, -ENOENT, pkey);
+    lcb_STATUS rc = sync_batch_execute(&batch);
+
+    for (size_t i = 0; i < npkeys; i++) {
+        if (gets[i] != NULL) {
+            results[i] = (rc == LCB_SUCCESS) ? get_stat_result(pkeys[i], gets[i], &stats[i], NULL) : -EIO;
+        }
+    }
+
+    IfLCBFailGotoDone(rc, -EIO);
 
 done:
-    sync_store_destroy(result);
+    sync_batch_destroy(&batch);
+    free(gets);
     return fresult;
 }
 
-int remove_stat(lcb_INSTANCE *instance, const char *pkey)
+int batch_replace_stat(sync_batch *batch, const char *pkey, const cbfuse_stat *stat, uint64_t cas, sync_store_result **result)
 {
     int fresult = 0;
-    sync_remove_result *result = NULL;
+
+    // the key lives until the batch is executed
+    const char *key = NULL;
+    size_t nkey = 0;
+    fresult = batch_path_key(batch, pkey, &key, &nkey);
+    IfFRErrorGotoDoneWithRef(pkey);
 
     lcb_STATUS rc;
-    lcb_CMDREMOVE *cmd;
+    lcb_CMDSTORE *cmd;
 
-    rc = lcb_cmdremove_create(&cmd);
+    // update the stat entry with the new version
+    rc = lcb_cmdstore_create(&cmd, LCB_STORE_REPLACE);
     IfLCBFailGotoDone(rc, -EIO);
 
-    rc = lcb_cmdremove_collection(
+    rc = lcb_cmdstore_collection(
         cmd,
         DEFAULT_SCOPE_STRING, DEFAULT_SCOPE_STRLEN,
         STATS_COLLECTION_STRING, STATS_COLLECTION_STRLEN);
     IfLCBFailGotoDone(rc, -EIO);
 
-    rc = lcb_cmdremove_key(cmd, pkey, strlen(pkey));
+    rc = lcb_cmdstore_datatype(cmd, LCB_VALUE_RAW);
+    IfLCBFailGotoDone(rc, -EIO);
+
+    rc = lcb_cmdstore_cas(cmd, cas);
     IfLCBFailGotoDone(rc, -EIO);
 
-    rc = sync_remove(instance, cmd, &result);
+    rc = lcb_cmdstore_key(cmd, key, nkey);
+    IfLCBFailGotoDone(rc, -EIO);
 
-    // first check the sync command result code
+    rc = lcb_cmdstore_value(cmd, (const char*)stat, CBFUSE_STAT_STRUCT_SIZE);
     IfLCBFailGotoDone(rc, -EIO);
 
+    rc = sync_batch_store(batch, cmd, result);
+    IfLCBFailGotoDone(rc, -EIO);
+
+done:
+    return fresult;
+}
+
+int replace_stat_result(const char *pkey, const cbfuse_stat *stat, const sync_store_result *result)
+{
+    int fresult = 0;
+
+    // a CAS mismatch means our copy is stale (and the next attempt has to read the stat that won)
+    if (result->status == LCB_ERR_CAS_MISMATCH) {
+        attr_cache_remove(pkey);
+        fresult = -EAGAIN;
+        goto done;
+    }
+
     // now check the actual result status
     IfLCBFailGotoDoneWithRef(result->status, -ENOENT, pkey);
 
+    // keep the cache current so the next mutation doesn't need to refetch
+    attr_cache_put(pkey, stat, result->cas);
+
 done:
-    sync_remove_destroy(result);
     return fresult;
 }
 
-int update_stat_atime(lcb_INSTANCE *instance, const char *pkey)
+// Replaces the stat document if it still has the expected CAS.
+// Returns -EAGAIN if the document was changed by someone else.
+static int replace_stat(lcb_INSTANCE *instance, const char *pkey, const cbfuse_stat *stat, uint64_t cas)
 {
     int fresult = 0;
-    cbfuse_stat stat = {0};
     sync_store_result *result = NULL;
 
-    // get the current stat
-    uint64_t cas = 0;
-    fresult = get_stat(instance, pkey, &stat, &cas);
+    sync_batch batch;
+    sync_batch_init(&batch, instance);
+
+    fresult = batch_replace_stat(&batch, pkey, stat, cas, &result);
     IfFRErrorGotoDoneWithRef(pkey);
 
-    // get the current time to update modified time
+    lcb_STATUS rc = sync_batch_execute(&batch);
+
+    // first check the sync command result code
+    IfLCBFailGotoDone(rc, -EIO);
+
+    fresult = replace_stat_result(pkey, stat, result);
+
+done:
+    sync_batch_destroy(&batch);
+    return fresult;
+}
+
+typedef struct stat_update {
+    lcb_INSTANCE *instance;
+    const char *pkey;
+    stat_mutator mutate;
+    const void *ctx;
+} stat_update;
+
+// Applies a mutation to the current stat and stores it with the CAS that was read.
+static int try_update_stat(void *context)
+{
+    int fresult = 0;
+    const stat_update *update = context;
+
+    // get the current stat (which may come from the cache)
+    cbfuse_stat stat = {0};
+    uint64_t cas = 0;
+    fresult = get_stat(update->instance, update->pkey, &stat, &cas);
+    IfFRErrorGotoDoneWithRef(update->pkey);
+
+    fresult = update->mutate(&stat, update->ctx);
+    if (fresult == STAT_UNCHANGED) {
+        fresult = 0;
+        goto done;
+    }
+    IfFRErrorGotoDoneWithRef(update->pkey);
+
+    // now write the stat back to Couchbase
+    fresult = replace_stat(update->instance, update->pkey, &stat, cas);
+
+done:
+    return fresult;
+}
+
+// Applies a mutation to the current stat, reading it again when someone else changed it first.
+static int update_stat(lcb_INSTANCE *instance, const char *pkey, stat_mutator mutate, const void *ctx)
+{
+    stat_update update = { .instance = instance, .pkey = pkey, .mutate = mutate, .ctx = ctx };
+    return cas_retry_update(pkey, try_update_stat, &update);
+}
+
+int batch_insert_stat(sync_batch *batch, const char *pkey, mode_t mode, uint64_t ino, cbfuse_stat *stat, sync_store_result **result)
+{
+    int fresult = 0;
+
+    // get the current time to update file times
     struct timespec ts;
     IfFalseGotoDoneWithRef(
         (clock_gettime(CLOCK_REALTIME, &ts) == 0),
@@ -187,17 +322,42 @@ int update_stat_atime(lcb_INSTANCE *instance, const char *pkey)
         "clock_gettime"
     );
 
-    // update the stat struct
-    stat.st_atime = ts.tv_sec;
-    stat.st_atimensec = ts.tv_nsec;
+    // create the stat struct to insert
+    memset(stat, 0, sizeof(cbfuse_stat));
+    stat->st_mode = mode;
+    stat->st_atime = ts.tv_sec;
+    stat->st_atimensec = ts.tv_nsec;
+    stat->st_mtime = ts.tv_sec;
+    stat->st_mtimensec = ts.tv_nsec;
+    stat->st_ctime = ts.tv_sec;
+    stat->st_ctimensec = ts.tv_nsec;
+    stat->st_ino = ino;
+
+    // now queue the write of the stat data to Couchbase
+    fresult = batch_copy_stat(batch, pkey, stat, result);
+    IfFRErrorGotoDoneWithRef(pkey);
 
-    // now write the stat back to Couchbase
+done:
+    return fresult;
+}
+
+int batch_copy_stat(sync_batch *batch, const char *pkey, const cbfuse_stat *stat, sync_store_result **result)
+{
+    int fresult = 0;
+
+    // the key lives until the batch is executed
+    const char *key = NULL;
+    size_t nkey = 0;
+    fresult = batch_path_key(batch, pkey, &key, &nkey);
+    IfFRErrorGotoDoneWithRef(pkey);
 
     lcb_STATUS rc;
     lcb_CMDSTORE *cmd;
 
-    // update the stat entry with the new version
-    rc = lcb_cmdstore_create(&cmd, LCB_STORE_REPLACE);
+    rc = lcb_cmdstore_create(&cmd, LCB_STORE_INSERT);
+    IfLCBFailGotoDone(rc, -EIO);
+
+    rc = lcb_cmdstore_datatype(cmd, LCB_VALUE_RAW);
     IfLCBFailGotoDone(rc, -EIO);
 
     rc = lcb_cmdstore_collection(
@@ -206,238 +366,378 @@ int update_stat_atime(lcb_INSTANCE *instance, const char *pkey)
         STATS_COLLECTION_STRING, STATS_COLLECTION_STRLEN);
     IfLCBFailGotoDone(rc, -EIO);
 
-    rc = lcb_cmdstore_datatype(cmd, LCB_VALUE_RAW);
+    rc = lcb_cmdstore_key(cmd, key, nkey);
     IfLCBFailGotoDone(rc, -EIO);
 
-    rc = lcb_cmdstore_cas(cmd, cas);
+    rc = lcb_cmdstore_value(cmd, (const char*)stat, CBFUSE_STAT_STRUCT_SIZE);
     IfLCBFailGotoDone(rc, -EIO);
 
-    rc = lcb_cmdstore_key(cmd, pkey, strlen(pkey));
+    rc = sync_batch_store(batch, cmd, result);
     IfLCBFailGotoDone(rc, -EIO);
 
-    rc = lcb_cmdstore_value(cmd, (char*)&stat, CBFUSE_STAT_STRUCT_SIZE);
-    IfLCBFailGotoDone(rc, -EIO);
-
-    rc = sync_store(instance, cmd, &result);
+done:
+    return fresult;
+}
 
-    // first check the sync command result code
-    IfLCBFailGotoDone(rc, -EIO);
+int insert_stat_result(const char *pkey, const cbfuse_stat *stat, const sync_store_result *result)
+{
+    int fresult = 0;
 
-    // now check the actual result status
+    IfTrueGotoDoneWithRef((result->status == LCB_ERR_DOCUMENT_EXISTS), -EEXIST, pkey);
     IfLCBFailGotoDoneWithRef(result->status, -ENOENT, pkey);
 
-    // TODO: retry if fail due to CAS (could also considering locking semantics with CAS to prevent this
+    attr_cache_put(pkey, stat, result->cas);
 
 done:
-    sync_store_destroy(result);
     return fresult;
 }
 
-int update_stat_utimens(lcb_INSTANCE *instance, const char *pkey, const struct timespec tv[2])
+int insert_stat(lcb_INSTANCE *instance, const char *pkey, mode_t mode, uint64_t ino)
 {
-    int fresult = 0;
-    cbfuse_stat stat = {0};
+    cbfuse_stat stat;
     sync_store_result *result = NULL;
 
-    // get the current stat
-    uint64_t cas = 0;
-    fresult = get_stat(instance, pkey, &stat, &cas);
+    sync_batch batch;
+    sync_batch_init(&batch, instance);
+
+    int fresult = batch_insert_stat(&batch, pkey, mode, ino, &stat, &result);
     IfFRErrorGotoDoneWithRef(pkey);
-    
-    // get the current time to update file times
-    struct timespec ts_now;
-    if (tv == NULL || tv[0].tv_nsec == UTIME_NOW || tv[1].tv_nsec == UTIME_NOW) {
-        IfFalseGotoDoneWithRef(
-            (clock_gettime(CLOCK_REALTIME, &ts_now) == 0),
-            -EIO,
-            "clock_gettime"
-        );
-    }
 
-    // update the stat struct - the rules are a little complicated
-    // for details see: UTIMENSAT(2)
-    if (tv == NULL) {
-        stat.st_atime = ts_now.tv_sec;
-        stat.st_atimensec = ts_now.tv_nsec;
-        stat.st_mtime = ts_now.tv_sec;
-        stat.st_mtimensec = ts_now.tv_nsec;
-    } else {
-        if (tv[0].tv_nsec == UTIME_NOW) {
-            stat.st_atime = ts_now.tv_sec;
-            stat.st_atimensec = ts_now.tv_nsec;
-        } else if (tv[0].tv_nsec != UTIME_OMIT) {
-            stat.st_atime = tv[0].tv_sec;
-            stat.st_atimensec = tv[0].tv_nsec;
-        }
-        if (tv[1].tv_nsec == UTIME_NOW) {
-            stat.st_mtime = ts_now.tv_sec;
-            stat.st_mtimensec = ts_now.tv_nsec;
-        } else if (tv[1].tv_nsec != UTIME_OMIT) {
-            stat.st_mtime = tv[1].tv_sec;
-            stat.st_mtimensec = tv[1].tv_nsec;
-        }
-    }
+    lcb_STATUS rc = sync_batch_execute(&batch);
 
-    // now write the stat back to Couchbase
+    // first check the sync command result code
+    IfLCBFailGotoDone(rc, -EIO);
+
+    // now check the actual result status
+    fresult = insert_stat_result(pkey, &stat, result);
+
+done:
+    sync_batch_destroy(&batch);
+    return fresult;
+}
+
+int batch_remove_stat(sync_batch *batch, const char *pkey, sync_remove_result **result)
+{
+    int fresult = 0;
+
+    // the key lives until the batch is executed
+    const char *key = NULL;
+    size_t nkey = 0;
+    fresult = batch_path_key(batch, pkey, &key, &nkey);
+    IfFRErrorGotoDoneWithRef(pkey);
 
     lcb_STATUS rc;
-    lcb_CMDSTORE *cmd;
+    lcb_CMDREMOVE *cmd;
 
-    // update the stat entry with the new version
-    rc = lcb_cmdstore_create(&cmd, LCB_STORE_REPLACE);
+    rc = lcb_cmdremove_create(&cmd);
     IfLCBFailGotoDone(rc, -EIO);
 
-    rc = lcb_cmdstore_collection(
+    rc = lcb_cmdremove_collection(
         cmd,
         DEFAULT_SCOPE_STRING, DEFAULT_SCOPE_STRLEN,
         STATS_COLLECTION_STRING, STATS_COLLECTION_STRLEN);
     IfLCBFailGotoDone(rc, -EIO);
 
-    rc = lcb_cmdstore_datatype(cmd, LCB_VALUE_RAW);
+    rc = lcb_cmdremove_key(cmd, key, nkey);
     IfLCBFailGotoDone(rc, -EIO);
 
-    rc = lcb_cmdstore_cas(cmd, cas);
+    rc = sync_batch_remove(batch, cmd, result);
     IfLCBFailGotoDone(rc, -EIO);
 
-    rc = lcb_cmdstore_key(cmd, pkey, strlen(pkey));
-    IfLCBFailGotoDone(rc, -EIO);
+done:
+    return fresult;
+}
 
-    rc = lcb_cmdstore_value(cmd, (char*)&stat, CBFUSE_STAT_STRUCT_SIZE);
-    IfLCBFailGotoDone(rc, -EIO);
+int remove_stat_result(const char *pkey, const sync_remove_result *result)
+{
+    int fresult = 0;
+
+    IfLCBFailGotoDoneWithRef(result->status, -ENOENT, pkey);
 
-    rc = sync_store(instance, cmd, &result);
+done:
+    // the entry is gone (or in an unknown state) so don't keep using the cached copy
+    if (fresult == 0) {
+        attr_cache_put_negative(pkey);
+    } else {
+        attr_cache_remove(pkey);
+    }
+    return fresult;
+}
+
+int remove_stat(lcb_INSTANCE *instance, const char *pkey)
+{
+    sync_remove_result *result = NULL;
+
+    sync_batch batch;
+    sync_batch_init(&batch, instance);
+
+    int fresult = batch_remove_stat(&batch, pkey, &result);
+    IfFRErrorGotoDoneWithRef(pkey);
+
+    lcb_STATUS rc = sync_batch_execute(&batch);
 
     // first check the sync command result code
     IfLCBFailGotoDone(rc, -EIO);
 
     // now check the actual result status
-    IfLCBFailGotoDoneWithRef(result->status, -ENOENT, pkey);
-
-    // TODO: retry if fail due to CAS (could also considering locking semantics with CAS to prevent this
+    fresult = remove_stat_result(pkey, result);
 
 done:
-    sync_store_destroy(result);
+    if (fresult != 0) {
+        attr_cache_remove(pkey);
+    }
+    sync_batch_destroy(&batch);
     return fresult;
 }
 
-int update_stat_size(lcb_INSTANCE *instance, const char *pkey, size_t size)
+static int mutate_atime(cbfuse_stat *stat, const void *ctx)
 {
-    int fresult = 0;
-    cbfuse_stat stat = {0};
-    sync_store_result *result = NULL;
-
-    // get the current stat
-    uint64_t cas = 0;
-    fresult = get_stat(instance, pkey, &stat, &cas);
-    IfFRErrorGotoDoneWithRef(pkey);
+    const struct timespec *ts = ctx;
 
-    // get the current time to update modified time
-    struct timespec ts;
-    IfFalseGotoDoneWithRef(
-        (clock_gettime(CLOCK_REALTIME, &ts) == 0),
-        -EIO,
-        "clock_gettime"
-    );
+    // an access time that was written later is kept
+    if (stat->st_atime > ts->tv_sec ||
+        (stat->st_atime == ts->tv_sec && stat->st_atimensec >= ts->tv_nsec)) {
+        return STAT_UNCHANGED;
+    }
 
     // update the stat struct
-    stat.st_mtime = ts.tv_sec;
-    stat.st_mtimensec = ts.tv_nsec;
-    stat.st_size = size;
+    stat->st_atime = ts->tv_sec;
+    stat->st_atimensec = ts->tv_nsec;
 
-    // now write the stat back to Couchbase
+    return 0;
+}
 
-    lcb_STATUS rc;
-    lcb_CMDSTORE *cmd;
+int update_stat_atime(lcb_INSTANCE *instance, const char *pkey, const struct timespec *atime)
+{
+    return update_stat(instance, pkey, mutate_atime, atime);
+}
 
-    // update the stat entry with the new version
-    rc = lcb_cmdstore_create(&cmd, LCB_STORE_REPLACE);
-    IfLCBFailGotoDone(rc, -EIO);
+// Access times written in the background are fetched and replaced in one batch each so a
+// flush costs two round trips. A stat that changed in between is updated on its own.
+int update_stat_atimes(lcb_INSTANCE *instance, const char *const pkeys[], const struct timespec atimes[], size_t npkeys, int results[])
+{
+    int fresult = 0;
+    if (npkeys == 0) {
+        return fresult;
+    }
 
-    rc = lcb_cmdstore_collection(
-        cmd,
-        DEFAULT_SCOPE_STRING, DEFAULT_SCOPE_STRLEN,
-        STATS_COLLECTION_STRING, STATS_COLLECTION_STRLEN);
-    IfLCBFailGotoDone(rc, -EIO);
+    sync_batch batch;
+    sync_batch_init(&batch, instance);
+
+    cbfuse_stat *stats = calloc(npkeys, sizeof(cbfuse_stat));
+    uint64_t *cas = calloc(npkeys, sizeof(uint64_t));
+    sync_get_result **gets = calloc(npkeys, sizeof(sync_get_result*));
+    sync_store_result **stores = calloc(npkeys, sizeof(sync_store_result*));
+    IfTrueGotoDoneWithRef((stats == NULL || cas == NULL || gets == NULL || stores == NULL), -ENOMEM, pkeys[0]);
+
+    for (size_t i = 0; i < npkeys; i++) {
+        attr_cache_status cached = attr_cache_get(pkeys[i], &stats[i], &cas[i]);
+        if (cached == ATTR_CACHE_MISS) {
+            results[i] = batch_get_stat(&batch, pkeys[i], &gets[i]);
+        } else {
+            results[i] = (cached == ATTR_CACHE_HIT) ? 0 : -ENOENT;
+        }
+    }
 
-    rc = lcb_cmdstore_datatype(cmd, LCB_VALUE_RAW);
-    IfLCBFailGotoDone(rc, -EIO);
+    lcb_STATUS rc = sync_batch_execute(&batch);
 
-    rc = lcb_cmdstore_cas(cmd, cas);
-    IfLCBFailGotoDone(rc, -EIO);
+    for (size_t i = 0; i < npkeys; i++) {
+        if (gets[i] != NULL) {
+            results[i] = (rc == LCB_SUCCESS) ? get_stat_result(pkeys[i], gets[i], &stats[i], &cas[i]) : -EIO;
+        }
+        if (results[i] != 0) {
+            continue;
+        }
 
-    rc = lcb_cmdstore_key(cmd, pkey, strlen(pkey));
-    IfLCBFailGotoDone(rc, -EIO);
+        if (mutate_atime(&stats[i], &atimes[i]) == 0) {
+            results[i] = batch_replace_stat(&batch, pkeys[i], &stats[i], cas[i], &stores[i]);
+        }
+    }
 
-    rc = lcb_cmdstore_value(cmd, (char*)&stat, CBFUSE_STAT_STRUCT_SIZE);
-    IfLCBFailGotoDone(rc, -EIO);
+    rc = sync_batch_execute(&batch);
 
-    rc = sync_store(instance, cmd, &result);
+    for (size_t i = 0; i < npkeys; i++) {
+        if (stores[i] != NULL) {
+            results[i] = (rc == LCB_SUCCESS) ? replace_stat_result(pkeys[i], &stats[i], stores[i]) : -EIO;
+        }
+        if (results[i] == -EAGAIN) {
+            results[i] = update_stat_atime(instance, pkeys[i], &atimes[i]);
+        }
+    }
 
-    // first check the sync command result code
     IfLCBFailGotoDone(rc, -EIO);
 
-    // now check the actual result status
-    IfLCBFailGotoDoneWithRef(result->status, -ENOENT, pkey);
+done:
+    sync_batch_destroy(&batch);
+    free(stores);
+    free(gets);
+    free(cas);
+    free(stats);
+    return fresult;
+}
 
-    // TODO: retry if fail due to CAS (could also considering locking semantics with CAS to prevent this
+static int mutate_utimens(cbfuse_stat *stat, const void *ctx)
+{
+    int fresult = 0;
+    const struct timespec *tv = ctx;
+
+    // get the current time to update file times
+    struct timespec ts_now;
+    if (tv == NULL || tv[0].tv_nsec == UTIME_NOW || tv[1].tv_nsec == UTIME_NOW) {
+        IfFalseGotoDoneWithRef(
+            (clock_gettime(CLOCK_REALTIME, &ts_now) == 0),
+            -EIO,
+            "clock_gettime"
+        );
+    }
+
+    // update the stat struct - the rules are a little complicated
+    // for details see: UTIMENSAT(2)
+    if (tv == NULL) {
+        stat->st_atime = ts_now.tv_sec;
+        stat->st_atimensec = ts_now.tv_nsec;
+        stat->st_mtime = ts_now.tv_sec;
+        stat->st_mtimensec = ts_now.tv_nsec;
+    } else {
+        if (tv[0].tv_nsec == UTIME_NOW) {
+            stat->st_atime = ts_now.tv_sec;
+            stat->st_atimensec = ts_now.tv_nsec;
+        } else if (tv[0].tv_nsec != UTIME_OMIT) {
+            stat->st_atime = tv[0].tv_sec;
+            stat->st_atimensec = tv[0].tv_nsec;
+        }
+        if (tv[1].tv_nsec == UTIME_NOW) {
+            stat->st_mtime = ts_now.tv_sec;
+            stat->st_mtimensec = ts_now.tv_nsec;
+        } else if (tv[1].tv_nsec != UTIME_OMIT) {
+            stat->st_mtime = tv[1].tv_sec;
+            stat->st_mtimensec = tv[1].tv_nsec;
+        }
+    }
 
 done:
-    sync_store_destroy(result);
     return fresult;
 }
 
-int update_stat_mode(lcb_INSTANCE *instance, const char *pkey, mode_t mode)
+int update_stat_utimens(lcb_INSTANCE *instance, const char *pkey, const struct timespec tv[2])
 {
-    int fresult = 0;
-    cbfuse_stat stat = {0};
-    sync_store_result *result = NULL;
+    return update_stat(instance, pkey, mutate_utimens, tv);
+}
 
-    // get the current stat
-    uint64_t cas = 0;
-    fresult = get_stat(instance, pkey, &stat, &cas);
-    IfFRErrorGotoDoneWithRef(pkey);
+bool utimens_sets_mtime(const struct timespec tv[2])
+{
+    return (tv == NULL || tv[1].tv_nsec != UTIME_OMIT);
+}
 
-    // update the stat struct
-    stat.st_mode = mode;
+typedef struct size_update {
+    size_t size;
+    bool grow_only;
+    const struct timespec *mtime;   // time of the write (NULL for now)
+} size_update;
 
-    // now write the stat back to Couchbase
+static int mutate_size(cbfuse_stat *stat, const void *ctx)
+{
+    int fresult = 0;
+    const size_update *update = ctx;
 
-    lcb_STATUS rc;
-    lcb_CMDSTORE *cmd;
+    // nothing to do if another block already extends past the new size (unless there's a write time)
+    bool resize = !update->grow_only || stat->st_size < (off_t)update->size;
+    if (!resize && update->mtime == NULL) {
+        fresult = STAT_UNCHANGED;
+        goto done;
+    }
 
-    // update the stat entry with the new version
-    rc = lcb_cmdstore_create(&cmd, LCB_STORE_REPLACE);
-    IfLCBFailGotoDone(rc, -EIO);
+    // get the current time to update modified time
+    struct timespec ts;
+    if (update->mtime != NULL) {
+        ts = *update->mtime;
+    } else {
+        IfFalseGotoDoneWithRef(
+            (clock_gettime(CLOCK_REALTIME, &ts) == 0),
+            -EIO,
+            "clock_gettime"
+        );
+    }
 
-    rc = lcb_cmdstore_collection(
-        cmd,
-        DEFAULT_SCOPE_STRING, DEFAULT_SCOPE_STRLEN,
-        STATS_COLLECTION_STRING, STATS_COLLECTION_STRLEN);
-    IfLCBFailGotoDone(rc, -EIO);
+    // update the stat struct
+    stat->st_mtime = ts.tv_sec;
+    stat->st_mtimensec = ts.tv_nsec;
+    if (resize) {
+        stat->st_size = update->size;
+    }
 
-    rc = lcb_cmdstore_datatype(cmd, LCB_VALUE_RAW);
-    IfLCBFailGotoDone(rc, -EIO);
+done:
+    return fresult;
+}
 
-    rc = lcb_cmdstore_cas(cmd, cas);
-    IfLCBFailGotoDone(rc, -EIO);
+int update_stat_size(lcb_INSTANCE *instance, const char *pkey, size_t size)
+{
+    size_update update = { .size = size, .grow_only = false, .mtime = NULL };
+    return update_stat(instance, pkey, mutate_size, &update);
+}
 
-    rc = lcb_cmdstore_key(cmd, pkey, strlen(pkey));
-    IfLCBFailGotoDone(rc, -EIO);
+int extend_stat_size(lcb_INSTANCE *instance, const char *pkey, size_t size)
+{
+    size_update update = { .size = size, .grow_only = true, .mtime = NULL };
+    return update_stat(instance, pkey, mutate_size, &update);
+}
 
-    rc = lcb_cmdstore_value(cmd, (char*)&stat, CBFUSE_STAT_STRUCT_SIZE);
-    IfLCBFailGotoDone(rc, -EIO);
+int update_stat_written(lcb_INSTANCE *instance, const char *pkey, size_t size, const struct timespec *mtime)
+{
+    size_update update = { .size = size, .grow_only = true, .mtime = mtime };
+    return update_stat(instance, pkey, mutate_size, &update);
+}
 
-    rc = sync_store(instance, cmd, &result);
+static int mutate_mode(cbfuse_stat *stat, const void *ctx)
+{
+    // update the stat struct
+    stat->st_mode = *(const mode_t*)ctx;
+    return 0;
+}
 
-    // first check the sync command result code
-    IfLCBFailGotoDone(rc, -EIO);
+int update_stat_mode(lcb_INSTANCE *instance, const char *pkey, mode_t mode)
+{
+    return update_stat(instance, pkey, mutate_mode, &mode);
+}
 
-    // now check the actual result status
-    IfLCBFailGotoDoneWithRef(result->status, -ENOENT, pkey);
+static int mutate_ctime(cbfuse_stat *stat, const void *ctx)
+{
+    int fresult = 0;
+    (void)ctx;
+
+    struct timespec ts;
+    IfFalseGotoDoneWithRef(
+        (clock_gettime(CLOCK_REALTIME, &ts) == 0),
+        -EIO,
+        "clock_gettime"
+    );
 
-    // TODO: retry if fail due to CAS (could also considering locking semantics with CAS to prevent this
+    // update the stat struct
+    stat->st_ctime = ts.tv_sec;
+    stat->st_ctimensec = ts.tv_nsec;
 
 done:
-    sync_store_destroy(result);
     return fresult;
 }
+
+int update_stat_ctime(lcb_INSTANCE *instance, const char *pkey)
+{
+    return update_stat(instance, pkey, mutate_ctime, NULL);
+}
+
+static int mutate_ino(cbfuse_stat *stat, const void *ctx)
+{
+    // an inode that was already assigned (e.g., by another mount) is kept
+    if (stat->st_ino != 0) {
+        return STAT_UNCHANGED;
+    }
+
+    // update the stat struct
+    stat->st_ino = *(const uint64_t*)ctx;
+    return 0;
+}
+
+int update_stat_ino(lcb_INSTANCE *instance, const char *pkey, uint64_t ino)
+{
+    return update_stat(instance, pkey, mutate_ino, &ino);
+}
@@ -18,8 +18,12 @@
 #ifndef CBFUSE_STATS_HEADER_SEEN
 #define CBFUSE_STATS_HEADER_SEEN
 
+#include <stdint.h>
+#include <stdbool.h>
 #include <libcouchbase/couchbase.h>
 
+#include "sync_batch.h"
+
 // a lightweight stat object
 typedef struct cbfuse_stat {
     mode_t          st_mode;        /* [XSI] Mode of file (see below) */
@@ -30,16 +34,45 @@ typedef struct cbfuse_stat {
 	time_t          st_ctime;       /* [XSI] Time of last status change */
 	long            st_ctimensec;   /* nsec of last status change */
 	off_t           st_size;        /* [XSI] file size, in bytes */
+	uint64_t        st_ino;         /* inode number (keys the entry, 0 if it predates inodes) */
 } cbfuse_stat;
 
 extern const size_t CBFUSE_STAT_STRUCT_SIZE;
 
 int get_stat(lcb_INSTANCE *instance, const char *pkey, cbfuse_stat *stat, uint64_t *cas);
-int insert_stat(lcb_INSTANCE *instance, const char *pkey, mode_t mode);
+// results[i] receives zero or an error code for each stat (the return value is for the whole batch)
+int get_stats(lcb_INSTANCE *instance, const char *const pkeys[], size_t npkeys, cbfuse_stat stats[], int results[]);
+int insert_stat(lcb_INSTANCE *instance, const char *pkey, mode_t mode, uint64_t ino);
 int remove_stat(lcb_INSTANCE *instance, const char *pkey);
-int update_stat_atime(lcb_INSTANCE *instance, const char *pkey);
+
+// batched variants (the stat must stay valid until the batch is executed and the result is checked)
+int batch_get_stat(sync_batch *batch, const char *pkey, sync_get_result **result);
+int get_stat_result(const char *pkey, const sync_get_result *result, cbfuse_stat *stat, uint64_t *cas);
+int batch_insert_stat(sync_batch *batch, const char *pkey, mode_t mode, uint64_t ino, cbfuse_stat *stat, sync_store_result **result);
+// inserts a copy of an existing stat under another key and is checked with insert_stat_result
+int batch_copy_stat(sync_batch *batch, const char *pkey, const cbfuse_stat *stat, sync_store_result **result);
+int insert_stat_result(const char *pkey, const cbfuse_stat *stat, const sync_store_result *result);
+// replaces a stat that still has the expected CAS and is checked with replace_stat_result (-EAGAIN if it changed)
+int batch_replace_stat(sync_batch *batch, const char *pkey, const cbfuse_stat *stat, uint64_t cas, sync_store_result **result);
+int replace_stat_result(const char *pkey, const cbfuse_stat *stat, const sync_store_result *result);
+int batch_remove_stat(sync_batch *batch, const char *pkey, sync_remove_result **result);
+int remove_stat_result(const char *pkey, const sync_remove_result *result);
+
+// an access time older than the stored one is ignored
+int update_stat_atime(lcb_INSTANCE *instance, const char *pkey, const struct timespec *atime);
+// results[i] receives zero or an error code for each access time (the return value is for the whole batch)
+int update_stat_atimes(lcb_INSTANCE *instance, const char *const pkeys[], const struct timespec atimes[], size_t npkeys, int results[]);
 int update_stat_utimens(lcb_INSTANCE *instance, const char *pkey, const struct timespec tv[2]);
+// whether utimens sets the modified time (rather than omitting it)
+bool utimens_sets_mtime(const struct timespec tv[2]);
 int update_stat_size(lcb_INSTANCE *instance, const char *pkey, size_t size);
+int extend_stat_size(lcb_INSTANCE *instance, const char *pkey, size_t size);
+// grows the size (like extend_stat_size) and sets the modified time of a file that was written
+int update_stat_written(lcb_INSTANCE *instance, const char *pkey, size_t size, const struct timespec *mtime);
 int update_stat_mode(lcb_INSTANCE *instance, const char *pkey, mode_t mode);
+// sets the status change time to now (e.g., when the entry is renamed)
+int update_stat_ctime(lcb_INSTANCE *instance, const char *pkey);
+// assigns an inode number to a stat that predates inodes (and is stored with the current size)
+int update_stat_ino(lcb_INSTANCE *instance, const char *pkey, uint64_t ino);
 
 #endif /* !CBFUSE_STATS_HEADER_SEEN */
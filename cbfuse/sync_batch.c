@@ -0,0 +1,313 @@
+/*
+ * cbfuse implements a FUSE file-system using Couchbase as the data store.
+ * Copyright (c) 2021 Raymond Cardillo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libcouchbase/couchbase.h>
+
+#include "sync_batch.h"
+
+// Operations like mkdir and unlink touch several documents that don't depend on each other.
+// A batch collects those commands (of mixed types) so they share one round trip.
+
+static void destroy_cmd(engine_op *op)
+{
+    switch (op->type) {
+    case ENGINE_OP_GET:
+        lcb_cmdget_destroy(op->cmd.get);
+        break;
+    case ENGINE_OP_STORE:
+        lcb_cmdstore_destroy(op->cmd.store);
+        break;
+    case ENGINE_OP_REMOVE:
+        lcb_cmdremove_destroy(op->cmd.remove);
+        break;
+    case ENGINE_OP_SUBDOC:
+        lcb_cmdsubdoc_destroy(op->cmd.subdoc);
+        lcb_subdocspecs_destroy(op->specs);
+        break;
+    case ENGINE_OP_COUNTER:
+        lcb_cmdcounter_destroy(op->cmd.counter);
+        break;
+    }
+}
+
+static void set_result_waiter(engine_op *op, engine_op *waiter)
+{
+    switch (op->type) {
+    case ENGINE_OP_GET:
+        ((sync_get_result*)op->cookie)->waiter = waiter;
+        break;
+    case ENGINE_OP_STORE:
+        ((sync_store_result*)op->cookie)->waiter = waiter;
+        break;
+    case ENGINE_OP_REMOVE:
+        ((sync_remove_result*)op->cookie)->waiter = waiter;
+        break;
+    case ENGINE_OP_SUBDOC:
+        ((sync_subdoc_result*)op->cookie)->waiter = waiter;
+        break;
+    case ENGINE_OP_COUNTER:
+        ((sync_counter_result*)op->cookie)->waiter = waiter;
+        break;
+    }
+}
+
+static void set_result_status(engine_op *op, lcb_STATUS status)
+{
+    switch (op->type) {
+    case ENGINE_OP_GET:
+        ((sync_get_result*)op->cookie)->status = status;
+        break;
+    case ENGINE_OP_STORE:
+        ((sync_store_result*)op->cookie)->status = status;
+        break;
+    case ENGINE_OP_REMOVE:
+        ((sync_remove_result*)op->cookie)->status = status;
+        break;
+    case ENGINE_OP_SUBDOC:
+        ((sync_subdoc_result*)op->cookie)->status = status;
+        break;
+    case ENGINE_OP_COUNTER:
+        ((sync_counter_result*)op->cookie)->status = status;
+        break;
+    }
+}
+
+static lcb_STATUS schedule_cmd(lcb_INSTANCE *instance, engine_op *op)
+{
+    lcb_STATUS rc = LCB_ERR_INVALID_ARGUMENT;
+
+    switch (op->type) {
+    case ENGINE_OP_GET:
+        rc = lcb_get(instance, op->cookie, op->cmd.get);
+        break;
+    case ENGINE_OP_STORE:
+        rc = lcb_store(instance, op->cookie, op->cmd.store);
+        break;
+    case ENGINE_OP_REMOVE:
+        rc = lcb_remove(instance, op->cookie, op->cmd.remove);
+        break;
+    case ENGINE_OP_SUBDOC:
+        rc = lcb_subdoc(instance, op->cookie, op->cmd.subdoc);
+        break;
+    case ENGINE_OP_COUNTER:
+        rc = lcb_counter(instance, op->cookie, op->cmd.counter);
+        break;
+    }
+
+    destroy_cmd(op);
+    return rc;
+}
+
+static lcb_STATUS queue_op(sync_batch *batch, engine_op *op, size_t nresult, void **result)
+{
+    *result = NULL;
+
+    if (batch->nops == batch->maxops) {
+        size_t maxops = batch->maxops ? batch->maxops * 2 : 8;
+        engine_op *ops = realloc(batch->ops, maxops * sizeof(engine_op));
+        if (ops == NULL) {
+            destroy_cmd(op);
+            return LCB_ERR_NO_MEMORY;
+        }
+        batch->ops = ops;
+        batch->maxops = maxops;
+    }
+
+    op->cookie = calloc(1, nresult);
+    if (op->cookie == NULL) {
+        destroy_cmd(op);
+        return LCB_ERR_NO_MEMORY;
+    }
+
+    batch->ops[batch->nops++] = *op;
+    *result = op->cookie;
+    return LCB_SUCCESS;
+}
+
+void sync_batch_init(sync_batch *batch, lcb_INSTANCE *instance)
+{
+    memset(batch, 0, sizeof(sync_batch));
+    batch->instance = instance;
+}
+
+lcb_STATUS sync_batch_get(sync_batch *batch, lcb_CMDGET *cmd, sync_get_result **result)
+{
+    engine_op op = { .type = ENGINE_OP_GET, .cmd.get = cmd };
+    return queue_op(batch, &op, sizeof(sync_get_result), (void**)result);
+}
+
+lcb_STATUS sync_batch_get_shared(sync_batch *batch, const char *collection, const char *key, size_t nkey, lcb_CMDGET *cmd, sync_get_result **result)
+{
+    lcb_STATUS rc = sync_batch_get(batch, cmd, result);
+    if (rc == LCB_SUCCESS) {
+        // a get that can't be marked is simply sent on its own
+        sync_get_share(*result, collection, key, nkey);
+    }
+    return rc;
+}
+
+lcb_STATUS sync_batch_store(sync_batch *batch, lcb_CMDSTORE *cmd, sync_store_result **result)
+{
+    engine_op op = { .type = ENGINE_OP_STORE, .cmd.store = cmd };
+    return queue_op(batch, &op, sizeof(sync_store_result), (void**)result);
+}
+
+lcb_STATUS sync_batch_remove(sync_batch *batch, lcb_CMDREMOVE *cmd, sync_remove_result **result)
+{
+    engine_op op = { .type = ENGINE_OP_REMOVE, .cmd.remove = cmd };
+    return queue_op(batch, &op, sizeof(sync_remove_result), (void**)result);
+}
+
+lcb_STATUS sync_batch_subdoc(sync_batch *batch, lcb_CMDSUBDOC *cmd, lcb_SUBDOCSPECS *specs, sync_subdoc_result **result)
+{
+    engine_op op = { .type = ENGINE_OP_SUBDOC, .cmd.subdoc = cmd, .specs = specs };
+    return queue_op(batch, &op, sizeof(sync_subdoc_result), (void**)result);
+}
+
+lcb_STATUS sync_batch_own(sync_batch *batch, void *mem)
+{
+    if (batch->nowned == batch->maxowned) {
+        size_t maxowned = batch->maxowned ? batch->maxowned * 2 : 4;
+        void **owned = realloc(batch->owned, maxowned * sizeof(void*));
+        if (owned == NULL) {
+            free(mem);
+            return LCB_ERR_NO_MEMORY;
+        }
+        batch->owned = owned;
+        batch->maxowned = maxowned;
+    }
+
+    batch->owned[batch->nowned++] = mem;
+    return LCB_SUCCESS;
+}
+
+lcb_STATUS sync_batch_execute(sync_batch *batch)
+{
+    lcb_STATUS rc = LCB_SUCCESS;
+    engine_op *ops = batch->ops + batch->nexecuted;
+    size_t nops = batch->nops - batch->nexecuted;
+    if (nops == 0) {
+        return rc;
+    }
+
+    // the commands are consumed whatever happens next
+    batch->nexecuted = batch->nops;
+
+    // Gets that follow a shared get that's already in flight aren't sent again so they're
+    // moved behind the commands that are scheduled (callers only hold on to the results).
+    size_t nsched = nops;
+    bool mutating = false;
+    for (size_t i = 0; i < nsched;) {
+        if (ops[i].type != ENGINE_OP_GET) {
+            mutating = true;
+            i++;
+        } else if (sync_get_depart(ops[i].cookie)) {
+            i++;
+        } else {
+            destroy_cmd(&ops[i]);
+            engine_op op = ops[i];
+            ops[i] = ops[--nsched];
+            ops[nsched] = op;
+        }
+    }
+
+    lcb_engine *engine = engine_from_instance(batch->instance);
+    if (engine != NULL) {
+        for (size_t i = 0; i < nsched; i++) {
+            set_result_waiter(&ops[i], &ops[i]);
+        }
+
+        engine_execute(engine, ops, nsched);
+
+        for (size_t i = 0; i < nsched; i++) {
+            set_result_waiter(&ops[i], NULL);
+            if (ops[i].rc != LCB_SUCCESS) {
+                set_result_status(&ops[i], ops[i].rc);
+            }
+        }
+    } else {
+        lcb_sched_enter(batch->instance);
+        for (size_t i = 0; i < nsched; i++) {
+            lcb_STATUS sched_rc = schedule_cmd(batch->instance, &ops[i]);
+            if (sched_rc != LCB_SUCCESS) {
+                fprintf(stderr, "  sync_batch_execute:schedule: %s\n", lcb_strerror_short(sched_rc));
+                set_result_status(&ops[i], sched_rc);
+            }
+        }
+        lcb_sched_leave(batch->instance);
+
+        rc = lcb_wait(batch->instance, LCB_WAIT_DEFAULT);
+    }
+
+    if (mutating) {
+        sync_get_fence();
+    }
+
+    // every led get lands before waiting on the others so callers never wait on each other
+    for (size_t i = 0; i < nsched; i++) {
+        if (ops[i].type == ENGINE_OP_GET) {
+            sync_get_land(ops[i].cookie, rc);
+        }
+    }
+
+    for (size_t i = nsched; i < nops; i++) {
+        lcb_STATUS follow_rc = sync_get_follow(ops[i].cookie);
+        if (follow_rc != LCB_SUCCESS) {
+            set_result_status(&ops[i], follow_rc);
+        }
+    }
+
+    return rc;
+}
+
+void sync_batch_destroy(sync_batch *batch)
+{
+    for (size_t i = 0; i < batch->nops; i++) {
+        if (i >= batch->nexecuted) {
+            destroy_cmd(&batch->ops[i]);
+        }
+
+        switch (batch->ops[i].type) {
+        case ENGINE_OP_GET:
+            sync_get_destroy(batch->ops[i].cookie);
+            break;
+        case ENGINE_OP_STORE:
+            sync_store_destroy(batch->ops[i].cookie);
+            break;
+        case ENGINE_OP_REMOVE:
+            sync_remove_destroy(batch->ops[i].cookie);
+            break;
+        case ENGINE_OP_SUBDOC:
+            sync_subdoc_destroy(batch->ops[i].cookie);
+            break;
+        case ENGINE_OP_COUNTER:
+            sync_counter_destroy(batch->ops[i].cookie);
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < batch->nowned; i++) {
+        free(batch->owned[i]);
+    }
+
+    free(batch->ops);
+    free(batch->owned);
+    memset(batch, 0, sizeof(sync_batch));
+}
@@ -0,0 +1,136 @@
+/*
+ * cbfuse implements a FUSE file-system using Couchbase as the data store.
+ * Copyright (c) 2021 Raymond Cardillo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CBFUSE_SYNC_BATCH_HEADER_SEEN
+#define CBFUSE_SYNC_BATCH_HEADER_SEEN
+
+#include <libcouchbase/couchbase.h>
+
+#include "engine.h"
+#include "sync_get.h"
+#include "sync_store.h"
+#include "sync_remove.h"
+#include "sync_subdoc.h"
+#include "sync_counter.h"
+
+typedef struct sync_batch {
+    lcb_INSTANCE *instance; // library instance to use
+    engine_op *ops;         // queued commands (the cookie of each one is its result)
+    size_t nops;            // number of queued commands
+    size_t nexecuted;       // number of commands that have already been executed
+    size_t maxops;          // allocated length of ops
+    void **owned;           // memory that must live until the batch is destroyed
+    size_t nowned;          // number of owned allocations
+    size_t maxowned;        // allocated length of owned
+} sync_batch;               // independent commands of any type that are executed together
+
+/**
+ * Initializes an empty batch.
+ *
+ * @param batch     batch to initialize
+ * @param instance  library instance to use
+ */
+void sync_batch_init(sync_batch *batch, lcb_INSTANCE *instance);
+
+/**
+ * Queues a get command. The result is owned by the batch and filled in by sync_batch_execute.
+ * For convenience, the command will be destroyed after it is used (even on failure).
+ *
+ * @param batch     batch to add to
+ * @param cmd       get command to queue
+ * @param result    receives the result for the command
+ * @return LCB_SUCCESS if the command was queued
+ */
+lcb_STATUS sync_batch_get(sync_batch *batch, lcb_CMDGET *cmd, sync_get_result **result);
+
+/**
+ * Queues a get command that's shared with concurrent gets of the same document (see sync_get_shared).
+ * The result is owned by the batch and filled in by sync_batch_execute.
+ * For convenience, the command will be destroyed after it is used (even on failure).
+ *
+ * @param batch     batch to add to
+ * @param collection collection the command reads from
+ * @param key       key the command reads
+ * @param nkey      length of the key
+ * @param cmd       get command to queue
+ * @param result    receives the result for the command
+ * @return LCB_SUCCESS if the command was queued
+ */
+lcb_STATUS sync_batch_get_shared(sync_batch *batch, const char *collection, const char *key, size_t nkey, lcb_CMDGET *cmd, sync_get_result **result);
+
+/**
+ * Queues a store command. The result is owned by the batch and filled in by sync_batch_execute.
+ * For convenience, the command will be destroyed after it is used (even on failure).
+ *
+ * @param batch     batch to add to
+ * @param cmd       store command to queue
+ * @param result    receives the result for the command
+ * @return LCB_SUCCESS if the command was queued
+ */
+lcb_STATUS sync_batch_store(sync_batch *batch, lcb_CMDSTORE *cmd, sync_store_result **result);
+
+/**
+ * Queues a remove command. The result is owned by the batch and filled in by sync_batch_execute.
+ * For convenience, the command will be destroyed after it is used (even on failure).
+ *
+ * @param batch     batch to add to
+ * @param cmd       remove command to queue
+ * @param result    receives the result for the command
+ * @return LCB_SUCCESS if the command was queued
+ */
+lcb_STATUS sync_batch_remove(sync_batch *batch, lcb_CMDREMOVE *cmd, sync_remove_result **result);
+
+/**
+ * Queues a sub-document command. The result is owned by the batch and filled in by sync_batch_execute.
+ * For convenience, the command and specs will be destroyed after they are used (even on failure).
+ *
+ * @param batch     batch to add to
+ * @param cmd       sub-document command to queue
+ * @param specs     specs used by the command
+ * @param result    receives the result for the command
+ * @return LCB_SUCCESS if the command was queued
+ */
+lcb_STATUS sync_batch_subdoc(sync_batch *batch, lcb_CMDSUBDOC *cmd, lcb_SUBDOCSPECS *specs, sync_subdoc_result **result);
+
+/**
+ * Hands memory (e.g., key or value buffers used by queued commands) to the batch
+ * so it lives until the batch is destroyed. The memory is freed even on failure.
+ *
+ * @param batch     batch that takes ownership
+ * @param mem       memory allocated with malloc
+ * @return LCB_SUCCESS if the batch took ownership
+ */
+lcb_STATUS sync_batch_own(sync_batch *batch, void *mem);
+
+/**
+ * Schedules every command queued since the last execute in a single scheduling window
+ * and waits for all of them. Commands that can't be scheduled report the failure in
+ * their result status. More commands can be queued and executed afterwards.
+ *
+ * @param batch     batch to execute
+ * @return status code of waiting for the commands
+ */
+lcb_STATUS sync_batch_execute(sync_batch *batch);
+
+/**
+ * Frees the results and owned memory (and destroys commands that were never executed).
+ *
+ * @param batch     batch to destroy
+ */
+void sync_batch_destroy(sync_batch *batch);
+
+#endif /* !CBFUSE_SYNC_BATCH_HEADER_SEEN */
@@ -0,0 +1,80 @@
+/*
+ * cbfuse implements a FUSE file-system using Couchbase as the data store.
+ * Copyright (c) 2021 Raymond Cardillo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libcouchbase/couchbase.h>
+
+#include "sync_counter.h"
+#include "engine.h"
+
+static void sync_counter_callback(__unused lcb_INSTANCE *instance, __unused int cbtype, const lcb_RESPCOUNTER *resp)
+{
+    sync_counter_result *result;
+    lcb_respcounter_cookie(resp, (void**)&result);
+    if (result == NULL) {
+        return;
+    }
+
+    lcb_STATUS status = lcb_respcounter_status(resp);
+    result->status = status;
+    if (status == LCB_SUCCESS) {
+        lcb_respcounter_value(resp, &result->value);
+    }
+
+    engine_complete(result->waiter);
+}
+
+void sync_counter_init(lcb_INSTANCE *instance)
+{
+    lcb_install_callback(instance, LCB_CALLBACK_COUNTER, (lcb_RESPCALLBACK)sync_counter_callback);
+}
+
+lcb_STATUS sync_counter(lcb_INSTANCE *instance, lcb_CMDCOUNTER *cmd, sync_counter_result **result)
+{
+    lcb_STATUS rc;
+    *result = calloc(1, sizeof(sync_counter_result));
+
+    // an instance driven by an engine is shared so the command is handed to its event loop
+    lcb_engine *engine = engine_from_instance(instance);
+    if (engine != NULL) {
+        engine_op op = { .type = ENGINE_OP_COUNTER, .cmd.counter = cmd, .cookie = *result };
+        (*result)->waiter = &op;
+        rc = engine_execute(engine, &op, 1);
+        (*result)->waiter = NULL;
+        return rc;
+    }
+
+    rc = lcb_counter(instance, *result, cmd);
+    if (rc != LCB_SUCCESS) {
+        fprintf(stderr, "  sync_counter:lcb_counter: %s\n", lcb_strerror_short(rc));
+        return rc;
+    }
+
+    rc = lcb_cmdcounter_destroy(cmd);
+    rc = lcb_wait(instance, LCB_WAIT_DEFAULT);
+
+    return rc;
+}
+
+void sync_counter_destroy(sync_counter_result *result)
+{
+    if (result != NULL) {
+        free(result);
+    }
+}
@@ -18,10 +18,39 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <libcouchbase/couchbase.h>
 
+#include "custom-uthash.h"
+#include "uthash/uthash.h"
+
 #include "util.h"
 #include "sync_get.h"
+#include "engine.h"
+
+// Concurrent gets of the same document (e.g., every worker of a job opening the same input)
+// share a single request. The first caller leads a flight and the others follow it and copy
+// the result once the leader lands it. A mutation that completes moves the fence forward so
+// a get that starts after a write never follows a flight that was sent before it.
+
+typedef struct sync_flight {
+    const char *id;             // collection and key (owned by the leader's result, only used while listed)
+    uint64_t fence;             // fence the flight was sent behind
+    bool listed;                // whether later gets can still follow the flight
+    bool landed;                // whether the leader has handed over the result
+    size_t nfollowers;          // followers that haven't copied the result yet
+    lcb_STATUS rc;              // status code of the leader's operation
+    sync_get_result result;     // copy of the leader's result (only made when there are followers)
+    pthread_cond_t cond;        // signaled when the flight lands
+    UT_hash_handle hh;
+} sync_flight;
+
+static pthread_mutex_t _flights_lock = PTHREAD_MUTEX_INITIALIZER;
+static sync_flight *_flights = NULL;
+static atomic_uint_fast64_t _fence;
+static atomic_uint_fast64_t _nflights;
+static atomic_uint_fast64_t _nfollowers;
 
 static void sync_get_callback(__unused lcb_INSTANCE *instance, __unused int cbtype, const lcb_RESPGET *resp)
 {
@@ -41,13 +70,27 @@ static void sync_get_callback(__unused lcb_INSTANCE *instance, __unused int cbty
         size_t nkey, nvalue;
         lcb_respget_key(resp, &key, &nkey);
         lcb_respget_value(resp, &value, &nvalue);
-
-        // make a copy of the allocated data
-        result->key = strdup(key);
         result->nkey = nkey;
-        result->value = memdup(value, nvalue);
         result->nvalue = nvalue;
+
+        if (result->slice.buf != NULL) {
+            // only the requested range is copied (the response buffer is gone after the callback)
+            const sync_get_slice *slice = &result->slice;
+            if (slice->offset < nvalue) {
+                result->nslice = nvalue - slice->offset;
+                if (result->nslice > slice->len) {
+                    result->nslice = slice->len;
+                }
+                memcpy(slice->buf, value + slice->offset, result->nslice);
+            }
+        } else {
+            // make a copy of the allocated data
+            result->key = strdup(key);
+            result->value = memdup(value, nvalue);
+        }
     }
+
+    engine_complete(result->waiter);
 }
 
 void sync_get_init(lcb_INSTANCE *instance)
@@ -55,11 +98,21 @@ void sync_get_init(lcb_INSTANCE *instance)
     lcb_install_callback(instance, LCB_CALLBACK_GET, (lcb_RESPCALLBACK)sync_get_callback);
 }
 
-lcb_STATUS sync_get(lcb_INSTANCE *instance, lcb_CMDGET *cmd, sync_get_result **result)
+static lcb_STATUS get_one(lcb_INSTANCE *instance, lcb_CMDGET *cmd, sync_get_result *result)
 {
     lcb_STATUS rc;
-    *result = calloc(1, sizeof(sync_get_result));
-    rc = lcb_get(instance, *result, cmd);
+
+    // an instance driven by an engine is shared so the command is handed to its event loop
+    lcb_engine *engine = engine_from_instance(instance);
+    if (engine != NULL) {
+        engine_op op = { .type = ENGINE_OP_GET, .cmd.get = cmd, .cookie = result };
+        result->waiter = &op;
+        rc = engine_execute(engine, &op, 1);
+        result->waiter = NULL;
+        return rc;
+    }
+
+    rc = lcb_get(instance, result, cmd);
     if (rc != LCB_SUCCESS) {
         fprintf(stderr, "  sync_get:lcb_get: %s\n", lcb_strerror_short(rc));
         return rc;
@@ -71,11 +124,322 @@ lcb_STATUS sync_get(lcb_INSTANCE *instance, lcb_CMDGET *cmd, sync_get_result **r
     return rc;
 }
 
+lcb_STATUS sync_get(lcb_INSTANCE *instance, lcb_CMDGET *cmd, sync_get_result **result)
+{
+    *result = calloc(1, sizeof(sync_get_result));
+    return get_one(instance, cmd, *result);
+}
+
+lcb_STATUS sync_get_shared(lcb_INSTANCE *instance, const char *collection, const char *key, size_t nkey, lcb_CMDGET *cmd, sync_get_result **result)
+{
+    *result = calloc(1, sizeof(sync_get_result));
+    if (*result == NULL) {
+        lcb_cmdget_destroy(cmd);
+        return LCB_ERR_NO_MEMORY;
+    }
+
+    // a get that can't be marked is simply sent on its own
+    sync_get_share(*result, collection, key, nkey);
+    if (!sync_get_depart(*result)) {
+        lcb_cmdget_destroy(cmd);
+        return sync_get_follow(*result);
+    }
+
+    lcb_STATUS rc = get_one(instance, cmd, *result);
+    sync_get_land(*result, rc);
+    return rc;
+}
+
+static lcb_STATUS get_multi(lcb_INSTANCE *instance, lcb_CMDGET **cmds, size_t ncmds, const sync_get_slice *slices, const char *collection, const char *const *keys, const size_t *nkeys, sync_get_result **results)
+{
+    lcb_STATUS rc = LCB_SUCCESS;
+    engine_op *ops = NULL;
+    size_t nops = 0;
+
+    for (size_t i = 0; i < ncmds; i++) {
+        results[i] = calloc(1, sizeof(sync_get_result));
+        if (results[i] == NULL) {
+            rc = LCB_ERR_NO_MEMORY;
+        } else if (slices != NULL) {
+            results[i]->slice = slices[i];
+        } else if (keys != NULL) {
+            sync_get_share(results[i], collection, keys[i], nkeys[i]);
+        }
+    }
+
+    lcb_engine *engine = engine_from_instance(instance);
+    if (rc == LCB_SUCCESS && engine != NULL) {
+        ops = calloc(ncmds, sizeof(engine_op));
+        if (ops == NULL) {
+            rc = LCB_ERR_NO_MEMORY;
+        }
+    }
+
+    if (rc != LCB_SUCCESS) {
+        for (size_t i = 0; i < ncmds; i++) {
+            lcb_cmdget_destroy(cmds[i]);
+        }
+        return rc;
+    }
+
+    // gets that follow a flight that's already in progress aren't sent again
+    for (size_t i = 0; i < ncmds; i++) {
+        if (!sync_get_depart(results[i])) {
+            lcb_cmdget_destroy(cmds[i]);
+        }
+    }
+
+    if (engine != NULL) {
+        for (size_t i = 0; i < ncmds; i++) {
+            if (!results[i]->following) {
+                ops[nops].type = ENGINE_OP_GET;
+                ops[nops].cmd.get = cmds[i];
+                ops[nops].cookie = results[i];
+                results[i]->waiter = &ops[nops];
+                nops++;
+            }
+        }
+
+        rc = engine_execute(engine, ops, nops);
+
+        for (size_t i = 0; i < nops; i++) {
+            sync_get_result *result = ops[i].cookie;
+            result->waiter = NULL;
+            if (ops[i].rc != LCB_SUCCESS) {
+                result->status = ops[i].rc;
+            }
+            sync_get_land(result, LCB_SUCCESS);
+        }
+
+        free(ops);
+    } else {
+        // all of the commands go out together and the responses are collected by a single wait
+        lcb_sched_enter(instance);
+        for (size_t i = 0; i < ncmds; i++) {
+            if (results[i]->following) {
+                continue;
+            }
+
+            lcb_STATUS sched_rc = lcb_get(instance, results[i], cmds[i]);
+            lcb_cmdget_destroy(cmds[i]);
+            if (sched_rc != LCB_SUCCESS) {
+                fprintf(stderr, "  sync_get_multi:lcb_get: %s\n", lcb_strerror_short(sched_rc));
+                results[i]->status = sched_rc;
+                if (rc == LCB_SUCCESS) {
+                    rc = sched_rc;
+                }
+            }
+        }
+        lcb_sched_leave(instance);
+
+        lcb_STATUS wait_rc = lcb_wait(instance, LCB_WAIT_DEFAULT);
+        for (size_t i = 0; i < ncmds; i++) {
+            sync_get_land(results[i], wait_rc);
+        }
+
+        if (rc == LCB_SUCCESS) {
+            rc = wait_rc;
+        }
+    }
+
+    // every led flight has landed so waiting on the others can't hold anyone up
+    for (size_t i = 0; i < ncmds; i++) {
+        lcb_STATUS follow_rc = sync_get_follow(results[i]);
+        if (rc == LCB_SUCCESS) {
+            rc = follow_rc;
+        }
+    }
+
+    return rc;
+}
+
+lcb_STATUS sync_get_multi(lcb_INSTANCE *instance, lcb_CMDGET **cmds, size_t ncmds, sync_get_result **results)
+{
+    return get_multi(instance, cmds, ncmds, NULL, NULL, NULL, NULL, results);
+}
+
+lcb_STATUS sync_get_multi_shared(lcb_INSTANCE *instance, const char *collection, const char *const *keys, const size_t *nkeys, lcb_CMDGET **cmds, size_t ncmds, sync_get_result **results)
+{
+    return get_multi(instance, cmds, ncmds, NULL, collection, keys, nkeys, results);
+}
+
+lcb_STATUS sync_get_slices(lcb_INSTANCE *instance, lcb_CMDGET **cmds, size_t ncmds, const sync_get_slice *slices, sync_get_result **results)
+{
+    return get_multi(instance, cmds, ncmds, slices, NULL, NULL, NULL, results);
+}
+
+lcb_STATUS sync_get_share(sync_get_result *result, const char *collection, const char *key, size_t nkey)
+{
+    // collection names can't contain a colon so the id is unique
+    size_t ncollection = strlen(collection);
+    result->share_id = malloc(ncollection + 1 + nkey + 1);
+    if (result->share_id == NULL) {
+        return LCB_ERR_NO_MEMORY;
+    }
+
+    memcpy(result->share_id, collection, ncollection);
+    result->share_id[ncollection] = ':';
+    memcpy(result->share_id + ncollection + 1, key, nkey);
+    result->share_id[ncollection + 1 + nkey] = '\0';
+    return LCB_SUCCESS;
+}
+
+bool sync_get_depart(sync_get_result *result)
+{
+    if (result->share_id == NULL) {
+        return true;
+    }
+
+    uint64_t fence = atomic_load_explicit(&_fence, memory_order_acquire);
+    sync_flight *flight = NULL;
+
+    pthread_mutex_lock(&_flights_lock);
+
+    HASH_FIND_STR(_flights, result->share_id, flight);
+    if (flight != NULL && flight->fence == fence) {
+        flight->nfollowers++;
+        result->flight = flight;
+        result->following = true;
+        pthread_mutex_unlock(&_flights_lock);
+
+        atomic_fetch_add_explicit(&_nfollowers, 1, memory_order_relaxed);
+        return false;
+    }
+
+    if (flight != NULL) {
+        // a mutation completed since that flight was sent so it only serves its own followers
+        HASH_DEL(_flights, flight);
+        flight->listed = false;
+    }
+
+    // without a flight the get is still sent, it just isn't shared
+    flight = calloc(1, sizeof(sync_flight));
+    if (flight != NULL) {
+        flight->id = result->share_id;
+        flight->fence = fence;
+        flight->listed = true;
+        pthread_cond_init(&flight->cond, NULL);
+        HASH_ADD_KEYPTR(hh, _flights, flight->id, strlen(flight->id), flight);
+        result->flight = flight;
+        atomic_fetch_add_explicit(&_nflights, 1, memory_order_relaxed);
+    }
+
+    pthread_mutex_unlock(&_flights_lock);
+    return true;
+}
+
+static void free_flight(sync_flight *flight)
+{
+    pthread_cond_destroy(&flight->cond);
+    free((void*)flight->result.key);
+    free((void*)flight->result.value);
+    free(flight);
+}
+
+void sync_get_land(sync_get_result *result, lcb_STATUS rc)
+{
+    sync_flight *flight = result->flight;
+    if (flight == NULL || result->following) {
+        return;
+    }
+    result->flight = NULL;
+
+    // once it's unlisted nobody else can follow the flight
+    pthread_mutex_lock(&_flights_lock);
+    if (flight->listed) {
+        HASH_DEL(_flights, flight);
+        flight->listed = false;
+    }
+    size_t nfollowers = flight->nfollowers;
+    pthread_mutex_unlock(&_flights_lock);
+
+    if (nfollowers == 0) {
+        free_flight(flight);
+        return;
+    }
+
+    flight->rc = rc;
+    flight->result.status = result->status;
+    flight->result.cas = result->cas;
+    flight->result.flags = result->flags;
+    flight->result.nkey = result->nkey;
+    flight->result.nvalue = result->nvalue;
+    if (result->key != NULL) {
+        flight->result.key = strdup(result->key);
+    }
+    if (result->value != NULL) {
+        flight->result.value = memdup(result->value, result->nvalue);
+    }
+    if ((result->key != NULL && flight->result.key == NULL) ||
+        (result->value != NULL && flight->result.value == NULL)) {
+        flight->rc = LCB_ERR_NO_MEMORY;
+    }
+
+    pthread_mutex_lock(&_flights_lock);
+    flight->landed = true;
+    pthread_cond_broadcast(&flight->cond);
+    pthread_mutex_unlock(&_flights_lock);
+}
+
+lcb_STATUS sync_get_follow(sync_get_result *result)
+{
+    sync_flight *flight = result->flight;
+    if (flight == NULL || !result->following) {
+        return LCB_SUCCESS;
+    }
+    result->flight = NULL;
+
+    pthread_mutex_lock(&_flights_lock);
+    while (!flight->landed) {
+        pthread_cond_wait(&flight->cond, &_flights_lock);
+    }
+    pthread_mutex_unlock(&_flights_lock);
+
+    // a landed flight doesn't change so it can be copied without the lock
+    lcb_STATUS rc = flight->rc;
+    result->status = flight->result.status;
+    result->cas = flight->result.cas;
+    result->flags = flight->result.flags;
+    result->nkey = flight->result.nkey;
+    result->nvalue = flight->result.nvalue;
+    if (flight->result.key != NULL) {
+        result->key = strdup(flight->result.key);
+    }
+    if (flight->result.value != NULL) {
+        result->value = memdup(flight->result.value, flight->result.nvalue);
+    }
+    if ((flight->result.key != NULL && result->key == NULL) ||
+        (flight->result.value != NULL && result->value == NULL)) {
+        rc = LCB_ERR_NO_MEMORY;
+    }
+
+    pthread_mutex_lock(&_flights_lock);
+    bool last = (--flight->nfollowers == 0);
+    pthread_mutex_unlock(&_flights_lock);
+
+    if (last) {
+        free_flight(flight);
+    }
+    return rc;
+}
+
+void sync_get_fence(void)
+{
+    atomic_fetch_add_explicit(&_fence, 1, memory_order_release);
+}
+
+void sync_get_get_share_stats(sync_get_share_stats *stats)
+{
+    stats->flights = atomic_load_explicit(&_nflights, memory_order_relaxed);
+    stats->followers = atomic_load_explicit(&_nfollowers, memory_order_relaxed);
+}
+
 void sync_get_destroy(sync_get_result *result)
 {
     if (result != NULL) {
         free((void*)result->key);
         free((void*)result->value);
+        free(result->share_id);
         free(result);
     }
 }
\ No newline at end of file
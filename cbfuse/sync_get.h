@@ -18,8 +18,16 @@
 #ifndef CBFUSE_SYNC_GET_HEADER_SEEN
 #define CBFUSE_SYNC_GET_HEADER_SEEN
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <libcouchbase/couchbase.h>
 
+typedef struct sync_get_slice {
+    char *buf;          // destination of the copied range
+    size_t offset;      // offset of the range within the value
+    size_t len;         // length of the range
+} sync_get_slice;       // a range of the value that's copied straight out of the response
+
 typedef struct sync_get_result {
     lcb_STATUS status;  // result status code
     const char *key;    // key string returned from the command
@@ -28,8 +36,19 @@ typedef struct sync_get_result {
     size_t nvalue;      // length of the value
     uint64_t cas;       // cas value (for optimistic write logic)
     uint32_t flags;     // flags metadata
+    sync_get_slice slice;       // when set, only this range is copied (key and value stay NULL)
+    size_t nslice;              // number of bytes copied into the slice
+    struct engine_op *waiter;   // engine operation waiting on the result (if any)
+    char *share_id;             // collection and key when the get can be shared (see sync_get_share)
+    struct sync_flight *flight; // shared get the result leads or follows (if any)
+    bool following;             // whether the result is copied from a get led by another caller
 } sync_get_result;      // contains the results of the operation
 
+typedef struct sync_get_share_stats {
+    uint64_t flights;           // shared gets that were sent to the cluster
+    uint64_t followers;         // gets that were served by a flight that was already in progress
+} sync_get_share_stats;
+
 /**
  * Initializes the synchronous helper by installing the required callback.
  *
@@ -48,6 +67,113 @@ void sync_get_init(lcb_INSTANCE *instance);
  */
 lcb_STATUS sync_get(lcb_INSTANCE *instance, lcb_CMDGET *cmd, sync_get_result **result);
 
+/**
+ * Perform several get operations in a single scheduling window and wait once for all of them.
+ * For convenience, the commands will be destroyed after they are used.
+ *
+ * @param instance  library instance to use
+ * @param cmds      get commands to call
+ * @param ncmds     number of commands
+ * @param results   receives a result for each command (each one must be destroyed)
+ * @return status code of the synchronous operation (or the first command that couldn't be scheduled)
+ */
+lcb_STATUS sync_get_multi(lcb_INSTANCE *instance, lcb_CMDGET **cmds, size_t ncmds, sync_get_result **results);
+
+/**
+ * Like sync_get_multi, but each response only copies a range of its value straight into
+ * a caller buffer instead of duplicating the whole value. The full value length is still
+ * reported in nvalue and the number of bytes copied is reported in nslice.
+ *
+ * @param instance  library instance to use
+ * @param cmds      get commands to call
+ * @param ncmds     number of commands
+ * @param slices    range of the value to copy for each command
+ * @param results   receives a result for each command (each one must be destroyed)
+ * @return status code of the synchronous operation (or the first command that couldn't be scheduled)
+ */
+lcb_STATUS sync_get_slices(lcb_INSTANCE *instance, lcb_CMDGET **cmds, size_t ncmds, const sync_get_slice *slices, sync_get_result **results);
+
+/**
+ * Like sync_get, but a concurrent get of the same document shares a single request.
+ * If a get of the document is already in flight (and no mutation completed since it was sent)
+ * the command is destroyed unused and the result is copied from that get once it arrives.
+ *
+ * @param instance  library instance to use
+ * @param collection collection the command reads from
+ * @param key       key the command reads
+ * @param nkey      length of the key
+ * @param cmd       specific get command to call
+ * @param result    results from the get operation
+ * @return status code of the synchronous operation
+ */
+lcb_STATUS sync_get_shared(lcb_INSTANCE *instance, const char *collection, const char *key, size_t nkey, lcb_CMDGET *cmd, sync_get_result **result);
+
+/**
+ * Like sync_get_multi, but each get is shared with concurrent gets of the same document
+ * (see sync_get_shared). Only the gets that aren't already in flight are scheduled.
+ *
+ * @param instance  library instance to use
+ * @param collection collection the commands read from
+ * @param keys      key each command reads
+ * @param nkeys     length of each key
+ * @param cmds      get commands to call
+ * @param ncmds     number of commands
+ * @param results   receives a result for each command (each one must be destroyed)
+ * @return status code of the synchronous operation (or the first command that couldn't be scheduled)
+ */
+lcb_STATUS sync_get_multi_shared(lcb_INSTANCE *instance, const char *collection, const char *const *keys, const size_t *nkeys, lcb_CMDGET **cmds, size_t ncmds, sync_get_result **results);
+
+/**
+ * Marks a result so its get can be shared with concurrent gets of the same document.
+ * This is used by callers that schedule gets themselves (e.g., sync_batch) together with
+ * sync_get_depart, sync_get_land, and sync_get_follow.
+ *
+ * @param result    result of a get that hasn't been scheduled yet
+ * @param collection collection the get reads from
+ * @param key       key the get reads
+ * @param nkey      length of the key
+ * @return LCB_SUCCESS or LCB_ERR_NO_MEMORY
+ */
+lcb_STATUS sync_get_share(sync_get_result *result, const char *collection, const char *key, size_t nkey);
+
+/**
+ * Joins a shared get of the same document that's already in flight or starts a new one.
+ *
+ * @param result    result marked with sync_get_share (other results are left alone)
+ * @return false if the result follows another get (its command must be destroyed unused)
+ */
+bool sync_get_depart(sync_get_result *result);
+
+/**
+ * Hands the result of a get that was led by the caller to its followers.
+ * Every led get must be landed before the caller follows any get so callers never wait on each other.
+ *
+ * @param result    result of a scheduled get that has completed (other results are left alone)
+ * @param rc        status code of scheduling and waiting for the get
+ */
+void sync_get_land(sync_get_result *result, lcb_STATUS rc);
+
+/**
+ * Waits for the get that a result follows and copies its result.
+ *
+ * @param result    result that follows another get (other results are left alone)
+ * @return status code of the followed get operation
+ */
+lcb_STATUS sync_get_follow(sync_get_result *result);
+
+/**
+ * Stops sharing the gets that are already in flight with later callers. This must be called
+ * after every mutation completes so a get that starts after a write never sees older data.
+ */
+void sync_get_fence(void);
+
+/**
+ * Gets the counters of every shared get so far.
+ *
+ * @param stats     receives the counters
+ */
+void sync_get_get_share_stats(sync_get_share_stats *stats);
+
 /**
  * Frees the memory that was used to provide results.
  *
@@ -23,6 +23,7 @@
 typedef struct
 sync_remove_result {
     lcb_STATUS status;
+    struct engine_op *waiter;   // engine operation waiting on the result (if any)
 } sync_remove_result; // contains the results of the operation
 
 /**
@@ -44,6 +45,18 @@ void sync_remove_init(lcb_INSTANCE *instance);
  */
 lcb_STATUS sync_remove(lcb_INSTANCE *instance, lcb_CMDREMOVE *cmd, sync_remove_result **result);
 
+/**
+ * Perform several remove operations in a single scheduling window and wait once for all of them.
+ * For convenience, the commands will be destroyed after they are used.
+ *
+ * @param instance  library instance to use
+ * @param cmds      remove commands to call
+ * @param ncmds     number of commands
+ * @param results   receives a result for each command (each one must be destroyed)
+ * @return status code of the synchronous operation (or the first command that couldn't be scheduled)
+ */
+lcb_STATUS sync_remove_multi(lcb_INSTANCE *instance, lcb_CMDREMOVE **cmds, size_t ncmds, sync_remove_result **results);
+
 /**
  * Frees the memory that was used to provide results.
  *
@@ -21,6 +21,8 @@
 #include <libcouchbase/couchbase.h>
 
 #include "sync_store.h"
+#include "sync_get.h"
+#include "engine.h"
 
 static void sync_store_callback(__unused lcb_INSTANCE *instance, __unused int cbtype, const lcb_RESPSTORE *resp)
 {
@@ -33,8 +35,10 @@ static void sync_store_callback(__unused lcb_INSTANCE *instance, __unused int cb
     lcb_STATUS status = lcb_respstore_status(resp);
     result->status = status;
     if (status == LCB_SUCCESS) {
-        // TBD - nothing extra needed currently
+        lcb_respstore_cas(resp, &result->cas);
     }
+
+    engine_complete(result->waiter);
 }
 
 void sync_store_init(lcb_INSTANCE *instance)
@@ -46,6 +50,18 @@ lcb_STATUS sync_store(lcb_INSTANCE *instance, lcb_CMDSTORE *cmd, sync_store_resu
 {
     lcb_STATUS rc;
     *result = calloc(1, sizeof(sync_store_result));
+
+    // an instance driven by an engine is shared so the command is handed to its event loop
+    lcb_engine *engine = engine_from_instance(instance);
+    if (engine != NULL) {
+        engine_op op = { .type = ENGINE_OP_STORE, .cmd.store = cmd, .cookie = *result };
+        (*result)->waiter = &op;
+        rc = engine_execute(engine, &op, 1);
+        (*result)->waiter = NULL;
+        sync_get_fence();
+        return rc;
+    }
+
     rc = lcb_store(instance, *result, cmd);
     if (rc != LCB_SUCCESS) {
         fprintf(stderr, "  sync_store:lcb_store: %s\n", lcb_strerror_short(rc));
@@ -54,10 +70,81 @@ lcb_STATUS sync_store(lcb_INSTANCE *instance, lcb_CMDSTORE *cmd, sync_store_resu
 
     rc = lcb_cmdstore_destroy(cmd);
     rc = lcb_wait(instance, LCB_WAIT_DEFAULT);
+    sync_get_fence();
 
     return rc;
 }
 
+lcb_STATUS sync_store_multi(lcb_INSTANCE *instance, lcb_CMDSTORE **cmds, size_t ncmds, sync_store_result **results)
+{
+    lcb_STATUS rc = LCB_SUCCESS;
+    engine_op *ops = NULL;
+
+    for (size_t i = 0; i < ncmds; i++) {
+        results[i] = calloc(1, sizeof(sync_store_result));
+        if (results[i] == NULL) {
+            rc = LCB_ERR_NO_MEMORY;
+        }
+    }
+
+    if (rc != LCB_SUCCESS) {
+        for (size_t i = 0; i < ncmds; i++) {
+            lcb_cmdstore_destroy(cmds[i]);
+        }
+        return rc;
+    }
+
+    lcb_engine *engine = engine_from_instance(instance);
+    if (engine != NULL) {
+        ops = calloc(ncmds, sizeof(engine_op));
+        if (ops == NULL) {
+            for (size_t i = 0; i < ncmds; i++) {
+                lcb_cmdstore_destroy(cmds[i]);
+            }
+            return LCB_ERR_NO_MEMORY;
+        }
+
+        for (size_t i = 0; i < ncmds; i++) {
+            ops[i].type = ENGINE_OP_STORE;
+            ops[i].cmd.store = cmds[i];
+            ops[i].cookie = results[i];
+            results[i]->waiter = &ops[i];
+        }
+
+        rc = engine_execute(engine, ops, ncmds);
+
+        for (size_t i = 0; i < ncmds; i++) {
+            results[i]->waiter = NULL;
+            if (ops[i].rc != LCB_SUCCESS) {
+                results[i]->status = ops[i].rc;
+            }
+        }
+
+        free(ops);
+        sync_get_fence();
+        return rc;
+    }
+
+    // all of the commands go out together and the responses are collected by a single wait
+    lcb_sched_enter(instance);
+    for (size_t i = 0; i < ncmds; i++) {
+        lcb_STATUS sched_rc = lcb_store(instance, results[i], cmds[i]);
+        lcb_cmdstore_destroy(cmds[i]);
+        if (sched_rc != LCB_SUCCESS) {
+            fprintf(stderr, "  sync_store_multi:lcb_store: %s\n", lcb_strerror_short(sched_rc));
+            results[i]->status = sched_rc;
+            if (rc == LCB_SUCCESS) {
+                rc = sched_rc;
+            }
+        }
+    }
+    lcb_sched_leave(instance);
+
+    lcb_STATUS wait_rc = lcb_wait(instance, LCB_WAIT_DEFAULT);
+    sync_get_fence();
+    return (rc != LCB_SUCCESS) ? rc : wait_rc;
+}
+
 void sync_store_destroy(sync_store_result *result)
 {
     if (result != NULL) {
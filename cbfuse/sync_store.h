@@ -22,7 +22,9 @@
 
 typedef struct
 sync_store_result {
-    lcb_STATUS status;
+    lcb_STATUS status;  // result status code
+    uint64_t cas;       // cas value of the stored document
+    struct engine_op *waiter;   // engine operation waiting on the result (if any)
 } sync_store_result; // contains the results of the operation
 
 /**
@@ -44,6 +46,18 @@ void sync_store_init(lcb_INSTANCE *instance);
  */
 lcb_STATUS sync_store(lcb_INSTANCE *instance, lcb_CMDSTORE *cmd, sync_store_result **result);
 
+/**
+ * Perform several store operations in a single scheduling window and wait once for all of them.
+ * For convenience, the commands will be destroyed after they are used.
+ *
+ * @param instance  library instance to use
+ * @param cmds      store commands to call
+ * @param ncmds     number of commands
+ * @param results   receives a result for each command (each one must be destroyed)
+ * @return status code of the synchronous operation (or the first command that couldn't be scheduled)
+ */
+lcb_STATUS sync_store_multi(lcb_INSTANCE *instance, lcb_CMDSTORE **cmds, size_t ncmds, sync_store_result **results);
+
 /**
  * Frees the memory that was used to provide results.
  *
@@ -0,0 +1,113 @@
+/*
+ * cbfuse implements a FUSE file-system using Couchbase as the data store.
+ * Copyright (c) 2021 Raymond Cardillo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libcouchbase/couchbase.h>
+
+#include "util.h"
+#include "sync_subdoc.h"
+#include "sync_get.h"
+#include "engine.h"
+
+static void sync_subdoc_callback(__unused lcb_INSTANCE *instance, __unused int cbtype, const lcb_RESPSUBDOC *resp)
+{
+    sync_subdoc_result *result;
+    lcb_respsubdoc_cookie(resp, (void**)&result);
+    if (result == NULL) {
+        return;
+    }
+
+    lcb_STATUS status = lcb_respsubdoc_status(resp);
+    result->status = status;
+    lcb_respsubdoc_cas(resp, &result->cas);
+
+    // the per-path results are available even when one of the paths failed
+    size_t nentries = lcb_respsubdoc_result_size(resp);
+    if (nentries > 0) {
+        result->entries = calloc(nentries, sizeof(sync_subdoc_entry));
+        if (result->entries == NULL) {
+            result->status = LCB_ERR_NO_MEMORY;
+            goto done;
+        }
+        result->nentries = nentries;
+
+        for (size_t i = 0; i < nentries; i++) {
+            const char *value = NULL;
+            size_t nvalue = 0;
+            result->entries[i].status = lcb_respsubdoc_result_status(resp, i);
+            lcb_respsubdoc_result_value(resp, i, &value, &nvalue);
+
+            // make a copy of the allocated data
+            if (value != NULL && nvalue > 0) {
+                result->entries[i].value = memdup(value, nvalue);
+                result->entries[i].nvalue = nvalue;
+            }
+        }
+    }
+
+done:
+    engine_complete(result->waiter);
+}
+
+void sync_subdoc_init(lcb_INSTANCE *instance)
+{
+    lcb_install_callback(instance, LCB_CALLBACK_SDLOOKUP, (lcb_RESPCALLBACK)sync_subdoc_callback);
+    lcb_install_callback(instance, LCB_CALLBACK_SDMUTATE, (lcb_RESPCALLBACK)sync_subdoc_callback);
+}
+
+lcb_STATUS sync_subdoc(lcb_INSTANCE *instance, lcb_CMDSUBDOC *cmd, lcb_SUBDOCSPECS *specs, sync_subdoc_result **result)
+{
+    lcb_STATUS rc;
+    *result = calloc(1, sizeof(sync_subdoc_result));
+
+    // an instance driven by an engine is shared so the command is handed to its event loop
+    lcb_engine *engine = engine_from_instance(instance);
+    if (engine != NULL) {
+        engine_op op = { .type = ENGINE_OP_SUBDOC, .cmd.subdoc = cmd, .specs = specs, .cookie = *result };
+        (*result)->waiter = &op;
+        rc = engine_execute(engine, &op, 1);
+        (*result)->waiter = NULL;
+        sync_get_fence();
+        return rc;
+    }
+
+    rc = lcb_subdoc(instance, *result, cmd);
+    lcb_cmdsubdoc_destroy(cmd);
+    lcb_subdocspecs_destroy(specs);
+    if (rc != LCB_SUCCESS) {
+        fprintf(stderr, "  sync_subdoc:lcb_subdoc: %s\n", lcb_strerror_short(rc));
+        return rc;
+    }
+
+    rc = lcb_wait(instance, LCB_WAIT_DEFAULT);
+    sync_get_fence();
+
+    return rc;
+}
+
+void sync_subdoc_destroy(sync_subdoc_result *result)
+{
+    if (result != NULL) {
+        for (size_t i = 0; i < result->nentries; i++) {
+            free((void*)result->entries[i].value);
+        }
+        free(result->entries);
+        free(result);
+    }
+}
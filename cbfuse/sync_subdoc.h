@@ -0,0 +1,64 @@
+/*
+ * cbfuse implements a FUSE file-system using Couchbase as the data store.
+ * Copyright (c) 2021 Raymond Cardillo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CBFUSE_SYNC_SUBDOC_HEADER_SEEN
+#define CBFUSE_SYNC_SUBDOC_HEADER_SEEN
+
+#include <libcouchbase/couchbase.h>
+
+typedef struct sync_subdoc_entry {
+    lcb_STATUS status;  // status of the individual path operation
+    const char *value;  // value returned for the path (if any)
+    size_t nvalue;      // length of the value
+} sync_subdoc_entry;    // contains the result of a single spec
+
+typedef struct sync_subdoc_result {
+    lcb_STATUS status;          // result status code
+    uint64_t cas;               // cas value of the document
+    sync_subdoc_entry *entries; // result of each spec (in order)
+    size_t nentries;            // number of spec results
+    struct engine_op *waiter;   // engine operation waiting on the result (if any)
+} sync_subdoc_result;           // contains the results of the operation
+
+/**
+ * Initializes the synchronous helper by installing the required callbacks.
+ *
+ * @param instance  the library instance to use
+ */
+void sync_subdoc_init(lcb_INSTANCE *instance);
+
+/**
+ * Perform a synchronous sub-document lookup or mutation and return the result.
+ *
+ * For convenience, the command and specs will be destroyed after they are used.
+ *
+ * @param instance  library instance to use
+ * @param cmd       specific sub-document command to call
+ * @param specs     specs used by the command
+ * @param result    results from the sub-document operation
+ * @return status code of the synchronous operation
+ */
+lcb_STATUS sync_subdoc(lcb_INSTANCE *instance, lcb_CMDSUBDOC *cmd, lcb_SUBDOCSPECS *specs, sync_subdoc_result **result);
+
+/**
+ * Frees the memory that was used to provide results.
+ *
+ * @param result    result memory to destroy
+ */
+void sync_subdoc_destroy(sync_subdoc_result *result);
+
+#endif /* !CBFUSE_SYNC_SUBDOC_HEADER_SEEN */
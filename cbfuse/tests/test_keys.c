@@ -0,0 +1,209 @@
+/*
+ * cbfuse implements a FUSE file-system using Couchbase as the data store.
+ * Copyright (c) 2021 Raymond Cardillo
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+#include "keys.h"
+
+// iterations of the timing test and the slowest average that passes (generous so slow machines pass)
+#define TIMING_ITERATIONS   100000
+#define TIMING_MAX_NSEC     50000
+
+// the hash, the shortest first sample and the four other samples (see keys.c)
+#define MIN_HASHED_KEY_LEN  (22 + 1 + 48 + 50 + 50 + 50)
+
+static int failures = 0;
+
+#define EXPECT(cond) \
+if (!(cond)) { \
+  fprintf(stderr, "  %s:%d EXPECT %s\n", __func__, __LINE__, #cond); \
+  failures++; \
+}
+
+// A path of npath characters whose characters all differ from their neighbours.
+static char *make_path(size_t npath)
+{
+    char *path = malloc(npath + 1);
+    if (path == NULL) {
+        exit(EXIT_FAILURE);
+    }
+
+    path[0] = '/';
+    for (size_t i = 1; i < npath; i++) {
+        path[i] = (i % 64 == 0) ? '/' : (char)('a' + (i % 26));
+    }
+    path[npath] = '\0';
+    return path;
+}
+
+// Checks the layout of a hashed key: hash, then samples from the start, 1/4, 1/2, 3/4 and end.
+static void expect_hashed(const char *path, const char *key, size_t nkey, size_t nmax)
+{
+    size_t npath = strlen(path);
+
+    EXPECT(nkey == nmax);
+    EXPECT(strlen(key) == nkey);
+    EXPECT(key[0] != '/');
+    for (size_t i = 0; i < 22; i++) {
+        EXPECT(key[i] != '/' && key[i] != '#' && key[i] != '\0');
+    }
+
+    size_t nfirst = nmax - (MIN_HASHED_KEY_LEN - 1);
+    const char *sample = key + 22;
+    EXPECT(memcmp(sample, path + 1, nfirst) == 0);
+    sample += nfirst;
+    EXPECT(memcmp(sample, path + npath / 4, 48) == 0);
+    sample += 48;
+    EXPECT(memcmp(sample, path + npath / 2, 50) == 0);
+    sample += 50;
+    EXPECT(memcmp(sample, path + (npath * 3) / 4, 50) == 0);
+    sample += 50;
+    EXPECT(memcmp(sample, path + npath - 51, 50) == 0);
+}
+
+static void test_short_paths(void)
+{
+    char key[MAX_KEY_LEN + 1];
+    size_t nkey = 0;
+
+    EXPECT(path_to_key("/", key, &nkey) == 0);
+    EXPECT(nkey == 1 && strcmp(key, "/") == 0);
+
+    char *path = make_path(MAX_KEY_LEN);
+    EXPECT(path_to_key(path, key, &nkey) == 0);
+    EXPECT(nkey == MAX_KEY_LEN && strcmp(key, path) == 0);
+    free(path);
+}
+
+static void test_hashed_paths(void)
+{
+    char key[MAX_KEY_LEN + 1];
+    size_t nkey = 0;
+
+    size_t lengths[] = { MAX_KEY_LEN + 1, 1000, MAX_PATH_LEN };
+    for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+        char *path = make_path(lengths[i]);
+        EXPECT(path_to_key(path, key, &nkey) == 0);
+        expect_hashed(path, key, nkey, MAX_KEY_LEN);
+
+        // the same path always maps to the same key
+        char again[MAX_KEY_LEN + 1];
+        size_t nagain = 0;
+        EXPECT(path_to_key(path, again, &nagain) == 0);
+        EXPECT(nagain == nkey && strcmp(again, key) == 0);
+
+        // a change outside of the samples still changes the hash
+        path[lengths[i] / 4 - 1] = '_';
+        EXPECT(path_to_key(path, again, &nagain) == 0);
+        EXPECT(nagain == nkey && strcmp(again, key) != 0);
+        EXPECT(strcmp(again + 22, key + 22) == 0);
+        free(path);
+    }
+
+    char *path = make_path(MAX_PATH_LEN + 1);
+    EXPECT(path_to_key(path, key, &nkey) == -ENAMETOOLONG);
+    free(path);
+}
+
+static void test_key_limits(void)
+{
+    char key[MAX_KEY_LEN + 1];
+    size_t nkey = 0;
+
+    // short paths fit any limit
+    EXPECT(path_to_key_len("/a", 2, key, &nkey) == 0);
+    EXPECT(nkey == 2 && strcmp(key, "/a") == 0);
+
+    char *path = make_path(MAX_KEY_LEN + 1);
+    EXPECT(path_to_key_len(path, MIN_HASHED_KEY_LEN - 1, key, &nkey) == -ENAMETOOLONG);
+    EXPECT(path_to_key_len(path, MIN_HASHED_KEY_LEN, key, &nkey) == 0);
+    expect_hashed(path, key, nkey, MIN_HASHED_KEY_LEN);
+    EXPECT(path_to_key_len(path, MAX_KEY_LEN + 1, key, &nkey) == -ENAMETOOLONG);
+    free(path);
+}
+
+// Shard keys prefix the directory key with '#' and the shard number (see dentries.c).
+static void test_shard_keys(void)
+{
+    char key[MAX_KEY_LEN + 1];
+    size_t nkey = 0;
+
+    const char *prefixes[] = { "#1", "#4294967295" };
+    size_t lengths[] = { MAX_KEY_LEN - 2, MAX_KEY_LEN, MAX_PATH_LEN };
+    for (size_t i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); i++) {
+        size_t nprefix = strlen(prefixes[i]);
+        size_t nmax = MAX_KEY_LEN - nprefix;
+
+        for (size_t j = 0; j < sizeof(lengths) / sizeof(lengths[0]); j++) {
+            char *path = make_path(lengths[j]);
+            memcpy(key, prefixes[i], nprefix);
+            EXPECT(path_to_key_len(path, nmax, key + nprefix, &nkey) == 0);
+            EXPECT(nprefix + nkey <= MAX_KEY_LEN);
+            EXPECT(strlen(key) == nprefix + nkey);
+            if (lengths[j] <= nmax) {
+                EXPECT(strcmp(key + nprefix, path) == 0);
+            } else {
+                expect_hashed(path, key + nprefix, nkey, nmax);
+            }
+            free(path);
+        }
+    }
+}
+
+// Times hashing the longest path (getattr maps a path to a key on every call).
+static void test_hashed_path_timing(void)
+{
+    char key[MAX_KEY_LEN + 1];
+    size_t nkey = 0;
+    char *path = make_path(MAX_PATH_LEN);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < TIMING_ITERATIONS; i++) {
+        // vary the path so the work can't be hoisted out of the loop
+        path[MAX_PATH_LEN - 2] = (char)('a' + (i % 26));
+        EXPECT(path_to_key(path, key, &nkey) == 0);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    long long nsec = (long long)(end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec);
+    long long per_key = nsec / TIMING_ITERATIONS;
+    fprintf(stderr, "path_to_key: %lld ns per %d character path\n", per_key, MAX_PATH_LEN);
+    EXPECT(per_key < TIMING_MAX_NSEC);
+    free(path);
+}
+
+int main(void)
+{
+    test_short_paths();
+    test_hashed_paths();
+    test_key_limits();
+    test_shard_keys();
+    test_hashed_path_timing();
+
+    if (failures > 0) {
+        fprintf(stderr, "%d key test(s) failed\n", failures);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,68 @@
+# 
+# cbfuse implements a FUSE file-system using Couchbase as the data store.
+# Copyright (c) 2021 Raymond Cardillo
+# 
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+# 
+#     http://www.apache.org/licenses/LICENSE-2.0
+# 
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+# 
+
+# Try to find the LIBEVENT library and define:
+#
+# LIBEVENT_FOUND        - True if library was found.
+# LIBEVENT_INCLUDE_DIRS - Include directories.
+# LIBEVENT_LIBRARIES    - Libraries.
+#
+# LIBEVENT::LIBEVENT
+
+# check if already in cache, be silent
+if (LIBEVENT_INCLUDE_DIRS AND LIBEVENT_LIBRARIES)
+    SET (LIBEVENT_FIND_QUIETLY TRUE)
+endif ()
+
+if (APPLE)
+    set (LIBEVENT_NAMES libevent.dylib event)
+else ()
+    set (LIBEVENT_NAMES libevent.a event)
+endif ()
+
+# find include
+find_path (
+    LIBEVENT_INCLUDE_DIRS event2/event.h
+    PATHS /opt /opt/local /usr /usr/local /usr/pkg
+    PATH_SUFFIXES include
+    REQUIRED)
+
+# find lib
+find_library (
+    LIBEVENT_LIBRARIES
+    NAMES ${LIBEVENT_NAMES}
+    PATHS /opt /opt/local /usr /usr/local /usr/pkg
+    PATH_SUFFIXES lib
+    REQUIRED)
+
+include ("FindPackageHandleStandardArgs")
+find_package_handle_standard_args (
+    "LIBEVENT" DEFAULT_MSG
+    LIBEVENT_INCLUDE_DIRS LIBEVENT_LIBRARIES)
+
+mark_as_advanced (LIBEVENT_INCLUDE_DIRS LIBEVENT_LIBRARIES)
+
+if (LIBEVENT_FOUND AND NOT TARGET LIBEVENT::LIBEVENT)
+  add_library(LIBEVENT::LIBEVENT STATIC IMPORTED)
+  set_target_properties(LIBEVENT::LIBEVENT PROPERTIES
+    IMPORTED_LOCATION "${LIBEVENT_LIBRARIES}"
+    INTERFACE_INCLUDE_DIRECTORIES "${LIBEVENT_INCLUDE_DIRS}")
+  target_compile_definitions(LIBEVENT::LIBEVENT INTERFACE LIBEVENT_FOUND)
+else()
+  message(WARNING "Notice: LIBEVENT not found, no LIBEVENT support")
+  add_library(LIBEVENT::LIBEVENT INTERFACE IMPORTED)
+endif()
\ No newline at end of file